@@ -0,0 +1,120 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "aviparser.h"
+
+#include <string.h>
+
+// the fields of the main header, and the stream type and handler at
+// the start of a stream header
+static const size_t avih_size = 14 * 4;
+static const size_t strh_prefix = 8;
+
+AviParser::AviParser(bool wantMovie)
+    : m_wantMovie(wantMovie), m_haveMainHeader(false), m_audioStream(false),
+      m_haveAudio(false), m_audioCodec(0), m_haveMovie(false), m_movieOffset(0), m_movieSize(0)
+{
+    memset(&m_mainHeader, 0, sizeof(m_mainHeader));
+    memset(m_videoHandler, 0, sizeof(m_videoHandler));
+    memset(m_audioHandler, 0, sizeof(m_audioHandler));
+}
+
+bool AviParser::accept(const char *form)
+{
+    return !memcmp(form, "AVI ", 4);
+}
+
+RiffParser::Action AviParser::chunk(const char *id, const char *type, uint64_t offset,
+                                    uint64_t &size, size_t &read)
+{
+    if (type) {
+        if (!memcmp(type, "hdrl", 4))
+            return Descend;
+        if (!memcmp(type, "strl", 4)) {
+            m_audioStream = false;
+            return Descend;
+        }
+        if (!memcmp(type, "movi", 4)) {
+            // the list size counts the list type as well
+            m_movieOffset = offset + 4;
+            m_movieSize = size > 4 ? size - 4 : 0;
+            m_haveMovie = true;
+        }
+        return done();
+    }
+
+    if (!memcmp(id, "avih", 4) && !m_haveMainHeader) {
+        read = avih_size;
+        return Read;
+    }
+    if (!memcmp(id, "strh", 4)) {
+        read = strh_prefix;
+        return Read;
+    }
+    // the audio codec is the format tag at the start of the WAVEFORMATEX
+    if (!memcmp(id, "strf", 4) && m_audioStream && !m_haveAudio) {
+        read = 2;
+        return Read;
+    }
+    return done();
+}
+
+RiffParser::Action AviParser::chunkData(const char *id, uint64_t /*offset*/,
+                                        const uint8_t *data, size_t length)
+{
+    if (!memcmp(id, "avih", 4)) {
+        if (length < avih_size)
+            return Stop;
+        m_mainHeader.microSecPerFrame = get32(data);
+        m_mainHeader.maxBytesPerSec = get32(data + 4);
+        m_mainHeader.reserved1 = get32(data + 8);
+        m_mainHeader.flags = get32(data + 12);
+        m_mainHeader.totalFrames = get32(data + 16);
+        m_mainHeader.initialFrames = get32(data + 20);
+        m_mainHeader.streams = get32(data + 24);
+        m_mainHeader.bufferSize = get32(data + 28);
+        m_mainHeader.width = get32(data + 32);
+        m_mainHeader.height = get32(data + 36);
+        m_mainHeader.scale = get32(data + 40);
+        m_mainHeader.rate = get32(data + 44);
+        m_mainHeader.start = get32(data + 48);
+        m_mainHeader.length = get32(data + 52);
+        m_haveMainHeader = true;
+    } else if (!memcmp(id, "strh", 4)) {
+        if (length < strh_prefix)
+            return Stop;
+        if (!memcmp(data, "vids", 4) && !m_videoHandler[0]) {
+            memcpy(m_videoHandler, data + 4, 4);
+        } else if (!memcmp(data, "auds", 4)) {
+            if (!m_audioHandler[0])
+                memcpy(m_audioHandler, data + 4, 4);
+            m_audioStream = true;
+        }
+    } else if (!memcmp(id, "strf", 4)) {
+        if (length < 2)
+            return Stop;
+        m_audioCodec = get16(data);
+        m_haveAudio = true;
+    }
+    return done();
+}
+
+RiffParser::Action AviParser::done() const
+{
+    return m_haveMainHeader && m_videoHandler[0] && m_haveAudio &&
+           (m_haveMovie || !m_wantMovie) ? Stop : Skip;
+}
@@ -0,0 +1,91 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef AVIPARSER_H
+#define AVIPARSER_H
+
+#include "riffparser.h"
+
+/**
+ * Reads the main header of an AVI file, the handlers of its first video
+ * and audio streams and the codec of the audio, and where the movie
+ * data is, which is only walked up to when wanted.
+ */
+class AviParser: public RiffParser
+{
+public:
+    struct MainHeader
+    {
+        uint32_t microSecPerFrame;
+        uint32_t maxBytesPerSec;
+        uint32_t reserved1;
+        uint32_t flags;
+        uint32_t totalFrames;
+        uint32_t initialFrames;
+        uint32_t streams;
+        uint32_t bufferSize;
+        uint32_t width;
+        uint32_t height;
+        uint32_t scale;
+        uint32_t rate;
+        uint32_t start;
+        uint32_t length;
+    };
+
+    explicit AviParser(bool wantMovie);
+
+    bool haveMainHeader() const { return m_haveMainHeader; }
+    const MainHeader &mainHeader() const { return m_mainHeader; }
+
+    /** The handlers of the streams, or empty strings. */
+    const char *videoHandler() const { return m_videoHandler; }
+    const char *audioHandler() const { return m_audioHandler; }
+
+    bool haveAudio() const { return m_haveAudio; }
+    /** The format tag of the audio stream's WAVEFORMATEX. */
+    uint16_t audioCodec() const { return m_audioCodec; }
+
+    bool haveMovie() const { return m_haveMovie; }
+    uint64_t movieOffset() const { return m_movieOffset; }
+    uint64_t movieSize() const { return m_movieSize; }
+
+protected:
+    virtual bool accept(const char *form);
+    virtual Action chunk(const char *id, const char *type, uint64_t offset,
+                         uint64_t &size, size_t &read);
+    virtual Action chunkData(const char *id, uint64_t offset, const uint8_t *data,
+                             size_t length);
+
+private:
+    Action done() const;
+
+    bool m_wantMovie;
+
+    bool m_haveMainHeader;
+    MainHeader m_mainHeader;
+    char m_videoHandler[5];
+    char m_audioHandler[5];
+    // whether the stream the strl list is about is audio
+    bool m_audioStream;
+    bool m_haveAudio;
+    uint16_t m_audioCodec;
+    bool m_haveMovie;
+    uint64_t m_movieOffset;
+    uint64_t m_movieSize;
+};
+
+#endif
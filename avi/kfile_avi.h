@@ -21,7 +21,9 @@
 #define __KFILE_AVI_H__
 
 #include <kfilemetainfo.h>
-#include <QFile>
+
+#include "cachedfileplugin.h"
+#include "payloadhash.h"
 
 #if !defined(__osf__)
 #include <inttypes.h>
@@ -32,55 +34,23 @@ typedef unsigned int   uint32_t;
 
 class QStringList;
 
-class KAviPlugin: public KFilePlugin
+class KAviPlugin: public CachedFilePlugin
 {
     Q_OBJECT
     
 public:
     KAviPlugin( QObject *parent, const QStringList& args );
 
-    virtual bool readInfo( KFileMetaInfo& info, uint what);
+    virtual bool readRecord( const QString& path, const QString& mimeType, uint what,
+                             MetadataRecord& record);
+    virtual AccessManifest accessManifest( uint what ) const;
 
 private:
 
-    bool read_avi();
-    bool read_list();
-    bool read_avih();
-    bool read_strl();
-    
-    bool read_strf(uint32_t blocksize);
-    bool read_strh(uint32_t blocksize);
-    
     // methods to sort out human readable names for the codecs
     const char * resolve_audio(uint16_t id);
-    
-    QFile f;
-    QDataStream dstream;
 
-    // AVI header information
-    bool done_avih;
-    uint32_t avih_microsecperframe;
-    uint32_t avih_maxbytespersec;
-    uint32_t avih_reserved1;
-    uint32_t avih_flags;
-    uint32_t avih_totalframes;
-    uint32_t avih_initialframes;
-    uint32_t avih_streams;
-    uint32_t avih_buffersize;
-    uint32_t avih_width;
-    uint32_t avih_height;
-    uint32_t avih_scale;
-    uint32_t avih_rate;
-    uint32_t avih_start;
-    uint32_t avih_length;
-
-    char handler_vids[5];   // leave room for trailing \0
-    char handler_auds[5];
-    uint16_t handler_audio; // the ID of the audio codec
-    bool done_audio;
-    
-    bool wantstrf;
-    
+    PayloadHash::Mode m_fingerprint;
 };
 
 #endif
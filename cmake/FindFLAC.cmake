@@ -0,0 +1,31 @@
+# Option for building the FLAC loudness measurement
+
+# Redistribution and use is allowed according to the terms of the BSD license.
+# For details see the accompanying COPYING-CMAKE-SCRIPTS file.
+
+
+if(FLAC_INCLUDE_DIR AND FLAC_LIBRARIES)
+	# Already in cache, be silent
+	set(FLAC_FIND_QUIETLY TRUE)
+endif(FLAC_INCLUDE_DIR AND FLAC_LIBRARIES)
+
+FIND_PATH(FLAC_INCLUDE_DIR FLAC/stream_decoder.h)
+
+FIND_LIBRARY(FLAC_LIBRARIES NAMES FLAC )
+
+if(FLAC_LIBRARIES AND FLAC_INCLUDE_DIR)
+	set(FLAC_FOUND TRUE)
+endif(FLAC_LIBRARIES AND FLAC_INCLUDE_DIR)
+
+if (FLAC_FOUND)
+  if (NOT FLAC_FIND_QUIETLY)
+     MESSAGE( STATUS "libFLAC found: includes in ${FLAC_INCLUDE_DIR}, library in ${FLAC_LIBRARIES}")
+  endif (NOT FLAC_FIND_QUIETLY)
+else (FLAC_FOUND)
+  if (FLAC_FIND_REQUIRED)
+     MESSAGE( FATAL_ERROR "libFLAC not found")
+  endif (FLAC_FIND_REQUIRED)
+endif (FLAC_FOUND)
+
+
+MARK_AS_ADVANCED(FLAC_INCLUDE_DIR FLAC_LIBRARIES)
@@ -0,0 +1,43 @@
+# Option for keeping what the plugins read in an SQLite index
+
+# Redistribution and use is allowed according to the terms of the BSD license.
+# For details see the accompanying COPYING-CMAKE-SCRIPTS file.
+
+
+if(SQLITE_INCLUDE_DIR AND SQLITE_LIBRARIES)
+	# Already in cache, be silent
+	set(SQLITE_FIND_QUIETLY TRUE)
+endif(SQLITE_INCLUDE_DIR AND SQLITE_LIBRARIES)
+
+FIND_PATH(SQLITE_INCLUDE_DIR sqlite3.h)
+
+FIND_LIBRARY(SQLITE_LIBRARIES NAMES sqlite3 )
+
+# the index upserts rows, which SQLite has as of 3.24
+if(SQLITE_INCLUDE_DIR AND EXISTS "${SQLITE_INCLUDE_DIR}/sqlite3.h")
+	file(STRINGS "${SQLITE_INCLUDE_DIR}/sqlite3.h" SQLITE_VERSION_LINE
+	     REGEX "^#define SQLITE_VERSION_NUMBER +[0-9]+")
+	string(REGEX REPLACE "^#define SQLITE_VERSION_NUMBER +([0-9]+).*" "\\1"
+	       SQLITE_VERSION_NUMBER "${SQLITE_VERSION_LINE}")
+endif(SQLITE_INCLUDE_DIR AND EXISTS "${SQLITE_INCLUDE_DIR}/sqlite3.h")
+
+if(SQLITE_LIBRARIES AND SQLITE_INCLUDE_DIR)
+	if(SQLITE_VERSION_NUMBER LESS 3024000)
+		MESSAGE( STATUS "SQLite ${SQLITE_VERSION_NUMBER} found, but 3.24 is needed for upserts")
+	else(SQLITE_VERSION_NUMBER LESS 3024000)
+		set(SQLITE_FOUND TRUE)
+	endif(SQLITE_VERSION_NUMBER LESS 3024000)
+endif(SQLITE_LIBRARIES AND SQLITE_INCLUDE_DIR)
+
+if (SQLITE_FOUND)
+  if (NOT SQLITE_FIND_QUIETLY)
+     MESSAGE( STATUS "SQLite found: includes in ${SQLITE_INCLUDE_DIR}, library in ${SQLITE_LIBRARIES}")
+  endif (NOT SQLITE_FIND_QUIETLY)
+else (SQLITE_FOUND)
+  if (SQLITE_FIND_REQUIRED)
+     MESSAGE( FATAL_ERROR "SQLite not found")
+  endif (SQLITE_FIND_REQUIRED)
+endif (SQLITE_FOUND)
+
+
+MARK_AS_ADVANCED(SQLITE_INCLUDE_DIR SQLITE_LIBRARIES)
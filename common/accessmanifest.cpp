@@ -0,0 +1,196 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "accessmanifest.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "regionsnapshot.h"
+
+// nobody gets more than this of a file ahead of time, however big its
+// tags claim to be
+static const uint64_t max_follow_up = 1 << 20;
+
+namespace {
+
+inline uint32_t get32le(const uint8_t *p)
+{
+    return uint32_t(p[0]) | (uint32_t(p[1]) << 8) |
+           (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24);
+}
+
+inline uint64_t get64le(const uint8_t *p)
+{
+    return uint64_t(get32le(p)) | (uint64_t(get32le(p + 4)) << 32);
+}
+
+inline uint32_t get24be(const uint8_t *p)
+{
+    return (uint32_t(p[0]) << 16) | (uint32_t(p[1]) << 8) | uint32_t(p[2]);
+}
+
+void advise(int fd, uint64_t offset, uint64_t length)
+{
+#ifdef POSIX_FADV_WILLNEED
+    posix_fadvise(fd, offset, length, POSIX_FADV_WILLNEED);
+#else
+    (void)fd;
+    (void)offset;
+    (void)length;
+#endif
+}
+
+bool readRange(int fd, uint64_t offset, uint64_t length, RegionSnapshot &snapshot)
+{
+    if (length == 0)
+        return true;
+
+    std::vector<char> data(length);
+    size_t done = 0;
+    while (done < length) {
+        ssize_t got = pread(fd, &data[done], length - done, offset + done);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            break;
+        done += got;
+    }
+    snapshot.add(offset, &data[0], done);
+    return done == length;
+}
+
+void addRange(uint64_t offset, uint64_t length, uint64_t size,
+              std::vector<AccessManifest::Range> &ranges)
+{
+    if (offset >= size)
+        return;
+    if (length > max_follow_up)
+        length = max_follow_up;
+    if (length > size - offset)
+        length = size - offset;
+    AccessManifest::Range range = { offset, length };
+    ranges.push_back(range);
+}
+
+}
+
+AccessManifest::AccessManifest(uint64_t head, uint64_t tail, FollowUps followUps, bool prefill)
+    : head(head), tail(tail), followUps(followUps), prefill(prefill)
+{
+}
+
+void AccessManifest::advise(int fd, uint64_t size) const
+{
+    const uint64_t first = head < size ? head : size;
+    if (first)
+        ::advise(fd, 0, first);
+    const uint64_t last = size - first < tail ? size - first : tail;
+    if (last)
+        ::advise(fd, size - last, last);
+}
+
+bool AccessManifest::read(int fd, uint64_t size, RegionSnapshot &snapshot) const
+{
+    snapshot.setFileSize(size);
+
+    const uint64_t first = head < size ? head : size;
+    const uint64_t last = size - first < tail ? size - first : tail;
+    if (!readRange(fd, 0, first, snapshot) || !readRange(fd, size - last, last, snapshot))
+        return false;
+    if (!followUps || first == 0)
+        return true;
+
+    std::vector<char> start(first);
+    snapshot.read(0, first, &start[0]);
+    std::vector<Range> ranges;
+    followUps(reinterpret_cast<const uint8_t *>(&start[0]), first, size, ranges);
+
+    // all of them on their way before waiting for any
+    for (size_t i = 0; i < ranges.size(); ++i)
+        ::advise(fd, ranges[i].offset, ranges[i].length);
+    bool ok = true;
+    for (size_t i = 0; i < ranges.size(); ++i)
+        ok = readRange(fd, ranges[i].offset, ranges[i].length, snapshot) && ok;
+    return ok;
+}
+
+void AccessManifest::riffChunks(const uint8_t *head, size_t length, uint64_t size,
+                                std::vector<Range> &ranges)
+{
+    if (length < 12 || (memcmp(head, "RIFF", 4) && memcmp(head, "RF64", 4) &&
+                        memcmp(head, "BW64", 4)))
+        return;
+
+    // in RF64 files the size of the data chunk is in ds64, the chunk says -1
+    const bool rf64 = memcmp(head, "RIFF", 4) != 0;
+    uint64_t dataSize = 0;
+    bool haveDs64 = false;
+    uint64_t offset = 12;
+    while (offset + 8 <= length) {
+        uint64_t chunk = get32le(head + offset + 4);
+        if (rf64 && !memcmp(head + offset, "ds64", 4) && offset + 8 + 16 <= length) {
+            dataSize = get64le(head + offset + 8 + 8);
+            haveDs64 = true;
+        } else if (rf64 && haveDs64 && !memcmp(head + offset, "data", 4) &&
+                   chunk == 0xffffffff) {
+            chunk = dataSize;
+        }
+        offset += 8 + chunk + (chunk & 1);
+        if (offset >= size)
+            return;
+    }
+    addRange(offset, 64 << 10, size, ranges);
+}
+
+void AccessManifest::id3v2Tag(const uint8_t *head, size_t length, uint64_t size,
+                              std::vector<Range> &ranges)
+{
+    if (length < 10 || memcmp(head, "ID3", 3))
+        return;
+
+    // the size is syncsafe, and doesn't count the header or footer
+    uint64_t tag = (uint64_t(head[6] & 0x7f) << 21) | ((head[7] & 0x7f) << 14) |
+                   ((head[8] & 0x7f) << 7) | (head[9] & 0x7f);
+    tag += (head[5] & 0x10) ? 20 : 10;
+    if (tag + 4096 > length)
+        addRange(length, tag + 4096 - length, size, ranges);
+}
+
+void AccessManifest::flacMetadata(const uint8_t *head, size_t length, uint64_t size,
+                                  std::vector<Range> &ranges)
+{
+    if (length < 4 || memcmp(head, "fLaC", 4))
+        return;
+
+    // blocks that start in the head are walked; the block after them is
+    // where the rest begins, and its length can't be known yet
+    uint64_t offset = 4;
+    while (offset + 4 <= length) {
+        const bool last = head[offset] & 0x80;
+        offset += 4 + get24be(head + offset + 1);
+        if (last) {
+            if (offset > length)
+                addRange(length, offset - length, size, ranges);
+            return;
+        }
+    }
+    const uint64_t end = (offset > length ? offset : length) + (64 << 10);
+    addRange(length, end - length, size, ranges);
+}
@@ -0,0 +1,91 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef ACCESSMANIFEST_H
+#define ACCESSMANIFEST_H
+
+#include <stddef.h>
+
+#include <vector>
+
+#if !defined(__osf__)
+#include <inttypes.h>
+#else
+typedef unsigned char  uint8_t;
+typedef unsigned short uint16_t;
+typedef unsigned int   uint32_t;
+typedef unsigned long long uint64_t;
+#endif
+
+class RegionSnapshot;
+
+/**
+ * A first guess at what an analyzer will read of a file: so many bytes
+ * at the start and at the end, and whatever else the start shows it
+ * will need, such as a tag whose size is in its header or the chunks
+ * after the audio data.
+ *
+ * Whoever reads many files can tell the kernel about all of them before
+ * the first is analyzed, or read the bytes into a RegionSnapshot the
+ * analyzer then reads from.
+ */
+struct AccessManifest
+{
+    struct Range
+    {
+        uint64_t offset;
+        uint64_t length;
+    };
+
+    /** Adds the ranges the head shows will be read as well. */
+    typedef void (*FollowUps)(const uint8_t *head, size_t length, uint64_t size,
+                              std::vector<Range> &ranges);
+
+    AccessManifest(uint64_t head = 0, uint64_t tail = 0, FollowUps followUps = 0,
+                   bool prefill = false);
+
+    uint64_t head;
+    uint64_t tail;
+    FollowUps followUps;
+
+    /** Whether the analyzer reads through a snapshot, so read() helps. */
+    bool prefill;
+
+    /** Asks the kernel to start reading the head and tail of fd. */
+    void advise(int fd, uint64_t size) const;
+
+    /** Reads the head, tail and follow-ups of fd into snapshot. */
+    bool read(int fd, uint64_t size, RegionSnapshot &snapshot) const;
+
+    /**
+     * The chunk after the last one that starts in the head of a RIFF
+     * file, and 64 KiB after it, which is where the tags are when they
+     * follow the data.
+     */
+    static void riffChunks(const uint8_t *head, size_t length, uint64_t size,
+                           std::vector<Range> &ranges);
+
+    /** An ID3v2 tag at the start, and 4 KiB after it for the first frames. */
+    static void id3v2Tag(const uint8_t *head, size_t length, uint64_t size,
+                         std::vector<Range> &ranges);
+
+    /** The metadata blocks of a native FLAC file. */
+    static void flacMetadata(const uint8_t *head, size_t length, uint64_t size,
+                             std::vector<Range> &ranges);
+};
+
+#endif
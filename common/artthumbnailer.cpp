@@ -0,0 +1,97 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "artthumbnailer.h"
+
+#include <QBuffer>
+#include <QByteArray>
+#include <QFile>
+#include <QImage>
+#include <QImageIOHandler>
+#include <QImageReader>
+#include <QSize>
+
+#include <string.h>
+
+#include "imagescaler.h"
+#include "payloadhash.h"
+
+ArtThumbnailer::ArtThumbnailer(const QString &cacheDirectory, int size)
+    : m_cache(QFile::encodeName(cacheDirectory).data()), m_size(size)
+{
+}
+
+bool ArtThumbnailer::thumbnail(int fd, const CoverArt::Picture &picture,
+                               std::vector<uint32_t> &pixels, int &width, int &height) const
+{
+    std::vector<uint8_t> data;
+    uint64_t key;
+    if (picture.encoding != CoverArt::Raw ||
+        !PayloadHash::hashRange(fd, picture.offset(), picture.length, PayloadHash::Full, key)) {
+        if (!CoverArt::read(fd, picture, data))
+            return false;
+        PayloadHash hash;
+        hash.update(&data[0], data.size());
+        key = hash.digest();
+    }
+
+    if (m_cache.lookup(key, m_size, pixels, width, height))
+        return true;
+
+    if (data.empty() && !CoverArt::read(fd, picture, data))
+        return false;
+
+    QByteArray bytes = QByteArray::fromRawData(reinterpret_cast<const char *>(&data[0]),
+                                               data.size());
+    QBuffer buffer(&bytes);
+    buffer.open(QIODevice::ReadOnly);
+    QImageReader reader(&buffer);
+
+    // the JPEG decoder can leave out detail nobody will see, by powers of
+    // two, which is most of the work for big covers
+    QSize size = reader.size();
+    if (size.isValid() && reader.supportsOption(QImageIOHandler::ScaledSize)) {
+        int shrink = 1;
+        while (shrink < 8 && size.width() / (shrink * 2) >= 2 * m_size &&
+               size.height() / (shrink * 2) >= 2 * m_size)
+            shrink *= 2;
+        if (shrink > 1)
+            reader.setScaledSize(QSize((size.width() + shrink - 1) / shrink,
+                                       (size.height() + shrink - 1) / shrink));
+    }
+
+    QImage image = reader.read();
+    if (image.isNull())
+        return false;
+    image = image.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+
+    ImageScaler::fit(image.width(), image.height(), m_size, width, height);
+    QImage thumbnail(width, height, QImage::Format_ARGB32_Premultiplied);
+    if (width == image.width() && height == image.height())
+        thumbnail = image;
+    else
+        ImageScaler::scale(reinterpret_cast<const uint32_t *>(image.bits()),
+                           image.width(), image.height(), image.bytesPerLine() / 4,
+                           reinterpret_cast<uint32_t *>(thumbnail.bits()),
+                           width, height, thumbnail.bytesPerLine() / 4);
+
+    pixels.resize(size_t(width) * height);
+    for (int y = 0; y < height; ++y)
+        memcpy(&pixels[size_t(y) * width], thumbnail.scanLine(y), size_t(width) * 4);
+    m_cache.store(key, m_size, &pixels[0], width, height);
+    return true;
+}
@@ -0,0 +1,52 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef ARTTHUMBNAILER_H
+#define ARTTHUMBNAILER_H
+
+#include <QString>
+
+#include <vector>
+
+#include "coverart.h"
+#include "thumbnailcache.h"
+
+/**
+ * Makes thumbnails of embedded cover art, going through a
+ * ThumbnailCache.
+ *
+ * The cache key is the XXH64 of the encoded image.  Images stored as is
+ * are hashed straight from the file, so a cache hit doesn't even read
+ * them into memory.  On a miss the image is decoded once, with the JPEG
+ * decoder told to shrink it by a power of two while decoding, and then
+ * scaled by ImageScaler.
+ */
+class ArtThumbnailer
+{
+public:
+    ArtThumbnailer(const QString &cacheDirectory, int size);
+
+    /** The thumbnail as premultiplied ARGB pixels, row after row. */
+    bool thumbnail(int fd, const CoverArt::Picture &picture,
+                   std::vector<uint32_t> &pixels, int &width, int &height) const;
+
+private:
+    ThumbnailCache m_cache;
+    int m_size;
+};
+
+#endif
@@ -0,0 +1,608 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "batchreader.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <deque>
+#include <set>
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#include "regionsnapshot.h"
+
+// results the pool may get ahead of the listener by
+static const size_t pool_backlog = 64;
+
+// times a submission the kernel has no room for is tried again, a
+// millisecond apart, before the ring is given up
+static const int submit_retries = 1000;
+
+namespace {
+
+/** A file on its way through the reader. */
+struct Job
+{
+    Job() : fd(-1), pending(0), ok(true), followedUp(false), reported(false) {}
+
+    int fd;
+    int pending;        // operations queued and not completed
+    bool ok;
+    bool followedUp;
+    bool reported;      // the listener has it
+    RegionSnapshot regions;
+};
+
+/** Reads a file the plain way, for the pool. */
+bool readFile(const char *path, const AccessManifest &manifest, RegionSnapshot &regions)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0 && manifest.read(fd, st.st_size, regions);
+    close(fd);
+    return ok;
+}
+
+struct Pool
+{
+    const std::vector<std::string> *paths;
+    const AccessManifest *manifest;
+
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t room;
+    size_t next;
+    std::deque<std::pair<size_t, Job *> > done;
+};
+
+void *readFiles(void *arg)
+{
+    Pool *pool = static_cast<Pool *>(arg);
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->done.size() >= pool_backlog)
+            pthread_cond_wait(&pool->room, &pool->lock);
+        const size_t index = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        if (index >= pool->paths->size())
+            break;
+
+        Job *job = new Job;
+        job->ok = readFile((*pool->paths)[index].c_str(), *pool->manifest, job->regions);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->done.push_back(std::make_pair(index, job));
+        pthread_cond_signal(&pool->ready);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return 0;
+}
+
+}
+
+#ifdef HAVE_IO_URING
+
+namespace {
+
+/** One operation on the ring. */
+struct Operation
+{
+    size_t index;
+    int opcode;
+    const char *path;
+    uint64_t offset;
+    std::vector<char> data;
+};
+
+inline unsigned loadAcquire(const unsigned *p)
+{
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+inline void storeRelease(unsigned *p, unsigned v)
+{
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+}
+
+/**
+ * A bare io_uring: the submission and completion queues mapped from the
+ * kernel, without liburing, which few systems have.
+ */
+class BatchReader::Ring
+{
+public:
+    static Ring *create(unsigned entries);
+    ~Ring();
+
+    /** How many operations may be in flight without losing completions. */
+    unsigned capacity() const { return m_cqEntries; }
+
+    bool push(Operation *operation, int fd);
+    bool submit(unsigned wait);
+    Operation *pop(int &result);
+
+    /** Operations the kernel has and hasn't completed yet. */
+    unsigned inFlight() const { return m_inFlight; }
+    /** Waits for the next completion of those. */
+    bool wait();
+
+private:
+    Ring();
+
+    int m_fd;
+    unsigned m_sqEntries;
+    unsigned m_cqEntries;
+    unsigned m_queued;
+    unsigned m_inFlight;
+
+    void *m_sq;
+    size_t m_sqSize;
+    void *m_cq;
+    size_t m_cqSize;
+    io_uring_sqe *m_sqes;
+    size_t m_sqesSize;
+
+    unsigned *m_sqHead;
+    unsigned *m_sqTail;
+    unsigned m_sqMask;
+    unsigned *m_sqArray;
+    unsigned *m_cqHead;
+    unsigned *m_cqTail;
+    unsigned m_cqMask;
+    io_uring_cqe *m_cqes;
+};
+
+BatchReader::Ring::Ring()
+    : m_fd(-1), m_queued(0), m_inFlight(0), m_sq(MAP_FAILED), m_sqSize(0), m_cq(MAP_FAILED),
+      m_cqSize(0), m_sqes(0), m_sqesSize(0)
+{
+}
+
+BatchReader::Ring *BatchReader::Ring::create(unsigned entries)
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0)
+        return 0;
+
+    Ring *ring = new Ring;
+    ring->m_fd = fd;
+    ring->m_sqEntries = params.sq_entries;
+    ring->m_cqEntries = params.cq_entries;
+
+    // opening, reading and closing came with 5.6; older kernels have
+    // rings that can't do them
+    const size_t probeSize = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+    std::vector<char> buffer(probeSize, 0);
+    io_uring_probe *probe = reinterpret_cast<io_uring_probe *>(&buffer[0]);
+    bool ok = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) >= 0;
+    const int needed[] = { IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_CLOSE };
+    for (int i = 0; ok && i < 3; ++i)
+        ok = needed[i] <= probe->last_op && (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+
+    if (ok) {
+        ring->m_sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        ring->m_cqSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            if (ring->m_cqSize > ring->m_sqSize)
+                ring->m_sqSize = ring->m_cqSize;
+            ring->m_cqSize = 0;
+        }
+        ring->m_sq = mmap(0, ring->m_sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          fd, IORING_OFF_SQ_RING);
+        ok = ring->m_sq != MAP_FAILED;
+    }
+    if (ok && ring->m_cqSize) {
+        ring->m_cq = mmap(0, ring->m_cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          fd, IORING_OFF_CQ_RING);
+        ok = ring->m_cq != MAP_FAILED;
+    }
+    if (ok) {
+        ring->m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        void *sqes = mmap(0, ring->m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          fd, IORING_OFF_SQES);
+        ok = sqes != MAP_FAILED;
+        if (ok)
+            ring->m_sqes = static_cast<io_uring_sqe *>(sqes);
+    }
+    if (!ok) {
+        delete ring;
+        return 0;
+    }
+
+    char *sq = static_cast<char *>(ring->m_sq);
+    char *cq = ring->m_cqSize ? static_cast<char *>(ring->m_cq) : sq;
+    ring->m_sqHead = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    ring->m_sqTail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    ring->m_sqMask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    ring->m_sqArray = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    ring->m_cqHead = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    ring->m_cqTail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    ring->m_cqMask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    ring->m_cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+    return ring;
+}
+
+BatchReader::Ring::~Ring()
+{
+    if (m_sqes)
+        munmap(m_sqes, m_sqesSize);
+    if (m_cq != MAP_FAILED)
+        munmap(m_cq, m_cqSize);
+    if (m_sq != MAP_FAILED)
+        munmap(m_sq, m_sqSize);
+    if (m_fd >= 0)
+        close(m_fd);
+}
+
+bool BatchReader::Ring::push(Operation *operation, int fd)
+{
+    const unsigned tail = *m_sqTail;
+    if (tail - loadAcquire(m_sqHead) >= m_sqEntries)
+        return false;
+
+    const unsigned slot = tail & m_sqMask;
+    io_uring_sqe *sqe = &m_sqes[slot];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = operation->opcode;
+    sqe->user_data = reinterpret_cast<uintptr_t>(operation);
+    if (operation->opcode == IORING_OP_OPENAT) {
+        sqe->fd = AT_FDCWD;
+        sqe->addr = reinterpret_cast<uintptr_t>(operation->path);
+        sqe->open_flags = O_RDONLY | O_CLOEXEC;
+    } else if (operation->opcode == IORING_OP_READ) {
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<uintptr_t>(&operation->data[0]);
+        sqe->len = operation->data.size();
+        sqe->off = operation->offset;
+    } else {
+        sqe->fd = fd;
+    }
+
+    m_sqArray[slot] = slot;
+    storeRelease(m_sqTail, tail + 1);
+    ++m_queued;
+    return true;
+}
+
+bool BatchReader::Ring::submit(unsigned wait)
+{
+    for (int retries = 0;;) {
+        int done = syscall(__NR_io_uring_enter, m_fd, m_queued, wait,
+                           wait ? IORING_ENTER_GETEVENTS : 0, 0, 0);
+        if (done >= 0) {
+            m_queued -= done;
+            m_inFlight += done;
+            return true;
+        }
+        if (errno == EINTR)
+            continue;
+        if (errno != EBUSY && errno != EAGAIN)
+            return false;
+
+        // the kernel is out of room for now: completions taken off make
+        // room, and otherwise what is in flight or a moment does
+        if (loadAcquire(m_cqTail) != *m_cqHead)
+            return true;
+        if (m_inFlight)
+            return this->wait();
+        if (++retries > submit_retries)
+            return false;
+        usleep(1000);
+    }
+}
+
+bool BatchReader::Ring::wait()
+{
+    for (;;) {
+        if (syscall(__NR_io_uring_enter, m_fd, 0, 1, IORING_ENTER_GETEVENTS, 0, 0) >= 0)
+            return true;
+        if (errno != EINTR)
+            return false;
+    }
+}
+
+Operation *BatchReader::Ring::pop(int &result)
+{
+    const unsigned head = *m_cqHead;
+    if (head == loadAcquire(m_cqTail))
+        return 0;
+
+    const io_uring_cqe &cqe = m_cqes[head & m_cqMask];
+    Operation *operation = reinterpret_cast<Operation *>(uintptr_t(cqe.user_data));
+    result = cqe.res;
+    storeRelease(m_cqHead, head + 1);
+    --m_inFlight;
+    return operation;
+}
+
+#else
+
+class BatchReader::Ring
+{
+public:
+    static Ring *create(unsigned) { return 0; }
+};
+
+#endif
+
+BatchReader::BatchReader(int depth, int threads)
+    : m_ring(Ring::create(depth)), m_depth(depth), m_threads(threads)
+{
+}
+
+BatchReader::~BatchReader()
+{
+    delete m_ring;
+}
+
+bool BatchReader::isRing() const
+{
+    return m_ring != 0;
+}
+
+void BatchReader::read(const std::vector<std::string> &paths, const AccessManifest &manifest,
+                       Listener &listener)
+{
+#ifdef HAVE_IO_URING
+    if (!m_ring) {
+        readThreaded(paths, manifest, listener);
+        return;
+    }
+
+    std::vector<Job> jobs(paths.size());
+    std::deque<Operation *> waiting;
+    // every operation not completed yet, queued or with the kernel
+    std::set<Operation *> live;
+    size_t next = 0;
+    size_t active = 0;
+    unsigned inflight = 0;
+
+    for (;;) {
+        // every file takes a few operations at a time, so half the depth
+        // in files keeps the ring full
+        while (next < paths.size() && active < size_t(m_depth) / 2 + 1) {
+            Operation *open = new Operation;
+            open->index = next++;
+            open->opcode = IORING_OP_OPENAT;
+            open->path = paths[open->index].c_str();
+            open->offset = 0;
+            jobs[open->index].pending = 1;
+            waiting.push_back(open);
+            live.insert(open);
+            ++active;
+        }
+
+        while (!waiting.empty() && inflight < m_ring->capacity() &&
+               m_ring->push(waiting.front(), jobs[waiting.front()->index].fd)) {
+            waiting.pop_front();
+            ++inflight;
+        }
+        if (inflight == 0)
+            break;
+
+        if (!m_ring->submit(1)) {
+            // the ring broke down.  The kernel may still be reading into
+            // the buffers of what it has, so that is waited for before
+            // the ring goes, and the files not yet handed to the
+            // listener go through the pool
+            for (size_t i = 0; i < waiting.size(); ++i) {
+                live.erase(waiting[i]);
+                delete waiting[i];
+            }
+            int result;
+            for (;;) {
+                Operation *operation = m_ring->pop(result);
+                if (!operation) {
+                    if (m_ring->inFlight() && m_ring->wait())
+                        continue;
+                    break;
+                }
+                Job &job = jobs[operation->index];
+                --job.pending;
+                if (operation->opcode == IORING_OP_OPENAT && result >= 0) {
+                    job.fd = result;
+                } else if (operation->opcode == IORING_OP_CLOSE) {
+                    job.fd = -1;
+                    if (!job.pending && !job.reported) {
+                        listener.completed(operation->index, job.regions, job.ok);
+                        job.regions.clear();
+                        job.reported = true;
+                    }
+                }
+                live.erase(operation);
+                delete operation;
+            }
+            // what the kernel never gave back can't be freed safely
+            if (!m_ring->inFlight()) {
+                for (std::set<Operation *>::iterator it = live.begin(); it != live.end(); ++it)
+                    delete *it;
+            }
+            delete m_ring;
+            m_ring = 0;
+
+            std::vector<std::string> rest;
+            std::vector<size_t> indexes;
+            for (size_t i = 0; i < paths.size(); ++i) {
+                if (jobs[i].fd >= 0)
+                    close(jobs[i].fd);
+                if (!jobs[i].reported) {
+                    rest.push_back(paths[i]);
+                    indexes.push_back(i);
+                }
+            }
+
+            class Renumber : public Listener
+            {
+            public:
+                Renumber(Listener &listener, const std::vector<size_t> &indexes)
+                    : m_listener(listener), m_indexes(indexes) {}
+                virtual void completed(size_t index, RegionSnapshot &regions, bool ok)
+                {
+                    m_listener.completed(m_indexes[index], regions, ok);
+                }
+            private:
+                Listener &m_listener;
+                const std::vector<size_t> &m_indexes;
+            } renumber(listener, indexes);
+            readThreaded(rest, manifest, renumber);
+            return;
+        }
+
+        int result;
+        while (Operation *operation = m_ring->pop(result)) {
+            --inflight;
+            Job &job = jobs[operation->index];
+            --job.pending;
+
+            std::vector<AccessManifest::Range> ranges;
+            if (operation->opcode == IORING_OP_OPENAT) {
+                struct stat st;
+                if (result >= 0 && fstat(result, &st) == 0) {
+                    job.fd = result;
+                    job.regions.setFileSize(st.st_size);
+                    const uint64_t size = st.st_size;
+                    const uint64_t head = manifest.head < size ? manifest.head : size;
+                    const uint64_t tail = size - head < manifest.tail ? size - head : manifest.tail;
+                    AccessManifest::Range first = { 0, head };
+                    AccessManifest::Range last = { size - tail, tail };
+                    ranges.push_back(first);
+                    ranges.push_back(last);
+                } else {
+                    if (result >= 0)
+                        close(result);
+                    job.ok = false;
+                }
+            } else if (operation->opcode == IORING_OP_READ) {
+                if (result > 0)
+                    job.regions.add(operation->offset, &operation->data[0], result);
+                if (result != int(operation->data.size()))
+                    job.ok = false;
+
+                // the head is in, so the follow-ups are known
+                if (job.pending == 0 && job.ok && !job.followedUp && manifest.followUps &&
+                    manifest.head) {
+                    job.followedUp = true;
+                    uint64_t head = manifest.head < job.regions.fileSize()
+                                  ? manifest.head : job.regions.fileSize();
+                    std::vector<char> start(head);
+                    if (head && job.regions.read(0, head, &start[0]))
+                        manifest.followUps(reinterpret_cast<const uint8_t *>(&start[0]), head,
+                                           job.regions.fileSize(), ranges);
+                }
+            }
+
+            for (size_t i = 0; i < ranges.size(); ++i) {
+                if (ranges[i].length == 0)
+                    continue;
+                Operation *read = new Operation;
+                read->index = operation->index;
+                read->opcode = IORING_OP_READ;
+                read->path = 0;
+                read->offset = ranges[i].offset;
+                read->data.resize(ranges[i].length);
+                waiting.push_back(read);
+                live.insert(read);
+                ++job.pending;
+            }
+
+            if (job.pending == 0 && operation->opcode != IORING_OP_CLOSE && job.fd >= 0) {
+                Operation *close = new Operation;
+                close->index = operation->index;
+                close->opcode = IORING_OP_CLOSE;
+                close->path = 0;
+                close->offset = 0;
+                waiting.push_back(close);
+                live.insert(close);
+                ++job.pending;
+            } else if (job.pending == 0) {
+                if (operation->opcode == IORING_OP_CLOSE)
+                    job.fd = -1;
+                listener.completed(operation->index, job.regions, job.ok);
+                job.regions.clear();
+                job.reported = true;
+                --active;
+            }
+            live.erase(operation);
+            delete operation;
+        }
+    }
+#else
+    readThreaded(paths, manifest, listener);
+#endif
+}
+
+void BatchReader::readThreaded(const std::vector<std::string> &paths,
+                               const AccessManifest &manifest, Listener &listener)
+{
+    Pool pool;
+    pool.paths = &paths;
+    pool.manifest = &manifest;
+    pool.next = 0;
+    pthread_mutex_init(&pool.lock, 0);
+    pthread_cond_init(&pool.ready, 0);
+    pthread_cond_init(&pool.room, 0);
+
+    std::vector<pthread_t> threads;
+    for (int t = 0; t < m_threads && size_t(t) < paths.size(); ++t) {
+        pthread_t thread;
+        if (pthread_create(&thread, 0, readFiles, &pool) == 0)
+            threads.push_back(thread);
+    }
+
+    for (size_t completed = 0; completed < paths.size(); ++completed) {
+        if (threads.empty()) {
+            RegionSnapshot regions;
+            const bool ok = readFile(paths[completed].c_str(), manifest, regions);
+            listener.completed(completed, regions, ok);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool.lock);
+        while (pool.done.empty())
+            pthread_cond_wait(&pool.ready, &pool.lock);
+        std::pair<size_t, Job *> done = pool.done.front();
+        pool.done.pop_front();
+        pthread_cond_signal(&pool.room);
+        pthread_mutex_unlock(&pool.lock);
+
+        listener.completed(done.first, done.second->regions, done.second->ok);
+        delete done.second;
+    }
+
+    for (size_t i = 0; i < threads.size(); ++i)
+        pthread_join(threads[i], 0);
+    pthread_cond_destroy(&pool.room);
+    pthread_cond_destroy(&pool.ready);
+    pthread_mutex_destroy(&pool.lock);
+}
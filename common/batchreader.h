@@ -0,0 +1,74 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef BATCHREADER_H
+#define BATCHREADER_H
+
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+#include "accessmanifest.h"
+
+class RegionSnapshot;
+
+/**
+ * Reads what an AccessManifest names of many files at once.
+ *
+ * Where the kernel has io_uring, the opens, reads and closes of up to
+ * depth files at a time are all queued on one ring, and follow-up reads
+ * are queued as soon as the head they depend on is in, so the calling
+ * thread only ever waits for whatever completes first.  Elsewhere a
+ * pool of threads does the same with open() and pread().
+ *
+ * Either way the listener is called on the thread that called read(),
+ * once for every file, in the order the files complete.
+ */
+class BatchReader
+{
+public:
+    class Listener
+    {
+    public:
+        virtual ~Listener() {}
+
+        /** regions holds what was read of paths[index], unless ok is false. */
+        virtual void completed(size_t index, RegionSnapshot &regions, bool ok) = 0;
+    };
+
+    explicit BatchReader(int depth = 256, int threads = 8);
+    ~BatchReader();
+
+    void read(const std::vector<std::string> &paths, const AccessManifest &manifest,
+              Listener &listener);
+
+    /** Whether read() goes through io_uring. */
+    bool isRing() const;
+
+private:
+    class Ring;
+
+    void readThreaded(const std::vector<std::string> &paths, const AccessManifest &manifest,
+                      Listener &listener);
+
+    Ring *m_ring;
+    int m_depth;
+    int m_threads;
+};
+
+#endif
@@ -0,0 +1,648 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "cachedfileplugin.h"
+
+#include <kconfig.h>
+#include <kconfiggroup.h>
+#include <kdebug.h>
+#include <kstandarddirs.h>
+
+#include <QFile>
+#include <QImage>
+#include <QList>
+#include <QSize>
+#include <QStringList>
+#include <QVariant>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "batchreader.h"
+#include "checkpointstate.h"
+#include "directorywalker.h"
+#include "metadatacache.h"
+#include "metadatacolumns.h"
+#include "metadatarecord.h"
+#include "payloadhash.h"
+#include "scratcharena.h"
+#include "tagindex.h"
+#ifdef HAVE_SQLITE
+#include "sqliteindex.h"
+#endif
+
+// prefetched bytes waiting for readInfo() are kept up to this much, and
+// files beyond that are only announced to the kernel
+static const quint64 max_prefetched = 32 << 20;
+
+// files read at once, or announced to the kernel at once
+static const int prefetch_batch = 128;
+
+// changes to the totals before they are appended to the log
+static const size_t totals_sync = 1024;
+
+// how much before the end of a file has to be unchanged for its
+// checkpoint to be resumed from
+static const uint64_t checkpoint_tail = 4096;
+
+namespace {
+
+bool tailHash(const char *path, uint64_t size, uint64_t &hash)
+{
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    const uint64_t length = size < checkpoint_tail ? size : checkpoint_tail;
+    char data[checkpoint_tail];
+    ssize_t got;
+    do
+        got = pread(fd, data, length, size - length);
+    while (got < 0 && errno == EINTR);
+    ::close(fd);
+    if (got != ssize_t(length))
+        return false;
+
+    PayloadHash tail;
+    tail.update(data, length);
+    hash = tail.digest();
+    return true;
+}
+
+QVariant toVariant(MetadataRecord::Type type, const MetadataRecord::Value &value, bool real)
+{
+    switch (type) {
+    case MetadataRecord::Integer:
+        return int(value.number);
+    case MetadataRecord::Boolean:
+        return bool(value.number);
+    case MetadataRecord::Real:
+        return value.real;
+    case MetadataRecord::Duration:
+        if (real)
+            return value.real;
+        return int((value.number + value.scale / 2) / value.scale);
+    case MetadataRecord::Hash:
+        return QString("%1").arg(qulonglong(value.number), 16, 16, QChar('0'));
+    case MetadataRecord::Text:
+        return QString::fromUtf8(value.data, value.length);
+    case MetadataRecord::Blob:
+        return QByteArray(value.data, value.length);
+    case MetadataRecord::Size:
+        return QSize(value.number, value.scale);
+    case MetadataRecord::Image: {
+        QImage image(value.number, value.scale, QImage::Format_ARGB32_Premultiplied);
+        for (int y = 0; y < image.height(); ++y)
+            memcpy(image.scanLine(y), value.data + size_t(y) * image.width() * 4,
+                   size_t(image.width()) * 4);
+        return image;
+    }
+    }
+    return QVariant();
+}
+
+}
+
+CachedFilePlugin::CachedFilePlugin(QObject *parent, const QStringList &args,
+                                   const char *name, uint version)
+    : KFilePlugin(parent, args), m_name(name), m_version(version), m_layout(0), m_cache(0),
+      m_snapshots(0), m_snapshot(0), m_checkpoints(0), m_index(0), m_indexSettings(0), m_tags(0),
+      m_totalsLoaded(false), m_reading(false), m_what(0),
+      m_haveCheckpoint(false), m_prefetchedBytes(0), m_reader(0)
+{
+    KConfig config("kfile_multimediarc");
+    KConfigGroup cache(&config, "Cache");
+    m_enabled = cache.readEntry("Enabled", true);
+
+    // snapshots of what was read let a new version of a plugin reread
+    // files without going to them, which matters on disks that sleep
+    KConfigGroup snapshots(&config, "Snapshots");
+    m_snapshotsEnabled = snapshots.readEntry("Enabled", false);
+    m_snapshotLimit = snapshots.readEntry("MaxSize", 256 << 10);
+
+    KConfigGroup checkpoints(&config, "Checkpoints");
+    m_checkpointsEnabled = checkpoints.readEntry("Enabled", true);
+
+    KConfigGroup index(&config, "Index");
+    m_indexEnabled = index.readEntry("Enabled", false);
+    m_indexPath = index.readEntry("Path",
+                                  KStandardDirs::locateLocal("data", "kfile_metadata.sqlite"));
+
+    KConfigGroup tags(&config, "Tags");
+    m_tagsEnabled = tags.readEntry("Enabled", false);
+    m_tagsPath = tags.readEntry("Path", KStandardDirs::locateLocal("data", "kfile_tags.index"));
+
+    KConfigGroup totals(&config, "Totals");
+    m_totalsEnabled = totals.readEntry("Enabled", false);
+    m_totalsPath = totals.readEntry("Path", KStandardDirs::locateLocal("data", "kfile_totals"));
+}
+
+CachedFilePlugin::~CachedFilePlugin()
+{
+    delete m_cache;
+    delete m_snapshots;
+    delete m_checkpoints;
+#ifdef HAVE_SQLITE
+    // what is still queued is written before the index goes
+    delete m_index;
+#endif
+    // saves what was added since the last merge
+    delete m_tags;
+    if (m_totalsEnabled && m_totals.changes())
+        syncTotals();
+    delete m_reader;
+}
+
+KFileMimeTypeInfo *CachedFilePlugin::addMimeTypeInfo(const QString &mimeType)
+{
+    m_mimeTypes.append(mimeType);
+    return KFilePlugin::addMimeTypeInfo(mimeType);
+}
+
+void CachedFilePlugin::setCacheSettings(const QByteArray &settings)
+{
+    m_settings = settings;
+}
+
+void CachedFilePlugin::setLayout(const MetadataLayout *layout)
+{
+    m_layout = layout;
+}
+
+MetadataCache *CachedFilePlugin::cache()
+{
+    // opened on first use, as the settings are only known once the
+    // plugin's constructor has run
+    if (!m_cache && m_enabled) {
+        const QString path = KStandardDirs::locateLocal("cache", "kfile_metadata.cache");
+        PayloadHash settings;
+        settings.update(m_settings.constData(), m_settings.size());
+        m_cache = new MetadataCache(QFile::encodeName(path).data(), m_name.data(),
+                                    m_version, settings.digest());
+
+        // snapshots outlive versions and settings, as they're of the file
+        if (m_snapshotsEnabled) {
+            const QString pack = KStandardDirs::locateLocal("cache", "kfile_snapshots.pack");
+            m_snapshots = new MetadataCache(QFile::encodeName(pack).data(), m_name.data(), 0, 0);
+        }
+    }
+    return m_cache;
+}
+
+MetadataCache *CachedFilePlugin::checkpoints()
+{
+    // only opened by the plugins that have checkpoints
+    if (!m_checkpoints && m_checkpointsEnabled && cache()) {
+        const QString path = KStandardDirs::locateLocal("cache", "kfile_checkpoints.cache");
+        PayloadHash settings;
+        settings.update(m_settings.constData(), m_settings.size());
+        m_checkpoints = new MetadataCache(QFile::encodeName(path).data(), m_name.data(),
+                                          m_version, settings.digest());
+    }
+    return m_checkpoints;
+}
+
+SqliteIndex *CachedFilePlugin::index()
+{
+#ifdef HAVE_SQLITE
+    // its writer is only started once there is something to write
+    if (!m_index && m_indexEnabled) {
+        // rows read by another version or with other settings are stale
+        PayloadHash settings;
+        settings.update(&m_version, sizeof(m_version));
+        settings.update(m_settings.constData(), m_settings.size());
+        m_indexSettings = settings.digest();
+        m_index = new SqliteIndex(QFile::encodeName(m_indexPath).data());
+        if (!m_index->isOpen()) {
+            kDebug(7034) << "could not open the index" << m_indexPath
+                         << m_index->error().c_str();
+            m_indexEnabled = false;
+        }
+    }
+    return m_indexEnabled ? m_index : 0;
+#else
+    return 0;
+#endif
+}
+
+void CachedFilePlugin::addToIndex(const MetadataCache::Key &key, const QByteArray &path, uint what,
+                                  const MetadataRecord &record)
+{
+#ifdef HAVE_SQLITE
+    if (index())
+        m_index->add(key, m_name.data(), m_indexSettings, what,
+                     std::string(path.constData(), path.size()), record);
+#endif
+
+    if (m_tagsEnabled && !m_tags)
+        m_tags = new TagIndex(QFile::encodeName(m_tagsPath).data());
+    // the tags are only read for these requests, and a record without
+    // them would look like a file without tags
+    if (m_tags && (what & (KFileMetaInfo::Fastest | KFileMetaInfo::DontCare |
+                           KFileMetaInfo::ContentInfo)))
+        m_tags->update(key, std::string(path.constData(), path.size()), record);
+
+    // only the fields the record has change, so a read for the tags
+    // alone keeps the length of the file
+    if (m_totalsEnabled) {
+        if (!m_totalsLoaded)
+            syncTotals();
+        m_totals.update(std::string(path.constData(), path.size()), record);
+        if (m_totals.changes() >= totals_sync)
+            syncTotals();
+    }
+}
+
+void CachedFilePlugin::syncTotals()
+{
+    if (!m_totals.sync(QFile::encodeName(m_totalsPath).data()))
+        kDebug(7034) << "could not save the totals" << m_totalsPath;
+    m_totalsLoaded = true;
+}
+
+void CachedFilePlugin::pruneTotals()
+{
+    // the files a compaction of the cache found gone
+    std::vector<std::string> gone;
+    m_cache->takeGone(gone);
+    for (size_t i = 0; i < gone.size(); ++i)
+        m_totals.remove(gone[i]);
+}
+
+const DirectoryTotals &CachedFilePlugin::totals()
+{
+    // the log is only read once, and the totals kept up to date from then
+    if (m_totalsEnabled && !m_totalsLoaded)
+        syncTotals();
+    return m_totals;
+}
+
+RegionSnapshot *CachedFilePlugin::snapshot() const
+{
+    return m_snapshot;
+}
+
+bool CachedFilePlugin::checkpoint(uint64_t &size, std::string &state)
+{
+    MetadataCache::Key earlier;
+    std::string payload;
+    if (!m_reading || !checkpoints() ||
+        !m_checkpoints->lookupEarlier(m_key, m_what, earlier, payload) || payload.size() < 8)
+        return false;
+
+    // the bytes before where the file ended then must still be there
+    uint64_t hash;
+    if (!tailHash(m_path.data(), earlier.size, hash) || hash != CheckpointState(payload).number(8))
+        return false;
+    size = earlier.size;
+    state.assign(payload, 8, std::string::npos);
+    return true;
+}
+
+void CachedFilePlugin::setCheckpoint(const std::string &state)
+{
+    if (!m_reading)
+        return;
+    m_checkpoint = state;
+    m_haveCheckpoint = true;
+}
+
+AccessManifest CachedFilePlugin::accessManifest(uint /*what*/) const
+{
+    return AccessManifest(64 << 10);
+}
+
+class CachedFilePlugin::PrefetchListener: public BatchReader::Listener
+{
+public:
+    PrefetchListener(const QStringList &paths, const QList<MetadataCache::Key> &keys,
+                     QHash<QString, Prefetched> &prefetched, quint64 &bytes)
+        : m_paths(paths), m_keys(keys), m_prefetched(prefetched), m_bytes(bytes) {}
+
+    virtual void completed(size_t index, RegionSnapshot &regions, bool ok)
+    {
+        // a file that changed size since the stat is better read again
+        if (!ok || regions.fileSize() != m_keys[index].size)
+            return;
+        Prefetched prefetched;
+        prefetched.key = m_keys[index];
+        prefetched.regions = regions;
+        m_bytes -= m_prefetched.value(m_paths[index]).regions.bytes();
+        m_bytes += prefetched.regions.bytes();
+        m_prefetched.insert(m_paths[index], prefetched);
+    }
+
+private:
+    const QStringList &m_paths;
+    const QList<MetadataCache::Key> &m_keys;
+    QHash<QString, Prefetched> &m_prefetched;
+    quint64 &m_bytes;
+};
+
+void CachedFilePlugin::prefetch(const QStringList &paths, uint what)
+{
+    if (!cache())
+        return;
+
+    QStringList known;
+    QList<MetadataCache::Key> keys;
+    for (int i = 0; i < paths.count(); ++i) {
+        MetadataCache::Key key;
+        if (MetadataCache::key(QFile::encodeName(paths[i]).data(), key)) {
+            known.append(paths[i]);
+            keys.append(key);
+        }
+    }
+    prefetch(known, keys, what);
+}
+
+void CachedFilePlugin::prefetch(const QStringList &paths, const QList<MetadataCache::Key> &fileKeys,
+                                uint what)
+{
+    if (!cache())
+        return;
+
+    const AccessManifest manifest = accessManifest(what);
+    QStringList batch;
+    std::vector<std::string> names;
+    QList<MetadataCache::Key> keys;
+    std::string payload;
+
+    for (int i = 0; i <= paths.count(); ++i) {
+        if (i < paths.count()) {
+            if (m_cache->lookup(fileKeys[i], what, payload))
+                continue;
+
+            const QByteArray path = QFile::encodeName(paths[i]);
+            batch.append(paths[i]);
+            names.push_back(std::string(path.data(), path.size()));
+            keys.append(fileKeys[i]);
+            if (batch.count() < prefetch_batch)
+                continue;
+        }
+
+        if (manifest.prefill && m_prefetchedBytes < max_prefetched) {
+            // the reader has all of the batch on its way at once, and
+            // hands the files over as they come in
+            if (!m_reader)
+                m_reader = new BatchReader(prefetch_batch);
+            PrefetchListener listener(batch, keys, m_prefetched, m_prefetchedBytes);
+            m_reader->read(names, manifest, listener);
+        } else {
+            for (int j = 0; j < batch.count(); ++j) {
+                int fd = ::open(names[j].c_str(), O_RDONLY);
+                if (fd < 0)
+                    continue;
+                manifest.advise(fd, keys[j].size);
+                ::close(fd);
+            }
+        }
+        batch.clear();
+        names.clear();
+        keys.clear();
+    }
+}
+
+bool CachedFilePlugin::readInfo(KFileMetaInfo &info, uint what)
+{
+    // what the parsers take from the arena for this file is theirs until
+    // it was read
+    ScratchScope scratch;
+
+    MetadataRecord record;
+    if (!read(info.path(), info.mimeType(), what, record))
+        return false;
+    appendRecord(info, record);
+    return true;
+}
+
+bool CachedFilePlugin::read(const QString &fileName, const QString &mimeType, uint what,
+                            MetadataRecord &record)
+{
+    const QByteArray path = QFile::encodeName(fileName);
+    MetadataCache::Key key;
+    if (path.isEmpty() || !MetadataCache::key(path.data(), key))
+        return readRecord(fileName, mimeType, what, record);
+    return read(fileName, key, mimeType, what, record);
+}
+
+bool CachedFilePlugin::read(const QString &fileName, const MetadataCache::Key &key,
+                            const QString &mimeType, uint what, MetadataRecord &record)
+{
+    const QByteArray path = QFile::encodeName(fileName);
+    if (!cache()) {
+        if (!readRecord(fileName, mimeType, what, record))
+            return false;
+        addToIndex(key, path, what, record);
+        return true;
+    }
+
+    // the indexes have what was read of an unchanged file already
+    std::string payload;
+    const bool hit = m_cache->lookup(key, what, payload) && record.load(payload);
+    if (m_totalsEnabled)
+        pruneTotals();
+    if (hit)
+        return true;
+
+    // a snapshot means the file was read before, by an older version or
+    // with other settings, and wasn't moved since
+    RegionSnapshot regions;
+    const bool replay = m_snapshots && m_snapshots->lookup(key, 0, payload) &&
+                        loadSnapshot(payload, regions) && regions.fileSize() == key.size;
+    if (!replay)
+        regions.clear();
+
+    // bytes prefetched for this file are as good, as long as the file
+    // hasn't changed since
+    QHash<QString, Prefetched>::iterator prefetched = m_prefetched.find(fileName);
+    if (prefetched != m_prefetched.end()) {
+        if (!replay && prefetched.value().key == key)
+            regions = prefetched.value().regions;
+        m_prefetchedBytes -= prefetched.value().regions.bytes();
+        m_prefetched.erase(prefetched);
+    }
+
+    // a file that was moved is found by two small reads, and then known
+    // by its new inode from here on
+    uint64_t fingerprint = regions.fingerprint();
+    std::string was;
+    if (!replay && MetadataCache::fingerprint(path.data(), key.size, fingerprint) &&
+        m_cache->lookup(key, fingerprint, what, payload, was) && record.load(payload)) {
+        m_cache->store(key, fingerprint, what, path.data(), payload);
+        // a copy leaves the file where it was
+        MetadataCache::Key old;
+        if (m_totalsEnabled && was != path.constData() && !MetadataCache::key(was.c_str(), old))
+            m_totals.remove(was);
+        addToIndex(key, path, what, record);
+        return true;
+    }
+
+    record.clear();
+    m_snapshot = m_snapshots || regions.bytes() ? &regions : 0;
+    m_reading = true;
+    m_key = key;
+    m_path = path;
+    m_what = what;
+    m_haveCheckpoint = false;
+    const bool ok = readRecord(fileName, mimeType, what, record);
+    m_snapshot = 0;
+    m_reading = false;
+    if (!ok)
+        return false;
+
+    // a file written to while it was read may not match what was read
+    MetadataCache::Key after;
+    if (MetadataCache::key(path.data(), after) && after == key) {
+        record.save(payload);
+        if (!m_cache->store(key, fingerprint, what, path.data(), payload))
+            kDebug(7034) << "could not cache" << fileName;
+        addToIndex(key, path, what, record);
+
+        regions.setFingerprint(fingerprint);
+        if (m_snapshots && regions.isChanged() && regions.bytes() <= quint64(m_snapshotLimit)) {
+            std::string raw;
+            regions.save(raw);
+            const QByteArray packed = qCompress(reinterpret_cast<const uchar *>(raw.data()),
+                                                raw.size());
+            m_snapshots->store(key, fingerprint, 0, path.data(),
+                               std::string(packed.constData(), packed.size()));
+        }
+
+        uint64_t hash;
+        if (m_haveCheckpoint && checkpoints() && tailHash(path.data(), key.size, hash)) {
+            std::string payload;
+            CheckpointState::put(payload, hash, 8);
+            m_checkpoints->store(key, 0, what, path.data(), payload + m_checkpoint);
+        }
+    }
+    m_checkpoint.clear();
+    return true;
+}
+
+void CachedFilePlugin::readColumns(const QStringList &paths, const QString &mimeType, uint what,
+                                   MetadataColumns &columns)
+{
+    // a batch is prefetched just before it is read, so that the bytes
+    // kept for it aren't pushed out by the files after it
+    for (int i = 0; i < paths.count(); i += prefetch_batch) {
+        const QStringList batch = paths.mid(i, prefetch_batch);
+        prefetch(batch, what);
+        for (int j = 0; j < batch.count(); ++j) {
+            ScratchScope scratch;
+            MetadataRecord record;
+            if (read(batch[j], mimeType, what, record))
+                columns.append(record);
+            else
+                columns.appendNull();
+        }
+    }
+}
+
+int CachedFilePlugin::scan(const QStringList &roots, const QStringList &mimeTypes, uint what)
+{
+    // readRecord() takes any file for one of the plugin's, so the walker
+    // must never be left to accept every type
+    const QStringList &accepted = mimeTypes.isEmpty() ? m_mimeTypes : mimeTypes;
+    if (accepted.isEmpty())
+        return 0;
+    DirectoryWalker walker(prefetch_batch);
+    for (int i = 0; i < accepted.count(); ++i)
+        walker.accept(accepted[i].toLatin1().data());
+    std::vector<std::string> names;
+    for (int i = 0; i < roots.count(); ++i) {
+        const QByteArray root = QFile::encodeName(roots[i]);
+        names.push_back(std::string(root.constData(), root.size()));
+    }
+    if (!walker.start(names))
+        return 0;
+
+    // the walker is at the next batches while this one is read
+    int count = 0;
+    std::vector<DirectoryWalker::Entry> entries;
+    while (walker.next(entries)) {
+        QStringList paths;
+        QList<MetadataCache::Key> keys;
+        for (size_t i = 0; i < entries.size(); ++i) {
+            paths.append(QFile::decodeName(entries[i].path.c_str()));
+            keys.append(entries[i].key);
+        }
+        prefetch(paths, keys, what);
+        for (size_t i = 0; i < entries.size(); ++i) {
+            ScratchScope scratch;
+            MetadataRecord record;
+            if (read(paths[i], keys[i], QString::fromLatin1(entries[i].mimeType), what, record))
+                ++count;
+        }
+    }
+    return count;
+}
+
+bool CachedFilePlugin::loadSnapshot(const std::string &payload, RegionSnapshot &regions)
+{
+    const QByteArray raw = qUncompress(reinterpret_cast<const uchar *>(payload.data()),
+                                       payload.size());
+    return !raw.isEmpty() && regions.load(std::string(raw.constData(), raw.size()));
+}
+
+void CachedFilePlugin::appendRecord(KFileMetaInfo &info, const MetadataRecord &record)
+{
+    // the fields go first, in their order, and then the extra items
+    QHash<QString, KFileMetaInfoGroup> groups;
+    for (int i = 0; i < MetadataRecord::FieldCount; ++i) {
+        const MetadataRecord::Field field = MetadataRecord::Field(i);
+        if (!record.has(field))
+            continue;
+
+        const char *group = MetadataRecord::group(field);
+        const char *key = MetadataRecord::key(field);
+        bool real = false;
+        for (const MetadataLayout *layout = m_layout;
+             layout && layout->field != MetadataRecord::FieldCount; ++layout) {
+            if (layout->field == field) {
+                group = layout->group ? layout->group : group;
+                key = layout->key ? layout->key : key;
+                real = layout->real;
+                break;
+            }
+        }
+        appendItem(metaGroup(info, groups, group), key,
+                   toVariant(MetadataRecord::type(field), record.value(field), real));
+    }
+
+    for (size_t i = 0; i < record.extraCount(); ++i) {
+        const MetadataRecord::Extra &extra = record.extra(i);
+        appendItem(metaGroup(info, groups, extra.group), QString::fromUtf8(extra.key),
+                   QString::fromUtf8(extra.value, extra.length));
+    }
+}
+
+KFileMetaInfoGroup &CachedFilePlugin::metaGroup(KFileMetaInfo &info,
+                                                QHash<QString, KFileMetaInfoGroup> &groups,
+                                                const char *name)
+{
+    const QString group = QString::fromUtf8(name);
+    QHash<QString, KFileMetaInfoGroup>::iterator found = groups.find(group);
+    if (found == groups.end())
+        found = groups.insert(group, appendGroup(info, group));
+    return found.value();
+}
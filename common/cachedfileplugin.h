@@ -0,0 +1,221 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef CACHEDFILEPLUGIN_H
+#define CACHEDFILEPLUGIN_H
+
+#include <kfilemetainfo.h>
+
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QString>
+#include <QStringList>
+
+#include <string>
+
+#include "accessmanifest.h"
+#include "directorytotals.h"
+#include "metadatacache.h"
+#include "metadatarecord.h"
+#include "regionsnapshot.h"
+
+class BatchReader;
+class MetadataColumns;
+class SqliteIndex;
+class TagIndex;
+
+/**
+ * A KFilePlugin that remembers what it read in a MetadataCache, so
+ * asking again about a file that hasn't changed only costs a stat().
+ *
+ * Plugins implement readRecord() instead of readInfo(), and fill in a
+ * MetadataRecord rather than appending items.  The record is stored
+ * along with the request it answered, and taken from the cache the next
+ * time, or when the file turns up again after a move.  Only readInfo()
+ * turns it into KFileMetaInfo items, as laid out with setLayout(), so
+ * indexers that call read() never go through QVariant.
+ *
+ * The version passed to the constructor must be raised whenever the
+ * plugin starts reading something differently, and everything read from
+ * the configuration that changes the results must go into
+ * setCacheSettings().
+ *
+ * With Enabled in the [Snapshots] group, the bytes a plugin reads
+ * through a SnapshotFile on snapshot() are kept in a compressed pack,
+ * up to MaxSize bytes per file.  When a new version of the plugin, or
+ * new settings, miss the cache, the file is read again from that
+ * snapshot, and only what isn't in it comes from the file.
+ *
+ * Plugins that read files which are still being written to, such as
+ * recordings, can leave a checkpoint with setCheckpoint(): whatever
+ * they need to pick up where they stopped.  When the file has only
+ * grown since, checkpoint() gives it back the next time, so only what
+ * was appended needs reading.  Checkpoints are kept unless Enabled in
+ * the [Checkpoints] group is false.
+ *
+ * Plugins also tell what they will read of a file in accessManifest(),
+ * so that prefetch() can get the files of a whole directory on their
+ * way before the first is read.  Plugins that read through snapshot()
+ * are then handed what was prefetched.  scan() does the same for whole
+ * trees, with the keys the DirectoryWalker got as it listed the files.
+ *
+ * With Enabled in the [Index] group, and where SQLite was found, every
+ * record read from a file, or found again after a move, is also kept
+ * in the SqliteIndex at Path, by default
+ * kfile_metadata.sqlite in the user's data directory.  Likewise, with
+ * Enabled in the [Tags] group, titles, artists and albums go into the
+ * TagIndex at its Path, by default kfile_tags.index.  The lengths and
+ * bitrates of what was read add up in totals() for every directory,
+ * with Enabled in the [Totals] group; every plugin adds to the same
+ * DirectoryTotals, logged at Path, by default kfile_totals in the
+ * user's data directory.  Files that moved or went away are taken out.
+ *
+ * The cache can be turned off with Enabled in the [Cache] group of
+ * kfile_multimediarc.
+ */
+class CachedFilePlugin: public KFilePlugin
+{
+public:
+    CachedFilePlugin(QObject *parent, const QStringList &args,
+                     const char *name, uint version);
+    virtual ~CachedFilePlugin();
+
+    virtual bool readInfo(KFileMetaInfo &info, uint what);
+
+    /**
+     * Reads a file as readInfo() does, from the cache if it can, but
+     * into record.  The record is only good within a ScratchScope.
+     */
+    bool read(const QString &path, const QString &mimeType, uint what, MetadataRecord &record);
+    /** Reads a file whose key is known already, as a DirectoryWalker gives it. */
+    bool read(const QString &path, const MetadataCache::Key &key, const QString &mimeType,
+              uint what, MetadataRecord &record);
+
+    /**
+     * Reads files of one type into the next rows of columns, in their
+     * order, prefetching them as it goes.  A file that can't be read
+     * gets a row without any field.
+     */
+    void readColumns(const QStringList &paths, const QString &mimeType, uint what,
+                     MetadataColumns &columns);
+
+    /** The totals of the directories of the files read so far, by any plugin. */
+    const DirectoryTotals &totals();
+
+    /** What readInfo() will read of a file for the request what. */
+    virtual AccessManifest accessManifest(uint what) const;
+
+    /**
+     * Gets the files that aren't in the cache yet ready for readInfo():
+     * the kernel is asked for all of them, or, for plugins that take them
+     * from snapshot(), a BatchReader reads them all at once.
+     */
+    void prefetch(const QStringList &paths, uint what);
+    void prefetch(const QStringList &paths, const QList<MetadataCache::Key> &keys, uint what);
+
+    /**
+     * Reads every file of mimeTypes below roots, found by a
+     * DirectoryWalker, into the cache and the indexes, and gives the
+     * number of files read.  Without mimeTypes, the plugin's own are
+     * read.
+     */
+    int scan(const QStringList &roots, const QStringList &mimeTypes, uint what);
+
+protected:
+    virtual bool readRecord(const QString &path, const QString &mimeType, uint what,
+                            MetadataRecord &record) = 0;
+
+    /** Also remembers the type as one of the plugin's, for scan(). */
+    KFileMimeTypeInfo *addMimeTypeInfo(const QString &mimeType);
+
+    void setCacheSettings(const QByteArray &settings);
+    /** Where fields are shown that aren't under their usual group and key. */
+    void setLayout(const MetadataLayout *layout);
+
+    /** What is known of the file being read, or 0 without snapshots. */
+    RegionSnapshot *snapshot() const;
+
+    /**
+     * The checkpoint left when the file being read was last read, if it
+     * has only grown since, and its size then.
+     */
+    bool checkpoint(uint64_t &size, std::string &state);
+    /** Leaves state to resume from once the file has grown. */
+    void setCheckpoint(const std::string &state);
+
+private:
+    struct Prefetched
+    {
+        MetadataCache::Key key;
+        RegionSnapshot regions;
+    };
+    class PrefetchListener;
+
+    MetadataCache *cache();
+    MetadataCache *checkpoints();
+    SqliteIndex *index();
+    void addToIndex(const MetadataCache::Key &key, const QByteArray &path, uint what,
+                    const MetadataRecord &record);
+    void syncTotals();
+    void pruneTotals();
+    void appendRecord(KFileMetaInfo &info, const MetadataRecord &record);
+    KFileMetaInfoGroup &metaGroup(KFileMetaInfo &info, QHash<QString, KFileMetaInfoGroup> &groups,
+                                  const char *name);
+    static bool loadSnapshot(const std::string &payload, RegionSnapshot &regions);
+
+    QByteArray m_name;
+    uint m_version;
+    QStringList m_mimeTypes;
+    QByteArray m_settings;
+    const MetadataLayout *m_layout;
+    bool m_enabled;
+    MetadataCache *m_cache;
+
+    bool m_snapshotsEnabled;
+    qint64 m_snapshotLimit;
+    MetadataCache *m_snapshots;
+    RegionSnapshot *m_snapshot;
+
+    bool m_checkpointsEnabled;
+    MetadataCache *m_checkpoints;
+
+    bool m_indexEnabled;
+    QString m_indexPath;
+    SqliteIndex *m_index;
+    uint64_t m_indexSettings;
+    bool m_tagsEnabled;
+    QString m_tagsPath;
+    TagIndex *m_tags;
+    bool m_totalsEnabled;
+    QString m_totalsPath;
+    bool m_totalsLoaded;
+    DirectoryTotals m_totals;
+    // the file being read, and its new checkpoint
+    bool m_reading;
+    MetadataCache::Key m_key;
+    QByteArray m_path;
+    uint m_what;
+    bool m_haveCheckpoint;
+    std::string m_checkpoint;
+
+    QHash<QString, Prefetched> m_prefetched;
+    quint64 m_prefetchedBytes;
+    BatchReader *m_reader;
+};
+
+#endif
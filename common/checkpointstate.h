@@ -0,0 +1,88 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef CHECKPOINTSTATE_H
+#define CHECKPOINTSTATE_H
+
+#include <string>
+
+#if !defined(__osf__)
+#include <inttypes.h>
+#else
+typedef unsigned char  uint8_t;
+typedef unsigned short uint16_t;
+typedef unsigned int   uint32_t;
+typedef unsigned long long uint64_t;
+#endif
+
+/**
+ * Writes and reads the state parsers leave as a checkpoint, little
+ * endian numbers and counted strings, so it reads back the same on any
+ * machine the cache is shared with.
+ */
+class CheckpointState
+{
+public:
+    /** Starts reading state. */
+    explicit CheckpointState(const std::string &state) : m_state(state), m_pos(0), m_ok(true) {}
+
+    static void put(std::string &state, uint64_t value, int size)
+    {
+        for (int i = 0; i < size; ++i)
+            state += char(value >> (8 * i));
+    }
+    static void put(std::string &state, const std::string &bytes)
+    {
+        put(state, bytes.size(), 4);
+        state += bytes;
+    }
+
+    /** Whether everything taken so far was there. */
+    bool ok() const { return m_ok; }
+    /** Whether all of the state was taken. */
+    bool atEnd() const { return m_pos == m_state.size(); }
+
+    uint64_t number(int size)
+    {
+        if (size_t(size) > m_state.size() - m_pos) {
+            m_ok = false;
+            return 0;
+        }
+        uint64_t value = 0;
+        for (int i = size - 1; i >= 0; --i)
+            value = (value << 8) | uint8_t(m_state[m_pos + i]);
+        m_pos += size;
+        return value;
+    }
+    std::string bytes()
+    {
+        const uint64_t length = number(4);
+        if (length > m_state.size() - m_pos) {
+            m_ok = false;
+            return std::string();
+        }
+        m_pos += length;
+        return m_state.substr(m_pos - length, length);
+    }
+
+private:
+    const std::string &m_state;
+    size_t m_pos;
+    bool m_ok;
+};
+
+#endif
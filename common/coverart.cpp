@@ -0,0 +1,940 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "coverart.h"
+
+#include <map>
+
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// FLAC metadata block types
+static const int block_vorbis_comment = 4;
+static const int block_picture = 6;
+
+// how much of an APIC frame is looked at for the start of the image; a
+// description that doesn't fit is too odd to bother with
+static const size_t apic_header_window = 1024;
+
+// how many JPEG segments are skipped looking for the frame header
+static const int jpeg_max_segments = 64;
+
+// base64 images are decoded this many bytes at a time
+static const size_t base64_chunk = 48 * 1024;
+
+typedef CoverArt::Extent Extent;
+typedef CoverArt::Picture Picture;
+
+static inline uint32_t be16(const uint8_t *p)
+{
+    return (uint32_t(p[0]) << 8) | p[1];
+}
+
+static inline uint32_t be32(const uint8_t *p)
+{
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) |
+           (uint32_t(p[2]) << 8) | p[3];
+}
+
+static inline uint32_t le32(const uint8_t *p)
+{
+    return uint32_t(p[0]) | (uint32_t(p[1]) << 8) |
+           (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24);
+}
+
+static inline uint32_t syncsafe(const uint8_t *p)
+{
+    return (uint32_t(p[0] & 0x7f) << 21) | (uint32_t(p[1] & 0x7f) << 14) |
+           (uint32_t(p[2] & 0x7f) << 7) | (p[3] & 0x7f);
+}
+
+static inline int base64Value(uint8_t c)
+{
+    if (c >= 'A' && c <= 'Z')
+        return c - 'A';
+    if (c >= 'a' && c <= 'z')
+        return c - 'a' + 26;
+    if (c >= '0' && c <= '9')
+        return c - '0' + 52;
+    if (c == '+')
+        return 62;
+    if (c == '/')
+        return 63;
+    return -1;
+}
+
+namespace {
+
+bool readAt(int fd, uint64_t offset, void *out, size_t length)
+{
+    uint8_t *p = static_cast<uint8_t *>(out);
+    while (length > 0) {
+        ssize_t got = pread(fd, p, length, off_t(offset));
+        if (got <= 0)
+            return false;
+        p += got;
+        offset += got;
+        length -= got;
+    }
+    return true;
+}
+
+uint64_t totalLength(const std::vector<Extent> &extents)
+{
+    uint64_t total = 0;
+    for (size_t i = 0; i < extents.size(); ++i)
+        total += extents[i].length;
+    return total;
+}
+
+void appendExtent(std::vector<Extent> &extents, uint64_t offset, uint64_t length)
+{
+    if (length == 0)
+        return;
+    if (!extents.empty() && extents.back().offset + extents.back().length == offset) {
+        extents.back().length += length;
+        return;
+    }
+    Extent extent;
+    extent.offset = offset;
+    extent.length = length;
+    extents.push_back(extent);
+}
+
+/** Reads length bytes at pos, counting the extents as one run of bytes. */
+bool readExtents(int fd, const std::vector<Extent> &extents, uint64_t pos,
+                 uint8_t *out, size_t length)
+{
+    for (size_t i = 0; i < extents.size() && length > 0; ++i) {
+        const Extent &extent = extents[i];
+        if (pos >= extent.length) {
+            pos -= extent.length;
+            continue;
+        }
+        size_t chunk = extent.length - pos < length ? size_t(extent.length - pos) : length;
+        if (!readAt(fd, extent.offset + pos, out, chunk))
+            return false;
+        out += chunk;
+        length -= chunk;
+        pos = 0;
+    }
+    return length == 0;
+}
+
+void sliceExtents(const std::vector<Extent> &extents, uint64_t pos, uint64_t length,
+                  std::vector<Extent> &slice)
+{
+    slice.clear();
+    for (size_t i = 0; i < extents.size() && length > 0; ++i) {
+        const Extent &extent = extents[i];
+        if (pos >= extent.length) {
+            pos -= extent.length;
+            continue;
+        }
+        uint64_t chunk = extent.length - pos < length ? extent.length - pos : length;
+        appendExtent(slice, extent.offset + pos, chunk);
+        length -= chunk;
+        pos = 0;
+    }
+}
+
+/**
+ * Reads forward through a range of the file, undoing ID3v2
+ * unsynchronisation if asked to.
+ */
+class TagReader
+{
+public:
+    TagReader(int fd, uint64_t offset, uint64_t length, bool unsync)
+        : m_fd(fd), m_filePos(offset), m_end(offset + length), m_unsync(unsync),
+          m_head(0), m_fill(0), m_lastFF(false) {}
+
+    /** Reads up to length bytes into out, or skips them if out is 0. */
+    uint64_t read(uint8_t *out, uint64_t length);
+
+    /** The file offset of the next byte. */
+    uint64_t tell();
+
+private:
+    bool fill();
+
+    int m_fd;
+    uint64_t m_filePos;     // just past the buffered bytes
+    uint64_t m_end;
+    bool m_unsync;
+
+    uint8_t m_buffer[16384];
+    size_t m_head;
+    size_t m_fill;
+    bool m_lastFF;
+};
+
+bool TagReader::fill()
+{
+    if (m_filePos >= m_end)
+        return false;
+    size_t length = m_end - m_filePos < sizeof(m_buffer) ? size_t(m_end - m_filePos)
+                                                         : sizeof(m_buffer);
+    if (!readAt(m_fd, m_filePos, m_buffer, length))
+        return false;
+    m_filePos += length;
+    m_head = 0;
+    m_fill = length;
+    return true;
+}
+
+uint64_t TagReader::read(uint8_t *out, uint64_t length)
+{
+    uint64_t done = 0;
+
+    if (!m_unsync) {
+        while (done < length) {
+            if (m_head == m_fill) {
+                if (!out) {
+                    // skipping needs no reading
+                    uint64_t left = m_end - m_filePos;
+                    uint64_t step = length - done < left ? length - done : left;
+                    m_filePos += step;
+                    done += step;
+                    break;
+                }
+                if (!fill())
+                    break;
+            }
+            size_t chunk = m_fill - m_head < length - done ? m_fill - m_head
+                                                          : size_t(length - done);
+            if (out)
+                memcpy(out + done, m_buffer + m_head, chunk);
+            m_head += chunk;
+            done += chunk;
+        }
+        return done;
+    }
+
+    while (done < length) {
+        if (m_head == m_fill && !fill())
+            break;
+        uint8_t c = m_buffer[m_head++];
+        if (m_lastFF && c == 0) {
+            m_lastFF = false;
+            continue;
+        }
+        m_lastFF = c == 0xff;
+        if (out)
+            out[done] = c;
+        ++done;
+    }
+    return done;
+}
+
+uint64_t TagReader::tell()
+{
+    // a stuffed zero belongs to the 0xff before it
+    if (m_unsync && m_lastFF) {
+        if ((m_head < m_fill || fill()) && m_buffer[m_head] == 0)
+            ++m_head;
+        m_lastFF = false;
+    }
+    return m_filePos - (m_fill - m_head);
+}
+
+/** Reads length decoded bytes at pos of what picture has stored. */
+bool readDecoded(int fd, const Picture &picture, uint64_t pos, uint8_t *out, size_t length)
+{
+    if (length == 0)
+        return true;
+
+    switch (picture.encoding) {
+    case CoverArt::Raw:
+        return readExtents(fd, picture.extents, pos, out, length);
+
+    case CoverArt::Base64: {
+        // every four characters decode to three bytes on their own
+        const uint64_t total = totalLength(picture.extents);
+        const uint64_t first = pos / 3 * 4;
+        uint64_t last = (pos + length + 2) / 3 * 4;
+        if (last > total)
+            last = total;
+        if (first >= last)
+            return false;
+
+        std::vector<char> text(last - first);
+        std::vector<uint8_t> bytes(text.size() / 4 * 3 + 2);
+        if (!readExtents(fd, picture.extents, first,
+                         reinterpret_cast<uint8_t *>(&text[0]), text.size()))
+            return false;
+        long decoded = CoverArt::decodeBase64(&text[0], text.size(), &bytes[0]);
+        if (decoded < 0 || uint64_t(decoded) < pos % 3 + length)
+            return false;
+        memcpy(out, &bytes[pos % 3], length);
+        return true;
+    }
+
+    case CoverArt::Unsynchronised: {
+        // where a decoded byte is stored depends on all the bytes before it
+        if (picture.extents.size() != 1)
+            return false;
+        TagReader reader(fd, picture.extents[0].offset, picture.extents[0].length, true);
+        return reader.read(0, pos) == pos && reader.read(out, length) == length;
+    }
+    }
+
+    return false;
+}
+
+/**
+ * Fills in picture from a FLAC picture block, whose stored bytes are
+ * given by its encoding and extents.
+ */
+bool parseFlacPicture(int fd, Picture &picture)
+{
+    uint64_t total = totalLength(picture.extents);
+    if (picture.encoding == CoverArt::Base64)
+        total = total / 4 * 3;
+
+    uint8_t buf[20];
+    if (total < 32 || !readDecoded(fd, picture, 0, buf, 8))
+        return false;
+    picture.type = be32(buf);
+
+    const uint64_t mimeLength = be32(buf + 4);
+    uint64_t pos = 8;
+    if (pos + mimeLength + 4 > total || mimeLength > 256)
+        return false;
+    std::vector<uint8_t> mime(mimeLength + 4);
+    if (!readDecoded(fd, picture, pos, &mime[0], mime.size()))
+        return false;
+    picture.mime.assign(reinterpret_cast<const char *>(&mime[0]), mimeLength);
+    pos += mimeLength + 4 + be32(&mime[mimeLength]);     // skips the description
+
+    if (pos + 20 > total || !readDecoded(fd, picture, pos, buf, 20))
+        return false;
+    picture.width = be32(buf);
+    picture.height = be32(buf + 4);
+    picture.depth = be32(buf + 8);
+    picture.length = be32(buf + 16);
+    pos += 20;
+    if (picture.length == 0 || pos + picture.length > total)
+        return false;
+
+    if (picture.encoding == CoverArt::Raw) {
+        std::vector<Extent> image;
+        sliceExtents(picture.extents, pos, picture.length, image);
+        picture.extents.swap(image);
+        picture.skip = 0;
+    } else {
+        picture.skip = pos;
+    }
+    return true;
+}
+
+void sniffJpeg(int fd, const Picture &picture, uint32_t &width, uint32_t &height,
+               uint32_t &depth)
+{
+    uint8_t segment[10];
+    uint64_t pos = 2;
+
+    for (int i = 0; i < jpeg_max_segments && pos + 4 <= picture.length; ++i) {
+        if (!readDecoded(fd, picture, picture.skip + pos, segment, 4) || segment[0] != 0xff)
+            return;
+
+        const uint8_t marker = segment[1];
+        if (marker == 0xff) {
+            ++pos;      // fill byte
+        } else if (marker == 0x01 || (marker >= 0xd0 && marker <= 0xd9)) {
+            pos += 2;   // no length
+        } else if (marker >= 0xc0 && marker <= 0xcf &&
+                   marker != 0xc4 && marker != 0xc8 && marker != 0xcc) {
+            // a start of frame: precision, height, width, components
+            if (pos + 10 > picture.length ||
+                !readDecoded(fd, picture, picture.skip + pos, segment, 10))
+                return;
+            height = be16(segment + 5);
+            width = be16(segment + 7);
+            depth = segment[4] * segment[9];
+            return;
+        } else {
+            pos += 2 + be16(segment + 2);
+        }
+    }
+}
+
+/**
+ * Fills in what the container didn't say about an image from the image
+ * itself, for PNG, GIF and JPEG.
+ */
+void sniffImage(int fd, Picture &picture)
+{
+    if (picture.width && picture.height && !picture.mime.empty())
+        return;
+
+    uint8_t head[32];
+    const size_t length = picture.length < sizeof(head) ? size_t(picture.length) : sizeof(head);
+    if (!readDecoded(fd, picture, picture.skip, head, length))
+        return;
+
+    const char *mime = 0;
+    uint32_t width = 0, height = 0, depth = 0;
+
+    if (length >= 26 && !memcmp(head, "\x89PNG\r\n\x1a\n", 8) && !memcmp(head + 12, "IHDR", 4)) {
+        // samples per pixel by colour type
+        static const int samples[7] = { 1, 0, 3, 1, 2, 0, 4 };
+        mime = "image/png";
+        width = be32(head + 16);
+        height = be32(head + 20);
+        depth = head[25] < 7 ? head[24] * samples[head[25]] : 0;
+    } else if (length >= 11 && (!memcmp(head, "GIF87a", 6) || !memcmp(head, "GIF89a", 6))) {
+        mime = "image/gif";
+        width = head[6] | (head[7] << 8);
+        height = head[8] | (head[9] << 8);
+        depth = (head[10] & 0x80) ? (head[10] & 7) + 1 : 0;
+    } else if (length >= 4 && head[0] == 0xff && head[1] == 0xd8) {
+        mime = "image/jpeg";
+        sniffJpeg(fd, picture, width, height, depth);
+    }
+
+    if (!mime)
+        return;
+    if (picture.mime.empty())
+        picture.mime = mime;
+    if (!picture.width || !picture.height) {
+        picture.width = width;
+        picture.height = height;
+        picture.depth = depth;
+    }
+}
+
+/**
+ * Fills in picture from an APIC (or, for ID3v2.2, PIC) frame whose data
+ * are the length bytes at start.  The first prefix decoded bytes are not
+ * part of the frame proper; decoded is the decoded size including them,
+ * or 0 if it has to be counted.
+ */
+bool parseApic(int fd, int version, uint64_t start, uint64_t length, bool unsync,
+               uint64_t prefix, uint64_t decoded, Picture &picture)
+{
+    TagReader frame(fd, start, length, unsync);
+    uint8_t head[apic_header_window];
+    if (frame.read(0, prefix) != prefix)
+        return false;
+    const size_t got = frame.read(head, sizeof(head));
+    if (got < 2)
+        return false;
+
+    // text encoding, then the MIME type or, in ID3v2.2, an image format
+    const uint8_t encoding = head[0];
+    size_t pos;
+    if (version == 2) {
+        if (got < 5)
+            return false;
+        if (!strncasecmp(reinterpret_cast<const char *>(head + 1), "JPG", 3))
+            picture.mime = "image/jpeg";
+        else if (!strncasecmp(reinterpret_cast<const char *>(head + 1), "PNG", 3))
+            picture.mime = "image/png";
+        pos = 4;
+    } else {
+        const uint8_t *end = static_cast<const uint8_t *>(memchr(head + 1, 0, got - 1));
+        if (!end)
+            return false;
+        picture.mime.assign(reinterpret_cast<const char *>(head + 1), end - head - 1);
+        pos = end - head + 1;
+    }
+
+    // "-->" says the frame holds a URL rather than an image
+    if (picture.mime == "-->" || pos >= got)
+        return false;
+    picture.type = head[pos++];
+
+    // the description ends in a terminator as wide as its characters
+    if (encoding == 1 || encoding == 2) {
+        while (pos + 1 < got && (head[pos] || head[pos + 1]))
+            pos += 2;
+        pos += 2;
+    } else {
+        while (pos < got && head[pos])
+            ++pos;
+        pos += 1;
+    }
+    if (pos > got)
+        return false;
+
+    const uint64_t header = prefix + pos;
+    if (decoded == 0)
+        decoded = prefix + got + frame.read(0, ~uint64_t(0));
+    if (decoded <= header)
+        return false;
+    picture.length = decoded - header;
+
+    picture.extents.clear();
+    if (unsync) {
+        picture.encoding = CoverArt::Unsynchronised;
+        appendExtent(picture.extents, start, length);
+        picture.skip = header;
+    } else {
+        picture.encoding = CoverArt::Raw;
+        appendExtent(picture.extents, start + header, picture.length);
+        picture.skip = 0;
+    }
+    return true;
+}
+
+void readId3v2Tag(int fd, uint64_t offset, uint64_t size, int version, int flags,
+                  std::vector<Picture> &pictures)
+{
+    // ID3v2.2 used this flag for a compression scheme that was never defined
+    if (version < 2 || version > 4 || (version == 2 && (flags & 0x40)))
+        return;
+
+    // before ID3v2.4 the whole tag is unsynchronised, frame headers
+    // included; ID3v2.4 does it frame by frame
+    const bool tagUnsync = (flags & 0x80) && version < 4;
+    TagReader tag(fd, offset, size, tagUnsync);
+    uint8_t buf[10];
+
+    if (version > 2 && (flags & 0x40)) {
+        // the extended header counts itself in ID3v2.4 but not in ID3v2.3
+        if (tag.read(buf, 4) != 4)
+            return;
+        uint64_t skip = version == 3 ? be32(buf) : syncsafe(buf);
+        if (version == 4)
+            skip = skip > 4 ? skip - 4 : 0;
+        if (tag.read(0, skip) != skip)
+            return;
+    }
+
+    const size_t headerSize = version == 2 ? 6 : 10;
+    while (tag.read(buf, headerSize) == headerSize && buf[0] != 0) {
+        uint64_t frameSize;
+        bool picture;
+        uint8_t format = 0;
+        if (version == 2) {
+            frameSize = (uint32_t(buf[3]) << 16) | (buf[4] << 8) | buf[5];
+            picture = !memcmp(buf, "PIC", 3);
+        } else {
+            frameSize = version == 3 ? be32(buf + 4) : syncsafe(buf + 4);
+            picture = !memcmp(buf, "APIC", 4);
+            format = buf[9];
+        }
+
+        // compressed or encrypted frames aren't worth the trouble
+        const bool opaque = version == 3 ? (format & 0xc0) : (format & 0x0c);
+        const uint64_t start = tag.tell();
+        if (!picture || opaque) {
+            if (tag.read(0, frameSize) != frameSize)
+                break;
+            continue;
+        }
+
+        Picture art;
+        bool ok;
+        if (tagUnsync) {
+            // the frame size counts decoded bytes, so the frame has to be
+            // gone through to find where it ends
+            const uint64_t group = (version == 3 && (format & 0x20)) ? 1 : 0;
+            if (tag.read(0, frameSize) != frameSize)
+                break;
+            ok = parseApic(fd, version, start, tag.tell() - start, true,
+                           group, frameSize, art);
+        } else {
+            uint64_t extra = 0;
+            uint64_t decoded = 0;
+            bool unsync = false;
+            if (version == 3 && (format & 0x20))
+                extra = 1;
+            if (version == 4) {
+                if (format & 0x40)
+                    extra += 1;
+                if (format & 0x01) {
+                    uint8_t indicator[4];
+                    if (frameSize >= extra + 4 && readAt(fd, start + extra, indicator, 4))
+                        decoded = syncsafe(indicator);
+                    extra += 4;
+                }
+                unsync = (format & 0x02) || (flags & 0x80);
+            }
+            if (tag.read(0, frameSize) != frameSize)
+                break;
+            ok = frameSize > extra &&
+                 parseApic(fd, version, start + extra, frameSize - extra, unsync,
+                           0, unsync ? decoded : frameSize - extra, art);
+        }
+
+        if (ok) {
+            sniffImage(fd, art);
+            pictures.push_back(art);
+        }
+    }
+}
+
+/**
+ * Looks for METADATA_BLOCK_PICTURE in the Vorbis comments starting at pos
+ * of packet.
+ */
+void readComments(int fd, const std::vector<Extent> &packet, uint64_t pos,
+                  std::vector<Picture> &pictures)
+{
+    static const char key[] = "METADATA_BLOCK_PICTURE=";
+    const size_t keyLength = sizeof(key) - 1;
+    const uint64_t length = totalLength(packet);
+    uint8_t buf[sizeof(key)];
+
+    // the vendor string, then the number of comments
+    if (pos + 4 > length || !readExtents(fd, packet, pos, buf, 4))
+        return;
+    pos += 4 + le32(buf);
+    if (pos + 4 > length || !readExtents(fd, packet, pos, buf, 4))
+        return;
+    const uint32_t count = le32(buf);
+    pos += 4;
+
+    for (uint32_t i = 0; i < count && pos + 4 <= length; ++i) {
+        if (!readExtents(fd, packet, pos, buf, 4))
+            return;
+        const uint64_t size = le32(buf);
+        pos += 4;
+        if (pos + size > length)
+            return;
+
+        if (size > keyLength && readExtents(fd, packet, pos, buf, keyLength) &&
+            !strncasecmp(reinterpret_cast<const char *>(buf), key, keyLength)) {
+            Picture art;
+            art.encoding = CoverArt::Base64;
+            sliceExtents(packet, pos + keyLength, size - keyLength, art.extents);
+            if (parseFlacPicture(fd, art)) {
+                sniffImage(fd, art);
+                pictures.push_back(art);
+            }
+        }
+        pos += size;
+    }
+}
+
+struct OggStream
+{
+    enum Kind {
+        Unknown,
+        Comments,   // the second packet holds the comments
+        Flac        // a metadata block per header packet
+    };
+
+    OggStream() : kind(Unknown), prefix(0), packets(0), done(false) {}
+
+    Kind kind;
+    uint64_t prefix;    // in front of the comments
+    int packets;
+    bool done;
+    std::vector<Extent> packet;
+};
+
+void oggPacket(int fd, OggStream &stream, std::vector<Picture> &pictures)
+{
+    const uint64_t length = totalLength(stream.packet);
+    uint8_t head[8];
+
+    if (stream.packets == 0) {
+        // the first packet says what the stream is
+        const size_t got = length < sizeof(head) ? size_t(length) : sizeof(head);
+        stream.done = true;
+        if (!readExtents(fd, stream.packet, 0, head, got))
+            return;
+        if (got >= 7 && !memcmp(head, "\x01vorbis", 7)) {
+            stream.kind = OggStream::Comments;
+            stream.prefix = 7;
+        } else if (got >= 7 && !memcmp(head, "\x80theora", 7)) {
+            stream.kind = OggStream::Comments;
+            stream.prefix = 7;
+        } else if (got >= 8 && !memcmp(head, "OpusHead", 8)) {
+            stream.kind = OggStream::Comments;
+            stream.prefix = 8;
+        } else if (got >= 8 && !memcmp(head, "Speex   ", 8)) {
+            stream.kind = OggStream::Comments;
+            stream.prefix = 0;
+        } else if (got >= 5 && !memcmp(head, "\x7f" "FLAC", 5)) {
+            stream.kind = OggStream::Flac;
+        } else {
+            return;
+        }
+        stream.done = false;
+        return;
+    }
+
+    if (stream.kind == OggStream::Comments) {
+        readComments(fd, stream.packet, stream.prefix, pictures);
+        stream.done = true;
+        return;
+    }
+
+    // audio frames start with a sync code, metadata blocks never do
+    if (length < 4 || !readExtents(fd, stream.packet, 0, head, 4) || head[0] == 0xff) {
+        stream.done = true;
+        return;
+    }
+    std::vector<Extent> block;
+    sliceExtents(stream.packet, 4, length - 4, block);
+    if ((head[0] & 0x7f) == block_picture) {
+        Picture art;
+        art.extents = block;
+        if (parseFlacPicture(fd, art)) {
+            sniffImage(fd, art);
+            pictures.push_back(art);
+        }
+    } else if ((head[0] & 0x7f) == block_vorbis_comment) {
+        readComments(fd, block, 0, pictures);
+    }
+    if (head[0] & 0x80)
+        stream.done = true;
+}
+
+}
+
+CoverArt::Picture::Picture()
+    : type(0), width(0), height(0), depth(0), length(0), encoding(Raw), skip(0)
+{
+}
+
+uint64_t CoverArt::Picture::offset() const
+{
+    return extents.empty() ? 0 : extents[0].offset;
+}
+
+bool CoverArt::findFlac(int fd, std::vector<Picture> &pictures)
+{
+    uint8_t buf[10];
+    uint64_t pos = 0;
+
+    // some taggers put an ID3v2 tag in front of the stream
+    if (readAt(fd, 0, buf, 10) && !memcmp(buf, "ID3", 3))
+        pos = 10 + syncsafe(buf + 6);
+    if (!readAt(fd, pos, buf, 4) || memcmp(buf, "fLaC", 4))
+        return false;
+    pos += 4;
+
+    bool last = false;
+    while (!last && readAt(fd, pos, buf, 4)) {
+        last = buf[0] & 0x80;
+        const uint64_t length = (uint32_t(buf[1]) << 16) | (buf[2] << 8) | buf[3];
+        if ((buf[0] & 0x7f) == block_picture) {
+            Picture art;
+            appendExtent(art.extents, pos + 4, length);
+            if (parseFlacPicture(fd, art)) {
+                sniffImage(fd, art);
+                pictures.push_back(art);
+            }
+        }
+        pos += 4 + length;
+    }
+
+    return !pictures.empty();
+}
+
+bool CoverArt::findId3v2(int fd, uint64_t offset, std::vector<Picture> &pictures)
+{
+    uint8_t header[10];
+
+    // there may be more than one, and a footer doubles the header
+    while (readAt(fd, offset, header, 10) && !memcmp(header, "ID3", 3)) {
+        const uint64_t size = syncsafe(header + 6);
+        readId3v2Tag(fd, offset + 10, size, header[3], header[5], pictures);
+        offset += 10 + size + ((header[5] & 0x10) ? 10 : 0);
+    }
+
+    return !pictures.empty();
+}
+
+bool CoverArt::findOgg(int fd, std::vector<Picture> &pictures)
+{
+    std::map<uint32_t, OggStream> streams;
+    uint8_t header[27 + 255];
+    uint64_t pos = 0;
+
+    // the header packets are assembled as lists of extents, as pictures
+    // easily span hundreds of pages
+    while (readAt(fd, pos, header, 27) && !memcmp(header, "OggS", 4)) {
+        const int segments = header[26];
+        if (!readAt(fd, pos + 27, header + 27, segments))
+            break;
+
+        const bool bos = header[5] & 0x02;
+        const uint32_t serial = le32(header + 14);
+        std::map<uint32_t, OggStream>::iterator it = streams.find(serial);
+        if (it == streams.end()) {
+            if (!bos)
+                break;  // a chained stream, or damage
+            it = streams.insert(std::make_pair(serial, OggStream())).first;
+        }
+        OggStream &stream = it->second;
+
+        uint64_t body = pos + 27 + segments;
+        for (int i = 0; i < segments; ++i) {
+            const uint8_t lacing = header[27 + i];
+            if (!stream.done) {
+                appendExtent(stream.packet, body, lacing);
+                if (lacing < 255) {
+                    oggPacket(fd, stream, pictures);
+                    stream.packet.clear();
+                    ++stream.packets;
+                }
+            }
+            body += lacing;
+        }
+        pos = body;
+
+        // the beginning of stream pages all come first
+        if (!bos) {
+            bool done = true;
+            for (it = streams.begin(); it != streams.end(); ++it)
+                done = done && it->second.done;
+            if (done)
+                break;
+        }
+    }
+
+    return !pictures.empty();
+}
+
+int CoverArt::frontCover(const std::vector<Picture> &pictures)
+{
+    for (size_t i = 0; i < pictures.size(); ++i)
+        if (pictures[i].type == 3)
+            return int(i);
+    return pictures.empty() ? -1 : 0;
+}
+
+bool CoverArt::read(int fd, const Picture &picture, std::vector<uint8_t> &data)
+{
+    data.resize(picture.length);
+    if (picture.length == 0)
+        return false;
+
+    if (picture.encoding != Base64)
+        return readDecoded(fd, picture, picture.skip, &data[0], data.size());
+
+    // a piece at a time, so the text held at once stays small
+    for (uint64_t done = 0; done < picture.length; ) {
+        size_t chunk = picture.length - done < base64_chunk ? size_t(picture.length - done)
+                                                            : base64_chunk;
+        if (!readDecoded(fd, picture, picture.skip + done, &data[done], chunk))
+            return false;
+        done += chunk;
+    }
+    return true;
+}
+
+long CoverArt::decodeBase64(const char *in, size_t length, uint8_t *out)
+{
+    const uint8_t *p = reinterpret_cast<const uint8_t *>(in);
+    const uint8_t *end = p + length;
+    uint8_t *o = out;
+
+#ifdef __SSE2__
+    // sixteen characters into twelve bytes at a time.  The two stores
+    // write fourteen bytes, so this stops while there are at least four
+    // more characters for the extra two to be overwritten by.
+    const __m128i upperLow = _mm_set1_epi8('A' - 1), upperHigh = _mm_set1_epi8('Z' + 1);
+    const __m128i lowerLow = _mm_set1_epi8('a' - 1), lowerHigh = _mm_set1_epi8('z' + 1);
+    const __m128i digitLow = _mm_set1_epi8('0' - 1), digitHigh = _mm_set1_epi8('9' + 1);
+    const __m128i plusChar = _mm_set1_epi8('+'), slashChar = _mm_set1_epi8('/');
+    const __m128i upperShift = _mm_set1_epi8(-65), lowerShift = _mm_set1_epi8(-71);
+    const __m128i digitShift = _mm_set1_epi8(4);
+    const __m128i plusShift = _mm_set1_epi8(19), slashShift = _mm_set1_epi8(16);
+    const __m128i lowByte = _mm_set1_epi16(0x00ff);
+    const __m128i lowHalf = _mm_set1_epi32(0xffff);
+    const __m128i middleByte = _mm_set1_epi32(0xff00);
+    const __m128i firstByte = _mm_set1_epi32(0xff);
+    const __m128i evenGroup = _mm_set_epi32(0, 0xffffff, 0, 0xffffff);
+    const __m128i oddGroup = _mm_set_epi32(0xffff, 0xff000000, 0xffff, 0xff000000);
+
+    while (end - p >= 20) {
+        const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+
+        // signed compares, so anything above 0x7f is in no range
+        const __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(x, upperLow), _mm_cmplt_epi8(x, upperHigh));
+        const __m128i lower = _mm_and_si128(_mm_cmpgt_epi8(x, lowerLow), _mm_cmplt_epi8(x, lowerHigh));
+        const __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(x, digitLow), _mm_cmplt_epi8(x, digitHigh));
+        const __m128i plus = _mm_cmpeq_epi8(x, plusChar);
+        const __m128i slash = _mm_cmpeq_epi8(x, slashChar);
+        const __m128i valid = _mm_or_si128(_mm_or_si128(upper, lower),
+                                           _mm_or_si128(digit, _mm_or_si128(plus, slash)));
+        // padding, line breaks and errors are left to the loop below
+        if (_mm_movemask_epi8(valid) != 0xffff)
+            break;
+
+        const __m128i shift = _mm_or_si128(
+            _mm_or_si128(_mm_and_si128(upper, upperShift), _mm_and_si128(lower, lowerShift)),
+            _mm_or_si128(_mm_and_si128(digit, digitShift),
+                         _mm_or_si128(_mm_and_si128(plus, plusShift),
+                                      _mm_and_si128(slash, slashShift))));
+        const __m128i v = _mm_add_epi8(x, shift);
+
+        // six bit values into twelve bit pairs, and those into 24 bit groups
+        const __m128i pairs = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(v, lowByte), 6),
+                                           _mm_srli_epi16(v, 8));
+        const __m128i groups = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(pairs, lowHalf), 12),
+                                            _mm_srli_epi32(pairs, 16));
+
+        // most significant byte first, then the groups packed together
+        const __m128i bytes = _mm_or_si128(
+            _mm_or_si128(_mm_and_si128(groups, middleByte),
+                         _mm_slli_epi32(_mm_and_si128(groups, firstByte), 16)),
+            _mm_and_si128(_mm_srli_epi32(groups, 16), firstByte));
+        const __m128i packed = _mm_or_si128(_mm_and_si128(bytes, evenGroup),
+                                            _mm_and_si128(_mm_srli_epi64(bytes, 8), oddGroup));
+
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(o), packed);
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(o + 6), _mm_srli_si128(packed, 8));
+        p += 16;
+        o += 12;
+    }
+#endif
+
+    uint32_t bits = 0;
+    int count = 0;
+    for (; p < end && *p != '='; ++p) {
+        const int value = base64Value(*p);
+        if (value < 0)
+            return -1;
+        bits = (bits << 6) | value;
+        if (++count == 4) {
+            o[0] = bits >> 16;
+            o[1] = bits >> 8;
+            o[2] = bits;
+            o += 3;
+            bits = 0;
+            count = 0;
+        }
+    }
+
+    // a last group of two or three characters, padded or not
+    if (count == 1)
+        return -1;
+    if (count == 2) {
+        *o++ = bits >> 4;
+    } else if (count == 3) {
+        *o++ = bits >> 10;
+        *o++ = bits >> 2;
+    }
+    for (; p < end; ++p)
+        if (*p != '=')
+            return -1;
+
+    return o - out;
+}
@@ -0,0 +1,104 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef COVERART_H
+#define COVERART_H
+
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+#if !defined(__osf__)
+#include <inttypes.h>
+#else
+typedef unsigned char  uint8_t;
+typedef unsigned short uint16_t;
+typedef unsigned int   uint32_t;
+typedef unsigned long long uint64_t;
+#endif
+
+/**
+ * Finds the pictures embedded in a file without reading them: FLAC
+ * PICTURE blocks, ID3v2 APIC (and ID3v2.2 PIC) frames, and the base64
+ * encoded METADATA_BLOCK_PICTURE comments of Ogg Vorbis, Opus, Speex,
+ * Theora and FLAC streams.
+ *
+ * Finding a picture only reads the few bytes describing it.  A Picture
+ * says where the image is and how it is stored, and read() fetches it
+ * when somebody actually wants it.
+ */
+class CoverArt
+{
+public:
+    enum Encoding {
+        Raw,            // stored as is
+        Unsynchronised, // ID3v2 unsynchronisation, 0xff 0x00 stands for 0xff
+        Base64          // a base64 encoded FLAC picture block
+    };
+
+    struct Extent
+    {
+        uint64_t offset;
+        uint64_t length;
+    };
+
+    struct Picture
+    {
+        Picture();
+
+        /** Where the image starts in the file; only meaningful for Raw. */
+        uint64_t offset() const;
+
+        uint32_t type;          // the ID3v2 picture type, 3 is the front cover
+        std::string mime;
+        uint32_t width;         // 0 when not known
+        uint32_t height;
+        uint32_t depth;         // bits per pixel
+        uint64_t length;        // of the image itself
+
+        // the stored bytes, in file order; Ogg packets are split over
+        // pages, so there may be more than one extent
+        Encoding encoding;
+        std::vector<Extent> extents;
+        uint64_t skip;          // decoded bytes in front of the image
+    };
+
+    /** Lists the PICTURE blocks of a native FLAC file. */
+    static bool findFlac(int fd, std::vector<Picture> &pictures);
+
+    /** Lists the pictures in the ID3v2 tags starting at offset. */
+    static bool findId3v2(int fd, uint64_t offset, std::vector<Picture> &pictures);
+
+    /** Lists the pictures in the header packets of an Ogg file. */
+    static bool findOgg(int fd, std::vector<Picture> &pictures);
+
+    /** The index of the front cover, or else of the first picture, or -1. */
+    static int frontCover(const std::vector<Picture> &pictures);
+
+    /** Reads the image of picture. */
+    static bool read(int fd, const Picture &picture, std::vector<uint8_t> &data);
+
+    /**
+     * Decodes length characters of base64 into out, which must have room
+     * for length / 4 * 3 + 2 bytes.  Returns the number of bytes decoded,
+     * or -1 if the input isn't base64.
+     */
+    static long decodeBase64(const char *in, size_t length, uint8_t *out);
+};
+
+#endif
@@ -0,0 +1,496 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "directorytotals.h"
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "checkpointstate.h"
+
+// the layout of saved totals; those of version 1 were whole snapshots
+static const char totals_version = 2;
+
+// records in the log beyond twice the files known before it is
+// rewritten with one for every file
+static const uint64_t compact_records = 4096;
+
+namespace {
+
+typedef MetadataRecord R;
+
+const DirectoryTotals::Tracked default_tracked[] = {
+    { R::Length, DirectoryTotals::Cummulative },
+    { R::Bitrate, DirectoryTotals::Averaged }
+};
+
+bool isNumber(R::Type type)
+{
+    return type == R::Integer || type == R::Boolean || type == R::Real || type == R::Duration;
+}
+
+// what a unit of a field's sum is worth
+double unit(R::Type type)
+{
+    return type == R::Duration ? 1e-6 : type == R::Real ? 1e-3 : 1;
+}
+
+int64_t units(R::Type type, const R::Value &value)
+{
+    if (type == R::Duration || type == R::Real)
+        return int64_t(floor(value.real / unit(type) + 0.5));
+    return value.number;
+}
+
+// with one slash between components and none at the end, so that the
+// root is the empty string
+std::string normalize(const std::string &path)
+{
+    std::string normal;
+    for (size_t i = 0; i < path.size(); ++i) {
+        if (path[i] == '/' && !normal.empty() && normal[normal.size() - 1] == '/')
+            continue;
+        normal += path[i];
+    }
+    while (!normal.empty() && normal[normal.size() - 1] == '/')
+        normal.erase(normal.size() - 1);
+    return normal;
+}
+
+std::string parentOf(const std::string &normal)
+{
+    const size_t slash = normal.rfind('/');
+    return slash == std::string::npos ? std::string() : normal.substr(0, slash);
+}
+
+bool readAt(int fd, uint64_t offset, uint64_t length, std::string &data)
+{
+    data.resize(length);
+    for (uint64_t done = 0; done < length;) {
+        const ssize_t got = pread(fd, &data[done], length - done, offset + done);
+        if (got <= 0)
+            return false;
+        done += got;
+    }
+    return true;
+}
+
+bool writeAt(int fd, const std::string &data, uint64_t offset)
+{
+    for (size_t done = 0; done < data.size();) {
+        const ssize_t wrote = pwrite(fd, data.data() + done, data.size() - done, offset + done);
+        if (wrote < 0)
+            return false;
+        done += wrote;
+    }
+    return true;
+}
+
+bool writeAll(const std::string &path, const std::string &data)
+{
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+        return false;
+    for (size_t done = 0; done < data.size();) {
+        const ssize_t wrote = write(fd, data.data() + done, data.size() - done);
+        if (wrote < 0) {
+            close(fd);
+            return false;
+        }
+        done += wrote;
+    }
+    return close(fd) == 0;
+}
+
+}
+
+DirectoryTotals::DirectoryTotals()
+    : m_pendingRecords(0), m_inode(0), m_logged(0), m_logRecords(0)
+{
+    track(default_tracked, sizeof(default_tracked) / sizeof(default_tracked[0]));
+}
+
+DirectoryTotals::DirectoryTotals(const Tracked *tracked, size_t count)
+    : m_pendingRecords(0), m_inode(0), m_logged(0), m_logRecords(0)
+{
+    track(tracked, count);
+}
+
+DirectoryTotals::~DirectoryTotals()
+{
+    clear();
+}
+
+void DirectoryTotals::track(const Tracked *tracked, size_t count)
+{
+    // fields without a number to add up are left out
+    for (size_t i = 0; i < count && m_tracked.size() < 64; ++i) {
+        if (isNumber(R::type(tracked[i].field)) && slot(tracked[i].field) < 0)
+            m_tracked.push_back(tracked[i]);
+    }
+}
+
+int DirectoryTotals::slot(MetadataRecord::Field field) const
+{
+    for (size_t i = 0; i < m_tracked.size(); ++i) {
+        if (m_tracked[i].field == field)
+            return i;
+    }
+    return -1;
+}
+
+void DirectoryTotals::clear()
+{
+    reset();
+    m_pending.clear();
+    m_pendingRecords = 0;
+    // the next sync() reads the whole log again
+    m_inode = 0;
+    m_logged = 0;
+    m_logRecords = 0;
+}
+
+void DirectoryTotals::reset()
+{
+    for (std::map<std::string, Node *>::iterator it = m_directories.begin();
+         it != m_directories.end(); ++it)
+        delete it->second;
+    m_directories.clear();
+    m_files.clear();
+}
+
+const DirectoryTotals::Node *DirectoryTotals::find(const std::string &directory) const
+{
+    std::map<std::string, Node *>::const_iterator it = m_directories.find(normalize(directory));
+    return it == m_directories.end() ? 0 : it->second;
+}
+
+DirectoryTotals::Node *DirectoryTotals::directory(const std::string &path)
+{
+    std::map<std::string, Node *>::iterator it = m_directories.find(path);
+    if (it != m_directories.end())
+        return it->second;
+
+    Node *node = new Node;
+    node->path = path;
+    node->parent = path.empty() ? 0 : directory(parentOf(path));
+    node->children = 0;
+    node->files = 0;
+    node->sums.assign(m_tracked.size(), 0);
+    node->counts.assign(m_tracked.size(), 0);
+    if (node->parent)
+        ++node->parent->children;
+    m_directories[path] = node;
+    return node;
+}
+
+void DirectoryTotals::apply(const File &file, int sign)
+{
+    for (Node *node = file.directory; node; node = node->parent) {
+        node->files += sign;
+        for (size_t i = 0; i < m_tracked.size(); ++i) {
+            if (file.present & (uint64_t(1) << i)) {
+                node->sums[i] += sign * file.values[i];
+                node->counts[i] += sign;
+            }
+        }
+    }
+}
+
+void DirectoryTotals::prune(Node *node)
+{
+    // directories are kept as long as there is a file below them
+    while (node && node->parent && !node->files && !node->children) {
+        Node *parent = node->parent;
+        m_directories.erase(node->path);
+        delete node;
+        --parent->children;
+        node = parent;
+    }
+}
+
+void DirectoryTotals::update(const std::string &path, const MetadataRecord &record)
+{
+    const std::string normal = normalize(path);
+    uint64_t present = 0;
+    std::vector<int64_t> values(m_tracked.size(), 0);
+    for (size_t i = 0; i < m_tracked.size(); ++i) {
+        const R::Field field = m_tracked[i].field;
+        if (record.has(field)) {
+            present |= uint64_t(1) << i;
+            values[i] = units(R::type(field), record.value(field));
+        }
+    }
+
+    // a file read again as it was is not logged again
+    std::map<std::string, File>::const_iterator known = m_files.find(normal);
+    if (known != m_files.end() && (known->second.present & present) == present) {
+        bool same = true;
+        for (size_t i = 0; i < m_tracked.size() && same; ++i)
+            same = !(present & (uint64_t(1) << i)) || known->second.values[i] == values[i];
+        if (same)
+            return;
+    }
+
+    merge(normal, present, values);
+    encode(m_pending, normal, present, values, false);
+    ++m_pendingRecords;
+}
+
+void DirectoryTotals::remove(const std::string &path)
+{
+    const std::string normal = normalize(path);
+    erase(normal);
+    encode(m_pending, normal, 0, std::vector<int64_t>(m_tracked.size(), 0), true);
+    ++m_pendingRecords;
+}
+
+void DirectoryTotals::merge(const std::string &normal, uint64_t present,
+                            const std::vector<int64_t> &values)
+{
+    std::map<std::string, File>::iterator known = m_files.find(normal);
+    if (known == m_files.end()) {
+        File file;
+        file.directory = directory(parentOf(normal));
+        file.present = 0;
+        file.values.assign(m_tracked.size(), 0);
+        known = m_files.insert(std::make_pair(normal, file)).first;
+    } else {
+        apply(known->second, -1);
+    }
+
+    File &file = known->second;
+    file.present |= present;
+    for (size_t i = 0; i < m_tracked.size(); ++i) {
+        if (present & (uint64_t(1) << i))
+            file.values[i] = values[i];
+    }
+    apply(file, 1);
+}
+
+void DirectoryTotals::erase(const std::string &normal)
+{
+    std::map<std::string, File>::iterator known = m_files.find(normal);
+    if (known == m_files.end())
+        return;
+    Node *directory = known->second.directory;
+    apply(known->second, -1);
+    m_files.erase(known);
+    prune(directory);
+}
+
+uint64_t DirectoryTotals::files(const std::string &directory) const
+{
+    const Node *node = find(directory);
+    return node ? node->files : 0;
+}
+
+uint64_t DirectoryTotals::count(const std::string &directory, MetadataRecord::Field field) const
+{
+    const Node *node = find(directory);
+    const int i = slot(field);
+    return node && i >= 0 ? node->counts[i] : 0;
+}
+
+double DirectoryTotals::value(const std::string &directory, MetadataRecord::Field field) const
+{
+    const Node *node = find(directory);
+    const int i = slot(field);
+    if (!node || i < 0 || !node->counts[i])
+        return 0;
+    const double total = node->sums[i] * unit(R::type(field));
+    return m_tracked[i].rollup == Averaged ? total / node->counts[i] : total;
+}
+
+void DirectoryTotals::header(std::string &data) const
+{
+    typedef CheckpointState S;
+    data += totals_version;
+    S::put(data, m_tracked.size(), 1);
+    for (size_t i = 0; i < m_tracked.size(); ++i) {
+        S::put(data, m_tracked[i].field, 1);
+        S::put(data, m_tracked[i].rollup, 1);
+    }
+}
+
+void DirectoryTotals::encode(std::string &data, const std::string &normal, uint64_t present,
+                             const std::vector<int64_t> &values, bool removed) const
+{
+    typedef CheckpointState S;
+    std::string record;
+    record += char(removed ? 'R' : 'U');
+    S::put(record, normal);
+    S::put(record, present, 8);
+    for (size_t i = 0; i < m_tracked.size(); ++i) {
+        if (present & (uint64_t(1) << i))
+            S::put(record, values[i], 8);
+    }
+    S::put(data, record.size(), 4);
+    data += record;
+}
+
+/**
+ * Applies the records in data from offset on, counting them in records,
+ * and gives where the last whole one ends.
+ */
+size_t DirectoryTotals::replay(const std::string &data, size_t offset, uint64_t &records)
+{
+    std::vector<int64_t> values(m_tracked.size(), 0);
+    while (data.size() - offset >= 4) {
+        uint64_t length = 0;
+        for (int i = 3; i >= 0; --i)
+            length = (length << 8) | uint8_t(data[offset + i]);
+        if (length > data.size() - offset - 4)
+            break;
+
+        const std::string record = data.substr(offset + 4, length);
+        CheckpointState in(record);
+        const uint64_t op = in.number(1);
+        const std::string path = in.bytes();
+        const uint64_t present = in.number(8);
+        for (size_t i = 0; i < m_tracked.size(); ++i)
+            values[i] = present & (uint64_t(1) << i) ? int64_t(in.number(8)) : 0;
+        if (!in.ok() || !in.atEnd() || (op != 'U' && op != 'R'))
+            break;
+
+        if (op == 'R')
+            erase(path);
+        else
+            merge(path, present, values);
+        offset += 4 + length;
+        ++records;
+    }
+    return offset;
+}
+
+void DirectoryTotals::save(std::string &data) const
+{
+    data.clear();
+    header(data);
+    for (std::map<std::string, File>::const_iterator it = m_files.begin();
+         it != m_files.end(); ++it)
+        encode(data, it->first, it->second.present, it->second.values, false);
+}
+
+bool DirectoryTotals::load(const std::string &data)
+{
+    clear();
+    std::string head;
+    header(head);
+    // totals of other fields are of no use
+    if (data.compare(0, head.size(), head) != 0)
+        return false;
+    uint64_t records = 0;
+    if (replay(data, head.size(), records) == data.size())
+        return true;
+    clear();
+    return false;
+}
+
+bool DirectoryTotals::sync(const std::string &path)
+{
+    // a compaction by another process may replace the log between opening
+    // and locking it, in which case it has to be opened again
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        int fd = open(path.c_str(), O_RDWR | O_CREAT, 0600);
+        if (fd < 0)
+            return false;
+        if (flock(fd, LOCK_EX) != 0) {
+            close(fd);
+            return false;
+        }
+        struct stat st, current;
+        if (fstat(fd, &st) != 0 || stat(path.c_str(), &current) != 0) {
+            close(fd);
+            return false;
+        }
+        if (st.st_ino != current.st_ino) {
+            close(fd);
+            continue;
+        }
+
+        // what the others appended since, or all of the log once another
+        // process compacted it
+        uint64_t from = m_logged;
+        if (uint64_t(st.st_ino) != m_inode || uint64_t(st.st_size) < m_logged) {
+            reset();
+            from = 0;
+            m_logRecords = 0;
+        }
+        std::string data;
+        bool ok = readAt(fd, from, st.st_size - from, data);
+        size_t start = 0;
+        if (ok && from == 0) {
+            // a log of another version or other fields is started anew
+            std::string head;
+            header(head);
+            if (data.compare(0, head.size(), head) != 0) {
+                data = head;
+                ok = ftruncate(fd, 0) == 0 && writeAt(fd, head, 0);
+            }
+            start = head.size();
+        }
+        uint64_t end = from;
+        if (ok) {
+            end = from + replay(data, start, m_logRecords);
+            // a record cut short by a process that died while appending it
+            if (end < from + data.size())
+                ok = ftruncate(fd, end) == 0;
+        }
+
+        // the changes made here win over those of the others
+        uint64_t own = 0;
+        replay(m_pending, 0, own);
+        if (ok && writeAt(fd, m_pending, end)) {
+            end += m_pending.size();
+            m_logRecords += own;
+            m_pending.clear();
+            m_pendingRecords = 0;
+            m_inode = st.st_ino;
+            m_logged = end;
+            if (m_logRecords > compact_records && m_logRecords > 2 * m_files.size())
+                compact(path);
+        } else {
+            ok = false;
+        }
+        close(fd);
+        return ok;
+    }
+    return false;
+}
+
+/** Rewrites the log, under its lock, with a record for every file. */
+bool DirectoryTotals::compact(const std::string &path)
+{
+    std::string data;
+    save(data);
+    const std::string temporary = path + ".new";
+    struct stat st;
+    if (!writeAll(temporary, data) || stat(temporary.c_str(), &st) != 0 ||
+        rename(temporary.c_str(), path.c_str()) != 0) {
+        unlink(temporary.c_str());
+        return false;
+    }
+    m_inode = st.st_ino;
+    m_logged = data.size();
+    m_logRecords = m_files.size();
+    return true;
+}
@@ -0,0 +1,144 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef DIRECTORYTOTALS_H
+#define DIRECTORYTOTALS_H
+
+#include <stddef.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "metadatarecord.h"
+
+/**
+ * The totals and averages of the fields the plugins mark Cummulative
+ * and Averaged, such as Length and Bitrate, for every directory and
+ * everything below it.
+ *
+ * Every directory keeps the sums and counts of its whole subtree.  A
+ * file that is added, changed or removed only changes those of the
+ * directories it is in, from its own up to the root, by the difference
+ * to what it had before; a directory's totals are then there without
+ * going through its files.  Sums are kept in whole units, microseconds
+ * for lengths, so that adding and taking away never drifts.
+ *
+ * Records are fed in as CachedFilePlugin::read() gives them, and only
+ * the fields a record has change; one read for the tags alone leaves
+ * the length and bitrate of a file as they were, and a file read again
+ * as it was changes nothing.
+ *
+ * The plugins of every process share the totals through a log that
+ * updates and removals are appended to.  sync() takes on what the
+ * others appended since and appends the changes made here, so it costs
+ * what changed rather than all the files; only the first reads the
+ * whole log.  Once most of the log is superseded, it is rewritten with
+ * one record for every file.  The totals are not for use by more than
+ * one thread at a time.
+ */
+class DirectoryTotals
+{
+public:
+    enum Rollup {
+        Cummulative,
+        Averaged
+    };
+
+    struct Tracked
+    {
+        MetadataRecord::Field field;
+        Rollup rollup;
+    };
+
+    /** Totals of Length, and the average Bitrate. */
+    DirectoryTotals();
+    DirectoryTotals(const Tracked *tracked, size_t count);
+    ~DirectoryTotals();
+
+    /** Takes the tracked fields record has for the file at path. */
+    void update(const std::string &path, const MetadataRecord &record);
+    void remove(const std::string &path);
+    /** Forgets all files, and the changes not synced yet. */
+    void clear();
+
+    /** Files in directory and below. */
+    uint64_t files(const std::string &directory) const;
+    /** The files of those that have field. */
+    uint64_t count(const std::string &directory, MetadataRecord::Field field) const;
+    /** The total or the average of field, as it is tracked. */
+    double value(const std::string &directory, MetadataRecord::Field field) const;
+
+    /** The totals as a log with a record for every file. */
+    void save(std::string &data) const;
+    bool load(const std::string &data);
+
+    /** Updates and removals since the last sync(). */
+    uint64_t changes() const { return m_pendingRecords; }
+    /** Takes on the log at path, and appends the changes to it. */
+    bool sync(const std::string &path);
+
+private:
+    struct Node
+    {
+        std::string path;
+        Node *parent;
+        size_t children;
+        uint64_t files;
+        std::vector<int64_t> sums;
+        std::vector<uint64_t> counts;
+    };
+    struct File
+    {
+        Node *directory;
+        uint64_t present;
+        std::vector<int64_t> values;
+    };
+
+    DirectoryTotals(const DirectoryTotals &);
+    DirectoryTotals &operator=(const DirectoryTotals &);
+
+    void track(const Tracked *tracked, size_t count);
+    void reset();
+    const Node *find(const std::string &directory) const;
+    Node *directory(const std::string &path);
+    void merge(const std::string &normal, uint64_t present, const std::vector<int64_t> &values);
+    void erase(const std::string &normal);
+    void apply(const File &file, int sign);
+    void prune(Node *node);
+    int slot(MetadataRecord::Field field) const;
+    void header(std::string &data) const;
+    void encode(std::string &data, const std::string &normal, uint64_t present,
+                const std::vector<int64_t> &values, bool removed) const;
+    size_t replay(const std::string &data, size_t offset, uint64_t &records);
+    bool compact(const std::string &path);
+
+    std::vector<Tracked> m_tracked;
+    // the directories by their paths, without a slash at the end
+    std::map<std::string, Node *> m_directories;
+    std::map<std::string, File> m_files;
+
+    // records of the changes not in the log yet
+    std::string m_pending;
+    uint64_t m_pendingRecords;
+    // the log as far as it was taken on
+    uint64_t m_inode;
+    uint64_t m_logged;
+    uint64_t m_logRecords;
+};
+
+#endif
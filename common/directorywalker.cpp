@@ -0,0 +1,522 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "directorywalker.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifdef HAVE_GETDENTS64
+#include <sys/syscall.h>
+#endif
+#ifdef HAVE_STATX
+#include <sys/sysmacros.h>
+#endif
+
+// bytes of names read from a directory at once
+static const size_t dirent_buffer = 256 << 10;
+
+// bytes read of a file to tell its type, enough for the first pages of
+// an Ogg stream with a skeleton
+static const size_t head_bytes = 1024;
+
+// batches the walkers may get ahead of next() by
+static const size_t walker_backlog = 16;
+
+// more threads than this only wait on the same disks
+static const size_t max_threads = 16;
+
+namespace {
+
+const char avi_type[] = "video/x-msvideo";
+const char wav_type[] = "audio/x-wav";
+const char flac_type[] = "audio/x-flac";
+const char ogg_flac_type[] = "audio/x-flac+ogg";
+const char mpeg_type[] = "audio/mpeg";
+const char musepack_type[] = "audio/x-musepack";
+const char sid_type[] = "audio/prs.sid";
+const char vorbis_type[] = "audio/x-vorbis+ogg";
+const char theora_type[] = "video/x-theora+ogg";
+
+// extensions that are Ogg, and tell nothing of what is in it
+const char ogg_container[] = "";
+
+const struct
+{
+    const char *extension;
+    const char *type;
+} extensions[] = {
+    { "avi", avi_type },
+    { "wav", wav_type },
+    { "flac", flac_type },
+    { "mp3", mpeg_type },
+    { "mp2", mpeg_type },
+    { "mpga", mpeg_type },
+    { "mpc", musepack_type },
+    { "mpp", musepack_type },
+    { "mp+", musepack_type },
+    { "sid", sid_type },
+    { "psid", sid_type },
+    { "ogg", ogg_container },
+    { "oga", ogg_container },
+    { "ogv", ogg_container },
+    { "ogx", ogg_container }
+};
+
+#ifdef HAVE_GETDENTS64
+struct Dirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[1];
+};
+#endif
+
+/** The type the extension of name stands for, ogg_container or 0. */
+const char *extensionType(const char *name)
+{
+    const char *dot = strrchr(name, '.');
+    if (!dot || !dot[1] || strlen(dot + 1) > 4)
+        return 0;
+    char extension[5];
+    size_t i = 0;
+    for (const char *c = dot + 1; *c; ++c)
+        extension[i++] = *c >= 'A' && *c <= 'Z' ? *c - 'A' + 'a' : *c;
+    extension[i] = 0;
+
+    for (size_t j = 0; j < sizeof(extensions) / sizeof(extensions[0]); ++j) {
+        if (!strcmp(extension, extensions[j].extension))
+            return extensions[j].type;
+    }
+    return 0;
+}
+
+bool starts(const unsigned char *head, size_t length, const char *magic)
+{
+    const size_t size = strlen(magic);
+    return length >= size && !memcmp(head, magic, size);
+}
+
+/** What the streams starting on the first pages are, video first. */
+const char *oggType(const unsigned char *head, size_t length)
+{
+    const char *type = 0;
+    size_t at = 0;
+    // every stream starts on a page of its own before any other page
+    while (at + 27 <= length && !memcmp(head + at, "OggS", 4) && (head[at + 5] & 2)) {
+        const size_t segments = head[at + 26];
+        const size_t body = at + 27 + segments;
+        if (body > length)
+            break;
+        size_t size = 0;
+        for (size_t i = 0; i < segments; ++i)
+            size += head[at + 27 + i];
+
+        const unsigned char *packet = head + body;
+        const size_t available = body + size <= length ? size : length - body;
+        if (starts(packet, available, "\x80theora"))
+            return theora_type;
+        if (!type && starts(packet, available, "\x01vorbis"))
+            type = vorbis_type;
+        if (!type && starts(packet, available, "\x7f" "FLAC"))
+            type = ogg_flac_type;
+        at = body + size;
+    }
+    return type;
+}
+
+bool matches(const char *type, const unsigned char *head, size_t length)
+{
+    // files with tags in front are taken by their extension
+    const bool tagged = starts(head, length, "ID3");
+    if (type == avi_type)
+        return starts(head, length, "RIFF") && length >= 12 && !memcmp(head + 8, "AVI ", 4);
+    if (type == wav_type)
+        return starts(head, length, "RIFF") && length >= 12 && !memcmp(head + 8, "WAVE", 4);
+    if (type == flac_type)
+        return tagged || starts(head, length, "fLaC");
+    if (type == mpeg_type)
+        return tagged || (length >= 2 && head[0] == 0xff && (head[1] & 0xe0) == 0xe0);
+    if (type == musepack_type)
+        return tagged || starts(head, length, "MP+") || starts(head, length, "MPCK");
+    if (type == sid_type)
+        return starts(head, length, "PSID") || starts(head, length, "RSID");
+    return false;
+}
+
+/** Gets the type of name in directory, and its key if wanted. */
+bool statAt(int dirfd, const char *name, bool wantKey, MetadataCache::Key &key, mode_t &mode)
+{
+#ifdef HAVE_STATX
+    const unsigned int mask = wantKey ? STATX_TYPE | STATX_INO | STATX_SIZE | STATX_MTIME
+                                      : STATX_TYPE;
+    struct statx stx;
+    if (statx(dirfd, name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, mask, &stx) != 0 ||
+        (stx.stx_mask & mask) != mask)
+        return false;
+    mode = stx.stx_mode;
+    key.device = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+    key.inode = stx.stx_ino;
+    key.mtime = int64_t(stx.stx_mtime.tv_sec) * 1000000000 + stx.stx_mtime.tv_nsec;
+    key.size = stx.stx_size;
+#else
+    (void)wantKey;
+    struct stat st;
+    if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+        return false;
+    mode = st.st_mode;
+    key.device = st.st_dev;
+    key.inode = st.st_ino;
+#if defined(__APPLE__)
+    key.mtime = int64_t(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+    key.mtime = int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+    key.size = st.st_size;
+#endif
+    return true;
+}
+
+size_t readHead(int dirfd, const char *name, unsigned char *head)
+{
+    int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd < 0)
+        return 0;
+    const ssize_t length = pread(fd, head, head_bytes, 0);
+    close(fd);
+    return length > 0 ? length : 0;
+}
+
+}
+
+DirectoryWalker::DirectoryWalker(size_t batch, unsigned threads)
+    : m_batch(batch ? batch : 1), m_verify(false),
+      m_queued(0), m_pending(0), m_running(0), m_stopping(false)
+{
+    m_threads = threads;
+    if (!m_threads) {
+        const long processors = sysconf(_SC_NPROCESSORS_ONLN);
+        m_threads = processors > 0 ? processors : 1;
+    }
+    if (m_threads > max_threads)
+        m_threads = max_threads;
+
+    pthread_mutex_init(&m_lock, 0);
+    pthread_cond_init(&m_work, 0);
+    pthread_cond_init(&m_ready, 0);
+    pthread_cond_init(&m_room, 0);
+}
+
+DirectoryWalker::~DirectoryWalker()
+{
+    stop();
+    pthread_cond_destroy(&m_room);
+    pthread_cond_destroy(&m_ready);
+    pthread_cond_destroy(&m_work);
+    pthread_mutex_destroy(&m_lock);
+}
+
+void DirectoryWalker::accept(const std::string &mimeType)
+{
+    m_accepted.insert(mimeType);
+}
+
+void DirectoryWalker::setVerify(bool verify)
+{
+    m_verify = verify;
+}
+
+const char *DirectoryWalker::classify(const char *name, const unsigned char *head,
+                                      size_t length)
+{
+    const char *type = extensionType(name);
+    if (type == ogg_container)
+        return oggType(head, length);
+    return type && matches(type, head, length) ? type : 0;
+}
+
+bool DirectoryWalker::wanted(const char *mimeType) const
+{
+    if (m_accepted.empty())
+        return true;
+    if (mimeType != ogg_container)
+        return m_accepted.count(mimeType);
+    return m_accepted.count(vorbis_type) || m_accepted.count(theora_type) ||
+           m_accepted.count(ogg_flac_type);
+}
+
+bool DirectoryWalker::start(const std::vector<std::string> &roots)
+{
+    stop();
+    m_queued = 0;
+    m_pending = 0;
+    m_stopping = false;
+
+    for (size_t i = 0; i < m_threads; ++i) {
+        Worker *worker = new Worker;
+        worker->walker = this;
+        worker->index = i;
+        worker->started = false;
+        worker->buffer = 0;
+        pthread_mutex_init(&worker->lock, 0);
+        m_workers.push_back(worker);
+    }
+    // the roots are spread over the threads, and the rest is stolen
+    m_roots.clear();
+    for (size_t i = 0; i < roots.size(); ++i) {
+        std::string root = roots[i];
+        while (!root.empty() && root[root.size() - 1] == '/')
+            root.erase(root.size() - 1);
+        if (!roots[i].empty()) {
+            m_roots.insert(root);
+            push(*m_workers[i % m_workers.size()], root);
+        }
+    }
+
+    // the directories of a thread that didn't start are left for the
+    // others to steal; those that did may be done by the time the last
+    // is created, so m_running can't tell
+    size_t started = 0;
+    for (size_t i = 0; i < m_workers.size(); ++i) {
+        pthread_mutex_lock(&m_lock);
+        m_workers[i]->started = pthread_create(&m_workers[i]->thread, 0, run, m_workers[i]) == 0;
+        if (m_workers[i]->started) {
+            ++m_running;
+            ++started;
+        }
+        pthread_mutex_unlock(&m_lock);
+    }
+    if (started)
+        return true;
+    stop();
+    return false;
+}
+
+void DirectoryWalker::stop()
+{
+    pthread_mutex_lock(&m_lock);
+    m_stopping = true;
+    pthread_cond_broadcast(&m_work);
+    pthread_cond_broadcast(&m_room);
+    pthread_mutex_unlock(&m_lock);
+
+    for (size_t i = 0; i < m_workers.size(); ++i) {
+        if (m_workers[i]->started)
+            pthread_join(m_workers[i]->thread, 0);
+        pthread_mutex_destroy(&m_workers[i]->lock);
+        delete m_workers[i];
+    }
+    m_workers.clear();
+    m_batches.clear();
+    m_running = 0;
+}
+
+bool DirectoryWalker::next(std::vector<Entry> &batch)
+{
+    pthread_mutex_lock(&m_lock);
+    while (m_batches.empty() && m_running)
+        pthread_cond_wait(&m_ready, &m_lock);
+    const bool ready = !m_batches.empty();
+    if (ready) {
+        batch.swap(m_batches.front());
+        m_batches.pop_front();
+        pthread_cond_signal(&m_room);
+    }
+    pthread_mutex_unlock(&m_lock);
+    if (!ready)
+        batch.clear();
+    return ready;
+}
+
+void *DirectoryWalker::run(void *arg)
+{
+    Worker *worker = static_cast<Worker *>(arg);
+    worker->walker->walk(*worker);
+    return 0;
+}
+
+void DirectoryWalker::walk(Worker &worker)
+{
+#ifdef HAVE_GETDENTS64
+    worker.buffer = new char[dirent_buffer];
+#endif
+    std::string directory;
+    while (take(worker, directory)) {
+        readDirectory(worker, directory);
+        pthread_mutex_lock(&m_lock);
+        if (!--m_pending)
+            pthread_cond_broadcast(&m_work);
+        pthread_mutex_unlock(&m_lock);
+    }
+    if (!worker.batch.empty())
+        hand(worker);
+    delete[] worker.buffer;
+    worker.buffer = 0;
+
+    pthread_mutex_lock(&m_lock);
+    if (!--m_running)
+        pthread_cond_broadcast(&m_ready);
+    pthread_mutex_unlock(&m_lock);
+}
+
+void DirectoryWalker::push(Worker &worker, const std::string &directory)
+{
+    // counted before another thread can take it, which it can only once
+    // the count is unlocked
+    pthread_mutex_lock(&m_lock);
+    pthread_mutex_lock(&worker.lock);
+    worker.directories.push_back(directory);
+    pthread_mutex_unlock(&worker.lock);
+    ++m_queued;
+    ++m_pending;
+    pthread_cond_signal(&m_work);
+    pthread_mutex_unlock(&m_lock);
+}
+
+bool DirectoryWalker::take(Worker &worker, std::string &directory)
+{
+    for (;;) {
+        // the newest of its own keeps a thread deep in one subtree, and
+        // the oldest of another's is the most to take over
+        bool found = false;
+        pthread_mutex_lock(&worker.lock);
+        if (!worker.directories.empty()) {
+            directory.swap(worker.directories.back());
+            worker.directories.pop_back();
+            found = true;
+        }
+        pthread_mutex_unlock(&worker.lock);
+        for (size_t i = 1; !found && i < m_workers.size(); ++i) {
+            Worker &other = *m_workers[(worker.index + i) % m_workers.size()];
+            pthread_mutex_lock(&other.lock);
+            if (!other.directories.empty()) {
+                directory.swap(other.directories.front());
+                other.directories.pop_front();
+                found = true;
+            }
+            pthread_mutex_unlock(&other.lock);
+        }
+
+        pthread_mutex_lock(&m_lock);
+        if (found)
+            --m_queued;
+        while (!found && !m_stopping && m_pending && !m_queued)
+            pthread_cond_wait(&m_work, &m_lock);
+        const bool more = !m_stopping && m_pending;
+        pthread_mutex_unlock(&m_lock);
+        if (found || !more)
+            return found && more;
+    }
+}
+
+void DirectoryWalker::readDirectory(Worker &worker, const std::string &directory)
+{
+    // a root may be a link to a directory elsewhere, as ~/Music often is
+    const int follow = m_roots.count(directory) ? 0 : O_NOFOLLOW;
+    int fd = open(directory.empty() ? "/" : directory.c_str(),
+                  O_RDONLY | O_DIRECTORY | O_CLOEXEC | follow);
+    if (fd < 0)
+        return;
+
+#ifdef HAVE_GETDENTS64
+    for (;;) {
+        const long length = syscall(SYS_getdents64, fd, worker.buffer, dirent_buffer);
+        if (length <= 0)
+            break;
+        for (long at = 0; at < length;) {
+            const Dirent64 *entry = reinterpret_cast<const Dirent64 *>(worker.buffer + at);
+            addEntry(worker, fd, directory, entry->d_name, entry->d_type);
+            at += entry->d_reclen;
+        }
+    }
+    close(fd);
+#else
+    DIR *dir = fdopendir(fd);
+    if (!dir) {
+        close(fd);
+        return;
+    }
+    while (struct dirent *entry = readdir(dir))
+        addEntry(worker, fd, directory, entry->d_name, entry->d_type);
+    closedir(dir);
+#endif
+}
+
+void DirectoryWalker::addEntry(Worker &worker, int dirfd, const std::string &directory,
+                               const char *name, unsigned char type)
+{
+    if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+        return;
+    if (type == DT_DIR) {
+        push(worker, directory + '/' + name);
+        return;
+    }
+    if (type != DT_REG && type != DT_UNKNOWN)
+        return;
+
+    // only files that may be of a wanted type are stat'ed, unless the
+    // file system doesn't tell which names are directories
+    const char *mimeType = extensionType(name);
+    const bool candidate = mimeType && wanted(mimeType);
+    if (!candidate && type != DT_UNKNOWN)
+        return;
+
+    Entry entry;
+    mode_t mode;
+    if (!statAt(dirfd, name, candidate, entry.key, mode))
+        return;
+    if (S_ISDIR(mode)) {
+        push(worker, directory + '/' + name);
+        return;
+    }
+    if (!candidate || !S_ISREG(mode))
+        return;
+
+    if (mimeType == ogg_container || m_verify) {
+        unsigned char head[head_bytes];
+        const size_t length = readHead(dirfd, name, head);
+        mimeType = classify(name, head, length);
+        if (!mimeType || !wanted(mimeType))
+            return;
+    }
+
+    entry.path = directory + '/' + name;
+    entry.mimeType = mimeType;
+    worker.batch.push_back(entry);
+    if (worker.batch.size() >= m_batch)
+        hand(worker);
+}
+
+void DirectoryWalker::hand(Worker &worker)
+{
+    pthread_mutex_lock(&m_lock);
+    while (m_batches.size() >= walker_backlog && !m_stopping)
+        pthread_cond_wait(&m_room, &m_lock);
+    if (!m_stopping) {
+        m_batches.push_back(std::vector<Entry>());
+        m_batches.back().swap(worker.batch);
+        pthread_cond_signal(&m_ready);
+    }
+    pthread_mutex_unlock(&m_lock);
+    worker.batch.clear();
+}
@@ -0,0 +1,123 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef DIRECTORYWALKER_H
+#define DIRECTORYWALKER_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#include <deque>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "metadatacache.h"
+
+/**
+ * Lists the files below some directories that one of the plugins reads,
+ * with their MetadataCache keys, in batches.
+ *
+ * Directories are read with getdents64() into a large buffer, where the
+ * kernel has it, and the type the kernel gives with every name means
+ * only files with the extension of a format are stat'ed at all, with
+ * statx() asking for no more than the key needs.  Extensions that don't
+ * name one format, such as .ogg, are settled by the first bytes of the
+ * file.  Symbolic links below the roots are not followed.
+ *
+ * Every thread has its own list of directories still to read, which it
+ * takes the newest from, and a thread that runs out takes the oldest of
+ * another's, as those are usually the largest subtrees left.  Batches
+ * are handed to the thread calling next() as they fill up.
+ */
+class DirectoryWalker
+{
+public:
+    struct Entry
+    {
+        std::string path;
+        MetadataCache::Key key;
+        const char *mimeType;
+    };
+
+    /** Files in a batch, and threads, by default one for every processor. */
+    explicit DirectoryWalker(size_t batch = 128, unsigned threads = 0);
+    ~DirectoryWalker();
+
+    /**
+     * Lists files of mimeType only; by default files of any plugin.  Set
+     * before start(), as setVerify() is.
+     */
+    void accept(const std::string &mimeType);
+    /** Also checks the first bytes where the extension names the format. */
+    void setVerify(bool verify);
+
+    bool start(const std::vector<std::string> &roots);
+    /** The next batch, or false once all of them were given. */
+    bool next(std::vector<Entry> &batch);
+    void stop();
+
+    /** The type of the file name, by its extension and its first bytes. */
+    static const char *classify(const char *name, const unsigned char *head, size_t length);
+
+private:
+    struct Worker
+    {
+        DirectoryWalker *walker;
+        size_t index;
+        pthread_t thread;
+        bool started;
+        pthread_mutex_t lock;
+        std::deque<std::string> directories;
+        std::vector<Entry> batch;
+        char *buffer;
+    };
+
+    DirectoryWalker(const DirectoryWalker &);
+    DirectoryWalker &operator=(const DirectoryWalker &);
+
+    static void *run(void *arg);
+    void walk(Worker &worker);
+    void push(Worker &worker, const std::string &directory);
+    bool take(Worker &worker, std::string &directory);
+    void readDirectory(Worker &worker, const std::string &directory);
+    void addEntry(Worker &worker, int dirfd, const std::string &directory, const char *name,
+                  unsigned char type);
+    bool wanted(const char *mimeType) const;
+    void hand(Worker &worker);
+
+    size_t m_batch;
+    size_t m_threads;
+    bool m_verify;
+    std::set<std::string> m_accepted;
+    // only read by the threads once they run
+    std::set<std::string> m_roots;
+
+    std::vector<Worker *> m_workers;
+    pthread_mutex_t m_lock;
+    pthread_cond_t m_work;
+    pthread_cond_t m_ready;
+    pthread_cond_t m_room;
+    // directories in the lists, and those plus the ones being read
+    size_t m_queued;
+    size_t m_pending;
+    size_t m_running;
+    bool m_stopping;
+    std::deque<std::vector<Entry> > m_batches;
+};
+
+#endif
@@ -0,0 +1,302 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "imagescaler.h"
+
+#include <math.h>
+
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static const double lanczos_lobes = 3.0;
+
+namespace {
+
+#ifdef __SSE2__
+
+// the four channels of a pixel, blue first as in memory
+struct Pixel
+{
+    __m128 v;
+};
+
+inline Pixel make(__m128 v)
+{
+    Pixel p = { v };
+    return p;
+}
+
+inline Pixel zero()
+{
+    return make(_mm_setzero_ps());
+}
+
+inline Pixel add(Pixel a, Pixel b)
+{
+    return make(_mm_add_ps(a.v, b.v));
+}
+
+inline Pixel scaled(Pixel p, float w)
+{
+    return make(_mm_mul_ps(p.v, _mm_set1_ps(w)));
+}
+
+inline Pixel madd(Pixel acc, Pixel p, float w)
+{
+    return make(_mm_add_ps(acc.v, _mm_mul_ps(p.v, _mm_set1_ps(w))));
+}
+
+inline Pixel unpack(uint32_t argb)
+{
+    const __m128i z = _mm_setzero_si128();
+    const __m128i v = _mm_cvtsi32_si128(int(argb));
+    return make(_mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(v, z), z)));
+}
+
+inline uint32_t pack(Pixel p)
+{
+    // ringing can push a colour above its alpha, which premultiplied
+    // pixels can't have
+    const __m128 alpha = _mm_min_ps(_mm_shuffle_ps(p.v, p.v, _MM_SHUFFLE(3, 3, 3, 3)),
+                                    _mm_set1_ps(255.0f));
+    __m128i v = _mm_cvtps_epi32(_mm_max_ps(_mm_min_ps(p.v, alpha), _mm_setzero_ps()));
+    v = _mm_packs_epi32(v, v);
+    return uint32_t(_mm_cvtsi128_si32(_mm_packus_epi16(v, v)));
+}
+
+#else
+
+struct Pixel
+{
+    float c[4];
+};
+
+inline Pixel zero()
+{
+    Pixel p = { { 0.0f, 0.0f, 0.0f, 0.0f } };
+    return p;
+}
+
+inline Pixel add(Pixel a, Pixel b)
+{
+    for (int i = 0; i < 4; ++i)
+        a.c[i] += b.c[i];
+    return a;
+}
+
+inline Pixel scaled(Pixel p, float w)
+{
+    for (int i = 0; i < 4; ++i)
+        p.c[i] *= w;
+    return p;
+}
+
+inline Pixel madd(Pixel acc, Pixel p, float w)
+{
+    for (int i = 0; i < 4; ++i)
+        acc.c[i] += p.c[i] * w;
+    return acc;
+}
+
+inline Pixel unpack(uint32_t argb)
+{
+    Pixel p;
+    for (int i = 0; i < 4; ++i)
+        p.c[i] = float((argb >> (8 * i)) & 0xff);
+    return p;
+}
+
+inline uint32_t pack(Pixel p)
+{
+    float alpha = p.c[3] < 255.0f ? p.c[3] : 255.0f;
+    uint32_t argb = 0;
+    for (int i = 0; i < 4; ++i) {
+        float v = p.c[i] < alpha ? p.c[i] : alpha;
+        if (v < 0.0f)
+            v = 0.0f;
+        argb |= uint32_t(v + 0.5f) << (8 * i);
+    }
+    return argb;
+}
+
+#endif
+
+inline double lanczos(double x)
+{
+    if (x == 0.0)
+        return 1.0;
+    if (x <= -lanczos_lobes || x >= lanczos_lobes)
+        return 0.0;
+    const double px = M_PI * x;
+    return lanczos_lobes * sin(px) * sin(px / lanczos_lobes) / (px * px);
+}
+
+/** The Lanczos taps of every output pixel of a row or column. */
+struct Filter
+{
+    Filter(int from, int to);
+
+    std::vector<int> first;
+    std::vector<int> count;
+    std::vector<float> weights;     // taps per output pixel
+    int taps;
+};
+
+Filter::Filter(int from, int to)
+{
+    // shrinking widens the kernel to the spacing of the source pixels
+    const double scale = double(from) / to;
+    const double stretch = scale > 1.0 ? scale : 1.0;
+    const double support = lanczos_lobes * stretch;
+
+    taps = int(ceil(support * 2)) + 1;
+    first.resize(to);
+    count.resize(to);
+    weights.assign(size_t(to) * taps, 0.0f);
+
+    for (int i = 0; i < to; ++i) {
+        const double center = (i + 0.5) * scale;
+        int left = int(floor(center - support));
+        int right = int(ceil(center + support));
+        if (left < 0)
+            left = 0;
+        if (right > from)
+            right = from;
+        if (right - left > taps)
+            right = left + taps;
+
+        double sum = 0.0;
+        for (int j = left; j < right; ++j)
+            sum += lanczos((j + 0.5 - center) / stretch);
+
+        first[i] = left;
+        count[i] = right - left;
+        float *w = &weights[size_t(i) * taps];
+        for (int j = left; j < right; ++j)
+            w[j - left] = sum != 0.0 ? float(lanczos((j + 0.5 - center) / stretch) / sum) : 0.0f;
+    }
+}
+
+/**
+ * Averages blocks of factor x factor pixels; the blocks at the right and
+ * bottom edges may be smaller.
+ */
+void boxReduce(const uint32_t *src, int width, int height, int stride, int factor,
+               std::vector<Pixel> &out, int &outWidth, int &outHeight)
+{
+    outWidth = (width + factor - 1) / factor;
+    outHeight = (height + factor - 1) / factor;
+    out.assign(size_t(outWidth) * outHeight, zero());
+
+    for (int oy = 0; oy < outHeight; ++oy) {
+        Pixel *row = &out[size_t(oy) * outWidth];
+        const int y0 = oy * factor;
+        const int y1 = y0 + factor < height ? y0 + factor : height;
+
+        for (int y = y0; y < y1; ++y) {
+            const uint32_t *line = src + size_t(y) * stride;
+            for (int ox = 0, x = 0; ox < outWidth; ++ox) {
+                const int x1 = x + factor < width ? x + factor : width;
+                Pixel acc = row[ox];
+                for (; x < x1; ++x)
+                    acc = add(acc, unpack(line[x]));
+                row[ox] = acc;
+            }
+        }
+
+        for (int ox = 0; ox < outWidth; ++ox) {
+            const int x0 = ox * factor;
+            const int x1 = x0 + factor < width ? x0 + factor : width;
+            row[ox] = scaled(row[ox], 1.0f / ((y1 - y0) * (x1 - x0)));
+        }
+    }
+}
+
+}
+
+void ImageScaler::scale(const uint32_t *src, int width, int height, int stride,
+                        uint32_t *dst, int dstWidth, int dstHeight, int dstStride)
+{
+    if (width <= 0 || height <= 0 || dstWidth <= 0 || dstHeight <= 0)
+        return;
+
+    // averaging is cheap and good enough while the image stays at least
+    // twice as big as wanted
+    int factor = width / (2 * dstWidth) < height / (2 * dstHeight)
+               ? width / (2 * dstWidth) : height / (2 * dstHeight);
+    if (factor < 1)
+        factor = 1;
+
+    std::vector<Pixel> image;
+    int w, h;
+    boxReduce(src, width, height, stride, factor, image, w, h);
+
+    const Filter horizontal(w, dstWidth);
+    std::vector<Pixel> rows(size_t(h) * dstWidth);
+    for (int y = 0; y < h; ++y) {
+        const Pixel *in = &image[size_t(y) * w];
+        Pixel *out = &rows[size_t(y) * dstWidth];
+        for (int x = 0; x < dstWidth; ++x) {
+            const float *weight = &horizontal.weights[size_t(x) * horizontal.taps];
+            const Pixel *tap = in + horizontal.first[x];
+            Pixel acc = zero();
+            for (int k = 0; k < horizontal.count[x]; ++k)
+                acc = madd(acc, tap[k], weight[k]);
+            out[x] = acc;
+        }
+    }
+
+    // a row at a time, to go through the rows in memory order
+    const Filter vertical(h, dstHeight);
+    std::vector<Pixel> line(dstWidth);
+    for (int y = 0; y < dstHeight; ++y) {
+        const float *weight = &vertical.weights[size_t(y) * vertical.taps];
+        line.assign(dstWidth, zero());
+        for (int k = 0; k < vertical.count[y]; ++k) {
+            const Pixel *in = &rows[size_t(vertical.first[y] + k) * dstWidth];
+            for (int x = 0; x < dstWidth; ++x)
+                line[x] = madd(line[x], in[x], weight[k]);
+        }
+
+        uint32_t *out = dst + size_t(y) * dstStride;
+        for (int x = 0; x < dstWidth; ++x)
+            out[x] = pack(line[x]);
+    }
+}
+
+void ImageScaler::fit(int width, int height, int size, int &fitWidth, int &fitHeight)
+{
+    fitWidth = width;
+    fitHeight = height;
+    if (width <= size && height <= size)
+        return;
+
+    if (width >= height) {
+        fitWidth = size;
+        fitHeight = int(double(height) * size / width + 0.5);
+    } else {
+        fitHeight = size;
+        fitWidth = int(double(width) * size / height + 0.5);
+    }
+    if (fitWidth < 1)
+        fitWidth = 1;
+    if (fitHeight < 1)
+        fitHeight = 1;
+}
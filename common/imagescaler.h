@@ -0,0 +1,49 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef IMAGESCALER_H
+#define IMAGESCALER_H
+
+#if !defined(__osf__)
+#include <inttypes.h>
+#else
+typedef unsigned char  uint8_t;
+typedef unsigned short uint16_t;
+typedef unsigned int   uint32_t;
+typedef unsigned long long uint64_t;
+#endif
+
+/**
+ * Scales premultiplied ARGB32 images, as QImage keeps them, for
+ * thumbnails.
+ *
+ * Big reductions first average blocks of pixels down to no less than
+ * twice the target size, then a separable Lanczos-3 filter does the
+ * rest.  Every pixel is filtered as one SSE2 vector of its four
+ * channels.  Strides are given in pixels.
+ */
+class ImageScaler
+{
+public:
+    static void scale(const uint32_t *src, int width, int height, int stride,
+                      uint32_t *dst, int dstWidth, int dstHeight, int dstStride);
+
+    /** Fits width x height into a size x size box, keeping the aspect. */
+    static void fit(int width, int height, int size, int &fitWidth, int &fitHeight);
+};
+
+#endif
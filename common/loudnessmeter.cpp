@@ -0,0 +1,554 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "loudnessmeter.h"
+
+#include <math.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// gating blocks are 4 (momentary) and 30 (short term) sub-blocks long
+static const int momentary_blocks = 4;
+static const int short_term_blocks = 30;
+static const size_t kept_blocks = short_term_blocks - 1;
+
+static const double absolute_gate = -70.0;
+static const double histogram_top = 5.0;
+static const int histogram_steps = 100;    // bins per LU
+static const int histogram_bins = int(histogram_top - absolute_gate) * histogram_steps;
+
+static inline double loudness(double energy)
+{
+    return -0.691 + 10.0 * log10(energy);
+}
+
+/**
+ * Gating blocks above the absolute gate, binned by loudness.  The energy
+ * of the blocks in each bin is kept as well so the relative gate can be
+ * computed exactly.
+ */
+struct LoudnessMeter::Histogram
+{
+    Histogram() : counts(histogram_bins, 0), energies(histogram_bins, 0.0) {}
+
+    void add(double energy)
+    {
+        double lufs = loudness(energy);
+        if (!(lufs >= absolute_gate))
+            return;
+        int bin = int((lufs - absolute_gate) * histogram_steps);
+        if (bin >= histogram_bins)
+            bin = histogram_bins - 1;
+        ++counts[bin];
+        energies[bin] += energy;
+    }
+
+    void add(const Histogram &other)
+    {
+        for (int i = 0; i < histogram_bins; ++i) {
+            counts[i] += other.counts[i];
+            energies[i] += other.energies[i];
+        }
+    }
+
+    int bin(double lufs) const
+    {
+        if (lufs <= absolute_gate)
+            return 0;
+        int bin = int(ceil((lufs - absolute_gate) * histogram_steps));
+        return bin < histogram_bins ? bin : histogram_bins;
+    }
+
+    // the mean energy of the blocks in bins from first on
+    double mean(int first, uint64_t *count = 0) const
+    {
+        uint64_t n = 0;
+        double sum = 0;
+        for (int i = first; i < histogram_bins; ++i) {
+            n += counts[i];
+            sum += energies[i];
+        }
+        if (count)
+            *count = n;
+        return n ? sum / n : 0;
+    }
+
+    std::vector<uint64_t> counts;
+    std::vector<double> energies;
+};
+
+/**
+ * The K-weighting filter of BS.1770: a high shelf followed by a high
+ * pass, as two biquads in transposed direct form II.  Channels are
+ * filtered in pairs, one per lane of an SSE2 register.
+ */
+class LoudnessMeter::Filter
+{
+public:
+    Filter(int sampleRate, int channels)
+        : m_channels(channels), m_pairs((channels + 1) / 2),
+          m_state(m_pairs * 4 * 2, 0.0)
+    {
+        // the analog prototypes of libebur128, bilinear transformed
+        double f0 = 1681.974450955533;
+        double gain = 3.999843853973347;
+        double q = 0.7071752369554196;
+        double k = tan(M_PI * f0 / sampleRate);
+        double vh = pow(10.0, gain / 20.0);
+        double vb = pow(vh, 0.4996667741545416);
+        double a0 = 1.0 + k / q + k * k;
+        m_b[0][0] = (vh + vb * k / q + k * k) / a0;
+        m_b[0][1] = 2.0 * (k * k - vh) / a0;
+        m_b[0][2] = (vh - vb * k / q + k * k) / a0;
+        m_a[0][0] = 2.0 * (k * k - 1.0) / a0;
+        m_a[0][1] = (1.0 - k / q + k * k) / a0;
+
+        f0 = 38.13547087602444;
+        q = 0.5003270373238773;
+        k = tan(M_PI * f0 / sampleRate);
+        a0 = 1.0 + k / q + k * k;
+        m_b[1][0] = 1.0;
+        m_b[1][1] = -2.0;
+        m_b[1][2] = 1.0;
+        m_a[1][0] = 2.0 * (k * k - 1.0) / a0;
+        m_a[1][1] = (1.0 - k / q + k * k) / a0;
+    }
+
+    // filters frames, adding the squared output of each channel to sums
+    void run(const float *samples, size_t frames, double *sums)
+    {
+        for (int pair = 0; pair < m_pairs; ++pair) {
+            const int channel = pair * 2;
+            const bool single = channel + 1 == m_channels;
+            double *z = &m_state[pair * 8];
+#ifdef __SSE2__
+            __m128d b0 = _mm_set1_pd(m_b[0][0]), b1 = _mm_set1_pd(m_b[0][1]);
+            __m128d b2 = _mm_set1_pd(m_b[0][2]), a1 = _mm_set1_pd(m_a[0][0]);
+            __m128d a2 = _mm_set1_pd(m_a[0][1]);
+            __m128d c1 = _mm_set1_pd(m_a[1][0]), c2 = _mm_set1_pd(m_a[1][1]);
+            __m128d s1 = _mm_loadu_pd(z), s2 = _mm_loadu_pd(z + 2);
+            __m128d t1 = _mm_loadu_pd(z + 4), t2 = _mm_loadu_pd(z + 6);
+            __m128d acc = _mm_setzero_pd();
+            const float *p = samples + channel;
+            for (size_t i = 0; i < frames; ++i, p += m_channels) {
+                __m128d x = single ? _mm_set_sd(p[0]) : _mm_set_pd(p[1], p[0]);
+                __m128d y = _mm_add_pd(_mm_mul_pd(b0, x), s1);
+                s1 = _mm_add_pd(_mm_sub_pd(_mm_mul_pd(b1, x), _mm_mul_pd(a1, y)), s2);
+                s2 = _mm_sub_pd(_mm_mul_pd(b2, x), _mm_mul_pd(a2, y));
+                // the high pass has b = 1, -2, 1
+                __m128d v = _mm_add_pd(y, t1);
+                t1 = _mm_sub_pd(_mm_sub_pd(t2, _mm_add_pd(y, y)), _mm_mul_pd(c1, v));
+                t2 = _mm_sub_pd(y, _mm_mul_pd(c2, v));
+                acc = _mm_add_pd(acc, _mm_mul_pd(v, v));
+            }
+            _mm_storeu_pd(z, s1);
+            _mm_storeu_pd(z + 2, s2);
+            _mm_storeu_pd(z + 4, t1);
+            _mm_storeu_pd(z + 6, t2);
+            double squares[2];
+            _mm_storeu_pd(squares, acc);
+#else
+            double squares[2] = { 0, 0 };
+            for (int lane = 0; lane < (single ? 1 : 2); ++lane) {
+                double s1 = z[lane], s2 = z[2 + lane];
+                double t1 = z[4 + lane], t2 = z[6 + lane];
+                const float *p = samples + channel + lane;
+                for (size_t i = 0; i < frames; ++i, p += m_channels) {
+                    double x = *p;
+                    double y = m_b[0][0] * x + s1;
+                    s1 = m_b[0][1] * x - m_a[0][0] * y + s2;
+                    s2 = m_b[0][2] * x - m_a[0][1] * y;
+                    double v = y + t1;
+                    t1 = -2.0 * y - m_a[1][0] * v + t2;
+                    t2 = y - m_a[1][1] * v;
+                    squares[lane] += v * v;
+                }
+                z[lane] = s1;
+                z[2 + lane] = s2;
+                z[4 + lane] = t1;
+                z[6 + lane] = t2;
+            }
+#endif
+            // keep long silences from decaying into denormals
+            for (int i = 0; i < 8; ++i)
+                if (fabs(z[i]) < 1e-30)
+                    z[i] = 0.0;
+
+            if (sums) {
+                sums[channel] += squares[0];
+                if (!single)
+                    sums[channel + 1] += squares[1];
+            }
+        }
+    }
+
+private:
+    int m_channels;
+    int m_pairs;
+    double m_b[2][3];
+    double m_a[2][2];
+    std::vector<double> m_state;
+};
+
+/**
+ * Estimates the true peak by oversampling with a polyphase windowed sinc
+ * interpolator of 12 taps per phase, as suggested by BS.1770 annex 2.
+ */
+class LoudnessMeter::PeakFilter
+{
+public:
+    enum { Taps = 12, Block = 1024 };
+
+    PeakFilter(int sampleRate, int channels)
+        : m_channels(channels),
+          m_factor(sampleRate < 96000 ? 4 : sampleRate < 192000 ? 2 : 1),
+          m_coefficients(m_factor * Taps),
+          m_history(channels, std::vector<float>(Taps - 1 + Block, 0.0f))
+    {
+        const int length = m_factor * Taps;
+        for (int phase = 0; phase < m_factor; ++phase) {
+            double sum = 0;
+            for (int k = 0; k < Taps; ++k) {
+                int n = phase + k * m_factor;
+                double t = (n - (length - 1) / 2.0) / m_factor;
+                double sinc = t == 0 ? 1.0 : sin(M_PI * t) / (M_PI * t);
+                double window = 0.5 - 0.5 * cos(2.0 * M_PI * (n + 0.5) / length);
+                m_coefficients[phase * Taps + Taps - 1 - k] = sinc * window;
+                sum += sinc * window;
+            }
+            // unity gain at DC for every phase
+            for (int k = 0; k < Taps; ++k)
+                m_coefficients[phase * Taps + k] /= sum;
+        }
+    }
+
+    // returns the highest absolute value of the oversampled signal
+    float run(const float *samples, size_t frames)
+    {
+        float peak = 0;
+        while (frames > 0) {
+            size_t count = frames < size_t(Block) ? frames : size_t(Block);
+            for (int channel = 0; channel < m_channels; ++channel) {
+                float *x = &m_history[channel][0];
+                for (size_t i = 0; i < count; ++i)
+                    x[Taps - 1 + i] = samples[i * m_channels + channel];
+                float p = m_factor == 1 ? scan(x + Taps - 1, count) : interpolate(x, count);
+                if (p > peak)
+                    peak = p;
+                memmove(x, x + count, (Taps - 1) * sizeof(float));
+            }
+            samples += count * m_channels;
+            frames -= count;
+        }
+        return peak;
+    }
+
+private:
+    static float scan(const float *x, size_t n)
+    {
+        float peak = 0;
+        for (size_t i = 0; i < n; ++i)
+            if (fabsf(x[i]) > peak)
+                peak = fabsf(x[i]);
+        return peak;
+    }
+
+    float interpolate(const float *x, size_t n) const
+    {
+        const float *h = &m_coefficients[0];
+        float peak = 0;
+#ifdef __SSE2__
+        const __m128 mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+        __m128 vpeak = _mm_setzero_ps();
+        for (size_t i = 0; i < n; ++i) {
+            const float *w = x + i;
+            __m128 x0 = _mm_loadu_ps(w), x1 = _mm_loadu_ps(w + 4);
+            __m128 x2 = _mm_loadu_ps(w + 8);
+            // four phases at a time, their dot products end up in one register
+            for (int phase = 0; phase < m_factor; phase += 4) {
+                __m128 d[4];
+                for (int j = 0; j < 4; ++j) {
+                    const float *c = h + (phase + (j < m_factor ? j : 0)) * Taps;
+                    d[j] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x0, _mm_loadu_ps(c)),
+                                                 _mm_mul_ps(x1, _mm_loadu_ps(c + 4))),
+                                      _mm_mul_ps(x2, _mm_loadu_ps(c + 8)));
+                }
+                // transpose and add: lane j holds the dot product of phase j
+                __m128 t0 = _mm_unpacklo_ps(d[0], d[1]), t1 = _mm_unpackhi_ps(d[0], d[1]);
+                __m128 t2 = _mm_unpacklo_ps(d[2], d[3]), t3 = _mm_unpackhi_ps(d[2], d[3]);
+                __m128 sum = _mm_add_ps(_mm_add_ps(_mm_movelh_ps(t0, t2), _mm_movehl_ps(t2, t0)),
+                                        _mm_add_ps(_mm_movelh_ps(t1, t3), _mm_movehl_ps(t3, t1)));
+                vpeak = _mm_max_ps(vpeak, _mm_and_ps(sum, mask));
+            }
+        }
+        float peaks[4];
+        _mm_storeu_ps(peaks, vpeak);
+        for (int j = 0; j < 4; ++j)
+            if (peaks[j] > peak)
+                peak = peaks[j];
+#else
+        for (size_t i = 0; i < n; ++i) {
+            const float *w = x + i;
+            for (int phase = 0; phase < m_factor; ++phase) {
+                const float *c = h + phase * Taps;
+                float sum = 0;
+                for (int k = 0; k < Taps; ++k)
+                    sum += c[k] * w[k];
+                if (fabsf(sum) > peak)
+                    peak = fabsf(sum);
+            }
+        }
+#endif
+        return peak;
+    }
+
+    int m_channels;
+    int m_factor;
+    std::vector<float> m_coefficients;
+    std::vector<std::vector<float> > m_history;
+};
+
+LoudnessMeter::LoudnessMeter(int sampleRate, int channels)
+    : m_sampleRate(sampleRate), m_channels(channels),
+      m_subBlockFrames((sampleRate + 5) / 10),
+      m_filter(new Filter(sampleRate, channels)),
+      m_peak(new PeakFilter(sampleRate, channels)),
+      m_weights(channels, 1.0),
+      m_partial(channels, 0.0), m_partialFrames(0),
+      m_subBlocks(0),
+      m_momentary(new Histogram), m_shortTerm(new Histogram),
+      m_truePeak(0), m_silence(0.001f),
+      m_frames(0), m_firstSound(0), m_lastSound(0), m_sound(false)
+{
+    // surround channels are weighted by +1.5 dB and LFE not at all,
+    // assuming the usual L R C (LFE) Ls Rs order of WAV and FLAC
+    if (channels == 5) {
+        m_weights[3] = m_weights[4] = 1.41;
+    } else if (channels == 6) {
+        m_weights[3] = 0.0;
+        m_weights[4] = m_weights[5] = 1.41;
+    }
+}
+
+LoudnessMeter::~LoudnessMeter()
+{
+    delete m_filter;
+    delete m_peak;
+    delete m_momentary;
+    delete m_shortTerm;
+}
+
+void LoudnessMeter::setSilenceThreshold(double dbfs)
+{
+    m_silence = pow(10.0, dbfs / 20.0);
+}
+
+void LoudnessMeter::prime(const float *samples, size_t frames)
+{
+    run(samples, frames, false);
+}
+
+void LoudnessMeter::process(const float *samples, size_t frames)
+{
+    run(samples, frames, true);
+}
+
+void LoudnessMeter::run(const float *samples, size_t frames, bool measure)
+{
+    if (!measure) {
+        m_filter->run(samples, frames, 0);
+        m_peak->run(samples, frames);
+        return;
+    }
+
+    float peak = m_peak->run(samples, frames);
+    if (peak > m_truePeak)
+        m_truePeak = peak;
+
+    // the first and last frame with a sample above the silence threshold
+    const size_t count = frames * m_channels;
+    size_t first = 0;
+#ifdef __SSE2__
+    const __m128 mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    const __m128 threshold = _mm_set1_ps(m_silence);
+    while (first + 4 <= count &&
+           !_mm_movemask_ps(_mm_cmpge_ps(_mm_and_ps(_mm_loadu_ps(samples + first), mask),
+                                         threshold)))
+        first += 4;
+#endif
+    while (first < count && fabsf(samples[first]) < m_silence)
+        ++first;
+    if (first < count) {
+        size_t last = count - 1;
+        while (fabsf(samples[last]) < m_silence)
+            --last;
+        if (!m_sound)
+            m_firstSound = m_frames + first / m_channels;
+        m_lastSound = m_frames + last / m_channels;
+        m_sound = true;
+    }
+    m_frames += frames;
+
+    // filter in pieces that end on sub-block boundaries
+    while (frames > 0) {
+        size_t piece = m_subBlockFrames - m_partialFrames;
+        if (piece > frames)
+            piece = frames;
+        m_filter->run(samples, piece, &m_partial[0]);
+        m_partialFrames += piece;
+        samples += piece * m_channels;
+        frames -= piece;
+
+        if (m_partialFrames == m_subBlockFrames) {
+            double energy = 0;
+            for (int i = 0; i < m_channels; ++i) {
+                energy += m_weights[i] * m_partial[i];
+                m_partial[i] = 0;
+            }
+            m_partialFrames = 0;
+            addSubBlock(energy / m_subBlockFrames);
+        }
+    }
+}
+
+void LoudnessMeter::addSubBlock(double energy)
+{
+    // complete the windows that end with this sub-block
+    m_tail.push_back(energy);
+    addWindows(&m_tail[0], m_tail.size(), m_tail.size() - 1, m_tail.size());
+
+    if (m_tail.size() > kept_blocks)
+        m_tail.erase(m_tail.begin());
+    if (m_head.size() < kept_blocks)
+        m_head.push_back(energy);
+    ++m_subBlocks;
+}
+
+/**
+ * Adds the gating windows that end at the sub-blocks from first to count
+ * in energies and start before the sub-block before, as far as energies
+ * holds all of their sub-blocks.
+ */
+void LoudnessMeter::addWindows(const double *energies, size_t count,
+                               size_t first, size_t before)
+{
+    for (size_t end = first; end < count; ++end) {
+        if (end + 1 >= size_t(momentary_blocks) && end + 1 - momentary_blocks < before) {
+            double sum = 0;
+            for (size_t i = end + 1 - momentary_blocks; i <= end; ++i)
+                sum += energies[i];
+            m_momentary->add(sum / momentary_blocks);
+        }
+        if (end + 1 >= size_t(short_term_blocks) && end + 1 - short_term_blocks < before) {
+            double sum = 0;
+            for (size_t i = end + 1 - short_term_blocks; i <= end; ++i)
+                sum += energies[i];
+            m_shortTerm->add(sum / short_term_blocks);
+        }
+    }
+}
+
+void LoudnessMeter::merge(const LoudnessMeter &next)
+{
+    // the windows that straddle the two segments, next has already
+    // counted those that lie within it
+    std::vector<double> seam(m_tail);
+    size_t joint = seam.size();
+    seam.insert(seam.end(), next.m_head.begin(), next.m_head.end());
+    if (joint > 0 && seam.size() > joint)
+        addWindows(&seam[0], seam.size(), joint, joint);
+
+    m_momentary->add(*next.m_momentary);
+    m_shortTerm->add(*next.m_shortTerm);
+
+    for (size_t i = 0; i < next.m_head.size() && m_head.size() < kept_blocks; ++i)
+        m_head.push_back(next.m_head[i]);
+    m_tail.insert(m_tail.end(), next.m_tail.begin(), next.m_tail.end());
+    if (m_tail.size() > kept_blocks)
+        m_tail.erase(m_tail.begin(), m_tail.end() - kept_blocks);
+    m_subBlocks += next.m_subBlocks;
+
+    // a segment ends on a sub-block boundary, all but the last one do
+    m_partial = next.m_partial;
+    m_partialFrames = next.m_partialFrames;
+
+    if (next.m_truePeak > m_truePeak)
+        m_truePeak = next.m_truePeak;
+
+    if (next.m_sound) {
+        if (!m_sound)
+            m_firstSound = m_frames + next.m_firstSound;
+        m_lastSound = m_frames + next.m_lastSound;
+        m_sound = true;
+    }
+    m_frames += next.m_frames;
+}
+
+LoudnessMeter::Result LoudnessMeter::result() const
+{
+    Result result;
+
+    // integrated: the mean of the blocks above the relative gate, which
+    // is 10 LU below the mean of those above the absolute gate
+    double mean = m_momentary->mean(0);
+    if (mean > 0)
+        mean = m_momentary->mean(m_momentary->bin(loudness(mean) - 10.0));
+    result.integrated = mean > 0 ? loudness(mean) : -HUGE_VAL;
+
+    // range: the spread between the 10th and 95th percentile of the short
+    // term loudness, above a relative gate of 20 LU
+    result.range = 0;
+    mean = m_shortTerm->mean(0);
+    if (mean > 0) {
+        int gate = m_shortTerm->bin(loudness(mean) - 20.0);
+        uint64_t count;
+        m_shortTerm->mean(gate, &count);
+        if (count > 0) {
+            uint64_t low = uint64_t(count * 0.10), high = uint64_t(count * 0.95);
+            uint64_t seen = 0;
+            int lowBin = -1, highBin = -1;
+            for (int i = gate; i < histogram_bins && highBin < 0; ++i) {
+                seen += m_shortTerm->counts[i];
+                if (lowBin < 0 && seen > low)
+                    lowBin = i;
+                if (seen > high)
+                    highBin = i;
+            }
+            if (highBin < 0)
+                highBin = histogram_bins - 1;
+            result.range = double(highBin - lowBin) / histogram_steps;
+        }
+    }
+
+    result.truePeak = m_truePeak > 0 ? 20.0 * log10(m_truePeak) : -HUGE_VAL;
+
+    if (m_sound) {
+        result.leadingSilence = double(m_firstSound) / m_sampleRate;
+        result.trailingSilence = double(m_frames - m_lastSound - 1) / m_sampleRate;
+    } else {
+        result.leadingSilence = result.trailingSilence = double(m_frames) / m_sampleRate;
+    }
+
+    return result;
+}
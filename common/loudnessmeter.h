@@ -0,0 +1,136 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef LOUDNESSMETER_H
+#define LOUDNESSMETER_H
+
+#include <stddef.h>
+#include <vector>
+
+#if !defined(__osf__)
+#include <inttypes.h>
+#else
+typedef unsigned char  uint8_t;
+typedef unsigned short uint16_t;
+typedef unsigned int   uint32_t;
+typedef unsigned long long uint64_t;
+#endif
+
+/**
+ * Measures loudness as specified by EBU R 128 (ITU-R BS.1770-4): the
+ * integrated loudness, the loudness range, the true peak, and how long
+ * the signal is silent at its start and end.
+ *
+ * Samples are fed in one pass as interleaved floats.  The K-weighting
+ * filters run on pairs of channels in SSE2 registers; the gating blocks
+ * are built from 100 ms sub-blocks and only kept as histograms, so the
+ * memory used doesn't grow with the length of the signal.
+ *
+ * Long signals can be measured in parallel: every thread measures a
+ * consecutive segment with its own meter, and the meters are merged in
+ * order at the end.  A segment should start at a multiple of
+ * subBlockFrames(), and prime() should be given the frames just before
+ * it so the filters are in the same state as in a single pass.
+ */
+class LoudnessMeter
+{
+public:
+    struct Result
+    {
+        double integrated;       // LUFS, -HUGE_VAL when everything is gated
+        double range;            // LU
+        double truePeak;         // dBTP, -HUGE_VAL for digital silence
+        double leadingSilence;   // seconds
+        double trailingSilence;  // seconds
+    };
+
+    LoudnessMeter(int sampleRate, int channels);
+    ~LoudnessMeter();
+
+    int sampleRate() const { return m_sampleRate; }
+    int channels() const { return m_channels; }
+
+    /** The length of a sub-block, segments should be a multiple of it. */
+    int subBlockFrames() const { return m_subBlockFrames; }
+
+    /** Frames that should be given to prime() before a segment. */
+    int primeFrames() const { return m_subBlockFrames * 2; }
+
+    /**
+     * Runs the filters over the frames preceding the segment this meter
+     * measures, without measuring them.
+     */
+    void prime(const float *samples, size_t frames);
+
+    /** Measures frames of interleaved samples in the range -1..1. */
+    void process(const float *samples, size_t frames);
+
+    /**
+     * Appends the measurements of next, which has measured the segment
+     * directly after the one of this meter.
+     */
+    void merge(const LoudnessMeter &next);
+
+    /**
+     * Samples below threshold (dBFS) in all channels count as silence;
+     * the default is -60 dBFS.
+     */
+    void setSilenceThreshold(double dbfs);
+
+    Result result() const;
+
+private:
+    LoudnessMeter(const LoudnessMeter &);
+    LoudnessMeter &operator=(const LoudnessMeter &);
+
+    struct Histogram;
+    class Filter;
+    class PeakFilter;
+
+    void run(const float *samples, size_t frames, bool measure);
+    void addSubBlock(double energy);
+    void addWindows(const double *energies, size_t count, size_t first, size_t before);
+
+    int m_sampleRate;
+    int m_channels;
+    int m_subBlockFrames;
+
+    Filter *m_filter;
+    PeakFilter *m_peak;
+    std::vector<double> m_weights;
+
+    // the sub-block being filled
+    std::vector<double> m_partial;
+    int m_partialFrames;
+
+    // all sub-blocks so far, only the first and last 29 are kept
+    uint64_t m_subBlocks;
+    std::vector<double> m_head;
+    std::vector<double> m_tail;
+
+    Histogram *m_momentary;
+    Histogram *m_shortTerm;
+    float m_truePeak;
+
+    float m_silence;
+    uint64_t m_frames;
+    uint64_t m_firstSound;
+    uint64_t m_lastSound;
+    bool m_sound;
+};
+
+#endif
@@ -0,0 +1,219 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "mappedinput.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace {
+
+int madviseFlag(InputAdvice advice)
+{
+    switch (advice) {
+    case SequentialAccess:
+        return MADV_SEQUENTIAL;
+    case RandomAccess:
+        return MADV_RANDOM;
+    case WillNeedAccess:
+        return MADV_WILLNEED;
+    default:
+        return MADV_NORMAL;
+    }
+}
+
+int fadviseFlag(InputAdvice advice)
+{
+    switch (advice) {
+    case SequentialAccess:
+        return POSIX_FADV_SEQUENTIAL;
+    case RandomAccess:
+        return POSIX_FADV_RANDOM;
+    case WillNeedAccess:
+        return POSIX_FADV_WILLNEED;
+    default:
+        return POSIX_FADV_NORMAL;
+    }
+}
+
+size_t preadAll(int fd, void *data, size_t length, uint64_t offset)
+{
+    size_t done = 0;
+    while (done < length) {
+        ssize_t got = pread(fd, static_cast<char *>(data) + done, length - done, offset + done);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            break;
+        done += got;
+    }
+    return done;
+}
+
+}
+
+MappedRange::MappedRange(int fd, uint64_t offset, uint64_t length, InputAdvice advice)
+    : m_map(MAP_FAILED), m_mapped(0), m_data(0), m_length(length)
+{
+    // mmap wants a page aligned offset
+    const uint64_t page = sysconf(_SC_PAGESIZE);
+    const uint64_t start = offset - offset % page;
+    const uint64_t mapped = offset - start + length;
+    m_mapped = mapped;
+    if (length == 0 || m_mapped != mapped || m_length != length)   // too big for a 32 bit address space
+        return;
+
+    m_map = mmap(0, m_mapped, PROT_READ, MAP_SHARED, fd, start);
+    if (m_map == MAP_FAILED)
+        return;
+    madvise(m_map, m_mapped, madviseFlag(advice));
+    m_data = static_cast<const uint8_t *>(m_map) + (offset - start);
+}
+
+MappedRange::~MappedRange()
+{
+    if (m_map != MAP_FAILED)
+        munmap(m_map, m_mapped);
+}
+
+void MappedRange::advise(InputAdvice advice)
+{
+    if (m_map != MAP_FAILED)
+        madvise(m_map, m_mapped, madviseFlag(advice));
+}
+
+MappedInput::MappedInput()
+    : m_fd(-1), m_ownFd(false), m_size(0), m_map(0)
+{
+}
+
+MappedInput::~MappedInput()
+{
+    close();
+}
+
+bool MappedInput::open(const char *path)
+{
+    close();
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    if (!open(fd)) {
+        ::close(fd);
+        return false;
+    }
+    m_ownFd = true;
+    return true;
+}
+
+bool MappedInput::open(int fd)
+{
+    close();
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+        return false;
+
+    m_fd = fd;
+    m_ownFd = false;
+    m_size = st.st_size;
+    if (S_ISREG(st.st_mode))
+        map();
+    return true;
+}
+
+bool MappedInput::map()
+{
+    const size_t length = m_size;
+    if (!length || length != m_size)
+        return false;
+
+    void *map = mmap(0, length, PROT_READ, MAP_SHARED, m_fd, 0);
+    if (map == MAP_FAILED)
+        return false;
+    m_map = static_cast<const uint8_t *>(map);
+    return true;
+}
+
+void MappedInput::close()
+{
+    if (m_map)
+        munmap(const_cast<uint8_t *>(m_map), m_size);
+    if (m_fd >= 0 && m_ownFd)
+        ::close(m_fd);
+    m_fd = -1;
+    m_ownFd = false;
+    m_size = 0;
+    m_map = 0;
+}
+
+void MappedInput::advise(InputAdvice advice, uint64_t offset, uint64_t length)
+{
+    if (m_fd < 0 || offset >= m_size)
+        return;
+    if (!length || length > m_size - offset)
+        length = m_size - offset;
+
+    if (!m_map) {
+        posix_fadvise(m_fd, offset, length, fadviseFlag(advice));
+        return;
+    }
+    const uint64_t page = sysconf(_SC_PAGESIZE);
+    const uint64_t start = offset - offset % page;
+    madvise(const_cast<uint8_t *>(m_map) + start, offset - start + length, madviseFlag(advice));
+}
+
+InputSpan MappedInput::span(uint64_t offset, size_t length)
+{
+    if (m_fd < 0 || offset >= m_size)
+        return InputSpan();
+    if (length > m_size - offset)
+        length = m_size - offset;
+
+    if (m_map)
+        return InputSpan(m_map + offset, length);
+    if (!length)
+        return InputSpan();
+
+    uint8_t *buffer = m_buffer.reserve(length);
+    return InputSpan(buffer, preadAll(m_fd, buffer, length, offset));
+}
+
+size_t MappedInput::read(uint64_t offset, void *data, size_t length)
+{
+    if (m_fd < 0 || offset >= m_size)
+        return 0;
+    if (length > m_size - offset)
+        length = m_size - offset;
+
+    if (!m_map)
+        return preadAll(m_fd, data, length, offset);
+    memcpy(data, m_map + offset, length);
+    return length;
+}
+
+PushParser::Status MappedInput::parse(PushParser &parser)
+{
+    while (parser.status() == PushParser::Continue) {
+        const InputSpan data = span(parser.offset(), parser.need());
+        parser.parse(data.data(), data.length());
+    }
+    return parser.status();
+}
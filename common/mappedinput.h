@@ -0,0 +1,148 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef MAPPEDINPUT_H
+#define MAPPEDINPUT_H
+
+#include <stddef.h>
+
+#include "pushparser.h"
+#include "scratcharena.h"
+
+/**
+ * Bytes of a file that were mapped or read, which can't be read past:
+ * has() tells whether a field is all there, and sub() gives a part of
+ * the span that is cut short at its end.
+ */
+class InputSpan
+{
+public:
+    InputSpan() : m_data(0), m_length(0) {}
+    InputSpan(const uint8_t *data, size_t length) : m_data(data), m_length(length) {}
+
+    const uint8_t *data() const { return m_data; }
+    size_t length() const { return m_length; }
+    bool isEmpty() const { return !m_length; }
+
+    bool has(size_t offset, size_t length) const
+    {
+        return offset <= m_length && length <= m_length - offset;
+    }
+    InputSpan sub(size_t offset, size_t length) const
+    {
+        if (offset > m_length)
+            return InputSpan();
+        return InputSpan(m_data + offset, length < m_length - offset ? length : m_length - offset);
+    }
+
+private:
+    const uint8_t *m_data;
+    size_t m_length;
+};
+
+/** How a mapping will be read, for the kernel to read ahead by. */
+enum InputAdvice {
+    NormalAccess,
+    SequentialAccess,
+    RandomAccess,
+    WillNeedAccess
+};
+
+/**
+ * A read only mapping of part of a file, for analyses that go over
+ * all of it, such as the payload hash and the waveform.  The mapping
+ * fails rather than falling back to reading when it is too big for the
+ * address space, and data() is 0 then.
+ */
+class MappedRange
+{
+public:
+    MappedRange(int fd, uint64_t offset, uint64_t length, InputAdvice advice);
+    ~MappedRange();
+
+    const uint8_t *data() const { return m_data; }
+    InputSpan span() const { return InputSpan(m_data, m_data ? m_length : 0); }
+
+    /** Tells the kernel about the range again, as with WillNeedAccess. */
+    void advise(InputAdvice advice);
+
+private:
+    MappedRange(const MappedRange &);
+    MappedRange &operator=(const MappedRange &);
+
+    void *m_map;
+    size_t m_mapped;
+    const uint8_t *m_data;
+    size_t m_length;
+};
+
+/**
+ * The one way the analyzers read a file: all of it is mapped, and what
+ * they ask for is handed out as spans of the mapping, without copying.
+ * Files that can't be mapped, as on some network file systems or when
+ * they are too big for the address space, are read with pread() into a
+ * buffer instead, which a span then points into.  That buffer is taken
+ * from the thread's ScratchArena while a scope is open.
+ *
+ * Files are mapped shared and read only, as the other mappings here
+ * are; like them, a file that is cut short while it is read raises
+ * SIGBUS for what is past its new end.
+ */
+class MappedInput
+{
+public:
+    MappedInput();
+    ~MappedInput();
+
+    bool open(const char *path);
+    /** Reads fd, which stays open when the input is closed. */
+    bool open(int fd);
+    void close();
+
+    bool isOpen() const { return m_fd >= 0; }
+    bool isMapped() const { return m_map != 0; }
+    int handle() const { return m_fd; }
+    uint64_t size() const { return m_size; }
+
+    /** Tells the kernel how length bytes at offset will be read; 0 is to the end. */
+    void advise(InputAdvice advice, uint64_t offset = 0, uint64_t length = 0);
+
+    /**
+     * Up to length bytes at offset, fewer at the end of the file, which
+     * stay valid until the next span() when the file isn't mapped.
+     */
+    InputSpan span(uint64_t offset, size_t length);
+    /** Copies up to length bytes at offset, and tells how many. */
+    size_t read(uint64_t offset, void *data, size_t length);
+
+    /** Runs parser over the input, handing it spans of what it asks for. */
+    PushParser::Status parse(PushParser &parser);
+
+private:
+    MappedInput(const MappedInput &);
+    MappedInput &operator=(const MappedInput &);
+
+    bool map();
+
+    int m_fd;
+    bool m_ownFd;
+    uint64_t m_size;
+    const uint8_t *m_map;
+    ScratchBuffer m_buffer;
+};
+
+#endif
@@ -0,0 +1,647 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "metadatacache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "payloadhash.h"
+
+// "KMDC", then the version of the format, all little endian
+static const uint32_t cache_magic = 0x43444d4b;
+static const uint32_t cache_version = 2;
+static const uint64_t cache_header = 16;
+
+// a record is its length and checksum, the key, the fingerprint, the
+// analyzer, its settings, when it was written, the analyzer's version and
+// request, and the lengths of the path and payload that follow; records
+// are padded to eight bytes
+static const uint64_t record_header = 88;
+static const uint64_t record_max = 64 << 20;
+
+// below this size leftovers aren't worth rewriting the cache for
+static const uint64_t compact_threshold = 4 << 20;
+
+// how much of either end of a file goes into its fingerprint
+static const uint64_t fingerprint_span = 64 << 10;
+
+// how long compaction keeps the records of files that went away, in case
+// they turn up elsewhere
+static const int64_t moved_grace = 30 * 24 * 3600;
+
+namespace {
+
+inline void put32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+inline void put64(uint8_t *p, uint64_t v)
+{
+    put32(p, uint32_t(v));
+    put32(p + 4, uint32_t(v >> 32));
+}
+
+inline uint32_t get32(const uint8_t *p)
+{
+    return uint32_t(p[0]) | (uint32_t(p[1]) << 8) |
+           (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24);
+}
+
+inline uint64_t get64(const uint8_t *p)
+{
+    return uint64_t(get32(p)) | (uint64_t(get32(p + 4)) << 32);
+}
+
+bool readAt(int fd, void *data, size_t length, uint64_t offset)
+{
+    char *p = static_cast<char *>(data);
+    while (length > 0) {
+        ssize_t got = pread(fd, p, length, offset);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return false;
+        p += got;
+        offset += got;
+        length -= got;
+    }
+    return true;
+}
+
+bool writeAll(int fd, const void *data, size_t length)
+{
+    const char *p = static_cast<const char *>(data);
+    while (length > 0) {
+        ssize_t done = write(fd, p, length);
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done <= 0)
+            return false;
+        p += done;
+        length -= done;
+    }
+    return true;
+}
+
+uint32_t checksum(const uint8_t *data, size_t length)
+{
+    PayloadHash hash;
+    hash.update(data, length);
+    return uint32_t(hash.digest());
+}
+
+struct Record
+{
+    MetadataCache::Key key;
+    uint64_t fingerprint;
+    uint64_t analyzer;
+    uint64_t settings;
+    int64_t written;
+    uint32_t version;
+    uint32_t what;
+    const uint8_t *path;
+    uint32_t pathLength;
+    const uint8_t *payload;
+    uint32_t payloadLength;
+};
+
+void decode(const uint8_t *p, Record &record)
+{
+    record.key.device = get64(p + 8);
+    record.key.inode = get64(p + 16);
+    record.key.mtime = int64_t(get64(p + 24));
+    record.key.size = get64(p + 32);
+    record.fingerprint = get64(p + 40);
+    record.analyzer = get64(p + 48);
+    record.settings = get64(p + 56);
+    record.written = int64_t(get64(p + 64));
+    record.version = get32(p + 72);
+    record.what = get32(p + 76);
+    record.pathLength = get32(p + 80);
+    record.payloadLength = get32(p + 84);
+    record.path = p + record_header;
+    record.payload = record.path + record.pathLength;
+}
+
+/**
+ * The length of the whole record at p, or 0 if it is torn.  Appends only
+ * ever leave a record short, so its contents are left to intact().
+ */
+uint64_t check(const uint8_t *p, uint64_t available)
+{
+    if (available < record_header)
+        return 0;
+    const uint64_t length = get32(p);
+    if (length < record_header || length > available || length > record_max || length % 8)
+        return 0;
+    if (uint64_t(get32(p + 80)) + get32(p + 84) > length - record_header)
+        return 0;
+    return length;
+}
+
+/** Whether the record at p, which check() took, is undamaged. */
+bool intact(const uint8_t *p)
+{
+    return checksum(p + 8, get32(p) - 8) == get32(p + 4);
+}
+
+void encode(const Record &record, std::vector<uint8_t> &out)
+{
+    const uint64_t length = (record_header + record.pathLength + record.payloadLength + 7) & ~uint64_t(7);
+    out.assign(length, 0);
+    uint8_t *p = &out[0];
+    put32(p, uint32_t(length));
+    put64(p + 8, record.key.device);
+    put64(p + 16, record.key.inode);
+    put64(p + 24, uint64_t(record.key.mtime));
+    put64(p + 32, record.key.size);
+    put64(p + 40, record.fingerprint);
+    put64(p + 48, record.analyzer);
+    put64(p + 56, record.settings);
+    put64(p + 64, uint64_t(record.written));
+    put32(p + 72, record.version);
+    put32(p + 76, record.what);
+    put32(p + 80, record.pathLength);
+    put32(p + 84, record.payloadLength);
+    if (record.pathLength)
+        memcpy(p + record_header, record.path, record.pathLength);
+    if (record.payloadLength)
+        memcpy(p + record_header + record.pathLength, record.payload, record.payloadLength);
+    put32(p + 4, checksum(p + 8, length - 8));
+}
+
+void header(uint8_t *p)
+{
+    memset(p, 0, cache_header);
+    put32(p, cache_magic);
+    put32(p + 4, cache_version);
+}
+
+bool statKey(const struct stat &st, MetadataCache::Key &key)
+{
+    key.device = st.st_dev;
+    key.inode = st.st_ino;
+#if defined(__APPLE__)
+    key.mtime = int64_t(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+    key.mtime = int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+    key.size = st.st_size;
+    return S_ISREG(st.st_mode);
+}
+
+}
+
+bool MetadataCache::Key::operator==(const Key &other) const
+{
+    return device == other.device && inode == other.inode &&
+           mtime == other.mtime && size == other.size;
+}
+
+bool MetadataCache::Slot::operator<(const Slot &other) const
+{
+    if (inode != other.inode)
+        return inode < other.inode;
+    if (device != other.device)
+        return device < other.device;
+    if (analyzer != other.analyzer)
+        return analyzer < other.analyzer;
+    return what < other.what;
+}
+
+MetadataCache::MetadataCache(const std::string &path, const std::string &analyzer,
+                             uint32_t version, uint64_t settings)
+    : m_path(path), m_loaded(false), m_version(version), m_settings(settings),
+      m_inode(0), m_map(0), m_mapped(0), m_scanned(0), m_live(0), m_dead(0)
+{
+    PayloadHash hash;
+    hash.update(analyzer.data(), analyzer.size());
+    m_analyzer = hash.digest();
+}
+
+MetadataCache::~MetadataCache()
+{
+    unmap();
+}
+
+bool MetadataCache::key(const char *path, Key &key)
+{
+    struct stat st;
+    return stat(path, &st) == 0 && statKey(st, key);
+}
+
+bool MetadataCache::fingerprint(const char *path, uint64_t size, uint64_t &fingerprint)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    // the ends are where tags get rewritten and where truncated or
+    // appended files differ, and both are two reads away
+    const uint64_t head = size < fingerprint_span ? size : fingerprint_span;
+    const uint64_t tail = size - head < fingerprint_span ? size - head : fingerprint_span;
+    std::vector<uint8_t> data(8 + head + tail);
+    put64(&data[0], size);
+    bool ok = readAt(fd, &data[8], head, 0) &&
+              readAt(fd, &data[8 + head], tail, size - tail);
+    close(fd);
+
+    if (ok) {
+        PayloadHash hash;
+        hash.update(&data[0], data.size());
+        fingerprint = hash.digest();
+    }
+    return ok;
+}
+
+void MetadataCache::unmap()
+{
+    if (m_map)
+        munmap(const_cast<uint8_t *>(m_map), m_mapped);
+    m_map = 0;
+    m_mapped = 0;
+    m_scanned = 0;
+    m_inode = 0;
+    m_index.clear();
+    m_fingerprints.clear();
+    m_versions.clear();
+    m_live = 0;
+    m_dead = 0;
+}
+
+/**
+ * Maps and indexes the cache the first time it is looked in, rather than
+ * whenever a plugin is loaded, and compacts it if that is worth it.
+ */
+bool MetadataCache::load()
+{
+    if (!m_loaded) {
+        m_loaded = true;
+        if (refresh() && needsCompaction())
+            compact();
+    }
+    return m_map || refresh();
+}
+
+/**
+ * Brings the mapping up to date with the file, which other processes may
+ * have appended to or replaced by a compacted one since.
+ */
+bool MetadataCache::refresh()
+{
+    int fd = open(m_path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        unmap();
+        return false;
+    }
+
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0;
+    // a torn record cut off by another process may have been mapped
+    if (ok && (uint64_t(st.st_ino) != m_inode || uint64_t(st.st_size) < m_mapped))
+        unmap();
+
+    if (ok && uint64_t(st.st_size) > m_mapped) {
+        // the file only ever grows, so the old mapping is a prefix of the
+        // new one and what was scanned stays valid
+        void *map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            unmap();
+            ok = false;
+        } else {
+            if (m_map)
+                munmap(const_cast<uint8_t *>(m_map), m_mapped);
+            m_map = static_cast<const uint8_t *>(map);
+            m_mapped = st.st_size;
+            m_inode = st.st_ino;
+            madvise(map, m_mapped, MADV_RANDOM);
+        }
+    }
+    close(fd);
+
+    return ok && m_map && scan();
+}
+
+/**
+ * Indexes the records appended since the last scan, by their headers
+ * alone, so that only the records looked up are read through.
+ */
+bool MetadataCache::scan()
+{
+    if (m_scanned == 0) {
+        if (m_mapped < cache_header || get32(m_map) != cache_magic ||
+            get32(m_map + 4) != cache_version)
+            return false;
+        m_scanned = cache_header;
+    }
+
+    while (m_scanned < m_mapped) {
+        const uint64_t length = check(m_map + m_scanned, m_mapped - m_scanned);
+        if (!length)
+            break;
+
+        Record record;
+        decode(m_map + m_scanned, record);
+        const Slot slot = { record.key.device, record.key.inode, record.analyzer, record.what };
+        std::map<Slot, uint64_t>::iterator it = m_index.find(slot);
+        if (it != m_index.end()) {
+            const uint64_t old = get32(m_map + it->second);
+            m_dead += old;
+            m_live -= old;
+            it->second = m_scanned;
+        } else {
+            m_index.insert(std::make_pair(slot, m_scanned));
+        }
+        m_live += length;
+
+        if (record.fingerprint) {
+            const Slot moved = { 0, record.fingerprint, record.analyzer, record.what };
+            m_fingerprints[moved] = m_scanned;
+        }
+
+        uint32_t &newest = m_versions[record.analyzer];
+        if (record.version > newest)
+            newest = record.version;
+
+        m_scanned += length;
+    }
+    return true;
+}
+
+bool MetadataCache::needsCompaction() const
+{
+    return m_mapped > compact_threshold && m_dead > m_live;
+}
+
+bool MetadataCache::lookup(const Key &key, uint32_t what, std::string &payload)
+{
+    const Slot slot = { key.device, key.inode, m_analyzer, what };
+    return find(m_index, slot, key, 0, payload, 0);
+}
+
+bool MetadataCache::lookup(const Key &key, uint64_t fingerprint, uint32_t what,
+                           std::string &payload)
+{
+    const Slot slot = { 0, fingerprint, m_analyzer, what };
+    return fingerprint && find(m_fingerprints, slot, key, fingerprint, payload, 0);
+}
+
+bool MetadataCache::lookup(const Key &key, uint64_t fingerprint, uint32_t what,
+                           std::string &payload, std::string &path)
+{
+    const Slot slot = { 0, fingerprint, m_analyzer, what };
+    return fingerprint && find(m_fingerprints, slot, key, fingerprint, payload, &path);
+}
+
+bool MetadataCache::lookupEarlier(const Key &key, uint32_t what, Key &earlier,
+                                  std::string &payload)
+{
+    const Slot slot = { key.device, key.inode, m_analyzer, what };
+    if (!load())
+        return false;
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        if (attempt && !refresh())
+            return false;
+
+        std::map<Slot, uint64_t>::const_iterator it = m_index.find(slot);
+        if (it == m_index.end() || !intact(m_map + it->second))
+            continue;
+
+        Record record;
+        decode(m_map + it->second, record);
+        if (record.key.size <= key.size && record.key.mtime <= key.mtime &&
+            record.version == m_version && record.settings == m_settings) {
+            earlier = record.key;
+            payload.assign(reinterpret_cast<const char *>(record.payload), record.payloadLength);
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Looks for slot in index, which is m_index or m_fingerprints.  Without
+ * a fingerprint the record must be of the file with key; with one, of a
+ * file with that fingerprint, size and modification time, which a move
+ * or a copy that keeps times leaves alone but an edit doesn't.
+ */
+bool MetadataCache::find(const std::map<Slot, uint64_t> &index, const Slot &slot,
+                         const Key &key, uint64_t fingerprint, std::string &payload,
+                         std::string *path)
+{
+    if (!load())
+        return false;
+    // the second time round with whatever other processes have put there
+    // meanwhile
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        if (attempt && !refresh())
+            return false;
+
+        std::map<Slot, uint64_t>::const_iterator it = index.find(slot);
+        if (it == index.end() || !intact(m_map + it->second))
+            continue;
+
+        Record record;
+        decode(m_map + it->second, record);
+        const bool same = fingerprint
+                        ? record.fingerprint == fingerprint && record.key.size == key.size &&
+                          record.key.mtime == key.mtime
+                        : record.key == key;
+        if (same && record.version == m_version && record.settings == m_settings) {
+            payload.assign(reinterpret_cast<const char *>(record.payload), record.payloadLength);
+            if (path)
+                path->assign(reinterpret_cast<const char *>(record.path), record.pathLength);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool MetadataCache::store(const Key &key, uint64_t fingerprint, uint32_t what,
+                          const std::string &path, const std::string &payload)
+{
+    Record record;
+    record.key = key;
+    record.fingerprint = fingerprint;
+    record.analyzer = m_analyzer;
+    record.settings = m_settings;
+    record.written = time(0);
+    record.version = m_version;
+    record.what = what;
+    record.path = reinterpret_cast<const uint8_t *>(path.data());
+    record.pathLength = path.size();
+    record.payload = reinterpret_cast<const uint8_t *>(payload.data());
+    record.payloadLength = payload.size();
+    if (record_header + path.size() + payload.size() > record_max)
+        return false;
+
+    std::vector<uint8_t> data;
+    encode(record, data);
+
+    // a compaction may replace the file between opening and locking it,
+    // in which case the record would go into the old one
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        int fd = open(m_path.c_str(), O_RDWR | O_APPEND | O_CREAT, 0600);
+        if (fd < 0)
+            return false;
+        if (flock(fd, LOCK_EX) != 0) {
+            close(fd);
+            return false;
+        }
+
+        struct stat st, current;
+        if (fstat(fd, &st) != 0 || stat(m_path.c_str(), &current) != 0) {
+            close(fd);
+            return false;
+        }
+        if (st.st_ino != current.st_ino) {
+            close(fd);
+            continue;
+        }
+
+        bool ok = true;
+        if (st.st_size > 0 && !refresh()) {
+            // not a cache, or one of another format
+            ok = ftruncate(fd, 0) == 0;
+            st.st_size = 0;
+            unmap();
+        } else if (m_scanned < uint64_t(st.st_size)) {
+            // whoever wrote the rest died half way through, and as
+            // appends happen under the lock nobody else is writing it now
+            ok = ftruncate(fd, m_scanned) == 0;
+            unmap();
+        }
+        if (ok && st.st_size == 0) {
+            uint8_t head[cache_header];
+            header(head);
+            ok = writeAll(fd, head, sizeof(head));
+        }
+
+        ok = ok && writeAll(fd, &data[0], data.size());
+        if (ok)
+            refresh();
+        close(fd);
+        return ok;
+    }
+    return false;
+}
+
+/**
+ * Rewrites the cache with only the latest record for every file,
+ * analyzer and request, dropping those of old analyzer versions and of
+ * files that changed since.  The records of files that went away are
+ * kept for a while, as the files may just have moved and are then found
+ * by their fingerprints.
+ */
+bool MetadataCache::compact()
+{
+    int fd = open(m_path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    if (flock(fd, LOCK_EX) != 0) {
+        close(fd);
+        return false;
+    }
+
+    struct stat st, current;
+    bool ok = fstat(fd, &st) == 0 && stat(m_path.c_str(), &current) == 0 &&
+              st.st_ino == current.st_ino && refresh() && m_inode == uint64_t(st.st_ino);
+
+    const std::string temporary = m_path + ".compact";
+    int out = -1;
+    if (ok) {
+        out = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        ok = out >= 0;
+    }
+
+    if (ok) {
+        // in file order, so the output is as sequential as the input
+        std::vector<uint64_t> offsets;
+        offsets.reserve(m_index.size());
+        for (std::map<Slot, uint64_t>::const_iterator it = m_index.begin();
+             it != m_index.end(); ++it)
+            offsets.push_back(it->second);
+        std::sort(offsets.begin(), offsets.end());
+
+        const int64_t now = time(0);
+        std::vector<uint8_t> buffer(cache_header);
+        header(&buffer[0]);
+        for (size_t i = 0; ok && i < offsets.size(); ++i) {
+            // damaged records are dropped along with the stale ones
+            if (!intact(m_map + offsets[i]))
+                continue;
+            Record record;
+            decode(m_map + offsets[i], record);
+            if (record.version < m_versions[record.analyzer])
+                continue;
+
+            const std::string path(reinterpret_cast<const char *>(record.path), record.pathLength);
+            Key key;
+            if (MetadataCache::key(path.c_str(), key)) {
+                if (!(key == record.key))
+                    continue;
+            } else {
+                m_gone.push_back(path);
+                const Slot moved = { 0, record.fingerprint, record.analyzer, record.what };
+                std::map<Slot, uint64_t>::const_iterator it = m_fingerprints.find(moved);
+                if (!record.fingerprint || now - record.written > moved_grace ||
+                    it == m_fingerprints.end() || it->second != offsets[i])
+                    continue;
+            }
+
+            const uint64_t length = get32(m_map + offsets[i]);
+            buffer.insert(buffer.end(), m_map + offsets[i], m_map + offsets[i] + length);
+            if (buffer.size() >= 1 << 20) {
+                ok = writeAll(out, &buffer[0], buffer.size());
+                buffer.clear();
+            }
+        }
+        ok = ok && (buffer.empty() || writeAll(out, &buffer[0], buffer.size()));
+        ok = close(out) == 0 && ok;
+        ok = ok && rename(temporary.c_str(), m_path.c_str()) == 0;
+        if (!ok)
+            unlink(temporary.c_str());
+    }
+
+    close(fd);
+    unmap();
+    return ok;
+}
+
+void MetadataCache::takeGone(std::vector<std::string> &paths)
+{
+    // a file has a record for every analyzer and request
+    std::sort(m_gone.begin(), m_gone.end());
+    m_gone.erase(std::unique(m_gone.begin(), m_gone.end()), m_gone.end());
+    paths.clear();
+    paths.swap(m_gone);
+}
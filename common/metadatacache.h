@@ -0,0 +1,144 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef METADATACACHE_H
+#define METADATACACHE_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+#if !defined(__osf__)
+#include <inttypes.h>
+#else
+typedef unsigned char  uint8_t;
+typedef unsigned short uint16_t;
+typedef unsigned int   uint32_t;
+typedef long long int64_t;
+typedef unsigned long long uint64_t;
+#endif
+
+/**
+ * Remembers what an analyzer found in a file, so a file that hasn't
+ * changed needn't be opened again.
+ *
+ * A file is known by its device, inode, modification time in
+ * nanoseconds and size, which a stat() gives without opening it.  The
+ * cache is a single file shared by all analyzers and processes: records
+ * are only ever appended, each with a checksum, and read through a
+ * memory mapping.  The latest record for a file, analyzer and request
+ * wins.  The file is only mapped and indexed once it is first looked
+ * in, and a record's checksum is checked when it is found.
+ *
+ * Records can also carry a fingerprint of the file's size and first and
+ * last 64 KiB, by which a file is found again after it was moved or
+ * copied, which changes its inode but not its contents or modification
+ * time.
+ *
+ * Every analyzer has a version, and settings that change its results.
+ * Records of another version or settings are misses, and compact()
+ * drops those of older versions along with the records superseded by
+ * later ones and the records of files that changed or went away.
+ */
+class MetadataCache
+{
+public:
+    struct Key
+    {
+        uint64_t device;
+        uint64_t inode;
+        int64_t mtime;
+        uint64_t size;
+
+        bool operator==(const Key &other) const;
+    };
+
+    MetadataCache(const std::string &path, const std::string &analyzer,
+                  uint32_t version, uint64_t settings);
+    ~MetadataCache();
+
+    /** Gets the key of the file at path, without opening it. */
+    static bool key(const char *path, Key &key);
+
+    /** Hashes the size and the first and last 64 KiB of the file at path. */
+    static bool fingerprint(const char *path, uint64_t size, uint64_t &fingerprint);
+
+    bool lookup(const Key &key, uint32_t what, std::string &payload);
+    bool lookup(const Key &key, uint64_t fingerprint, uint32_t what,
+                std::string &payload);
+    /** Also gives the path the file had when it was stored. */
+    bool lookup(const Key &key, uint64_t fingerprint, uint32_t what,
+                std::string &payload, std::string &path);
+    /**
+     * Looks for what was stored for the file with key's device and inode
+     * when it was no larger and no newer, as for files that are only
+     * appended to, and gives the key it was stored with.
+     */
+    bool lookupEarlier(const Key &key, uint32_t what, Key &earlier, std::string &payload);
+
+    bool store(const Key &key, uint64_t fingerprint, uint32_t what,
+               const std::string &path, const std::string &payload);
+
+    bool compact();
+    /**
+     * Takes the paths compactions found no file at any more, whose
+     * records they dropped or kept for a file that may have moved.
+     */
+    void takeGone(std::vector<std::string> &paths);
+
+private:
+    struct Slot
+    {
+        uint64_t device;
+        uint64_t inode;
+        uint64_t analyzer;
+        uint32_t what;
+
+        bool operator<(const Slot &other) const;
+    };
+
+    bool find(const std::map<Slot, uint64_t> &index, const Slot &slot,
+              const Key &key, uint64_t fingerprint, std::string &payload, std::string *path);
+    bool load();
+    bool refresh();
+    void unmap();
+    bool scan();
+    bool needsCompaction() const;
+
+    std::string m_path;
+    bool m_loaded;
+    uint64_t m_analyzer;
+    uint32_t m_version;
+    uint64_t m_settings;
+
+    // the mapped file, and how far its records have been checked
+    uint64_t m_inode;
+    const uint8_t *m_map;
+    uint64_t m_mapped;
+    uint64_t m_scanned;
+
+    // the latest records by file and, with the fingerprint in place of
+    // the inode, by fingerprint
+    std::map<Slot, uint64_t> m_index;
+    std::map<Slot, uint64_t> m_fingerprints;
+    std::map<uint64_t, uint32_t> m_versions;
+    uint64_t m_live;
+    uint64_t m_dead;
+    std::vector<std::string> m_gone;
+};
+
+#endif
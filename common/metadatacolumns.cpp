@@ -0,0 +1,146 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "metadatacolumns.h"
+
+#include <string.h>
+
+namespace {
+
+typedef MetadataColumns::Column Column;
+typedef MetadataRecord R;
+
+// bitmaps grow a byte every eight rows
+void appendBit(std::vector<uint8_t> &bitmap, size_t row, bool set)
+{
+    if (row % 8 == 0)
+        bitmap.push_back(0);
+    if (set)
+        bitmap.back() |= uint8_t(1) << (row % 8);
+}
+
+void reset(Column &column, R::Type type)
+{
+    column.type = type;
+    column.validity.clear();
+    column.nulls = 0;
+    column.integers.clear();
+    column.bits.clear();
+    column.reals.clear();
+    column.offsets.clear();
+    column.bytes.clear();
+    // the end of no row is where the first one starts
+    if (type == R::Text || type == R::Blob || type == R::Image)
+        column.offsets.push_back(0);
+}
+
+void appendBytes(Column &column, const char *data, size_t length)
+{
+    column.bytes.insert(column.bytes.end(), data, data + length);
+    column.offsets.push_back(column.bytes.size());
+}
+
+// value is 0 for a row without the field
+void appendValue(Column &column, size_t row, const R::Value *value)
+{
+    static const R::Value none = { 0, 0, 0.0, 0, 0 };
+    appendBit(column.validity, row, value);
+    if (!value) {
+        ++column.nulls;
+        value = &none;
+    }
+
+    switch (column.type) {
+    case R::Integer:
+    case R::Hash:
+        column.integers.push_back(value->number);
+        break;
+    case R::Boolean:
+        appendBit(column.bits, row, value->number);
+        break;
+    case R::Real:
+    case R::Duration:
+        column.reals.push_back(value->real);
+        break;
+    case R::Text:
+    case R::Blob:
+        appendBytes(column, value->data, value->length);
+        break;
+    case R::Size:
+        column.integers.push_back(value->number);
+        column.integers.push_back(value->scale);
+        break;
+    case R::Image:
+        column.integers.push_back(value->number);
+        column.integers.push_back(value->scale);
+        appendBytes(column, value->data, value->length);
+        break;
+    }
+}
+
+void appendText(Column &column, size_t row, const char *text, size_t length)
+{
+    R::Value value = { 0, 0, 0.0, text, length };
+    appendValue(column, row, &value);
+}
+
+}
+
+MetadataColumns::MetadataColumns(uint64_t fields)
+    : m_fields(fields)
+{
+    clear();
+}
+
+void MetadataColumns::clear()
+{
+    m_rows = 0;
+    for (int i = 0; i < MetadataRecord::FieldCount; ++i)
+        reset(m_columns[i], MetadataRecord::type(MetadataRecord::Field(i)));
+    m_extras.rows.clear();
+    reset(m_extras.groups, MetadataRecord::Text);
+    reset(m_extras.keys, MetadataRecord::Text);
+    reset(m_extras.values, MetadataRecord::Text);
+}
+
+void MetadataColumns::append(const MetadataRecord &record)
+{
+    for (int i = 0; i < MetadataRecord::FieldCount; ++i) {
+        const MetadataRecord::Field field = MetadataRecord::Field(i);
+        if (hasColumn(field))
+            appendValue(m_columns[i], m_rows, record.has(field) ? &record.value(field) : 0);
+    }
+
+    for (size_t i = 0; i < record.extraCount(); ++i) {
+        const MetadataRecord::Extra &extra = record.extra(i);
+        const size_t row = m_extras.rows.size();
+        m_extras.rows.push_back(m_rows);
+        appendText(m_extras.groups, row, extra.group, strlen(extra.group));
+        appendText(m_extras.keys, row, extra.key, strlen(extra.key));
+        appendText(m_extras.values, row, extra.value, extra.length);
+    }
+    ++m_rows;
+}
+
+void MetadataColumns::appendNull()
+{
+    for (int i = 0; i < MetadataRecord::FieldCount; ++i) {
+        if (hasColumn(MetadataRecord::Field(i)))
+            appendValue(m_columns[i], m_rows, 0);
+    }
+    ++m_rows;
+}
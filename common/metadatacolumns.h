@@ -0,0 +1,100 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef METADATACOLUMNS_H
+#define METADATACOLUMNS_H
+
+#include <stddef.h>
+
+#include <vector>
+
+#include "metadatarecord.h"
+
+/**
+ * The records of many files, one column per field, laid out as Arrow
+ * lays out its arrays so that a column store can take the buffers as
+ * they are.
+ *
+ * Row i of every column is the i-th record appended.  A bit in the
+ * validity bitmap of a column, least significant bit first, tells
+ * whether the row has the field; rows without it still take their
+ * slot in the values, as zeros or an empty string.
+ *
+ * Only the columns asked for in the constructor are filled, and
+ * clear() keeps what the buffers have grown to, so one set of columns
+ * can take batch after batch.
+ */
+class MetadataColumns
+{
+public:
+    struct Column
+    {
+        MetadataRecord::Type type;
+        std::vector<uint8_t> validity;
+        size_t nulls;
+
+        // Integer and Hash: a value per row.  Size and Image: width and
+        // height of every row, one after the other
+        std::vector<int64_t> integers;
+        // Boolean: a bitmap as validity is
+        std::vector<uint8_t> bits;
+        // Real, and Duration in seconds
+        std::vector<double> reals;
+        // Text, Blob and Image: where the bytes of row i start and,
+        // at i + 1, end
+        std::vector<int64_t> offsets;
+        std::vector<char> bytes;
+    };
+
+    /** Tags without a field, as a table of their own. */
+    struct Extras
+    {
+        // the row of every extra item
+        std::vector<uint32_t> rows;
+        Column groups;
+        Column keys;
+        Column values;
+    };
+
+    /** Columns for the fields set in the mask, bit n for Field n. */
+    explicit MetadataColumns(uint64_t fields = ~uint64_t(0));
+
+    void clear();
+
+    void append(const MetadataRecord &record);
+    /** A row without any field, for a file that couldn't be read. */
+    void appendNull();
+
+    size_t rows() const { return m_rows; }
+    bool hasColumn(MetadataRecord::Field field) const
+    {
+        return m_fields & (uint64_t(1) << field);
+    }
+    const Column &column(MetadataRecord::Field field) const { return m_columns[field]; }
+    const Extras &extras() const { return m_extras; }
+
+private:
+    MetadataColumns(const MetadataColumns &);
+    MetadataColumns &operator=(const MetadataColumns &);
+
+    uint64_t m_fields;
+    size_t m_rows;
+    Column m_columns[MetadataRecord::FieldCount];
+    Extras m_extras;
+};
+
+#endif
@@ -0,0 +1,368 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "metadatarecord.h"
+
+#include <string.h>
+
+#include "checkpointstate.h"
+#include "scratcharena.h"
+
+// the layout of saved records
+static const char record_version = 1;
+
+namespace {
+
+struct FieldInfo
+{
+    const char *group;
+    const char *key;
+    const char *name;
+    MetadataRecord::Type type;
+};
+
+typedef MetadataRecord R;
+
+// in the order of MetadataRecord::Field
+const FieldInfo fields[] = {
+    { "Comment",     "Title",                "title",                R::Text },
+    { "Comment",     "Artist",               "artist",               R::Text },
+    { "Comment",     "Album",                "album",                R::Text },
+    { "Comment",     "Date",                 "date",                 R::Text },
+    { "Comment",     "Comment",              "comment",              R::Text },
+    { "Comment",     "Tracknumber",          "tracknumber",          R::Text },
+    { "Comment",     "Genre",                "genre",                R::Text },
+    { "Comment",     "Copyright",            "copyright",            R::Text },
+
+    { "Technical",   "Length",               "length",               R::Duration },
+    { "Technical",   "Bitrate",              "bitrate",              R::Integer },
+    { "Technical",   "UpperBitrate",         "upper_bitrate",        R::Integer },
+    { "Technical",   "LowerBitrate",         "lower_bitrate",        R::Integer },
+    { "Technical",   "NominalBitrate",       "nominal_bitrate",      R::Integer },
+    { "Technical",   "Sample Rate",          "sample_rate",          R::Integer },
+    { "Technical",   "Sample Width",         "sample_width",         R::Integer },
+    { "Technical",   "Channels",             "channels",             R::Integer },
+    { "Technical",   "Version",              "version",              R::Integer },
+    { "Technical",   "Version",              "mpeg_version",         R::Text },
+    { "Technical",   "Layer",                "layer",                R::Integer },
+    { "Technical",   "Copyright",            "copyright_flag",       R::Boolean },
+    { "Technical",   "Original",             "original_flag",        R::Boolean },
+    { "Technical",   "Frame rate",           "frame_rate",           R::Integer },
+    { "Technical",   "Resolution",           "resolution",           R::Size },
+    { "Technical",   "Quality",              "quality",              R::Integer },
+    { "Technical",   "Video codec",          "video_codec",          R::Text },
+    { "Technical",   "Audio codec",          "audio_codec",          R::Text },
+    { "Technical",   "Number of Songs",      "song_count",           R::Integer },
+    { "Technical",   "Start Song",           "start_song",           R::Integer },
+    { "Technical",   "Song Lengths",         "song_lengths",         R::Text },
+    { "Broadcast",   "Time Reference",       "time_reference",       R::Real },
+
+    { "Cover Art",   "Pictures",             "pictures",             R::Integer },
+    { "Cover Art",   "Mime Type",            "picture_mime_type",    R::Text },
+    { "Cover Art",   "Resolution",           "picture_resolution",   R::Size },
+    { "Cover Art",   "Size",                 "picture_size",         R::Integer },
+    { "Cover Art",   "Thumbnail",            "thumbnail",            R::Image },
+
+    { "Analysis",    "Waveform",             "waveform",             R::Blob },
+    { "Analysis",    "Integrated Loudness",  "integrated_loudness",  R::Real },
+    { "Analysis",    "Loudness Range",       "loudness_range",       R::Real },
+    { "Analysis",    "True Peak",            "true_peak",            R::Real },
+    { "Analysis",    "Leading Silence",      "leading_silence",      R::Real },
+    { "Analysis",    "Trailing Silence",     "trailing_silence",     R::Real },
+    { "Fingerprint", "Payload Hash",         "payload_hash",         R::Hash },
+    { "Fingerprint", "Sampled Payload Hash", "sampled_payload_hash", R::Hash }
+};
+
+// every field has a bit in m_present
+typedef char fields_complete[sizeof(fields) / sizeof(fields[0]) == R::FieldCount ? 1 : -1];
+typedef char fields_fit[R::FieldCount <= 64 ? 1 : -1];
+
+const char *copy(const void *data, size_t length)
+{
+    char *copied = static_cast<char *>(ScratchArena::local().allocate(length + 1));
+    if (length)
+        memcpy(copied, data, length);
+    copied[length] = 0;
+    return copied;
+}
+
+std::string bytes(const char *data, size_t length)
+{
+    return length ? std::string(data, length) : std::string();
+}
+
+}
+
+MetadataRecord::MetadataRecord()
+{
+    clear();
+}
+
+void MetadataRecord::clear()
+{
+    m_present = 0;
+    memset(m_values, 0, sizeof(m_values));
+    m_extras = 0;
+    m_extraCount = 0;
+    m_extraSpace = 0;
+}
+
+MetadataRecord::Type MetadataRecord::type(Field field)
+{
+    return fields[field].type;
+}
+
+const char *MetadataRecord::group(Field field)
+{
+    return fields[field].group;
+}
+
+const char *MetadataRecord::key(Field field)
+{
+    return fields[field].key;
+}
+
+const char *MetadataRecord::name(Field field)
+{
+    return fields[field].name;
+}
+
+bool MetadataRecord::find(const char *group, const char *key, Field &field)
+{
+    for (int i = 0; i < FieldCount; ++i) {
+        if (fields[i].type == Text && !strcmp(fields[i].key, key) &&
+            !strcmp(fields[i].group, group)) {
+            field = Field(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+MetadataRecord::Value &MetadataRecord::set(Field field)
+{
+    m_present |= uint64_t(1) << field;
+    Value &value = m_values[field];
+    memset(&value, 0, sizeof(value));
+    return value;
+}
+
+void MetadataRecord::setInteger(Field field, int64_t value)
+{
+    set(field).number = value;
+}
+
+void MetadataRecord::setBoolean(Field field, bool value)
+{
+    set(field).number = value;
+}
+
+void MetadataRecord::setReal(Field field, double value)
+{
+    set(field).real = value;
+}
+
+void MetadataRecord::setDuration(Field field, int64_t amount, int64_t scale)
+{
+    Value &value = set(field);
+    value.number = amount;
+    value.scale = scale > 0 ? scale : 1;
+    value.real = double(amount) / value.scale;
+}
+
+void MetadataRecord::setHash(Field field, uint64_t value)
+{
+    set(field).number = int64_t(value);
+}
+
+void MetadataRecord::setText(Field field, const char *text, size_t length)
+{
+    Value &value = set(field);
+    value.data = copy(text, length);
+    value.length = length;
+}
+
+void MetadataRecord::setText(Field field, const std::string &text)
+{
+    setText(field, text.data(), text.size());
+}
+
+void MetadataRecord::setTrimmedText(Field field, const std::string &text)
+{
+    static const char blanks[] = " \t\n\r\v\f";
+    const size_t begin = text.find_first_not_of(blanks);
+    if (begin == std::string::npos)
+        setText(field, 0, 0);
+    else
+        setText(field, text.data() + begin, text.find_last_not_of(blanks) + 1 - begin);
+}
+
+void MetadataRecord::setBlob(Field field, const void *data, size_t length)
+{
+    Value &value = set(field);
+    value.data = copy(data, length);
+    value.length = length;
+}
+
+void MetadataRecord::setSize(Field field, uint32_t width, uint32_t height)
+{
+    Value &value = set(field);
+    value.number = width;
+    value.scale = height;
+}
+
+void MetadataRecord::setImage(Field field, const uint32_t *pixels, uint32_t width, uint32_t height)
+{
+    Value &value = set(field);
+    value.number = width;
+    value.scale = height;
+    value.length = size_t(width) * height * 4;
+    value.data = copy(pixels, value.length);
+}
+
+void MetadataRecord::setTag(const char *group, const char *key, const char *text, size_t length)
+{
+    Field field;
+    if (find(group, key, field) && !has(field))
+        setText(field, text, length);
+    else
+        addExtra(copy(group, strlen(group)), copy(key, strlen(key)), copy(text, length), length);
+}
+
+void MetadataRecord::addExtra(const char *group, const char *key, const char *text, size_t length)
+{
+    // the list grows in the arena, where the old one is given up
+    if (m_extraCount == m_extraSpace) {
+        const size_t space = m_extraSpace ? 2 * m_extraSpace : 16;
+        Extra *extras = static_cast<Extra *>(ScratchArena::local().allocate(space * sizeof(Extra)));
+        if (m_extraCount)
+            memcpy(extras, m_extras, m_extraCount * sizeof(Extra));
+        m_extras = extras;
+        m_extraSpace = space;
+    }
+    Extra &extra = m_extras[m_extraCount++];
+    extra.group = group;
+    extra.key = key;
+    extra.value = text;
+    extra.length = length;
+}
+
+void MetadataRecord::save(std::string &data) const
+{
+    typedef CheckpointState S;
+    data.clear();
+    data += record_version;
+    S::put(data, m_present, 8);
+    for (int i = 0; i < FieldCount; ++i) {
+        if (!has(Field(i)))
+            continue;
+        const Value &value = m_values[i];
+        switch (fields[i].type) {
+        case Real: {
+            uint64_t bits;
+            memcpy(&bits, &value.real, 8);
+            S::put(data, bits, 8);
+            break;
+        }
+        case Duration:
+        case Size:
+            S::put(data, value.number, 8);
+            S::put(data, value.scale, 8);
+            break;
+        case Text:
+        case Blob:
+            S::put(data, bytes(value.data, value.length));
+            break;
+        case Image:
+            S::put(data, value.number, 4);
+            S::put(data, value.scale, 4);
+            S::put(data, bytes(value.data, value.length));
+            break;
+        default:
+            S::put(data, value.number, 8);
+            break;
+        }
+    }
+
+    S::put(data, m_extraCount, 4);
+    for (size_t i = 0; i < m_extraCount; ++i) {
+        S::put(data, std::string(m_extras[i].group));
+        S::put(data, std::string(m_extras[i].key));
+        S::put(data, bytes(m_extras[i].value, m_extras[i].length));
+    }
+}
+
+bool MetadataRecord::load(const std::string &data)
+{
+    clear();
+    CheckpointState in(data);
+    if (in.number(1) != uint64_t(record_version))
+        return false;
+    const uint64_t present = in.number(8);
+    for (int i = 0; i < FieldCount && in.ok(); ++i) {
+        const Field field = Field(i);
+        if (!(present & (uint64_t(1) << i)))
+            continue;
+        switch (fields[i].type) {
+        case Real: {
+            const uint64_t bits = in.number(8);
+            double real;
+            memcpy(&real, &bits, 8);
+            setReal(field, real);
+            break;
+        }
+        case Duration: {
+            const int64_t amount = in.number(8);
+            setDuration(field, amount, in.number(8));
+            break;
+        }
+        case Size: {
+            const uint32_t width = in.number(8);
+            setSize(field, width, in.number(8));
+            break;
+        }
+        case Text:
+        case Blob: {
+            const std::string text = in.bytes();
+            setBlob(field, text.data(), text.size());
+            break;
+        }
+        case Image: {
+            const uint32_t width = in.number(4);
+            const uint32_t height = in.number(4);
+            const std::string pixels = in.bytes();
+            if (pixels.size() != size_t(width) * height * 4)
+                return false;
+            setImage(field, reinterpret_cast<const uint32_t *>(pixels.data()), width, height);
+            break;
+        }
+        default:
+            set(field).number = in.number(8);
+            break;
+        }
+    }
+
+    const uint64_t extras = in.number(4);
+    for (uint64_t i = 0; i < extras && in.ok(); ++i) {
+        const std::string group = in.bytes();
+        const std::string key = in.bytes();
+        const std::string text = in.bytes();
+        addExtra(copy(group.data(), group.size()), copy(key.data(), key.size()),
+                 copy(text.data(), text.size()), text.size());
+    }
+    return in.ok() && in.atEnd() && !(present >> FieldCount);
+}
@@ -0,0 +1,209 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef METADATARECORD_H
+#define METADATARECORD_H
+
+#include <stddef.h>
+
+#include <string>
+
+#if !defined(__osf__)
+#include <inttypes.h>
+#else
+typedef unsigned char  uint8_t;
+typedef unsigned short uint16_t;
+typedef unsigned int   uint32_t;
+typedef unsigned long long uint64_t;
+typedef long long int64_t;
+#endif
+
+/**
+ * What an analyzer found in a file, as typed fields in one fixed block
+ * rather than as items looked up by group and key.
+ *
+ * Every field the plugins know has a slot of its own, whose type never
+ * changes: lengths are a count over a scale, so that both whole seconds
+ * and sample counts are exact, and text, blobs and pixels are views
+ * into the thread's ScratchArena.  A record is thus filled and used
+ * within one ScratchScope, and can't be copied.
+ *
+ * Tags without a field of their own, as Vorbis comments and iXML can
+ * have any name, are kept as extra items with their group and key.
+ *
+ * CachedFilePlugin turns records into KFileMetaInfo items, under the
+ * group and key a field has unless the plugin lays it out otherwise
+ * with a MetadataLayout.
+ */
+class MetadataRecord
+{
+public:
+    enum Field {
+        // tags
+        Title,
+        Artist,
+        Album,
+        Date,
+        Comment,
+        Tracknumber,
+        Genre,
+        Copyright,
+
+        // technical details
+        Length,
+        Bitrate,
+        UpperBitrate,
+        LowerBitrate,
+        NominalBitrate,
+        SampleRate,
+        SampleWidth,
+        Channels,
+        Version,
+        MpegVersion,
+        Layer,
+        CopyrightFlag,
+        OriginalFlag,
+        FrameRate,
+        Resolution,
+        Quality,
+        VideoCodec,
+        AudioCodec,
+        SongCount,
+        StartSong,
+        SongLengths,
+        TimeReference,
+
+        // the front cover, or else the first picture
+        Pictures,
+        PictureMimeType,
+        PictureResolution,
+        PictureSize,
+        Thumbnail,
+
+        // analyses of the whole payload
+        Waveform,
+        IntegratedLoudness,
+        LoudnessRange,
+        TruePeak,
+        LeadingSilence,
+        TrailingSilence,
+        PayloadHash,
+        SampledPayloadHash,
+
+        FieldCount
+    };
+
+    enum Type {
+        Integer,
+        Boolean,
+        Real,
+        Duration,   // number seconds over scale
+        Hash,
+        Text,
+        Blob,
+        Size,       // number wide and scale high
+        Image       // premultiplied ARGB pixels, sized as Size
+    };
+
+    struct Value
+    {
+        int64_t number;
+        int64_t scale;
+        double real;
+        const char *data;   // nul terminated for Text
+        size_t length;
+    };
+
+    /** A tag without a field of its own. */
+    struct Extra
+    {
+        const char *group;
+        const char *key;
+        const char *value;
+        size_t length;
+    };
+
+    MetadataRecord();
+
+    void clear();
+
+    static Type type(Field field);
+    static const char *group(Field field);
+    static const char *key(Field field);
+    /** A name for the field where it needs one, as for a column. */
+    static const char *name(Field field);
+    /** The text field kept under group and key, if there is one. */
+    static bool find(const char *group, const char *key, Field &field);
+
+    bool has(Field field) const { return m_present & (uint64_t(1) << field); }
+    bool isEmpty() const { return !m_present && !m_extraCount; }
+    const Value &value(Field field) const { return m_values[field]; }
+
+    void setInteger(Field field, int64_t value);
+    void setBoolean(Field field, bool value);
+    void setReal(Field field, double value);
+    void setDuration(Field field, int64_t amount, int64_t scale);
+    void setHash(Field field, uint64_t value);
+    void setText(Field field, const char *text, size_t length);
+    void setText(Field field, const std::string &text);
+    /** Text without the blanks taggers leave around it. */
+    void setTrimmedText(Field field, const std::string &text);
+    void setBlob(Field field, const void *data, size_t length);
+    void setSize(Field field, uint32_t width, uint32_t height);
+    void setImage(Field field, const uint32_t *pixels, uint32_t width, uint32_t height);
+
+    /**
+     * Keeps a tag: in its field, if it has one that isn't set yet, and
+     * as an extra item otherwise.
+     */
+    void setTag(const char *group, const char *key, const char *text, size_t length);
+
+    size_t extraCount() const { return m_extraCount; }
+    const Extra &extra(size_t i) const { return m_extras[i]; }
+
+    /** The record as the metadata cache keeps it. */
+    void save(std::string &data) const;
+    bool load(const std::string &data);
+
+private:
+    MetadataRecord(const MetadataRecord &);
+    MetadataRecord &operator=(const MetadataRecord &);
+
+    Value &set(Field field);
+    void addExtra(const char *group, const char *key, const char *text, size_t length);
+
+    uint64_t m_present;
+    Value m_values[FieldCount];
+    Extra *m_extras;
+    size_t m_extraCount;
+    size_t m_extraSpace;
+};
+
+/**
+ * Where a plugin shows a field, when that isn't under its usual group
+ * and key; a list of them ends with FieldCount.  Durations are shown as
+ * rounded seconds, or with a fraction for real ones.
+ */
+struct MetadataLayout
+{
+    MetadataRecord::Field field;
+    const char *group;
+    const char *key;
+    bool real;
+};
+
+#endif
@@ -0,0 +1,423 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "payloadhash.h"
+
+#include <map>
+
+#include <string.h>
+#include <strings.h>
+
+#include "mappedinput.h"
+
+// the sampled variant hashes this many windows of this size
+static const int sample_windows = 16;
+static const uint64_t sample_size = 64 * 1024;
+
+static const uint64_t prime1 = 0x9e3779b185ebca87ULL;
+static const uint64_t prime2 = 0xc2b2ae3d27d4eb4fULL;
+static const uint64_t prime3 = 0x165667b19e3779f9ULL;
+static const uint64_t prime4 = 0x85ebca77c2b2ae63ULL;
+static const uint64_t prime5 = 0x27d4eb2f165667c5ULL;
+
+static inline uint64_t rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const uint8_t *p)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+#else
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; --i)
+        v = (v << 8) | p[i];
+    return v;
+#endif
+}
+
+static inline uint32_t read32(const uint8_t *p)
+{
+    return uint32_t(p[0]) | (uint32_t(p[1]) << 8) |
+           (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24);
+}
+
+static inline uint64_t xxhRound(uint64_t acc, uint64_t input)
+{
+    acc += input * prime2;
+    return rotl(acc, 31) * prime1;
+}
+
+static inline uint64_t mergeRound(uint64_t acc, uint64_t value)
+{
+    acc ^= xxhRound(0, value);
+    return acc * prime1 + prime4;
+}
+
+PayloadHash::PayloadHash(uint64_t seed)
+    : m_seed(seed), m_total(0), m_buffered(0)
+{
+    m_lanes[0] = seed + prime1 + prime2;
+    m_lanes[1] = seed + prime2;
+    m_lanes[2] = seed;
+    m_lanes[3] = seed - prime1;
+}
+
+PayloadHash::Mode PayloadHash::mode(const char *name)
+{
+    if (!strcasecmp(name, "full"))
+        return Full;
+    if (!strcasecmp(name, "sampled"))
+        return Sampled;
+    return Off;
+}
+
+inline void PayloadHash::consume(const uint8_t *stripe)
+{
+    m_lanes[0] = xxhRound(m_lanes[0], read64(stripe));
+    m_lanes[1] = xxhRound(m_lanes[1], read64(stripe + 8));
+    m_lanes[2] = xxhRound(m_lanes[2], read64(stripe + 16));
+    m_lanes[3] = xxhRound(m_lanes[3], read64(stripe + 24));
+}
+
+void PayloadHash::update(const void *data, size_t length)
+{
+    const uint8_t *p = static_cast<const uint8_t *>(data);
+    m_total += length;
+
+    if (m_buffered > 0) {
+        size_t fill = 32 - m_buffered < length ? 32 - m_buffered : length;
+        memcpy(m_buffer + m_buffered, p, fill);
+        m_buffered += fill;
+        p += fill;
+        length -= fill;
+        if (m_buffered < 32)
+            return;
+        consume(m_buffer);
+        m_buffered = 0;
+    }
+
+    // the four lanes are independent, which keeps the CPU busy enough to
+    // hash at memory speed
+    uint64_t v1 = m_lanes[0], v2 = m_lanes[1], v3 = m_lanes[2], v4 = m_lanes[3];
+    for (; length >= 32; p += 32, length -= 32) {
+        v1 = xxhRound(v1, read64(p));
+        v2 = xxhRound(v2, read64(p + 8));
+        v3 = xxhRound(v3, read64(p + 16));
+        v4 = xxhRound(v4, read64(p + 24));
+    }
+    m_lanes[0] = v1;
+    m_lanes[1] = v2;
+    m_lanes[2] = v3;
+    m_lanes[3] = v4;
+
+    memcpy(m_buffer, p, length);
+    m_buffered = length;
+}
+
+uint64_t PayloadHash::digest() const
+{
+    uint64_t h;
+    if (m_total >= 32) {
+        h = rotl(m_lanes[0], 1) + rotl(m_lanes[1], 7) +
+            rotl(m_lanes[2], 12) + rotl(m_lanes[3], 18);
+        for (int i = 0; i < 4; ++i)
+            h = mergeRound(h, m_lanes[i]);
+    } else {
+        h = m_seed + prime5;
+    }
+    h += m_total;
+
+    const uint8_t *p = m_buffer;
+    size_t left = m_buffered;
+    for (; left >= 8; p += 8, left -= 8)
+        h = rotl(h ^ xxhRound(0, read64(p)), 27) * prime1 + prime4;
+    if (left >= 4) {
+        h = rotl(h ^ (read32(p) * prime1), 23) * prime2 + prime3;
+        p += 4;
+        left -= 4;
+    }
+    for (; left > 0; ++p, --left)
+        h = rotl(h ^ (*p * prime5), 11) * prime1;
+
+    h ^= h >> 33;
+    h *= prime2;
+    h ^= h >> 29;
+    h *= prime3;
+    h ^= h >> 32;
+    return h;
+}
+
+namespace {
+
+// CRC-32 with the polynomial 0x04c11db7, unreflected, as Ogg pages have it
+const uint32_t ogg_crc_table[256] = {
+    0x00000000, 0x04c11db7, 0x09823b6e, 0x0d4326d9, 0x130476dc, 0x17c56b6b,
+    0x1a864db2, 0x1e475005, 0x2608edb8, 0x22c9f00f, 0x2f8ad6d6, 0x2b4bcb61,
+    0x350c9b64, 0x31cd86d3, 0x3c8ea00a, 0x384fbdbd, 0x4c11db70, 0x48d0c6c7,
+    0x4593e01e, 0x4152fda9, 0x5f15adac, 0x5bd4b01b, 0x569796c2, 0x52568b75,
+    0x6a1936c8, 0x6ed82b7f, 0x639b0da6, 0x675a1011, 0x791d4014, 0x7ddc5da3,
+    0x709f7b7a, 0x745e66cd, 0x9823b6e0, 0x9ce2ab57, 0x91a18d8e, 0x95609039,
+    0x8b27c03c, 0x8fe6dd8b, 0x82a5fb52, 0x8664e6e5, 0xbe2b5b58, 0xbaea46ef,
+    0xb7a96036, 0xb3687d81, 0xad2f2d84, 0xa9ee3033, 0xa4ad16ea, 0xa06c0b5d,
+    0xd4326d90, 0xd0f37027, 0xddb056fe, 0xd9714b49, 0xc7361b4c, 0xc3f706fb,
+    0xceb42022, 0xca753d95, 0xf23a8028, 0xf6fb9d9f, 0xfbb8bb46, 0xff79a6f1,
+    0xe13ef6f4, 0xe5ffeb43, 0xe8bccd9a, 0xec7dd02d, 0x34867077, 0x30476dc0,
+    0x3d044b19, 0x39c556ae, 0x278206ab, 0x23431b1c, 0x2e003dc5, 0x2ac12072,
+    0x128e9dcf, 0x164f8078, 0x1b0ca6a1, 0x1fcdbb16, 0x018aeb13, 0x054bf6a4,
+    0x0808d07d, 0x0cc9cdca, 0x7897ab07, 0x7c56b6b0, 0x71159069, 0x75d48dde,
+    0x6b93dddb, 0x6f52c06c, 0x6211e6b5, 0x66d0fb02, 0x5e9f46bf, 0x5a5e5b08,
+    0x571d7dd1, 0x53dc6066, 0x4d9b3063, 0x495a2dd4, 0x44190b0d, 0x40d816ba,
+    0xaca5c697, 0xa864db20, 0xa527fdf9, 0xa1e6e04e, 0xbfa1b04b, 0xbb60adfc,
+    0xb6238b25, 0xb2e29692, 0x8aad2b2f, 0x8e6c3698, 0x832f1041, 0x87ee0df6,
+    0x99a95df3, 0x9d684044, 0x902b669d, 0x94ea7b2a, 0xe0b41de7, 0xe4750050,
+    0xe9362689, 0xedf73b3e, 0xf3b06b3b, 0xf771768c, 0xfa325055, 0xfef34de2,
+    0xc6bcf05f, 0xc27dede8, 0xcf3ecb31, 0xcbffd686, 0xd5b88683, 0xd1799b34,
+    0xdc3abded, 0xd8fba05a, 0x690ce0ee, 0x6dcdfd59, 0x608edb80, 0x644fc637,
+    0x7a089632, 0x7ec98b85, 0x738aad5c, 0x774bb0eb, 0x4f040d56, 0x4bc510e1,
+    0x46863638, 0x42472b8f, 0x5c007b8a, 0x58c1663d, 0x558240e4, 0x51435d53,
+    0x251d3b9e, 0x21dc2629, 0x2c9f00f0, 0x285e1d47, 0x36194d42, 0x32d850f5,
+    0x3f9b762c, 0x3b5a6b9b, 0x0315d626, 0x07d4cb91, 0x0a97ed48, 0x0e56f0ff,
+    0x1011a0fa, 0x14d0bd4d, 0x19939b94, 0x1d528623, 0xf12f560e, 0xf5ee4bb9,
+    0xf8ad6d60, 0xfc6c70d7, 0xe22b20d2, 0xe6ea3d65, 0xeba91bbc, 0xef68060b,
+    0xd727bbb6, 0xd3e6a601, 0xdea580d8, 0xda649d6f, 0xc423cd6a, 0xc0e2d0dd,
+    0xcda1f604, 0xc960ebb3, 0xbd3e8d7e, 0xb9ff90c9, 0xb4bcb610, 0xb07daba7,
+    0xae3afba2, 0xaafbe615, 0xa7b8c0cc, 0xa379dd7b, 0x9b3660c6, 0x9ff77d71,
+    0x92b45ba8, 0x9675461f, 0x8832161a, 0x8cf30bad, 0x81b02d74, 0x857130c3,
+    0x5d8a9099, 0x594b8d2e, 0x5408abf7, 0x50c9b640, 0x4e8ee645, 0x4a4ffbf2,
+    0x470cdd2b, 0x43cdc09c, 0x7b827d21, 0x7f436096, 0x7200464f, 0x76c15bf8,
+    0x68860bfd, 0x6c47164a, 0x61043093, 0x65c52d24, 0x119b4be9, 0x155a565e,
+    0x18197087, 0x1cd86d30, 0x029f3d35, 0x065e2082, 0x0b1d065b, 0x0fdc1bec,
+    0x3793a651, 0x3352bbe6, 0x3e119d3f, 0x3ad08088, 0x2497d08d, 0x2056cd3a,
+    0x2d15ebe3, 0x29d4f654, 0xc5a92679, 0xc1683bce, 0xcc2b1d17, 0xc8ea00a0,
+    0xd6ad50a5, 0xd26c4d12, 0xdf2f6bcb, 0xdbee767c, 0xe3a1cbc1, 0xe760d676,
+    0xea23f0af, 0xeee2ed18, 0xf0a5bd1d, 0xf464a0aa, 0xf9278673, 0xfde69bc4,
+    0x89b8fd09, 0x8d79e0be, 0x803ac667, 0x84fbdbd0, 0x9abc8bd5, 0x9e7d9662,
+    0x933eb0bb, 0x97ffad0c, 0xafb010b1, 0xab710d06, 0xa6322bdf, 0xa2f33668,
+    0xbcb4666d, 0xb8757bda, 0xb5365d03, 0xb1f740b4
+};
+
+uint32_t oggCrc(const uint8_t *data, size_t length)
+{
+    uint32_t crc = 0;
+    for (size_t i = 0; i < length; ++i) {
+        // the checksum field itself counts as zero
+        uint8_t byte = i >= 22 && i < 26 ? 0 : data[i];
+        crc = (crc << 8) ^ ogg_crc_table[((crc >> 24) ^ byte) & 0xff];
+    }
+    return crc;
+}
+
+struct OggPage
+{
+    const uint8_t *header;
+    size_t headerSize;
+    size_t bodySize;
+
+    size_t size() const { return headerSize + bodySize; }
+    const uint8_t *body() const { return header + headerSize; }
+    uint32_t serial() const { return read32(header + 14); }
+    bool firstPage() const { return header[5] & 0x02; }
+};
+
+// reads the page at p, if there is a complete one
+bool readOggPage(const uint8_t *p, uint64_t left, OggPage &page)
+{
+    if (left < 27 || memcmp(p, "OggS", 4) != 0 || p[4] != 0)
+        return false;
+    page.header = p;
+    page.headerSize = 27 + p[26];
+    if (left < page.headerSize)
+        return false;
+    page.bodySize = 0;
+    for (int i = 0; i < p[26]; ++i)
+        page.bodySize += p[27 + i];
+    return left >= page.size();
+}
+
+// the number of header packets, judging by the first packet of a stream
+int oggHeaderPackets(const OggPage &page)
+{
+    const uint8_t *packet = page.body();
+    const size_t size = page.bodySize;
+    if (size >= 8 && !memcmp(packet, "OpusHead", 8))
+        return 2;
+    if (size >= 8 && !memcmp(packet, "Speex   ", 8))
+        return 2;
+    if (size >= 9 && !memcmp(packet, "\x7f" "FLAC", 5)) {
+        // the mapping header counts the metadata packets after it
+        int count = (packet[7] << 8) | packet[8];
+        return 1 + (count > 0 ? count : 1);
+    }
+    // Vorbis, Theora and most other Xiph codecs have three
+    return 3;
+}
+
+// the number of packets that end on the page
+int oggCompletedPackets(const OggPage &page)
+{
+    int count = 0;
+    for (int i = 0; i < page.header[26]; ++i)
+        if (page.header[27 + i] < 255)
+            ++count;
+    return count;
+}
+
+void hashOggPage(PayloadHash &hash, const OggPage &page)
+{
+    hash.update(page.header + 6, 8);    // granule position
+    hash.update(page.body(), page.bodySize);
+}
+
+// finds the next page at or after p that is real, not a stray "OggS"
+const uint8_t *syncOggPage(const uint8_t *p, const uint8_t *end, OggPage &page)
+{
+    while (end - p >= 27) {
+        const uint8_t *found = static_cast<const uint8_t *>(memchr(p, 'O', end - p - 26));
+        if (!found)
+            return 0;
+        if (readOggPage(found, end - found, page) &&
+            oggCrc(found, page.size()) == read32(found + 22))
+            return found;
+        p = found + 1;
+    }
+    return 0;
+}
+
+}
+
+bool PayloadHash::hashRange(int fd, uint64_t offset, uint64_t length,
+                            Mode mode, uint64_t &hash)
+{
+    if (mode == Off || length == 0)
+        return false;
+
+    MappedRange map(fd, offset, length, mode == Full ? SequentialAccess : RandomAccess);
+    if (!map.data())
+        return false;
+
+    if (mode == Full) {
+        PayloadHash h;
+        h.update(map.data(), length);
+        hash = h.digest();
+        return true;
+    }
+
+    // the length goes in first, so payloads that only differ between the
+    // windows still rarely collide
+    PayloadHash h(1);
+    uint8_t size[8];
+    for (int i = 0; i < 8; ++i)
+        size[i] = (length >> (8 * i)) & 0xff;
+    h.update(size, 8);
+
+    if (length <= sample_windows * sample_size) {
+        h.update(map.data(), length);
+    } else {
+        for (int i = 0; i < sample_windows; ++i) {
+            uint64_t start = (length - sample_size) * i / (sample_windows - 1);
+            h.update(map.data() + start, sample_size);
+        }
+    }
+    hash = h.digest();
+    return true;
+}
+
+bool PayloadHash::hashOggPages(int fd, uint64_t offset, uint64_t length,
+                               Mode mode, uint64_t &hash)
+{
+    if (mode == Off || length == 0)
+        return false;
+
+    MappedRange map(fd, offset, length, mode == Full ? SequentialAccess : RandomAccess);
+    if (!map.data())
+        return false;
+
+    const uint8_t *p = map.data();
+    const uint8_t *end = p + length;
+
+    // header packets still to come per logical stream
+    std::map<uint32_t, int> headers;
+    int pending = 0;
+
+    PayloadHash h(mode == Full ? 0 : 1);
+    OggPage page;
+    bool audio = false;
+    while (p < end) {
+        if (!readOggPage(p, end - p, page)) {
+            // skip garbage between pages
+            p = syncOggPage(p + 1, end, page);
+            if (!p)
+                break;
+            continue;
+        }
+
+        std::map<uint32_t, int>::iterator stream = headers.find(page.serial());
+        if (page.firstPage() || stream == headers.end()) {
+            int count = page.firstPage() ? oggHeaderPackets(page) : 0;
+            stream = headers.insert(std::make_pair(page.serial(), count)).first;
+            pending += count;
+        }
+
+        if (stream->second == 0) {
+            if (mode == Sampled && pending == 0) {
+                audio = true;
+                break;
+            }
+            hashOggPage(h, page);
+        } else {
+            int done = oggCompletedPackets(page);
+            if (done > stream->second)
+                done = stream->second;
+            stream->second -= done;
+            pending -= done;
+        }
+        p += page.size();
+    }
+
+    if (mode == Sampled) {
+        if (!audio)
+            return false;
+
+        // windows in the audio pages, which keep their size when the
+        // headers are rewritten
+        const uint64_t audioLength = end - p;
+        uint8_t size[8];
+        for (int i = 0; i < 8; ++i)
+            size[i] = (audioLength >> (8 * i)) & 0xff;
+        h.update(size, 8);
+
+        const uint8_t *audioStart = p;
+        for (int i = 0; i < sample_windows; ++i) {
+            uint64_t start = audioLength > sample_size
+                           ? (audioLength - sample_size) * i / (sample_windows - 1) : 0;
+            const uint8_t *q = syncOggPage(audioStart + start, end, page);
+            uint64_t hashed = 0;
+            while (q && hashed < sample_size && readOggPage(q, end - q, page)) {
+                hashOggPage(h, page);
+                hashed += page.bodySize;
+                q += page.size();
+            }
+        }
+    }
+
+    hash = h.digest();
+    return true;
+}
@@ -0,0 +1,83 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef PAYLOADHASH_H
+#define PAYLOADHASH_H
+
+#include <stddef.h>
+
+#if !defined(__osf__)
+#include <inttypes.h>
+#else
+typedef unsigned char  uint8_t;
+typedef unsigned short uint16_t;
+typedef unsigned int   uint32_t;
+typedef unsigned long long uint64_t;
+#endif
+
+/**
+ * Fingerprints the audio payload of a file, leaving out its tags, so
+ * copies that only differ in their tags get the same fingerprint.
+ *
+ * The hash is XXH64, computed over the memory-mapped payload.  The full
+ * variant hashes every byte; the sampled variant only hashes the length
+ * of the payload and a fixed number of windows spread evenly over it,
+ * which costs a few seeks no matter how big the file is.  The two give
+ * different values for the same payload and must not be compared.
+ */
+class PayloadHash
+{
+public:
+    enum Mode {
+        Off,
+        Full,
+        Sampled
+    };
+
+    explicit PayloadHash(uint64_t seed = 0);
+
+    /** Maps "Full" and "Sampled" (in any case) to a mode, all else to Off. */
+    static Mode mode(const char *name);
+
+    void update(const void *data, size_t length);
+    uint64_t digest() const;
+
+    /** Hashes length bytes starting at offset in fd. */
+    static bool hashRange(int fd, uint64_t offset, uint64_t length,
+                          Mode mode, uint64_t &hash);
+
+    /**
+     * Hashes the audio pages of the Ogg stream in length bytes starting
+     * at offset in fd.  Only the bodies and granule positions of the
+     * pages after the header packets of every logical stream are hashed,
+     * as tag editors rewrite the header pages and renumber the pages that
+     * follow them.
+     */
+    static bool hashOggPages(int fd, uint64_t offset, uint64_t length,
+                             Mode mode, uint64_t &hash);
+
+private:
+    void consume(const uint8_t *stripe);
+
+    uint64_t m_seed;
+    uint64_t m_total;
+    uint64_t m_lanes[4];
+    uint8_t m_buffer[32];
+    size_t m_buffered;
+};
+
+#endif
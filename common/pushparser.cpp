@@ -0,0 +1,136 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "pushparser.h"
+
+PushParser::PushParser()
+    : m_status(Continue), m_offset(0), m_need(1)
+{
+}
+
+PushParser::~PushParser()
+{
+}
+
+void PushParser::want(uint64_t offset, size_t length)
+{
+    m_offset = offset;
+    m_need = length ? length : 1;
+}
+
+PushParser::Status PushParser::parse(const uint8_t *data, size_t length)
+{
+    if (m_status != Continue)
+        return m_status;
+
+    static const uint8_t nothing = 0;
+    const uint64_t offset = m_offset;
+    const size_t need = m_need;
+    m_status = consume(length ? data : &nothing, length);
+    if (m_status != Continue)
+        return m_status;
+
+    // at the end there is nothing more to want; going back, or wanting
+    // what was just handed over again, would never end either
+    if (length < need)
+        m_status = Done;
+    else if (m_offset < offset || (m_offset == offset && m_need <= length))
+        m_status = Failed;
+    return m_status;
+}
+
+PushFeeder::PushFeeder(PushParser &parser)
+    : m_parser(parser), m_head(0), m_position(0)
+{
+}
+
+PushParser::Status PushFeeder::push(const uint8_t *data, size_t length)
+{
+    while (length && m_parser.status() == PushParser::Continue) {
+        if (m_head < m_buffer.size()) {
+            // the parser is waiting for more of what is buffered
+            m_buffer.erase(m_buffer.begin(), m_buffer.begin() + m_head);
+            m_head = 0;
+            m_buffer.insert(m_buffer.end(), data, data + length);
+            m_position += length;
+            drain();
+            break;
+        }
+
+        const uint64_t offset = m_parser.offset();
+        if (offset > m_position) {
+            const uint64_t skip = offset - m_position < length ? offset - m_position : length;
+            data += skip;
+            length -= skip;
+            m_position += skip;
+            continue;
+        }
+
+        // straight from the piece while it holds what the parser wants
+        if (length < m_parser.need()) {
+            m_buffer.assign(data, data + length);
+            m_head = 0;
+            m_position += length;
+            break;
+        }
+        m_parser.parse(data, length);
+        if (m_parser.offset() >= m_position + length) {
+            m_position += length;
+            break;
+        }
+        const size_t used = m_parser.offset() - m_position;
+        data += used;
+        length -= used;
+        m_position += used;
+    }
+    return m_parser.status();
+}
+
+PushParser::Status PushFeeder::finish()
+{
+    drain();
+    if (m_parser.status() == PushParser::Continue) {
+        if (m_parser.offset() < m_position)
+            m_parser.parse(&m_buffer[m_head], m_buffer.size() - m_head);
+        else
+            m_parser.parse(0, 0);
+    }
+    m_buffer.clear();
+    m_head = 0;
+    return m_parser.status();
+}
+
+void PushFeeder::drain()
+{
+    while (m_parser.status() == PushParser::Continue) {
+        const uint64_t start = m_position - (m_buffer.size() - m_head);
+        const uint64_t offset = m_parser.offset();
+        if (offset >= m_position) {
+            m_head = m_buffer.size();
+            break;
+        }
+        m_head += offset - start;
+        const size_t available = m_buffer.size() - m_head;
+        if (available < m_parser.need())
+            break;
+        m_parser.parse(&m_buffer[m_head], available);
+    }
+    if (m_head == m_buffer.size()) {
+        m_buffer.clear();
+        m_head = 0;
+    }
+}
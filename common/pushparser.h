@@ -0,0 +1,105 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef PUSHPARSER_H
+#define PUSHPARSER_H
+
+#include <stddef.h>
+
+#include <vector>
+
+#if !defined(__osf__)
+#include <inttypes.h>
+#else
+typedef unsigned char  uint8_t;
+typedef unsigned short uint16_t;
+typedef unsigned int   uint32_t;
+typedef unsigned long long uint64_t;
+#endif
+
+/**
+ * A parser that is handed its input instead of reading it.
+ *
+ * At any time the parser wants need() bytes at offset(), which is never
+ * before the bytes it was handed last; wanting them further on means
+ * whatever lies between is skipped.  parse() hands them over, and more
+ * after them if there are, and the parser says what it wants next.  It
+ * is handed fewer only where the input ends, and is then done.
+ *
+ * Nothing of this waits for anything, so one thread can keep any number
+ * of parsers going, on files or on streams arriving in pieces.
+ */
+class PushParser
+{
+public:
+    enum Status {
+        Continue,
+        Done,
+        Failed
+    };
+
+    PushParser();
+    virtual ~PushParser();
+
+    Status status() const { return m_status; }
+    uint64_t offset() const { return m_offset; }
+    size_t need() const { return m_need; }
+
+    /** Hands over the bytes at offset(). */
+    Status parse(const uint8_t *data, size_t length);
+
+protected:
+    /** Takes the bytes at offset(), and calls want() unless it is done. */
+    virtual Status consume(const uint8_t *data, size_t length) = 0;
+
+    void want(uint64_t offset, size_t length);
+
+private:
+    Status m_status;
+    uint64_t m_offset;
+    size_t m_need;
+};
+
+/**
+ * Hands a stream that arrives in pieces of any size to a PushParser:
+ * what the parser wants is buffered until all of it is there, and what
+ * it skips is dropped as it goes by.
+ */
+class PushFeeder
+{
+public:
+    explicit PushFeeder(PushParser &parser);
+
+    /** The next piece of the stream. */
+    PushParser::Status push(const uint8_t *data, size_t length);
+    /** The stream has ended. */
+    PushParser::Status finish();
+
+    /** How much of the stream was pushed. */
+    uint64_t position() const { return m_position; }
+
+private:
+    void drain();
+
+    PushParser &m_parser;
+    // the bytes up to m_position the parser may still want, from m_head
+    std::vector<uint8_t> m_buffer;
+    size_t m_head;
+    uint64_t m_position;
+};
+
+#endif
@@ -0,0 +1,173 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "regionsnapshot.h"
+
+#include <string.h>
+
+namespace {
+
+void put64(std::string &out, uint64_t v)
+{
+    for (int i = 0; i < 8; ++i)
+        out += char(v >> (8 * i));
+}
+
+bool get64(const std::string &in, size_t &pos, uint64_t &v)
+{
+    if (in.size() - pos < 8)
+        return false;
+    v = 0;
+    for (int i = 0; i < 8; ++i)
+        v |= uint64_t(uint8_t(in[pos + i])) << (8 * i);
+    pos += 8;
+    return true;
+}
+
+}
+
+RegionSnapshot::RegionSnapshot()
+{
+    clear();
+}
+
+void RegionSnapshot::clear()
+{
+    m_regions.clear();
+    m_bytes = 0;
+    m_fileSize = 0;
+    m_fingerprint = 0;
+    m_changed = false;
+}
+
+void RegionSnapshot::setFileSize(uint64_t size)
+{
+    m_changed = m_changed || size != m_fileSize;
+    m_fileSize = size;
+}
+
+void RegionSnapshot::setFingerprint(uint64_t fingerprint)
+{
+    m_changed = m_changed || fingerprint != m_fingerprint;
+    m_fingerprint = fingerprint;
+}
+
+bool RegionSnapshot::read(uint64_t offset, size_t length, char *data) const
+{
+    if (m_regions.empty())
+        return false;
+
+    // the region starting at or before offset is the only one that can
+    // hold it, as adjacent regions are merged
+    std::map<uint64_t, std::string>::const_iterator it = m_regions.upper_bound(offset);
+    if (it == m_regions.begin())
+        return false;
+    --it;
+    if (offset + length > it->first + it->second.size())
+        return false;
+
+    memcpy(data, it->second.data() + (offset - it->first), length);
+    return true;
+}
+
+void RegionSnapshot::add(uint64_t offset, const char *data, size_t length)
+{
+    if (length == 0)
+        return;
+
+    uint64_t start = offset;
+    uint64_t end = offset + length;
+
+    // everything overlapping or touching [start, end) is merged into one
+    std::map<uint64_t, std::string>::iterator first = m_regions.upper_bound(start);
+    if (first != m_regions.begin()) {
+        std::map<uint64_t, std::string>::iterator before = first;
+        --before;
+        if (before->first + before->second.size() >= start)
+            first = before;
+    }
+    std::map<uint64_t, std::string>::iterator last = first;
+    while (last != m_regions.end() && last->first <= end)
+        ++last;
+
+    if (first != last) {
+        std::map<uint64_t, std::string>::iterator back = last;
+        --back;
+        if (first->first < start)
+            start = first->first;
+        if (back->first + back->second.size() > end)
+            end = back->first + back->second.size();
+    }
+
+    std::string merged(end - start, '\0');
+    for (std::map<uint64_t, std::string>::iterator it = first; it != last; ++it) {
+        merged.replace(it->first - start, it->second.size(), it->second);
+        m_bytes -= it->second.size();
+    }
+    merged.replace(offset - start, length, data, length);
+    m_regions.erase(first, last);
+    m_regions.insert(std::make_pair(start, merged));
+    m_bytes += merged.size();
+    m_changed = true;
+}
+
+/**
+ * The file size and fingerprint, the number of regions, and the offset,
+ * length and bytes of each, little endian.
+ */
+void RegionSnapshot::save(std::string &out) const
+{
+    out.clear();
+    out.reserve(24 + m_regions.size() * 16 + m_bytes);
+    put64(out, m_fileSize);
+    put64(out, m_fingerprint);
+    put64(out, m_regions.size());
+    for (std::map<uint64_t, std::string>::const_iterator it = m_regions.begin();
+         it != m_regions.end(); ++it) {
+        put64(out, it->first);
+        put64(out, it->second.size());
+        out += it->second;
+    }
+}
+
+bool RegionSnapshot::load(const std::string &in)
+{
+    clear();
+
+    size_t pos = 0;
+    uint64_t count;
+    if (!get64(in, pos, m_fileSize) || !get64(in, pos, m_fingerprint) || !get64(in, pos, count))
+        return false;
+
+    for (uint64_t i = 0; i < count; ++i) {
+        uint64_t offset, length;
+        if (!get64(in, pos, offset) || !get64(in, pos, length) ||
+            length > in.size() - pos || offset + length > m_fileSize) {
+            clear();
+            return false;
+        }
+        add(offset, in.data() + pos, length);
+        pos += length;
+    }
+
+    if (pos != in.size()) {
+        clear();
+        return false;
+    }
+    m_changed = false;
+    return true;
+}
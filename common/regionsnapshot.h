@@ -0,0 +1,76 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef REGIONSNAPSHOT_H
+#define REGIONSNAPSHOT_H
+
+#include <stddef.h>
+
+#include <map>
+#include <string>
+
+#if !defined(__osf__)
+#include <inttypes.h>
+#else
+typedef unsigned char  uint8_t;
+typedef unsigned short uint16_t;
+typedef unsigned int   uint32_t;
+typedef unsigned long long uint64_t;
+#endif
+
+/**
+ * The parts of a file an analyzer read, so it can read them again
+ * without going to the file.
+ *
+ * Regions are kept sorted and merged, along with the size of the whole
+ * file and its MetadataCache fingerprint, which would otherwise need
+ * reading the file too.
+ */
+class RegionSnapshot
+{
+public:
+    RegionSnapshot();
+
+    void clear();
+
+    uint64_t fileSize() const { return m_fileSize; }
+    void setFileSize(uint64_t size);
+    uint64_t fingerprint() const { return m_fingerprint; }
+    void setFingerprint(uint64_t fingerprint);
+
+    /** Copies length bytes at offset, if all of them are in the snapshot. */
+    bool read(uint64_t offset, size_t length, char *data) const;
+    void add(uint64_t offset, const char *data, size_t length);
+
+    /** The number of bytes of the file in the snapshot. */
+    uint64_t bytes() const { return m_bytes; }
+    /** Whether anything was added since the snapshot was loaded or cleared. */
+    bool isChanged() const { return m_changed; }
+
+    void save(std::string &out) const;
+    bool load(const std::string &in);
+
+private:
+    // disjoint regions, by offset; adjacent ones are merged
+    std::map<uint64_t, std::string> m_regions;
+    uint64_t m_bytes;
+    uint64_t m_fileSize;
+    uint64_t m_fingerprint;
+    bool m_changed;
+};
+
+#endif
@@ -0,0 +1,119 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "riffparser.h"
+
+#include <string.h>
+
+// a chunk header, and the list type when it is a list
+static const size_t riff_header = 12;
+
+RiffParser::RiffParser()
+    : m_state(Form), m_rf64(false), m_read(0), m_next(0), m_last(0)
+{
+    m_id[4] = '\0';
+    want(0, riff_header);
+}
+
+void RiffParser::resume(uint64_t offset, bool rf64)
+{
+    m_state = Header;
+    m_rf64 = rf64;
+    m_ends.clear();
+    m_last = offset;
+    want(offset, riff_header);
+}
+
+RiffParser::Action RiffParser::chunkData(const char * /*id*/, uint64_t /*offset*/,
+                                         const uint8_t * /*data*/, size_t /*length*/)
+{
+    return Skip;
+}
+
+PushParser::Status RiffParser::consume(const uint8_t *data, size_t length)
+{
+    const uint64_t offset = this->offset();
+
+    if (m_state == Form) {
+        if (length < riff_header)
+            return Failed;
+        if (!memcmp(data, "RF64", 4) || !memcmp(data, "BW64", 4))
+            m_rf64 = true;
+        else if (memcmp(data, "RIFF", 4))
+            return Failed;
+
+        char form[5] = { 0 };
+        memcpy(form, data + 8, 4);
+        if (!accept(form))
+            return Failed;
+        m_state = Header;
+        want(riff_header, riff_header);
+        return Continue;
+    }
+
+    if (m_state == Data) {
+        m_state = Header;
+        return next(chunkData(m_id, offset, data, length < m_read ? length : m_read));
+    }
+
+    // the lists that end here are done with
+    while (!m_ends.empty() && offset >= m_ends.back())
+        m_ends.pop_back();
+
+    if (length < 8)
+        return Done;
+    if (m_ends.empty())
+        m_last = offset;
+    memcpy(m_id, data, 4);
+    uint64_t size = get32(data + 4);
+    char type[5] = { 0 };
+    const bool list = !memcmp(m_id, "LIST", 4) || !memcmp(m_id, "RIFF", 4);
+    if (list && length >= riff_header)
+        memcpy(type, data + 8, 4);
+
+    size_t read = 0;
+    Action action = chunk(m_id, list ? type : 0, offset + 8, size, read);
+
+    // chunks are word aligned
+    m_next = offset + 8 + size + (size & 1);
+
+    if (action == Read) {
+        if (read > size)
+            read = size;
+        if (read) {
+            m_state = Data;
+            m_read = read;
+            want(offset + 8, read);
+            return Continue;
+        }
+        action = Skip;
+    }
+    if (action == Descend && list && size >= 4) {
+        m_ends.push_back(m_next);
+        want(offset + riff_header, riff_header);
+        return Continue;
+    }
+    return next(action == Descend ? Skip : action);
+}
+
+PushParser::Status RiffParser::next(Action action)
+{
+    if (action == Stop)
+        return Done;
+    want(m_next, riff_header);
+    return Continue;
+}
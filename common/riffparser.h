@@ -0,0 +1,103 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef RIFFPARSER_H
+#define RIFFPARSER_H
+
+#include "pushparser.h"
+
+/**
+ * Walks the chunks of a RIFF file, or of an RF64 or BW64 one, as a
+ * PushParser: only the chunk headers, and the chunks a subclass asks
+ * for, are wanted, and everything else is skipped.
+ *
+ * The walk goes on to the end of the input rather than to the end the
+ * RIFF header gives, which writers that were interrupted leave wrong.
+ */
+class RiffParser: public PushParser
+{
+public:
+    RiffParser();
+
+    /** Whether the file is RF64 or BW64, with the real sizes in ds64. */
+    bool isRf64() const { return m_rf64; }
+
+protected:
+    enum Action {
+        Skip,
+        Read,       // the first read bytes go to chunkData()
+        Descend,    // for lists: walk the chunks in it
+        Stop
+    };
+
+    /** Whether a file of the form, such as "WAVE", is wanted at all. */
+    virtual bool accept(const char *form) = 0;
+
+    /**
+     * A chunk whose data starts at offset.  type is the list type for
+     * lists, which is the first four bytes of the data, and 0 for other
+     * chunks.  size can be changed where the real size is known better.
+     */
+    virtual Action chunk(const char *id, const char *type, uint64_t offset,
+                         uint64_t &size, size_t &read) = 0;
+
+    /** How many lists the chunk given to chunk() is in. */
+    size_t depth() const { return m_ends.size(); }
+
+    /**
+     * Where the header of the last chunk given to chunk() outside of
+     * any list is, which is where a walk over more of the file can be
+     * resumed from.
+     */
+    uint64_t lastChunk() const { return m_last; }
+    /** Walks on from the chunk header at offset, as if the rest was seen. */
+    void resume(uint64_t offset, bool rf64);
+
+    /** What Read asked for, or less at the end of the input. */
+    virtual Action chunkData(const char *id, uint64_t offset, const uint8_t *data,
+                             size_t length);
+
+    static uint16_t get16(const uint8_t *p) { return p[0] | (p[1] << 8); }
+    static uint32_t get32(const uint8_t *p)
+    {
+        return uint32_t(p[0]) | (uint32_t(p[1]) << 8) |
+               (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24);
+    }
+    static uint64_t get64(const uint8_t *p) { return get32(p) | (uint64_t(get32(p + 4)) << 32); }
+
+private:
+    virtual Status consume(const uint8_t *data, size_t length);
+    Status next(Action action);
+
+    enum State {
+        Form,
+        Header,
+        Data
+    };
+
+    State m_state;
+    bool m_rf64;
+    char m_id[5];
+    size_t m_read;
+    // the chunk after the one being read, and the ends of the lists
+    // the walk is in
+    uint64_t m_next;
+    std::vector<uint64_t> m_ends;
+    uint64_t m_last;
+};
+
+#endif
@@ -0,0 +1,185 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "scratcharena.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include <new>
+
+// the first block, each one after it at least twice the one before
+static const size_t first_block = 64 << 10;
+
+// an arena that was done with a file keeps up to this much for the next
+static const size_t kept_blocks = 1 << 20;
+
+// what everything handed out is aligned to
+static const size_t alignment = 16;
+
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+static pthread_key_t arena_key;
+
+void ScratchArena::createKey()
+{
+    pthread_key_create(&arena_key, destroy);
+}
+
+ScratchArena &ScratchArena::local()
+{
+    pthread_once(&arena_once, createKey);
+    ScratchArena *arena = static_cast<ScratchArena *>(pthread_getspecific(arena_key));
+    if (!arena) {
+        arena = new ScratchArena;
+        pthread_setspecific(arena_key, arena);
+    }
+    return *arena;
+}
+
+void ScratchArena::destroy(void *arena)
+{
+    delete static_cast<ScratchArena *>(arena);
+}
+
+ScratchArena::ScratchArena()
+    : m_block(0), m_used(0), m_scopes(0), m_generation(0)
+{
+}
+
+ScratchArena::~ScratchArena()
+{
+    for (size_t i = 0; i < m_blocks.size(); ++i)
+        free(m_blocks[i].data);
+}
+
+void *ScratchArena::allocate(size_t size)
+{
+    size = (size + alignment - 1) & ~(alignment - 1);
+
+    // what doesn't fit in the current block goes in the next one that it
+    // fits in, and blocks skipped are used again after the scope
+    while (m_block < m_blocks.size() && m_blocks[m_block].size - m_used < size) {
+        ++m_block;
+        m_used = 0;
+    }
+    if (m_block == m_blocks.size()) {
+        size_t blockSize = m_blocks.empty() ? first_block : 2 * m_blocks.back().size;
+        if (blockSize < size)
+            blockSize = size;
+        // malloc aligns for any type, which is as much as is asked for
+        Block block;
+        block.data = static_cast<char *>(malloc(blockSize));
+        if (!block.data)
+            throw std::bad_alloc();
+        block.size = blockSize;
+        m_blocks.push_back(block);
+        m_used = 0;
+    }
+
+    void *data = m_blocks[m_block].data + m_used;
+    m_used += size;
+    return data;
+}
+
+size_t ScratchArena::used() const
+{
+    size_t used = m_used;
+    for (size_t i = 0; i < m_block && i < m_blocks.size(); ++i)
+        used += m_blocks[i].size;
+    return used;
+}
+
+ScratchArena::Mark ScratchArena::open()
+{
+    ++m_scopes;
+    Mark mark;
+    mark.block = m_block;
+    mark.used = m_used;
+    return mark;
+}
+
+void ScratchArena::close(const Mark &mark)
+{
+    --m_scopes;
+    ++m_generation;
+    m_block = mark.block;
+    m_used = mark.used;
+    if (m_scopes)
+        return;
+
+    // a file that needed a lot doesn't keep it from the others
+    size_t kept = 0;
+    size_t i = 0;
+    while (i < m_blocks.size() && kept + m_blocks[i].size <= kept_blocks)
+        kept += m_blocks[i++].size;
+    // what was handed out outside of any scope stays
+    const size_t held = m_used ? m_block + 1 : m_block;
+    if (i < held)
+        i = held;
+    for (size_t j = i; j < m_blocks.size(); ++j)
+        free(m_blocks[j].data);
+    m_blocks.resize(i);
+}
+
+ScratchScope::ScratchScope()
+    : m_arena(ScratchArena::local()), m_mark(m_arena.open())
+{
+}
+
+ScratchScope::~ScratchScope()
+{
+    m_arena.close(m_mark);
+}
+
+ScratchBuffer::ScratchBuffer()
+    : m_data(0), m_size(0), m_heap(false), m_generation(0)
+{
+}
+
+ScratchBuffer::~ScratchBuffer()
+{
+    if (m_heap)
+        free(m_data);
+}
+
+uint8_t *ScratchBuffer::reserve(size_t size)
+{
+    ScratchArena &arena = ScratchArena::local();
+    if (!m_heap && m_generation != arena.generation())
+        m_size = 0;
+    if (size <= m_size)
+        return m_data;
+
+    size_t grown = 2 * m_size;
+    if (grown < size)
+        grown = size;
+    if (m_heap)
+        free(m_data);
+    m_data = 0;
+    m_size = 0;
+    m_heap = !arena.inScope();
+    if (m_heap) {
+        m_data = static_cast<uint8_t *>(malloc(grown));
+        if (!m_data)
+            throw std::bad_alloc();
+    } else {
+        m_data = static_cast<uint8_t *>(arena.allocate(grown));
+        m_generation = arena.generation();
+    }
+    m_size = grown;
+    return m_data;
+}
@@ -0,0 +1,135 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef SCRATCHARENA_H
+#define SCRATCHARENA_H
+
+#include <stddef.h>
+
+#include <vector>
+
+#if !defined(__osf__)
+#include <inttypes.h>
+#else
+typedef unsigned char  uint8_t;
+typedef unsigned short uint16_t;
+typedef unsigned int   uint32_t;
+typedef unsigned long long uint64_t;
+#endif
+
+/**
+ * Memory for what the parsers need while one file is read, taken from
+ * blocks that are kept from one file to the next instead of going back
+ * to malloc.  Every thread has its own, so the workers of an indexer
+ * don't contend for the heap.
+ *
+ * Nothing is freed by itself: a ScratchScope, which CachedFilePlugin
+ * opens around every file, takes back all that was handed out in it
+ * when it ends.
+ */
+class ScratchArena
+{
+public:
+    /** The arena of the calling thread. */
+    static ScratchArena &local();
+
+    /** size bytes, aligned for any type, until the scope ends. */
+    void *allocate(size_t size);
+
+    /** Whether a scope is open, without which nothing is ever taken back. */
+    bool inScope() const { return m_scopes > 0; }
+    /** How often a scope ended, so buffers know theirs is gone. */
+    uint64_t generation() const { return m_generation; }
+    /** What is handed out now. */
+    size_t used() const;
+
+private:
+    friend class ScratchScope;
+
+    struct Block
+    {
+        char *data;
+        size_t size;
+    };
+    struct Mark
+    {
+        size_t block;
+        size_t used;
+    };
+
+    ScratchArena();
+    ~ScratchArena();
+    ScratchArena(const ScratchArena &);
+    ScratchArena &operator=(const ScratchArena &);
+
+    static void createKey();
+    static void destroy(void *arena);
+
+    Mark open();
+    void close(const Mark &mark);
+
+    std::vector<Block> m_blocks;
+    // the block being handed out from, and how much of it is
+    size_t m_block;
+    size_t m_used;
+    int m_scopes;
+    uint64_t m_generation;
+};
+
+/**
+ * Everything the thread's arena hands out while this is in scope is
+ * taken back at its end.  Scopes nest.
+ */
+class ScratchScope
+{
+public:
+    ScratchScope();
+    ~ScratchScope();
+
+private:
+    ScratchScope(const ScratchScope &);
+    ScratchScope &operator=(const ScratchScope &);
+
+    ScratchArena &m_arena;
+    ScratchArena::Mark m_mark;
+};
+
+/**
+ * A buffer that grows in the thread's arena while a scope is open, and
+ * on the heap otherwise.  Its contents are not kept when it grows, and
+ * it mustn't be used past the end of the scope it grew in.
+ */
+class ScratchBuffer
+{
+public:
+    ScratchBuffer();
+    ~ScratchBuffer();
+
+    /** At least size bytes. */
+    uint8_t *reserve(size_t size);
+
+private:
+    ScratchBuffer(const ScratchBuffer &);
+    ScratchBuffer &operator=(const ScratchBuffer &);
+
+    uint8_t *m_data;
+    size_t m_size;
+    bool m_heap;
+    uint64_t m_generation;
+};
+
+#endif
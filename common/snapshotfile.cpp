@@ -0,0 +1,159 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "snapshotfile.h"
+
+#include <QFile>
+
+#include <string.h>
+
+#include "regionsnapshot.h"
+#include "scratcharena.h"
+
+// the file is read and remembered in whole pages, as the kernel reads
+// those anyway and parsers tend to come back for the bytes nearby
+static const qint64 snapshot_page = 4096;
+
+SnapshotFile::SnapshotFile(const QString &name, RegionSnapshot *snapshot)
+    : m_name(name), m_snapshot(snapshot), m_size(0)
+{
+}
+
+SnapshotFile::~SnapshotFile()
+{
+    close();
+}
+
+void SnapshotFile::setFileName(const QString &name)
+{
+    m_name = name;
+}
+
+void SnapshotFile::setSnapshot(RegionSnapshot *snapshot)
+{
+    m_snapshot = snapshot;
+}
+
+bool SnapshotFile::openFile()
+{
+    if (m_input.isOpen())
+        return true;
+    if (!m_input.open(QFile::encodeName(m_name).data()))
+        return false;
+    m_size = m_input.size();
+    return true;
+}
+
+bool SnapshotFile::open(OpenMode mode)
+{
+    if (isOpen() || (mode & (WriteOnly | Append | Truncate)))
+        return false;
+
+    // a snapshot that knows the size needn't touch the file at all
+    if (m_snapshot && m_snapshot->fileSize())
+        m_size = m_snapshot->fileSize();
+    else if (!openFile())
+        return false;
+
+    if (m_snapshot)
+        m_snapshot->setFileSize(m_size);
+
+    // QIODevice's buffer would ask for more than the parser wants
+    return QIODevice::open(mode | Unbuffered);
+}
+
+void SnapshotFile::close()
+{
+    if (isOpen())
+        QIODevice::close();
+    m_input.close();
+    m_size = 0;
+}
+
+qint64 SnapshotFile::size() const
+{
+    return m_size;
+}
+
+bool SnapshotFile::isSequential() const
+{
+    return false;
+}
+
+int SnapshotFile::handle()
+{
+    return isOpen() && openFile() ? m_input.handle() : -1;
+}
+
+PushParser::Status SnapshotFile::parse(PushParser &parser)
+{
+    if (!m_snapshot && isOpen() && openFile())
+        return m_input.parse(parser);
+
+    ScratchBuffer buffer;
+    while (parser.status() == PushParser::Continue) {
+        if (qint64(parser.offset()) >= m_size) {
+            parser.parse(0, 0);
+            continue;
+        }
+        uint8_t *data = buffer.reserve(parser.need());
+        qint64 got = -1;
+        if (seek(parser.offset()))
+            got = read(reinterpret_cast<char *>(data), parser.need());
+        if (got < 0)
+            return PushParser::Failed;
+        parser.parse(data, got);
+    }
+    return parser.status();
+}
+
+qint64 SnapshotFile::readData(char *data, qint64 maxSize)
+{
+    const qint64 offset = pos();
+    if (offset >= m_size || maxSize <= 0)
+        return 0;
+    const qint64 length = maxSize < m_size - offset ? maxSize : m_size - offset;
+
+    if (m_snapshot && m_snapshot->read(offset, length, data))
+        return length;
+    if (!openFile())
+        return -1;
+
+    if (!m_snapshot)
+        return m_input.read(offset, data, length);
+
+    const qint64 first = offset / snapshot_page * snapshot_page;
+    qint64 last = (offset + length + snapshot_page - 1) / snapshot_page * snapshot_page;
+    if (last > m_size)
+        last = m_size;
+
+    // only what was really read goes into the snapshot, should the file
+    // have shrunk since it was opened
+    const InputSpan pages = m_input.span(first, last - first);
+    const qint64 done = pages.length();
+    if (done <= offset - first)
+        return 0;
+    m_snapshot->add(first, reinterpret_cast<const char *>(pages.data()), done);
+    const qint64 got = done - (offset - first) < length ? done - (offset - first) : length;
+    memcpy(data, pages.data() + (offset - first), got);
+    return got;
+}
+
+qint64 SnapshotFile::writeData(const char * /*data*/, qint64 /*maxSize*/)
+{
+    return -1;
+}
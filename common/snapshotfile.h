@@ -0,0 +1,71 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef SNAPSHOTFILE_H
+#define SNAPSHOTFILE_H
+
+#include <QIODevice>
+#include <QString>
+
+#include "mappedinput.h"
+#include "pushparser.h"
+
+class RegionSnapshot;
+
+/**
+ * A read only file that goes through a RegionSnapshot.
+ *
+ * Reads the snapshot holds are answered from it; everything else is read
+ * from the file, which is only opened then, a page at a time, and added
+ * to the snapshot.  Without a snapshot this is just a MappedInput, and
+ * parse() hands the parser spans of the mapping.
+ *
+ * handle() opens the file too, and reads through it bypass the snapshot.
+ */
+class SnapshotFile: public QIODevice
+{
+public:
+    explicit SnapshotFile(const QString &name = QString(), RegionSnapshot *snapshot = 0);
+    virtual ~SnapshotFile();
+
+    void setFileName(const QString &name);
+    void setSnapshot(RegionSnapshot *snapshot);
+
+    virtual bool open(OpenMode mode);
+    virtual void close();
+    virtual qint64 size() const;
+    virtual bool isSequential() const;
+
+    int handle();
+
+    /** Runs parser over the file, reading only what it asks for. */
+    PushParser::Status parse(PushParser &parser);
+
+protected:
+    virtual qint64 readData(char *data, qint64 maxSize);
+    virtual qint64 writeData(const char *data, qint64 maxSize);
+
+private:
+    bool openFile();
+
+    QString m_name;
+    RegionSnapshot *m_snapshot;
+    MappedInput m_input;
+    qint64 m_size;
+};
+
+#endif
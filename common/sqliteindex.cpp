@@ -0,0 +1,436 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "sqliteindex.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <sqlite3.h>
+
+#include "metadatarecord.h"
+#include "scratcharena.h"
+
+// the layout of the tables, along with the number of fields, which
+// gives a column or more each; a database of another is made anew
+static const int schema_version = 2;
+
+// records fewer than a batch are written after waiting this long for more
+static const int commit_delay = 1;
+
+// how long a write waits for other processes on the same database
+static const int busy_timeout = 5000;
+
+namespace {
+
+typedef MetadataRecord R;
+
+int userVersion()
+{
+    return schema_version << 8 | R::FieldCount;
+}
+
+struct Column
+{
+    std::string name;
+    const char *type;
+};
+
+// the columns of a field, which for sizes and images has the width and
+// height in columns of their own
+std::vector<Column> fieldColumns(R::Field field)
+{
+    std::vector<Column> columns(1);
+    columns[0].name = R::name(field);
+    switch (R::type(field)) {
+    case R::Integer:
+    case R::Boolean:
+    case R::Hash:
+        columns[0].type = "INTEGER";
+        break;
+    case R::Real:
+    case R::Duration:
+        columns[0].type = "REAL";
+        break;
+    case R::Text:
+        columns[0].type = "TEXT";
+        break;
+    case R::Blob:
+    case R::Image:
+        columns[0].type = "BLOB";
+        break;
+    case R::Size:
+        columns.clear();
+        break;
+    }
+    if (R::type(field) == R::Size || R::type(field) == R::Image) {
+        const Column width = { std::string(R::name(field)) + "_width", "INTEGER" };
+        const Column height = { std::string(R::name(field)) + "_height", "INTEGER" };
+        columns.push_back(width);
+        columns.push_back(height);
+    }
+    return columns;
+}
+
+// binds the value of a field to the columns from index on, and gives
+// the index after them
+int bindField(sqlite3_stmt *statement, int index, R::Type type, const R::Value *value)
+{
+    const int columns = type == R::Image ? 3 : type == R::Size ? 2 : 1;
+    if (!value)
+        return index + columns;   // null, as the bindings were cleared
+
+    switch (type) {
+    case R::Integer:
+    case R::Boolean:
+    case R::Hash:
+        sqlite3_bind_int64(statement, index, value->number);
+        break;
+    case R::Real:
+    case R::Duration:
+        sqlite3_bind_double(statement, index, value->real);
+        break;
+    case R::Text:
+        sqlite3_bind_text(statement, index, value->data, value->length, SQLITE_STATIC);
+        break;
+    case R::Blob:
+        sqlite3_bind_blob(statement, index, value->data, value->length, SQLITE_STATIC);
+        break;
+    case R::Size:
+        sqlite3_bind_int64(statement, index, value->number);
+        sqlite3_bind_int64(statement, index + 1, value->scale);
+        break;
+    case R::Image:
+        sqlite3_bind_blob(statement, index, value->data, value->length, SQLITE_STATIC);
+        sqlite3_bind_int64(statement, index + 1, value->number);
+        sqlite3_bind_int64(statement, index + 2, value->scale);
+        break;
+    }
+    return index + columns;
+}
+
+// the file, analyzer and request a row is kept under
+int bindKey(sqlite3_stmt *statement, const MetadataCache::Key &key,
+            const std::string &analyzer, uint32_t what)
+{
+    sqlite3_bind_int64(statement, 1, key.device);
+    sqlite3_bind_int64(statement, 2, key.inode);
+    sqlite3_bind_text(statement, 3, analyzer.data(), analyzer.size(), SQLITE_STATIC);
+    sqlite3_bind_int64(statement, 4, what);
+    return 5;
+}
+
+bool step(sqlite3_stmt *statement)
+{
+    const bool done = sqlite3_step(statement) == SQLITE_DONE;
+    sqlite3_reset(statement);
+    sqlite3_clear_bindings(statement);
+    return done;
+}
+
+}
+
+SqliteIndex::SqliteIndex(const std::string &path, size_t limit, size_t batch)
+    : m_db(0), m_upsert(0), m_deleteExtras(0), m_insertExtra(0),
+      m_limit(limit ? limit : 1), m_batch(batch ? batch : 1), m_running(false),
+      m_busy(false), m_flush(false), m_stop(false), m_failed(0)
+{
+    pthread_mutex_init(&m_mutex, 0);
+    pthread_cond_init(&m_wake, 0);
+    pthread_cond_init(&m_space, 0);
+    pthread_cond_init(&m_done, 0);
+    if (m_batch > m_limit)
+        m_batch = m_limit;
+
+    if (open(path))
+        m_running = pthread_create(&m_thread, 0, run, this) == 0;
+    if (!m_running && m_db) {
+        sqlite3_finalize(m_upsert);
+        sqlite3_finalize(m_deleteExtras);
+        sqlite3_finalize(m_insertExtra);
+        sqlite3_close(m_db);
+        m_db = 0;
+    }
+}
+
+SqliteIndex::~SqliteIndex()
+{
+    if (m_running) {
+        pthread_mutex_lock(&m_mutex);
+        m_stop = true;
+        pthread_cond_signal(&m_wake);
+        pthread_mutex_unlock(&m_mutex);
+        pthread_join(m_thread, 0);
+
+        sqlite3_finalize(m_upsert);
+        sqlite3_finalize(m_deleteExtras);
+        sqlite3_finalize(m_insertExtra);
+        sqlite3_close(m_db);
+    }
+    pthread_cond_destroy(&m_done);
+    pthread_cond_destroy(&m_space);
+    pthread_cond_destroy(&m_wake);
+    pthread_mutex_destroy(&m_mutex);
+}
+
+bool SqliteIndex::execute(const char *sql)
+{
+    if (sqlite3_exec(m_db, sql, 0, 0, 0) == SQLITE_OK)
+        return true;
+    m_error = sqlite3_errmsg(m_db);
+    return false;
+}
+
+bool SqliteIndex::prepare(const std::string &sql, sqlite3_stmt *&statement)
+{
+    if (sqlite3_prepare_v2(m_db, sql.c_str(), sql.size() + 1, &statement, 0) == SQLITE_OK)
+        return true;
+    m_error = sqlite3_errmsg(m_db);
+    return false;
+}
+
+bool SqliteIndex::open(const std::string &path)
+{
+    // the library may be older than the header built against
+    if (sqlite3_libversion_number() < 3024000) {
+        m_error = std::string("SQLite ") + sqlite3_libversion() + " has no upserts";
+        return false;
+    }
+
+    // only ever used by the writer, which needs no locking of SQLite's
+    if (sqlite3_open_v2(path.c_str(), &m_db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE |
+                        SQLITE_OPEN_NOMUTEX, 0) != SQLITE_OK) {
+        m_error = sqlite3_errmsg(m_db);
+        sqlite3_close(m_db);
+        m_db = 0;
+        return false;
+    }
+    sqlite3_busy_timeout(m_db, busy_timeout);
+
+    // with WAL, readers of the index don't hold up the writer, and a
+    // commit only has to reach the log
+    execute("PRAGMA journal_mode = WAL");
+    execute("PRAGMA synchronous = NORMAL");
+
+    int version = -1;
+    sqlite3_stmt *statement;
+    if (prepare("PRAGMA user_version", statement)) {
+        if (sqlite3_step(statement) == SQLITE_ROW)
+            version = sqlite3_column_int(statement, 0);
+        sqlite3_finalize(statement);
+    }
+    if (version != userVersion() &&
+        !(execute("DROP TABLE IF EXISTS files") && execute("DROP TABLE IF EXISTS extras")))
+        return false;
+
+    std::string columns;
+    std::string names;
+    std::string values;
+    std::string updates;
+    for (int i = 0; i < R::FieldCount; ++i) {
+        const std::vector<Column> parts = fieldColumns(R::Field(i));
+        for (size_t j = 0; j < parts.size(); ++j) {
+            columns += ", " + parts[j].name + " " + parts[j].type;
+            names += ", " + parts[j].name;
+            values += ", ?";
+            updates += ", " + parts[j].name + " = excluded." + parts[j].name;
+        }
+    }
+
+    const std::string create =
+        "CREATE TABLE IF NOT EXISTS files (device INTEGER NOT NULL, inode INTEGER NOT NULL, "
+        "analyzer TEXT NOT NULL, what INTEGER NOT NULL, mtime INTEGER NOT NULL, "
+        "size INTEGER NOT NULL, path TEXT NOT NULL, settings INTEGER NOT NULL" + columns + ", "
+        "PRIMARY KEY (device, inode, analyzer, what))";
+    char pragma[64];
+    snprintf(pragma, sizeof(pragma), "PRAGMA user_version = %d", userVersion());
+    if (!execute(create.c_str()) ||
+        !execute("CREATE TABLE IF NOT EXISTS extras (device INTEGER NOT NULL, "
+                 "inode INTEGER NOT NULL, analyzer TEXT NOT NULL, what INTEGER NOT NULL, "
+                 "tag_group TEXT NOT NULL, tag_key TEXT NOT NULL, tag_value TEXT)") ||
+        !execute("CREATE INDEX IF NOT EXISTS extras_file "
+                 "ON extras (device, inode, analyzer, what)") ||
+        !execute(pragma))
+        return false;
+
+    // a file known with the same key and path, and read with the same
+    // settings, keeps its row untouched
+    const std::string upsert =
+        "INSERT INTO files (device, inode, analyzer, what, mtime, size, path, settings" + names +
+        ") VALUES (?, ?, ?, ?, ?, ?, ?, ?" + values + ") "
+        "ON CONFLICT (device, inode, analyzer, what) DO UPDATE SET "
+        "mtime = excluded.mtime, size = excluded.size, path = excluded.path, "
+        "settings = excluded.settings" + updates +
+        " WHERE mtime != excluded.mtime OR size != excluded.size OR path != excluded.path"
+        " OR settings != excluded.settings";
+    return prepare(upsert, m_upsert) &&
+           prepare("DELETE FROM extras WHERE device = ? AND inode = ? AND analyzer = ? "
+                   "AND what = ?", m_deleteExtras) &&
+           prepare("INSERT INTO extras VALUES (?, ?, ?, ?, ?, ?, ?)", m_insertExtra);
+}
+
+void SqliteIndex::add(const MetadataCache::Key &key, const std::string &analyzer,
+                      uint64_t settings, uint32_t what, const std::string &path,
+                      const MetadataRecord &record)
+{
+    if (!m_running)
+        return;
+
+    // the record lives in this thread's arena, so what is queued is its
+    // saved form
+    std::string saved;
+    record.save(saved);
+
+    pthread_mutex_lock(&m_mutex);
+    while (m_queue.size() >= m_limit)
+        pthread_cond_wait(&m_space, &m_mutex);
+    m_queue.push_back(Row());
+    Row &row = m_queue.back();
+    row.key = key;
+    row.analyzer = analyzer;
+    row.settings = settings;
+    row.what = what;
+    row.path = path;
+    row.record.swap(saved);
+    // the writer sleeps until the first record, and then waits for a batch
+    if (m_queue.size() == 1 || m_queue.size() >= m_batch)
+        pthread_cond_signal(&m_wake);
+    pthread_mutex_unlock(&m_mutex);
+}
+
+void SqliteIndex::flush()
+{
+    if (!m_running)
+        return;
+    pthread_mutex_lock(&m_mutex);
+    m_flush = true;
+    pthread_cond_signal(&m_wake);
+    while (!m_queue.empty() || m_busy)
+        pthread_cond_wait(&m_done, &m_mutex);
+    m_flush = false;
+    pthread_mutex_unlock(&m_mutex);
+}
+
+uint64_t SqliteIndex::failed() const
+{
+    pthread_mutex_lock(&m_mutex);
+    const uint64_t failed = m_failed;
+    pthread_mutex_unlock(&m_mutex);
+    return failed;
+}
+
+void *SqliteIndex::run(void *data)
+{
+    SqliteIndex *index = static_cast<SqliteIndex *>(data);
+    std::vector<Row> rows;
+
+    pthread_mutex_lock(&index->m_mutex);
+    for (;;) {
+        // a batch, or what came within the delay, or all there is when
+        // flushing or stopping
+        while (!index->m_stop && index->m_queue.size() < (index->m_flush ? 1 : index->m_batch)) {
+            if (index->m_queue.empty()) {
+                pthread_cond_wait(&index->m_wake, &index->m_mutex);
+                continue;
+            }
+            struct timeval now;
+            gettimeofday(&now, 0);
+            struct timespec deadline;
+            deadline.tv_sec = now.tv_sec + commit_delay;
+            deadline.tv_nsec = now.tv_usec * 1000;
+            if (pthread_cond_timedwait(&index->m_wake, &index->m_mutex, &deadline) == ETIMEDOUT)
+                break;
+        }
+        if (index->m_queue.empty())
+            break;
+
+        rows.swap(index->m_queue);
+        index->m_busy = true;
+        pthread_cond_broadcast(&index->m_space);
+        pthread_mutex_unlock(&index->m_mutex);
+
+        index->write(rows);
+        rows.clear();
+
+        pthread_mutex_lock(&index->m_mutex);
+        index->m_busy = false;
+        pthread_cond_broadcast(&index->m_done);
+    }
+    pthread_mutex_unlock(&index->m_mutex);
+    return 0;
+}
+
+void SqliteIndex::write(std::vector<Row> &rows)
+{
+    uint64_t failed = 0;
+    if (!execute("BEGIN IMMEDIATE")) {
+        failed = rows.size();
+    } else {
+        for (size_t i = 0; i < rows.size(); ++i) {
+            if (!writeRow(rows[i]))
+                ++failed;
+        }
+        if (!execute("COMMIT")) {
+            execute("ROLLBACK");
+            failed = rows.size();
+        }
+    }
+
+    pthread_mutex_lock(&m_mutex);
+    m_failed += failed;
+    pthread_mutex_unlock(&m_mutex);
+}
+
+bool SqliteIndex::writeRow(const Row &row)
+{
+    ScratchScope scratch;
+    MetadataRecord record;
+    if (!record.load(row.record))
+        return false;
+
+    int index = bindKey(m_upsert, row.key, row.analyzer, row.what);
+    sqlite3_bind_int64(m_upsert, index++, row.key.mtime);
+    sqlite3_bind_int64(m_upsert, index++, row.key.size);
+    sqlite3_bind_text(m_upsert, index++, row.path.data(), row.path.size(), SQLITE_STATIC);
+    sqlite3_bind_int64(m_upsert, index++, sqlite3_int64(row.settings));
+    for (int i = 0; i < R::FieldCount; ++i) {
+        const R::Field field = R::Field(i);
+        index = bindField(m_upsert, index, R::type(field),
+                          record.has(field) ? &record.value(field) : 0);
+    }
+    if (!step(m_upsert))
+        return false;
+    // nothing more to do for a file that didn't change
+    if (sqlite3_changes(m_db) == 0)
+        return true;
+
+    bindKey(m_deleteExtras, row.key, row.analyzer, row.what);
+    if (!step(m_deleteExtras))
+        return false;
+    for (size_t i = 0; i < record.extraCount(); ++i) {
+        const MetadataRecord::Extra &extra = record.extra(i);
+        index = bindKey(m_insertExtra, row.key, row.analyzer, row.what);
+        sqlite3_bind_text(m_insertExtra, index++, extra.group, -1, SQLITE_STATIC);
+        sqlite3_bind_text(m_insertExtra, index++, extra.key, -1, SQLITE_STATIC);
+        sqlite3_bind_text(m_insertExtra, index++, extra.value, extra.length, SQLITE_STATIC);
+        if (!step(m_insertExtra))
+            return false;
+    }
+    return true;
+}
@@ -0,0 +1,110 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef SQLITEINDEX_H
+#define SQLITEINDEX_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+#include "metadatacache.h"
+
+struct sqlite3;
+struct sqlite3_stmt;
+class MetadataRecord;
+
+/**
+ * Keeps what the analyzers found in an SQLite database, a row per file,
+ * analyzer and request, with a column for every MetadataRecord field.
+ *
+ * add() only queues a copy of the record; a thread of the index's own
+ * writes whatever has piled up in one transaction, through prepared
+ * statements, to a database in WAL mode.  Once the queue holds limit
+ * records add() waits for the writer, so that a slow disk holds up the
+ * analyzers instead of filling the memory.
+ *
+ * Rows are upserted by the cache key of the file: a file that is added
+ * again with the same modification time, size and path, and read with
+ * the same settings, is left alone, and otherwise its row is replaced.
+ * Tags without a field of their own go to a table of extras next to it.
+ * Upserts need SQLite 3.24, and an older library leaves the index closed.
+ */
+class SqliteIndex
+{
+public:
+    SqliteIndex(const std::string &path, size_t limit = 4096, size_t batch = 1024);
+    ~SqliteIndex();
+
+    bool isOpen() const { return m_db; }
+    /** Why the index isn't open, if it isn't. */
+    const std::string &error() const { return m_error; }
+
+    /** settings is a digest of the analyzer's version and settings. */
+    void add(const MetadataCache::Key &key, const std::string &analyzer, uint64_t settings,
+             uint32_t what, const std::string &path, const MetadataRecord &record);
+    /** Waits until everything added so far is committed. */
+    void flush();
+
+    /** Records that couldn't be written. */
+    uint64_t failed() const;
+
+private:
+    struct Row
+    {
+        MetadataCache::Key key;
+        std::string analyzer;
+        uint64_t settings;
+        uint32_t what;
+        std::string path;
+        std::string record;
+    };
+
+    SqliteIndex(const SqliteIndex &);
+    SqliteIndex &operator=(const SqliteIndex &);
+
+    bool open(const std::string &path);
+    bool prepare(const std::string &sql, sqlite3_stmt *&statement);
+    bool execute(const char *sql);
+    static void *run(void *index);
+    void write(std::vector<Row> &rows);
+    bool writeRow(const Row &row);
+
+    sqlite3 *m_db;
+    std::string m_error;
+    sqlite3_stmt *m_upsert;
+    sqlite3_stmt *m_deleteExtras;
+    sqlite3_stmt *m_insertExtra;
+
+    size_t m_limit;
+    size_t m_batch;
+    pthread_t m_thread;
+    bool m_running;
+    mutable pthread_mutex_t m_mutex;
+    pthread_cond_t m_wake;
+    pthread_cond_t m_space;
+    pthread_cond_t m_done;
+    std::vector<Row> m_queue;
+    bool m_busy;
+    bool m_flush;
+    bool m_stop;
+    uint64_t m_failed;
+};
+
+#endif
@@ -0,0 +1,1319 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "tagindex.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include <QString>
+
+#include <algorithm>
+
+#include "metadatarecord.h"
+
+// the layout of index files
+static const char index_magic[4] = { 'K', 'T', 'I', 'X' };
+// an index of another version, whose words may be folded otherwise, is
+// started anew
+static const uint32_t index_version = 2;
+static const size_t index_header = 96;
+
+// the sizes of the entries of the docs, words and grams sections
+static const size_t doc_entry = 40;
+static const size_t word_entry = 16;
+static const size_t gram_entry = 16;
+
+// files in a block of a posting list, which the skip table steps over
+static const size_t posting_block = 128;
+
+// the words a prefix or fuzzy word stands for at most, the most common first
+static const size_t max_expansions = 512;
+
+// updates kept in memory before they are saved by themselves
+static const size_t max_pending = 65536;
+
+// the log of updates saved since the index file, which is merged into a
+// new one once it is this large and a quarter of its size
+static const char log_magic[4] = { 'K', 'T', 'I', 'L' };
+static const uint64_t fold_size = 1 << 20;
+
+namespace {
+
+// what a word is padded with for its first and last trigrams
+const uint8_t gram_pad = 1;
+
+// letters that decomposition leaves whole, in lower case, and what they
+// are searched as
+const struct
+{
+    uint32_t letter;
+    const char *folded;
+} whole_letters[] = {
+    { 0x00df, "ss" }, { 0x00e6, "ae" }, { 0x00f0, "d" }, { 0x00f8, "o" },
+    { 0x00fe, "th" }, { 0x0111, "d" }, { 0x0127, "h" }, { 0x0131, "i" },
+    { 0x0142, "l" }, { 0x0153, "oe" }, { 0x0167, "t" }, { 0x0180, "b" },
+    { 0x0192, "f" }, { 0x01e5, "g" }, { 0x0268, "i" }, { 0x0289, "u" }
+};
+
+uint32_t get32(const uint8_t *data)
+{
+    return data[0] | data[1] << 8 | data[2] << 16 | uint32_t(data[3]) << 24;
+}
+
+uint64_t get64(const uint8_t *data)
+{
+    return get32(data) | uint64_t(get32(data + 4)) << 32;
+}
+
+void put32(std::string &data, uint32_t value)
+{
+    for (int i = 0; i < 4; ++i)
+        data += char(value >> (8 * i));
+}
+
+void put64(std::string &data, uint64_t value)
+{
+    put32(data, uint32_t(value));
+    put32(data, uint32_t(value >> 32));
+}
+
+void putVarint(std::string &data, uint64_t value)
+{
+    while (value >= 0x80) {
+        data += char(value | 0x80);
+        value >>= 7;
+    }
+    data += char(value);
+}
+
+bool readAt(int fd, uint64_t offset, uint64_t length, std::string &data)
+{
+    data.resize(length);
+    for (uint64_t done = 0; done < length;) {
+        const ssize_t got = pread(fd, &data[done], length - done, offset + done);
+        if (got <= 0)
+            return false;
+        done += got;
+    }
+    return true;
+}
+
+bool writeAt(int fd, const std::string &data, uint64_t offset)
+{
+    for (size_t done = 0; done < data.size();) {
+        const ssize_t wrote = pwrite(fd, data.data() + done, data.size() - done, offset + done);
+        if (wrote < 0)
+            return false;
+        done += wrote;
+    }
+    return true;
+}
+
+void logHeader(std::string &data)
+{
+    data.assign(log_magic, 4);
+    put32(data, index_version);
+}
+
+// a counted string of a log record
+bool getString(const uint8_t *&data, const uint8_t *end, std::string &value)
+{
+    if (end - data < 4 || get32(data) > uint64_t(end - data - 4))
+        return false;
+    value.assign(reinterpret_cast<const char *>(data) + 4, get32(data));
+    data += 4 + value.size();
+    return true;
+}
+
+void putString(std::string &data, const std::string &value)
+{
+    put32(data, value.size());
+    data += value;
+}
+
+bool getVarint(const uint8_t *&data, const uint8_t *end, uint64_t &value)
+{
+    value = 0;
+    for (int shift = 0; data < end && shift < 64; shift += 7) {
+        const uint8_t byte = *data++;
+        value |= uint64_t(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+void putUtf8(std::string &data, uint32_t c)
+{
+    if (c < 0x80) {
+        data += char(c);
+    } else if (c < 0x800) {
+        data += char(0xc0 | c >> 6);
+        data += char(0x80 | (c & 0x3f));
+    } else if (c < 0x10000) {
+        data += char(0xe0 | c >> 12);
+        data += char(0x80 | (c >> 6 & 0x3f));
+        data += char(0x80 | (c & 0x3f));
+    } else {
+        data += char(0xf0 | c >> 18);
+        data += char(0x80 | (c >> 12 & 0x3f));
+        data += char(0x80 | (c >> 6 & 0x3f));
+        data += char(0x80 | (c & 0x3f));
+    }
+}
+
+// the next character, with bytes that aren't UTF-8 taken as Latin-1
+uint32_t getUtf8(const uint8_t *&data, const uint8_t *end)
+{
+    const uint8_t first = *data++;
+    int more = first >= 0xf0 && first < 0xf8 ? 3 : first >= 0xe0 ? 2 : first >= 0xc0 ? 1 : 0;
+    if (first < 0x80 || !more || end - data < more)
+        return first;
+    uint32_t c = first & (0x3f >> more);
+    for (int i = 0; i < more; ++i) {
+        if ((data[i] & 0xc0) != 0x80)
+            return first;
+        c = c << 6 | (data[i] & 0x3f);
+    }
+    data += more;
+    return c;
+}
+
+enum Folded {
+    Separator,
+    Dropped,
+    Kept
+};
+
+// appends c, of text that was decomposed and case folded, to word
+Folded fold(uint32_t c, std::string &word)
+{
+    // apostrophes join the parts of a word
+    if (c == '\'' || c == 0x2019 || c == 0x2bc)
+        return Dropped;
+
+    switch (QChar::category(c)) {
+    case QChar::Mark_NonSpacing:
+    case QChar::Mark_SpacingCombining:
+    case QChar::Mark_Enclosing:
+        // the accents that were taken off
+        return Dropped;
+    case QChar::Letter_Uppercase:
+    case QChar::Letter_Lowercase:
+    case QChar::Letter_Titlecase:
+    case QChar::Letter_Modifier:
+    case QChar::Letter_Other:
+    case QChar::Number_DecimalDigit:
+    case QChar::Number_Letter:
+    case QChar::Number_Other:
+        break;
+    default:
+        return Separator;
+    }
+
+    for (size_t i = 0; i < sizeof(whole_letters) / sizeof(whole_letters[0]); ++i) {
+        if (whole_letters[i].letter == c) {
+            word += whole_letters[i].folded;
+            return Kept;
+        }
+    }
+    putUtf8(word, c);
+    return Kept;
+}
+
+void grams(const std::string &word, std::vector<uint32_t> &grams)
+{
+    std::string padded;
+    padded += char(gram_pad);
+    padded += word;
+    padded += char(gram_pad);
+    grams.clear();
+    for (size_t i = 0; i + 3 <= padded.size(); ++i) {
+        const uint8_t *p = reinterpret_cast<const uint8_t *>(padded.data()) + i;
+        grams.push_back(uint32_t(p[0]) << 16 | p[1] << 8 | p[2]);
+    }
+    std::sort(grams.begin(), grams.end());
+    grams.erase(std::unique(grams.begin(), grams.end()), grams.end());
+}
+
+// how many edits a word of this length may be off by
+size_t allowedEdits(size_t length)
+{
+    return length <= 3 ? 0 : length <= 7 ? 1 : 2;
+}
+
+bool withinEdits(const char *a, size_t aLength, const std::string &b, size_t edits)
+{
+    const size_t bLength = b.size();
+    if ((aLength > bLength ? aLength - bLength : bLength - aLength) > edits)
+        return false;
+
+    std::vector<size_t> previous(bLength + 1), current(bLength + 1);
+    for (size_t j = 0; j <= bLength; ++j)
+        previous[j] = j;
+    for (size_t i = 1; i <= aLength; ++i) {
+        current[0] = i;
+        size_t best = current[0];
+        for (size_t j = 1; j <= bLength; ++j) {
+            const size_t substitution = previous[j - 1] + (a[i - 1] != b[j - 1]);
+            current[j] = std::min(substitution, std::min(previous[j], current[j - 1]) + 1);
+            best = std::min(best, current[j]);
+        }
+        if (best > edits)
+            return false;
+        previous.swap(current);
+    }
+    return previous[bLength] <= edits;
+}
+
+void encodePostings(const std::vector<uint32_t> &docs, std::string &data)
+{
+    const size_t blocks = (docs.size() + posting_block - 1) / posting_block;
+    std::string skips;
+    std::string body;
+    uint32_t last = 0;
+    for (size_t block = 0; block < blocks; ++block) {
+        const size_t start = block * posting_block;
+        const size_t end = std::min(start + posting_block, docs.size());
+        const size_t before = body.size();
+        uint32_t previous = last;
+        for (size_t i = start; i < end; ++i) {
+            putVarint(body, docs[i] - previous);
+            previous = docs[i];
+        }
+        putVarint(skips, previous - last);
+        putVarint(skips, body.size() - before);
+        last = previous;
+    }
+    putVarint(data, docs.size());
+    putVarint(data, blocks);
+    putVarint(data, skips.size());
+    data += skips;
+    data += body;
+}
+
+/**
+ * Walks an encoded posting list, stepping over the blocks that end
+ * before the file looked for.
+ */
+class PostingCursor
+{
+public:
+    PostingCursor(const uint8_t *data, const uint8_t *end)
+        : m_skip(0), m_skipEnd(0), m_data(0), m_blockEnd(0), m_end(end), m_left(0),
+          m_inBlock(0), m_blocksLeft(0), m_previous(0), m_blockLast(0), m_current(0),
+          m_valid(false)
+    {
+        uint64_t count, blocks, skipLength;
+        if (!getVarint(data, end, count) || !getVarint(data, end, blocks) ||
+            !getVarint(data, end, skipLength) || skipLength > uint64_t(end - data))
+            return;
+        m_left = count;
+        m_blocksLeft = blocks;
+        m_skip = data;
+        m_skipEnd = data + skipLength;
+        m_blockEnd = m_skipEnd;
+    }
+
+    uint64_t count() const { return m_left; }
+
+    bool next(uint32_t &doc)
+    {
+        uint64_t delta;
+        while (!m_inBlock) {
+            if (!nextBlock())
+                return m_valid = false;
+        }
+        if (!getVarint(m_data, m_blockEnd, delta))
+            return m_valid = false;
+        --m_inBlock;
+        m_previous += delta;
+        doc = m_current = m_previous;
+        return m_valid = true;
+    }
+
+    /** The first file from target on. */
+    bool advance(uint32_t target, uint32_t &doc)
+    {
+        if (m_valid && m_current >= target) {
+            doc = m_current;
+            return true;
+        }
+        while (!m_inBlock || m_blockLast < target) {
+            if (!nextBlock())
+                return m_valid = false;
+        }
+        while (next(doc)) {
+            if (doc >= target)
+                return true;
+        }
+        return false;
+    }
+
+private:
+    bool nextBlock()
+    {
+        uint64_t lastDelta, length;
+        if (!m_blocksLeft || !getVarint(m_skip, m_skipEnd, lastDelta) ||
+            !getVarint(m_skip, m_skipEnd, length) || length > uint64_t(m_end - m_blockEnd))
+            return false;
+        --m_blocksLeft;
+        m_previous = m_blockLast;
+        m_blockLast += lastDelta;
+        m_data = m_blockEnd;
+        m_blockEnd = m_data + length;
+        m_inBlock = std::min<uint64_t>(posting_block, m_left);
+        m_left -= m_inBlock;
+        return true;
+    }
+
+    const uint8_t *m_skip;
+    const uint8_t *m_skipEnd;
+    const uint8_t *m_data;
+    const uint8_t *m_blockEnd;
+    const uint8_t *m_end;
+    uint64_t m_left;
+    uint64_t m_inBlock;
+    uint64_t m_blocksLeft;
+    uint32_t m_previous;
+    uint32_t m_blockLast;
+    uint32_t m_current;
+    bool m_valid;
+};
+
+// keeps the candidates that are in one of the lists
+template <typename Contains>
+void keepMatching(std::vector<uint32_t> &candidates, Contains &contains)
+{
+    size_t kept = 0;
+    for (size_t i = 0; i < candidates.size(); ++i) {
+        if (contains(candidates[i]))
+            candidates[kept++] = candidates[i];
+    }
+    candidates.resize(kept);
+}
+
+bool byEstimate(const std::pair<uint64_t, size_t> &a, const std::pair<uint64_t, size_t> &b)
+{
+    return a.first < b.first;
+}
+
+bool byCount(const std::pair<uint32_t, uint32_t> &a, const std::pair<uint32_t, uint32_t> &b)
+{
+    return a.first > b.first;
+}
+
+class FileWriter
+{
+public:
+    explicit FileWriter(FILE *file) : m_file(file), m_offset(0), m_ok(file) {}
+
+    void write(const std::string &data) { write(data.data(), data.size()); }
+    void write(const void *data, size_t length)
+    {
+        m_ok = m_ok && fwrite(data, 1, length, m_file) == length;
+        m_offset += length;
+    }
+
+    uint64_t offset() const { return m_offset; }
+    bool ok() const { return m_ok; }
+
+private:
+    FILE *m_file;
+    uint64_t m_offset;
+    bool m_ok;
+};
+
+}
+
+struct TagIndex::Expansion
+{
+    // words of the index file, or else of the updates
+    std::vector<uint32_t> words;
+    std::vector<const std::vector<uint32_t> *> pending;
+    uint64_t estimate;
+};
+
+bool TagIndex::Bytes::operator()(const std::string &a, const std::string &b) const
+{
+    const int order = memcmp(a.data(), b.data(), std::min(a.size(), b.size()));
+    return order < 0 || (order == 0 && a.size() < b.size());
+}
+
+TagIndex::TagIndex(const std::string &path)
+    : m_path(path), m_inode(0), m_logPath(path + ".log"), m_logged(0), m_journalRecords(0)
+{
+    openSegment();
+    refresh();
+}
+
+TagIndex::~TagIndex()
+{
+    save();
+}
+
+void TagIndex::tokenize(const char *text, size_t length, std::vector<std::string> &words)
+{
+    // bytes that aren't UTF-8 are taken as Latin-1
+    const uint8_t *data = reinterpret_cast<const uint8_t *>(text);
+    const uint8_t *end = data + length;
+    std::vector<uint> characters;
+    while (data < end)
+        characters.push_back(getUtf8(data, end));
+    if (characters.empty())
+        return;
+
+    // compatibility decomposition turns fullwidth and other forms into
+    // plain letters and takes accents off them as marks of their own
+    const QString folded = QString::fromUcs4(&characters[0], characters.size())
+                               .normalized(QString::NormalizationForm_KD).toCaseFolded();
+    std::string word;
+    for (int i = 0; i < folded.size(); ++i) {
+        uint c = folded.at(i).unicode();
+        if (QChar::isHighSurrogate(c) && i + 1 < folded.size() &&
+            QChar::isLowSurrogate(folded.at(i + 1).unicode()))
+            c = QChar::surrogateToUcs4(c, folded.at(++i).unicode());
+        if (fold(c, word) == Separator && !word.empty()) {
+            words.push_back(word);
+            word.clear();
+        }
+    }
+    if (!word.empty())
+        words.push_back(word);
+}
+
+bool TagIndex::openSegment()
+{
+    m_input.close();
+    m_inode = 0;
+    m_docCount = m_wordCount = m_gramCount = 0;
+    m_docs = m_paths = m_postings = m_words = m_strings = m_grams = m_lists = m_end = 0;
+    m_dead.clear();
+
+    struct stat st;
+    if (!m_input.open(m_path.c_str()) || fstat(m_input.handle(), &st) != 0)
+        return false;
+    m_inode = st.st_ino;
+    const InputSpan file = m_input.span(0, m_input.size());
+    if (!m_input.isMapped() || file.length() < index_header ||
+        memcmp(file.data(), index_magic, 4) || get32(file.data() + 4) != index_version)
+        return false;
+
+    const uint8_t *header = file.data() + 8;
+    const uint64_t docs = get64(header), words = get64(header + 8), grams = get64(header + 16);
+    uint64_t offsets[8];
+    for (int i = 0; i < 8; ++i)
+        offsets[i] = get64(header + 24 + 8 * i);
+    // every section where the header says, and large enough for its entries
+    for (int i = 0; i < 8; ++i) {
+        if (offsets[i] < index_header || offsets[i] > file.length() ||
+            (i && offsets[i] < offsets[i - 1]))
+            return false;
+    }
+    if (docs >= 0xffffffffu || words >= 0xffffffffu || grams >= 0xffffffffu ||
+        offsets[1] - offsets[0] != (docs + 1) * doc_entry ||
+        offsets[4] - offsets[3] != (words + 1) * word_entry ||
+        offsets[6] - offsets[5] != (grams + 1) * gram_entry)
+        return false;
+
+    m_docCount = docs;
+    m_wordCount = words;
+    m_gramCount = grams;
+    m_docs = file.data() + offsets[0];
+    m_paths = file.data() + offsets[1];
+    m_postings = file.data() + offsets[2];
+    m_words = file.data() + offsets[3];
+    m_strings = file.data() + offsets[4];
+    m_grams = file.data() + offsets[5];
+    m_lists = file.data() + offsets[6];
+    m_end = file.data() + offsets[7];
+    m_input.advise(RandomAccess);
+
+    m_dead.assign(m_docCount, false);
+    for (std::set<FileId>::const_iterator it = m_removed.begin(); it != m_removed.end(); ++it) {
+        uint32_t doc;
+        if (findDoc(*it, doc))
+            m_dead[doc] = true;
+    }
+    return true;
+}
+
+TagIndex::FileId TagIndex::docId(uint32_t doc) const
+{
+    const uint8_t *entry = m_docs + doc * doc_entry;
+    return FileId(get64(entry), get64(entry + 8));
+}
+
+std::string TagIndex::docPath(uint32_t doc) const
+{
+    const uint8_t *entry = m_docs + doc * doc_entry;
+    const uint64_t start = get64(entry + 32);
+    const uint64_t end = get64(entry + doc_entry + 32);
+    if (start > end || end > uint64_t(m_postings - m_paths))
+        return std::string();
+    return std::string(reinterpret_cast<const char *>(m_paths) + start, end - start);
+}
+
+bool TagIndex::sameDoc(uint32_t doc, const MetadataCache::Key &key, const std::string &path) const
+{
+    const uint8_t *entry = m_docs + doc * doc_entry;
+    return int64_t(get64(entry + 16)) == key.mtime && get64(entry + 24) == key.size &&
+           docPath(doc) == path;
+}
+
+bool TagIndex::findDoc(const FileId &id, uint32_t &doc) const
+{
+    // the files are in the order of their ids
+    uint32_t low = 0, high = m_docCount;
+    while (low < high) {
+        const uint32_t middle = low + (high - low) / 2;
+        if (docId(middle) < id)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    doc = low;
+    return low < m_docCount && docId(low) == id;
+}
+
+std::string TagIndex::word(uint32_t word) const
+{
+    const uint8_t *entry = m_words + word * word_entry;
+    const uint32_t start = get32(entry + 8);
+    const uint32_t end = get32(entry + word_entry + 8);
+    if (start > end || end > uint64_t(m_grams - m_strings))
+        return std::string();
+    return std::string(reinterpret_cast<const char *>(m_strings) + start, end - start);
+}
+
+uint32_t TagIndex::lowerWord(const std::string &word) const
+{
+    const Bytes less;
+    uint32_t low = 0, high = m_wordCount;
+    while (low < high) {
+        const uint32_t middle = low + (high - low) / 2;
+        if (less(this->word(middle), word))
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+bool TagIndex::update(const MetadataCache::Key &key, const std::string &path,
+                      const MetadataRecord &record)
+{
+    static const MetadataRecord::Field fields[] = {
+        MetadataRecord::Title, MetadataRecord::Artist, MetadataRecord::Album
+    };
+    bool tagged = false;
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); ++i)
+        tagged = tagged || record.has(fields[i]);
+
+    // a record without any of the tags may have been read for other
+    // fields only, so it doesn't replace the words of the file; they
+    // only go once the file changed
+    const FileId id(key.device, key.inode);
+    bool known = false;
+    bool same = false;
+    bool unchanged = false;
+    std::map<FileId, uint32_t>::const_iterator pending = m_pendingIds.find(id);
+    if (pending != m_pendingIds.end()) {
+        const Pending &entry = m_pending[pending->second];
+        known = true;
+        unchanged = entry.mtime == key.mtime && entry.size == key.size;
+        same = unchanged && entry.path == path;
+    } else {
+        uint32_t doc;
+        if (findDoc(id, doc) && !m_dead[doc]) {
+            known = true;
+            unchanged = sameDoc(doc, key, docPath(doc));
+            same = unchanged && docPath(doc) == path;
+        }
+    }
+    if (same || (!tagged && (!known || unchanged)))
+        return false;
+    if (!tagged) {
+        remove(key.device, key.inode);
+        return true;
+    }
+    std::vector<std::string> words;
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); ++i) {
+        if (record.has(fields[i]))
+            tokenize(record.value(fields[i]).data, record.value(fields[i]).length, words);
+    }
+    std::sort(words.begin(), words.end(), Bytes());
+    words.erase(std::unique(words.begin(), words.end()), words.end());
+    add(id, key.mtime, key.size, path, words);
+
+    // an update stands for the removal of what was indexed before
+    std::string logged(1, 'U');
+    put64(logged, id.first);
+    put64(logged, id.second);
+    put64(logged, key.mtime);
+    put64(logged, key.size);
+    putString(logged, path);
+    put32(logged, words.size());
+    for (size_t i = 0; i < words.size(); ++i)
+        putString(logged, words[i]);
+    put32(m_journal, logged.size());
+    m_journal += logged;
+    if (++m_journalRecords >= max_pending)
+        save();
+    return true;
+}
+
+void TagIndex::remove(uint64_t device, uint64_t inode)
+{
+    const FileId id(device, inode);
+    forget(id);
+    std::string logged(1, 'R');
+    put64(logged, device);
+    put64(logged, inode);
+    put32(m_journal, logged.size());
+    m_journal += logged;
+    if (++m_journalRecords >= max_pending)
+        save();
+}
+
+void TagIndex::add(const FileId &id, int64_t mtime, uint64_t size, const std::string &path,
+                   const std::vector<std::string> &words)
+{
+    forget(id);
+    const uint32_t local = m_pending.size();
+    Pending added;
+    added.id = id;
+    added.mtime = mtime;
+    added.size = size;
+    added.path = path;
+    added.dead = false;
+    m_pending.push_back(added);
+    m_pendingIds[id] = local;
+    for (size_t i = 0; i < words.size(); ++i)
+        m_pendingWords[words[i]].push_back(local);
+}
+
+void TagIndex::forget(const FileId &id)
+{
+    m_removed.insert(id);
+    uint32_t doc;
+    if (findDoc(id, doc))
+        m_dead[doc] = true;
+    std::map<FileId, uint32_t>::iterator pending = m_pendingIds.find(id);
+    if (pending != m_pendingIds.end()) {
+        m_pending[pending->second].dead = true;
+        m_pendingIds.erase(pending);
+    }
+}
+
+void TagIndex::expand(const std::string &word, Match match, Expansion &expansion) const
+{
+    expansion.words.clear();
+    expansion.pending.clear();
+    expansion.estimate = 0;
+
+    // the words of the index file, with how many files each is in
+    std::vector<std::pair<uint32_t, uint32_t> > found;
+    const size_t edits = match == Fuzzy ? allowedEdits(word.size()) : 0;
+    if (match == Prefix) {
+        for (uint32_t i = lowerWord(word); i < m_wordCount; ++i) {
+            const std::string candidate = this->word(i);
+            if (candidate.compare(0, word.size(), word) != 0)
+                break;
+            found.push_back(std::make_pair(get32(m_words + i * word_entry + 12), i));
+        }
+    } else if (edits) {
+        // a word within n edits shares all but 3n of the trigrams
+        std::vector<uint32_t> wanted;
+        grams(word, wanted);
+        std::vector<uint32_t> candidates;
+        for (size_t i = 0; i < wanted.size(); ++i) {
+            uint32_t low = 0, high = m_gramCount;
+            while (low < high) {
+                const uint32_t middle = low + (high - low) / 2;
+                if (get32(m_grams + middle * gram_entry) < wanted[i])
+                    low = middle + 1;
+                else
+                    high = middle;
+            }
+            if (low == m_gramCount || get32(m_grams + low * gram_entry) != wanted[i])
+                continue;
+            const uint8_t *entry = m_grams + low * gram_entry;
+            const uint8_t *list = m_lists + get64(entry + 8);
+            const uint8_t *end = m_lists + get64(entry + gram_entry + 8);
+            if (list > end || end > m_end)
+                continue;
+            uint64_t id = 0, delta;
+            while (getVarint(list, end, delta))
+                candidates.push_back(id += delta);
+        }
+        std::sort(candidates.begin(), candidates.end());
+        const size_t shared = wanted.size() > 3 * edits ? wanted.size() - 3 * edits : 1;
+        for (size_t i = 0; i < candidates.size();) {
+            size_t j = i;
+            while (j < candidates.size() && candidates[j] == candidates[i])
+                ++j;
+            if (j - i >= shared && candidates[i] < m_wordCount) {
+                const std::string candidate = this->word(candidates[i]);
+                if (withinEdits(candidate.data(), candidate.size(), word, edits))
+                    found.push_back(std::make_pair(get32(m_words + candidates[i] * word_entry + 12),
+                                                   uint32_t(candidates[i])));
+            }
+            i = j;
+        }
+    } else {
+        const uint32_t i = lowerWord(word);
+        if (i < m_wordCount && this->word(i) == word)
+            found.push_back(std::make_pair(get32(m_words + i * word_entry + 12), i));
+    }
+
+    if (found.size() > max_expansions) {
+        std::partial_sort(found.begin(), found.begin() + max_expansions, found.end(), byCount);
+        found.resize(max_expansions);
+    }
+    for (size_t i = 0; i < found.size(); ++i) {
+        expansion.words.push_back(found[i].second);
+        expansion.estimate += found[i].first;
+    }
+
+    // the updates are few enough to go through
+    Words::const_iterator it = m_pendingWords.lower_bound(match == Fuzzy ? std::string() : word);
+    for (; it != m_pendingWords.end(); ++it) {
+        if (match == Fuzzy) {
+            if (!withinEdits(it->first.data(), it->first.size(), word, edits))
+                continue;
+        } else if (match == Prefix ? it->first.compare(0, word.size(), word) != 0
+                                   : it->first != word) {
+            break;
+        }
+        expansion.pending.push_back(&it->second);
+    }
+}
+
+namespace {
+
+struct InPostings
+{
+    InPostings(const uint8_t *data, const uint8_t *end) : cursor(data, end) {}
+    bool operator()(uint32_t doc)
+    {
+        uint32_t found;
+        return cursor.advance(doc, found) && found == doc;
+    }
+    PostingCursor cursor;
+};
+
+struct InAny
+{
+    explicit InAny(const std::vector<uint32_t> &docs) : docs(docs) {}
+    bool operator()(uint32_t doc)
+    {
+        return std::binary_search(docs.begin(), docs.end(), doc);
+    }
+    const std::vector<uint32_t> &docs;
+};
+
+}
+
+void TagIndex::searchSegment(const std::vector<std::string> &words, Match match,
+                             std::vector<Hit> &hits, size_t limit) const
+{
+    std::vector<Expansion> expansions(words.size());
+    std::vector<std::pair<uint64_t, size_t> > order;
+    for (size_t i = 0; i < words.size(); ++i) {
+        expand(words[i], match == Prefix && i + 1 < words.size() ? Exact : match, expansions[i]);
+        if (expansions[i].words.empty())
+            return;
+        order.push_back(std::make_pair(expansions[i].estimate, i));
+    }
+    std::sort(order.begin(), order.end(), byEstimate);
+
+    // the rarest word gives the candidates, which the others narrow down
+    std::vector<uint32_t> candidates;
+    const Expansion &rarest = expansions[order[0].second];
+    for (size_t i = 0; i < rarest.words.size(); ++i) {
+        const uint8_t *entry = m_words + rarest.words[i] * word_entry;
+        PostingCursor cursor(m_postings + get64(entry), m_postings + get64(entry + word_entry));
+        uint32_t doc;
+        while (cursor.next(doc))
+            candidates.push_back(doc);
+    }
+    if (rarest.words.size() > 1) {
+        std::sort(candidates.begin(), candidates.end());
+        candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+    }
+
+    for (size_t i = 1; i < order.size() && !candidates.empty(); ++i) {
+        const Expansion &expansion = expansions[order[i].second];
+        std::vector<uint32_t> matched;
+        for (size_t j = 0; j < expansion.words.size(); ++j) {
+            const uint8_t *entry = m_words + expansion.words[j] * word_entry;
+            std::vector<uint32_t> left = candidates;
+            InPostings in(m_postings + get64(entry), m_postings + get64(entry + word_entry));
+            keepMatching(left, in);
+            matched.insert(matched.end(), left.begin(), left.end());
+        }
+        if (expansion.words.size() > 1) {
+            std::sort(matched.begin(), matched.end());
+            matched.erase(std::unique(matched.begin(), matched.end()), matched.end());
+        }
+        candidates.swap(matched);
+    }
+
+    for (size_t i = 0; i < candidates.size() && hits.size() < limit; ++i) {
+        if (candidates[i] >= m_docCount || m_dead[candidates[i]])
+            continue;
+        const FileId id = docId(candidates[i]);
+        Hit hit;
+        hit.device = id.first;
+        hit.inode = id.second;
+        hit.path = docPath(candidates[i]);
+        hits.push_back(hit);
+    }
+}
+
+void TagIndex::searchPending(const std::vector<std::string> &words, Match match,
+                             std::vector<Hit> &hits, size_t limit) const
+{
+    std::vector<uint32_t> candidates;
+    for (size_t i = 0; i < words.size(); ++i) {
+        Expansion expansion;
+        expand(words[i], match == Prefix && i + 1 < words.size() ? Exact : match, expansion);
+        std::vector<uint32_t> docs;
+        for (size_t j = 0; j < expansion.pending.size(); ++j)
+            docs.insert(docs.end(), expansion.pending[j]->begin(), expansion.pending[j]->end());
+        std::sort(docs.begin(), docs.end());
+        docs.erase(std::unique(docs.begin(), docs.end()), docs.end());
+        if (i == 0) {
+            candidates.swap(docs);
+        } else {
+            InAny in(docs);
+            keepMatching(candidates, in);
+        }
+        if (candidates.empty())
+            return;
+    }
+
+    for (size_t i = 0; i < candidates.size() && hits.size() < limit; ++i) {
+        const Pending &pending = m_pending[candidates[i]];
+        if (pending.dead)
+            continue;
+        Hit hit;
+        hit.device = pending.id.first;
+        hit.inode = pending.id.second;
+        hit.path = pending.path;
+        hits.push_back(hit);
+    }
+}
+
+size_t TagIndex::search(const std::string &query, Match match, std::vector<Hit> &hits,
+                        size_t limit)
+{
+    const size_t before = hits.size();
+    std::vector<std::string> words;
+    tokenize(query.data(), query.size(), words);
+    if (words.empty())
+        return 0;
+
+    // repeated words would only be looked up again
+    std::vector<std::string> unique;
+    for (size_t i = 0; i < words.size(); ++i) {
+        if (std::find(unique.begin(), unique.end(), words[i]) == unique.end() ||
+            (match == Prefix && i + 1 == words.size()))
+            unique.push_back(words[i]);
+    }
+
+    refresh();
+    limit += before;
+    searchSegment(unique, match, hits, limit);
+    searchPending(unique, match, hits, limit);
+    return hits.size() - before;
+}
+
+bool TagIndex::save()
+{
+    if (m_journal.empty())
+        return true;
+
+    // a merge by another process may replace the file between opening
+    // and locking it, in which case it has to be opened again
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        int fd = open(m_path.c_str(), O_RDWR | O_CREAT, 0600);
+        if (fd < 0)
+            return false;
+        if (flock(fd, LOCK_EX) != 0) {
+            close(fd);
+            return false;
+        }
+        struct stat st, current;
+        if (fstat(fd, &st) != 0 || stat(m_path.c_str(), &current) != 0) {
+            close(fd);
+            return false;
+        }
+        if (st.st_ino != current.st_ino) {
+            close(fd);
+            continue;
+        }
+        int log = open(m_logPath.c_str(), O_RDWR | O_CREAT, 0600);
+        struct stat logged;
+        if (log < 0 || fstat(log, &logged) != 0) {
+            if (log >= 0)
+                close(log);
+            close(fd);
+            return false;
+        }
+
+        // what others saved since is taken in first
+        uint64_t end = catchUp(log, st.st_ino, logged.st_size);
+        bool ok = true;
+        if (!end) {
+            std::string head;
+            logHeader(head);
+            ok = ftruncate(log, 0) == 0 && writeAt(log, head, 0);
+            end = head.size();
+        } else if (end < uint64_t(logged.st_size)) {
+            // a record cut short by a process that died while appending it
+            ok = ftruncate(log, end) == 0;
+        }
+        ok = ok && writeAt(log, m_journal, end);
+        if (ok) {
+            m_logged = end + m_journal.size();
+            m_journal.clear();
+            m_journalRecords = 0;
+            if (m_logged >= fold_size && m_logged >= m_input.size() / 4)
+                mergeLog(log);
+        }
+        close(log);
+        close(fd);
+        return ok;
+    }
+    return false;
+}
+
+/** Takes in what other processes saved since, unless it is the same. */
+void TagIndex::refresh()
+{
+    struct stat st, logged;
+    if (stat(m_path.c_str(), &st) != 0)
+        return;
+    const bool hasLog = stat(m_logPath.c_str(), &logged) == 0;
+    if (uint64_t(st.st_ino) == m_inode && uint64_t(hasLog ? logged.st_size : 0) == m_logged)
+        return;
+
+    int fd = open(m_path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return;
+    if (flock(fd, LOCK_SH) == 0 && fstat(fd, &st) == 0) {
+        int log = open(m_logPath.c_str(), O_RDONLY);
+        if (log >= 0 && fstat(log, &logged) == 0)
+            catchUp(log, st.st_ino, logged.st_size);
+        else if (uint64_t(st.st_ino) != m_inode)
+            catchUp(-1, st.st_ino, 0);
+        if (log >= 0)
+            close(log);
+    }
+    close(fd);
+}
+
+/**
+ * Takes in the log, of size, under the lock of the index file with
+ * inode, and gives where its last whole record ends, or 0 for a log to
+ * be started anew.
+ */
+uint64_t TagIndex::catchUp(int log, uint64_t inode, uint64_t size)
+{
+    // all of the log once another process merged it into a new file
+    uint64_t from = m_logged;
+    const bool merged = inode != m_inode || size < m_logged;
+    if (merged) {
+        m_removed.clear();
+        m_pending.clear();
+        m_pendingIds.clear();
+        m_pendingWords.clear();
+        openSegment();
+        from = 0;
+    }
+    std::string data;
+    if (size == from || !readAt(log, from, size - from, data))
+        data.clear();
+    size_t start = 0;
+    bool valid = true;
+    if (from == 0) {
+        // a log of another version is started anew
+        std::string head;
+        logHeader(head);
+        valid = data.compare(0, head.size(), head) == 0;
+        start = valid ? head.size() : data.size();
+    }
+    const size_t end = replay(data, start);
+    m_logged = valid ? from + end : 0;
+
+    // the changes made here win over those of the others
+    if (merged || end > start)
+        replay(m_journal, 0);
+    return m_logged;
+}
+
+/**
+ * Applies the records in data from offset on, and gives where the last
+ * whole one ends.
+ */
+size_t TagIndex::replay(const std::string &data, size_t offset)
+{
+    std::vector<std::string> words;
+    while (data.size() - offset >= 4) {
+        const uint8_t *record = reinterpret_cast<const uint8_t *>(data.data()) + offset;
+        const uint64_t length = get32(record);
+        if (length > data.size() - offset - 4)
+            break;
+        const uint8_t *end = record + 4 + length;
+        const uint8_t *field = record + 5;
+        if (length < 17 || (record[4] != 'U' && record[4] != 'R'))
+            break;
+        const FileId id(get64(field), get64(field + 8));
+        field += 16;
+
+        if (record[4] == 'R') {
+            if (field != end)
+                break;
+            forget(id);
+        } else {
+            std::string path;
+            if (end - field < 16)
+                break;
+            const int64_t mtime = get64(field);
+            const uint64_t size = get64(field + 8);
+            field += 16;
+            if (!getString(field, end, path) || end - field < 4)
+                break;
+            const uint32_t count = get32(field);
+            field += 4;
+            if (count > uint64_t(end - field) / 4)
+                break;
+            words.resize(count);
+            bool whole = true;
+            for (uint32_t i = 0; i < count && whole; ++i)
+                whole = getString(field, end, words[i]);
+            if (!whole || field != end)
+                break;
+            add(id, mtime, size, path, words);
+        }
+        offset += 4 + length;
+    }
+    return offset;
+}
+
+/**
+ * Merges the log into a new index file, under its lock, and starts the
+ * log anew.
+ */
+bool TagIndex::mergeLog(int log)
+{
+    const std::string temporary = m_path + ".new";
+    if (!write(temporary) || rename(temporary.c_str(), m_path.c_str()) != 0) {
+        unlink(temporary.c_str());
+        return false;
+    }
+    // a log left behind is taken in again, which changes nothing
+    m_removed.clear();
+    m_pending.clear();
+    m_pendingIds.clear();
+    m_pendingWords.clear();
+    openSegment();
+    m_logged = 0;
+    return ftruncate(log, 0) == 0;
+}
+bool TagIndex::write(const std::string &path)
+{
+    // the files that stay, and the updates, in the order of their ids
+    std::vector<uint32_t> updates;
+    for (uint32_t i = 0; i < m_pending.size(); ++i) {
+        if (!m_pending[i].dead)
+            updates.push_back(i);
+    }
+    std::vector<std::pair<FileId, uint32_t> > sorted;
+    for (size_t i = 0; i < updates.size(); ++i)
+        sorted.push_back(std::make_pair(m_pending[updates[i]].id, updates[i]));
+    std::sort(sorted.begin(), sorted.end());
+
+    // what every file is numbered in the new file, from either side
+    const uint32_t none = 0xffffffffu;
+    std::vector<uint32_t> fromSegment(m_docCount, none);
+    std::vector<uint32_t> fromPending(m_pending.size(), none);
+    std::vector<std::pair<bool, uint32_t> > docs;
+    uint32_t doc = 0;
+    size_t next = 0;
+    while (doc < m_docCount || next < sorted.size()) {
+        if (doc < m_docCount && m_dead[doc]) {
+            ++doc;
+        } else if (next == sorted.size() || (doc < m_docCount && docId(doc) < sorted[next].first)) {
+            fromSegment[doc] = docs.size();
+            docs.push_back(std::make_pair(false, doc++));
+        } else {
+            fromPending[sorted[next].second] = docs.size();
+            docs.push_back(std::make_pair(true, sorted[next++].second));
+        }
+    }
+
+    FILE *file = fopen(path.c_str(), "wb");
+    if (!file)
+        return false;
+    FileWriter out(file);
+    uint64_t offsets[8];
+    std::string data(index_header, '\0');
+    out.write(data);
+
+    // the files, with a last entry for where their paths end
+    offsets[0] = out.offset();
+    uint64_t pathOffset = 0;
+    for (size_t i = 0; i <= docs.size(); ++i) {
+        data.clear();
+        if (i == docs.size()) {
+            put64(data, 0);
+            put64(data, 0);
+            put64(data, 0);
+            put64(data, 0);
+        } else if (docs[i].first) {
+            const Pending &pending = m_pending[docs[i].second];
+            put64(data, pending.id.first);
+            put64(data, pending.id.second);
+            put64(data, pending.mtime);
+            put64(data, pending.size);
+        } else {
+            data.append(reinterpret_cast<const char *>(m_docs + docs[i].second * doc_entry), 32);
+        }
+        put64(data, pathOffset);
+        out.write(data);
+        if (i < docs.size())
+            pathOffset += docs[i].first ? m_pending[docs[i].second].path.size()
+                                        : docPath(docs[i].second).size();
+    }
+    offsets[1] = out.offset();
+    for (size_t i = 0; i < docs.size(); ++i)
+        out.write(docs[i].first ? m_pending[docs[i].second].path : docPath(docs[i].second));
+
+    // the words of both, in order, each with its files
+    offsets[2] = out.offset();
+    std::string words;
+    std::string strings;
+    std::map<uint32_t, std::vector<uint32_t> > gramWords;
+    std::vector<uint32_t> wordGrams;
+    const Bytes less;
+    uint32_t word = 0;
+    Words::const_iterator pending = m_pendingWords.begin();
+    std::vector<uint32_t> postings, added;
+    while (word < m_wordCount || pending != m_pendingWords.end()) {
+        std::string text;
+        postings.clear();
+        added.clear();
+        const std::string segmentWord = word < m_wordCount ? this->word(word) : std::string();
+        const bool morePending = pending != m_pendingWords.end();
+        const bool fromFile = word < m_wordCount &&
+                              (!morePending || !less(pending->first, segmentWord));
+        const bool fromUpdates = morePending &&
+                                 (word == m_wordCount || !less(segmentWord, pending->first));
+        if (fromFile) {
+            text = segmentWord;
+            const uint8_t *entry = m_words + word * word_entry;
+            PostingCursor cursor(m_postings + get64(entry), m_postings + get64(entry + word_entry));
+            uint32_t found;
+            while (cursor.next(found)) {
+                if (found < m_docCount && fromSegment[found] != none)
+                    postings.push_back(fromSegment[found]);
+            }
+            ++word;
+        }
+        if (fromUpdates) {
+            text = pending->first;
+            for (size_t i = 0; i < pending->second.size(); ++i) {
+                if (fromPending[pending->second[i]] != none)
+                    added.push_back(fromPending[pending->second[i]]);
+            }
+            std::sort(added.begin(), added.end());
+            ++pending;
+        }
+        if (!added.empty()) {
+            std::vector<uint32_t> merged(postings.size() + added.size());
+            std::merge(postings.begin(), postings.end(), added.begin(), added.end(),
+                       merged.begin());
+            postings.swap(merged);
+        }
+        if (postings.empty())
+            continue;
+
+        const uint32_t id = words.size() / word_entry;
+        put64(words, out.offset() - offsets[2]);
+        put32(words, strings.size());
+        put32(words, postings.size());
+        strings += text;
+        data.clear();
+        encodePostings(postings, data);
+        out.write(data);
+        grams(text, wordGrams);
+        for (size_t i = 0; i < wordGrams.size(); ++i)
+            gramWords[wordGrams[i]].push_back(id);
+    }
+    const uint32_t wordCount = words.size() / word_entry;
+    put64(words, out.offset() - offsets[2]);
+    put32(words, strings.size());
+    put32(words, 0);
+
+    offsets[3] = out.offset();
+    out.write(words);
+    offsets[4] = out.offset();
+    out.write(strings);
+
+    // the words by their trigrams, the lists as deltas
+    std::string grams;
+    std::string lists;
+    for (std::map<uint32_t, std::vector<uint32_t> >::const_iterator it = gramWords.begin();
+         it != gramWords.end(); ++it) {
+        put32(grams, it->first);
+        put32(grams, it->second.size());
+        put64(grams, lists.size());
+        uint32_t previous = 0;
+        for (size_t i = 0; i < it->second.size(); ++i) {
+            putVarint(lists, it->second[i] - previous);
+            previous = it->second[i];
+        }
+    }
+    put32(grams, 0);
+    put32(grams, 0);
+    put64(grams, lists.size());
+    offsets[5] = out.offset();
+    out.write(grams);
+    offsets[6] = out.offset();
+    out.write(lists);
+    offsets[7] = out.offset();
+
+    data.assign(index_magic, 4);
+    put32(data, index_version);
+    put64(data, docs.size());
+    put64(data, wordCount);
+    put64(data, gramWords.size());
+    for (int i = 0; i < 8; ++i)
+        put64(data, offsets[i]);
+    bool ok = out.ok() && fseek(file, 0, SEEK_SET) == 0 &&
+              fwrite(data.data(), 1, data.size(), file) == data.size();
+    ok = fflush(file) == 0 && fsync(fileno(file)) == 0 && ok;
+    return fclose(file) == 0 && ok;
+}
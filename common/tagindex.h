@@ -0,0 +1,170 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef TAGINDEX_H
+#define TAGINDEX_H
+
+#include <stddef.h>
+
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "mappedinput.h"
+#include "metadatacache.h"
+
+class MetadataRecord;
+
+/**
+ * Finds files by the words in their titles, artists and albums.
+ *
+ * Tags are split into words, which are decomposed, case folded and
+ * stripped of their accents, so that "Björk" is found by "bjork",
+ * "Ｔｈｅ" by "the", and a decomposed "é" is the same as a composed one.
+ * Every word has the sorted list of the files it is in, kept as deltas
+ * in varints, in blocks of 128 with a skip table in front so that long
+ * lists are stepped over when another word is rarer.  Words are also
+ * listed by their trigrams, which give the candidates for a fuzzy match
+ * before their edit distance is checked.
+ *
+ * The index file is mapped and never changed in place.  Updates are
+ * kept in memory, where they are searched along with the file, until
+ * save() appends them to a log next to it, under a lock so that
+ * processes sharing the index don't lose each other's.  Searches take
+ * in what the others logged since, and once the log has grown to a
+ * quarter of the file it is merged into a new one.  A TagIndex is not
+ * for use by more than one thread at a time.
+ */
+class TagIndex
+{
+public:
+    enum Match {
+        Exact,
+        Prefix,     // the last word of the query is a prefix
+        Fuzzy       // words may be misspelled
+    };
+
+    struct Hit
+    {
+        uint64_t device;
+        uint64_t inode;
+        std::string path;
+    };
+
+    explicit TagIndex(const std::string &path);
+    ~TagIndex();
+
+    /**
+     * Indexes the tags of the file with key, unless they are indexed
+     * already for that modification time, size and path.  A record with
+     * none of the tags leaves the words of an unchanged file alone.
+     */
+    bool update(const MetadataCache::Key &key, const std::string &path,
+                const MetadataRecord &record);
+    void remove(uint64_t device, uint64_t inode);
+
+    /** Files with all the words of query, up to limit of them. */
+    size_t search(const std::string &query, Match match, std::vector<Hit> &hits,
+                  size_t limit = 100);
+
+    /**
+     * Appends the updates to the log, and merges the log into the index
+     * file once it is large.
+     */
+    bool save();
+
+    /** The folded words of text. */
+    static void tokenize(const char *text, size_t length, std::vector<std::string> &words);
+
+private:
+    typedef std::pair<uint64_t, uint64_t> FileId;
+
+    struct Pending
+    {
+        FileId id;
+        int64_t mtime;
+        uint64_t size;
+        std::string path;
+        bool dead;
+    };
+    struct Bytes
+    {
+        bool operator()(const std::string &a, const std::string &b) const;
+    };
+    typedef std::map<std::string, std::vector<uint32_t>, Bytes> Words;
+    struct Expansion;
+
+    TagIndex(const TagIndex &);
+    TagIndex &operator=(const TagIndex &);
+
+    bool openSegment();
+    void refresh();
+    uint64_t catchUp(int log, uint64_t inode, uint64_t size);
+    size_t replay(const std::string &data, size_t offset);
+    void forget(const FileId &id);
+    void add(const FileId &id, int64_t mtime, uint64_t size, const std::string &path,
+             const std::vector<std::string> &words);
+    bool mergeLog(int log);
+    bool findDoc(const FileId &id, uint32_t &doc) const;
+    FileId docId(uint32_t doc) const;
+    std::string docPath(uint32_t doc) const;
+    bool sameDoc(uint32_t doc, const MetadataCache::Key &key, const std::string &path) const;
+    std::string word(uint32_t word) const;
+    uint32_t lowerWord(const std::string &word) const;
+    void expand(const std::string &word, Match match, Expansion &expansion) const;
+    void searchSegment(const std::vector<std::string> &words, Match match,
+                       std::vector<Hit> &hits, size_t limit) const;
+    void searchPending(const std::vector<std::string> &words, Match match,
+                       std::vector<Hit> &hits, size_t limit) const;
+    bool write(const std::string &path);
+
+    std::string m_path;
+    MappedInput m_input;
+    uint64_t m_inode;
+
+    // the sections of the index file
+    uint32_t m_docCount;
+    uint32_t m_wordCount;
+    uint32_t m_gramCount;
+    const uint8_t *m_docs;
+    const uint8_t *m_paths;
+    const uint8_t *m_postings;
+    const uint8_t *m_words;
+    const uint8_t *m_strings;
+    const uint8_t *m_grams;
+    const uint8_t *m_lists;
+    const uint8_t *m_end;
+
+    // what changed since, in the log or here, with files only known by
+    // updates numbered on their own
+    std::set<FileId> m_removed;
+    std::vector<bool> m_dead;
+    std::vector<Pending> m_pending;
+    std::map<FileId, uint32_t> m_pendingIds;
+    Words m_pendingWords;
+
+    // the log of updates saved since the index file, up to where it was
+    // taken in, and the records of those not saved yet
+    std::string m_logPath;
+    uint64_t m_logged;
+    std::string m_journal;
+    size_t m_journalRecords;
+};
+
+#endif
@@ -0,0 +1,96 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "taglibstream.h"
+
+#ifdef HAVE_TAGLIB_IOSTREAM
+
+#include "mappedinput.h"
+
+TagLibStream::TagLibStream(MappedInput &input, const char *name)
+    : m_input(input), m_name(name), m_pos(0)
+{
+}
+
+TagLib::FileName TagLibStream::name() const
+{
+    return m_name.c_str();
+}
+
+TagLib::ByteVector TagLibStream::readBlock(unsigned long length)
+{
+    if (m_pos < 0)
+        return TagLib::ByteVector();
+    const InputSpan data = m_input.span(m_pos, length);
+    m_pos += data.length();
+    return TagLib::ByteVector(reinterpret_cast<const char *>(data.data()), data.length());
+}
+
+void TagLibStream::writeBlock(const TagLib::ByteVector & /*data*/)
+{
+}
+
+void TagLibStream::insert(const TagLib::ByteVector & /*data*/, unsigned long /*start*/,
+                          unsigned long /*replace*/)
+{
+}
+
+void TagLibStream::removeBlock(unsigned long /*start*/, unsigned long /*length*/)
+{
+}
+
+bool TagLibStream::readOnly() const
+{
+    return true;
+}
+
+bool TagLibStream::isOpen() const
+{
+    return m_input.isOpen();
+}
+
+void TagLibStream::seek(long offset, Position p)
+{
+    // like FileStream, seeking is allowed past the end
+    switch (p) {
+    case Beginning:
+        m_pos = offset;
+        break;
+    case Current:
+        m_pos += offset;
+        break;
+    case End:
+        m_pos = long(m_input.size()) + offset;
+        break;
+    }
+}
+
+long TagLibStream::tell() const
+{
+    return m_pos;
+}
+
+long TagLibStream::length()
+{
+    return m_input.size();
+}
+
+void TagLibStream::truncate(long /*length*/)
+{
+}
+
+#endif
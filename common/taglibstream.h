@@ -0,0 +1,61 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef TAGLIBSTREAM_H
+#define TAGLIBSTREAM_H
+
+#ifdef HAVE_TAGLIB_IOSTREAM
+
+#include <string>
+
+#include <tiostream.h>
+
+class MappedInput;
+
+/**
+ * Lets TagLib read a file through a MappedInput, so its blocks are
+ * copied out of the mapping rather than read into FileStream's buffer
+ * first.  The stream is read only; writing tags still goes through
+ * TagLib's own files.
+ */
+class TagLibStream: public TagLib::IOStream
+{
+public:
+    TagLibStream(MappedInput &input, const char *name);
+
+    virtual TagLib::FileName name() const;
+    virtual TagLib::ByteVector readBlock(unsigned long length);
+    virtual void writeBlock(const TagLib::ByteVector &data);
+    virtual void insert(const TagLib::ByteVector &data, unsigned long start = 0,
+                        unsigned long replace = 0);
+    virtual void removeBlock(unsigned long start = 0, unsigned long length = 0);
+    virtual bool readOnly() const;
+    virtual bool isOpen() const;
+    virtual void seek(long offset, Position p = Beginning);
+    virtual long tell() const;
+    virtual long length();
+    virtual void truncate(long length);
+
+private:
+    MappedInput &m_input;
+    std::string m_name;
+    long m_pos;
+};
+
+#endif
+
+#endif
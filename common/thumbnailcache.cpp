@@ -0,0 +1,157 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "thumbnailcache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// "KTHM", then the version, width and height, all little endian
+static const uint32_t thumbnail_magic = 0x4d48544b;
+static const uint32_t thumbnail_version = 1;
+static const int thumbnail_header = 16;
+
+// nobody wants thumbnails bigger than this
+static const int thumbnail_max_size = 4096;
+
+static inline void put32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static inline uint32_t get32(const uint8_t *p)
+{
+    return uint32_t(p[0]) | (uint32_t(p[1]) << 8) |
+           (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24);
+}
+
+static bool readAll(int fd, void *data, size_t length)
+{
+    char *p = static_cast<char *>(data);
+    while (length > 0) {
+        ssize_t got = read(fd, p, length);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return false;
+        p += got;
+        length -= got;
+    }
+    return true;
+}
+
+static bool writeAll(int fd, const void *data, size_t length)
+{
+    const char *p = static_cast<const char *>(data);
+    while (length > 0) {
+        ssize_t done = write(fd, p, length);
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done <= 0)
+            return false;
+        p += done;
+        length -= done;
+    }
+    return true;
+}
+
+ThumbnailCache::ThumbnailCache(const std::string &directory)
+    : m_directory(directory)
+{
+    if (!m_directory.empty() && m_directory[m_directory.size() - 1] != '/')
+        m_directory += '/';
+}
+
+std::string ThumbnailCache::path(uint64_t key, int size, bool makeDirectory) const
+{
+    char name[48];
+    snprintf(name, sizeof(name), "%02x", unsigned(key >> 56));
+    std::string path = m_directory + name;
+    if (makeDirectory)
+        mkdir(path.c_str(), 0700);
+
+    snprintf(name, sizeof(name), "/%016llx-%d.thumb", (unsigned long long)key, size);
+    return path + name;
+}
+
+bool ThumbnailCache::lookup(uint64_t key, int size, std::vector<uint32_t> &pixels,
+                            int &width, int &height) const
+{
+    int fd = open(path(key, size, false).c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    uint8_t header[thumbnail_header];
+    bool ok = readAll(fd, header, sizeof(header)) &&
+              get32(header) == thumbnail_magic && get32(header + 4) == thumbnail_version;
+    if (ok) {
+        width = get32(header + 8);
+        height = get32(header + 12);
+        ok = width > 0 && height > 0 &&
+             width <= thumbnail_max_size && height <= thumbnail_max_size;
+    }
+    if (ok) {
+        std::vector<uint8_t> data(size_t(width) * height * 4);
+        ok = readAll(fd, &data[0], data.size());
+        pixels.resize(size_t(width) * height);
+        for (size_t i = 0; ok && i < pixels.size(); ++i)
+            pixels[i] = get32(&data[i * 4]);
+    }
+
+    close(fd);
+    return ok;
+}
+
+bool ThumbnailCache::store(uint64_t key, int size, const uint32_t *pixels,
+                           int width, int height) const
+{
+    if (width <= 0 || height <= 0 || width > thumbnail_max_size || height > thumbnail_max_size)
+        return false;
+
+    std::vector<uint8_t> data(thumbnail_header + size_t(width) * height * 4);
+    put32(&data[0], thumbnail_magic);
+    put32(&data[4], thumbnail_version);
+    put32(&data[8], width);
+    put32(&data[12], height);
+    for (size_t i = 0; i < size_t(width) * height; ++i)
+        put32(&data[thumbnail_header + i * 4], pixels[i]);
+
+    // the same cover may be stored by another process at the same time,
+    // which is harmless as both write the same thing
+    const std::string target = path(key, size, true);
+    std::vector<char> temporary(target.begin(), target.end());
+    const char suffix[] = ".XXXXXX";
+    temporary.insert(temporary.end(), suffix, suffix + sizeof(suffix));
+
+    int fd = mkstemp(&temporary[0]);
+    if (fd < 0)
+        return false;
+    bool ok = writeAll(fd, &data[0], data.size());
+    ok = close(fd) == 0 && ok;
+    ok = ok && rename(&temporary[0], target.c_str()) == 0;
+    if (!ok)
+        unlink(&temporary[0]);
+    return ok;
+}
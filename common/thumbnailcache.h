@@ -0,0 +1,59 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef THUMBNAILCACHE_H
+#define THUMBNAILCACHE_H
+
+#include <string>
+#include <vector>
+
+#if !defined(__osf__)
+#include <inttypes.h>
+#else
+typedef unsigned char  uint8_t;
+typedef unsigned short uint16_t;
+typedef unsigned int   uint32_t;
+typedef unsigned long long uint64_t;
+#endif
+
+/**
+ * Keeps scaled cover art on disk, addressed by a hash of the encoded
+ * image and the thumbnail size, so a cover shared by all the tracks of
+ * an album is only scaled and stored once.
+ *
+ * Every thumbnail is a file of its own in a subdirectory named after the
+ * first byte of the hash, holding the premultiplied ARGB32 pixels after
+ * a small header.  Files are written under a temporary name and renamed,
+ * so readers never see half of one.
+ */
+class ThumbnailCache
+{
+public:
+    explicit ThumbnailCache(const std::string &directory);
+
+    bool lookup(uint64_t key, int size, std::vector<uint32_t> &pixels,
+                int &width, int &height) const;
+    bool store(uint64_t key, int size, const uint32_t *pixels,
+               int width, int height) const;
+
+private:
+    std::string path(uint64_t key, int size, bool makeDirectory) const;
+
+    std::string m_directory;
+};
+
+#endif
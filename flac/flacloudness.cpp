@@ -0,0 +1,203 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "flacloudness.h"
+
+#include <math.h>
+#include <pthread.h>
+
+#include <FLAC/stream_decoder.h>
+
+namespace {
+
+struct Segment
+{
+    Segment() : decoder(0), meter(0), rate(0), channels(0), total(0),
+                prime(0), first(0), last(0), failed(false) {}
+
+    FLAC__StreamDecoder *decoder;
+    LoudnessMeter *meter;
+
+    // from STREAMINFO
+    unsigned rate;
+    unsigned channels;
+    uint64_t total;
+
+    // primed from prime, measured from first up to last
+    uint64_t prime;
+    uint64_t first;
+    uint64_t last;
+
+    std::vector<float> buffer;
+    bool failed;
+};
+
+FLAC__StreamDecoderWriteStatus writeFrame(const FLAC__StreamDecoder *,
+                                          const FLAC__Frame *frame,
+                                          const FLAC__int32 *const data[],
+                                          void *client)
+{
+    Segment &segment = *static_cast<Segment *>(client);
+    const unsigned channels = frame->header.channels;
+    const unsigned frames = frame->header.blocksize;
+    if (!segment.meter || channels != segment.channels)
+        return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+
+    // the decoder always numbers frames by their first sample here
+    uint64_t position = frame->header.number.sample_number;
+    uint64_t from = position > segment.prime ? position : segment.prime;
+    uint64_t to = position + frames < segment.last ? position + frames : segment.last;
+
+    if (from < to) {
+        const float scale = ldexpf(1.0f, 1 - int(frame->header.bits_per_sample));
+        segment.buffer.resize(size_t(to - from) * channels);
+        float *out = &segment.buffer[0];
+        for (uint64_t i = from - position; i < to - position; ++i)
+            for (unsigned c = 0; c < channels; ++c)
+                *out++ = data[c][i] * scale;
+
+        // the frame may straddle the start of the segment
+        size_t primed = 0;
+        if (from < segment.first) {
+            primed = (to < segment.first ? to : segment.first) - from;
+            segment.meter->prime(&segment.buffer[0], primed);
+        }
+        if (to > segment.first)
+            segment.meter->process(&segment.buffer[primed * channels], to - from - primed);
+    }
+
+    if (position + frames >= segment.last)
+        return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+    return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+}
+
+void readMetadata(const FLAC__StreamDecoder *, const FLAC__StreamMetadata *metadata,
+                  void *client)
+{
+    Segment &segment = *static_cast<Segment *>(client);
+    if (metadata->type == FLAC__METADATA_TYPE_STREAMINFO) {
+        segment.rate = metadata->data.stream_info.sample_rate;
+        segment.channels = metadata->data.stream_info.channels;
+        segment.total = metadata->data.stream_info.total_samples;
+    }
+}
+
+void decodeError(const FLAC__StreamDecoder *, FLAC__StreamDecoderErrorStatus, void *client)
+{
+    static_cast<Segment *>(client)->failed = true;
+}
+
+bool openDecoder(const char *path, bool ogg, Segment &segment)
+{
+    segment.decoder = FLAC__stream_decoder_new();
+    if (!segment.decoder)
+        return false;
+
+    FLAC__StreamDecoderInitStatus status = ogg
+        ? FLAC__stream_decoder_init_ogg_file(segment.decoder, path, writeFrame,
+                                             readMetadata, decodeError, &segment)
+        : FLAC__stream_decoder_init_file(segment.decoder, path, writeFrame,
+                                         readMetadata, decodeError, &segment);
+    if (status != FLAC__STREAM_DECODER_INIT_STATUS_OK)
+        return false;
+
+    return FLAC__stream_decoder_process_until_end_of_metadata(segment.decoder);
+}
+
+void *decodeSegment(void *arg)
+{
+    Segment &segment = *static_cast<Segment *>(arg);
+    if (segment.prime > 0 &&
+        !FLAC__stream_decoder_seek_absolute(segment.decoder, segment.prime)) {
+        segment.failed = true;
+        return 0;
+    }
+
+    // ends with an abort once the segment is done
+    FLAC__stream_decoder_process_until_end_of_stream(segment.decoder);
+    return 0;
+}
+
+}
+
+bool FlacLoudness::measure(const char *path, bool ogg, int threads,
+                           LoudnessMeter::Result &result)
+{
+    // the decoders point at their segments, which mustn't move
+    std::vector<Segment> segments(1);
+    segments.reserve(threads > 1 ? threads : 1);
+    bool ok = openDecoder(path, ogg, segments[0]);
+
+    const unsigned rate = segments[0].rate;
+    const unsigned channels = segments[0].channels;
+    const uint64_t total = segments[0].total;
+    if (!ok || rate == 0 || channels == 0)
+        threads = 0;
+    else if (total == 0)
+        threads = 1;    // no length known, so nothing to cut
+    else if (threads < 1)
+        threads = 1;
+
+    segments.resize(threads > 0 ? threads : 1);
+    for (int t = 0; t < threads; ++t) {
+        Segment &segment = segments[t];
+        segment.meter = new LoudnessMeter(rate, channels);
+        if (t > 0)
+            ok = openDecoder(path, ogg, segment) && ok;
+
+        const uint64_t subBlock = segment.meter->subBlockFrames();
+        const uint64_t subBlocks = total / subBlock;
+        if (total == 0) {
+            segment.last = ~uint64_t(0);
+        } else {
+            segment.first = subBlocks * t / threads * subBlock;
+            segment.last = t + 1 < threads ? subBlocks * (t + 1) / threads * subBlock : total;
+        }
+        segment.prime = segment.first > uint64_t(segment.meter->primeFrames())
+                      ? segment.first - segment.meter->primeFrames() : 0;
+    }
+
+    std::vector<pthread_t> pool;
+    for (int t = 1; ok && t < threads; ++t) {
+        pthread_t thread;
+        if (pthread_create(&thread, 0, decodeSegment, &segments[t]) == 0)
+            pool.push_back(thread);
+        else
+            decodeSegment(&segments[t]);
+    }
+    if (ok && threads > 0)
+        decodeSegment(&segments[0]);
+    for (size_t i = 0; i < pool.size(); ++i)
+        pthread_join(pool[i], 0);
+
+    for (int t = 0; t < threads; ++t)
+        ok = ok && !segments[t].failed;
+    for (int t = 1; ok && t < threads; ++t)
+        segments[0].meter->merge(*segments[t].meter);
+    if (ok && threads > 0)
+        result = segments[0].meter->result();
+
+    for (size_t i = 0; i < segments.size(); ++i) {
+        if (segments[i].decoder) {
+            FLAC__stream_decoder_finish(segments[i].decoder);
+            FLAC__stream_decoder_delete(segments[i].decoder);
+        }
+        delete segments[i].meter;
+    }
+
+    return ok && threads > 0;
+}
@@ -0,0 +1,39 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef FLACLOUDNESS_H
+#define FLACLOUDNESS_H
+
+#include "loudnessmeter.h"
+
+/**
+ * Measures the loudness of a FLAC or Ogg FLAC file, decoding it with
+ * libFLAC.
+ *
+ * When the stream says how many samples it holds, it is cut into one
+ * segment per thread.  Every thread runs its own decoder, seeks to its
+ * segment and feeds the decoded frames to its own LoudnessMeter; the
+ * meters are merged at the end.
+ */
+class FlacLoudness
+{
+public:
+    static bool measure(const char *path, bool ogg, int threads,
+                        LoudnessMeter::Result &result);
+};
+
+#endif
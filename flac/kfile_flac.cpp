@@ -29,6 +29,7 @@
 #include <q3dict.h>
 #include <qvalidator.h>
 #include <qfileinfo.h>
+#include <QThread>
 
 #include <kdebug.h>
 #include <kurl.h>
@@ -36,6 +37,9 @@
 #include <klocale.h>
 #include <kgenericfactory.h>
 #include <ksavefile.h>
+#include <kconfig.h>
+#include <kconfiggroup.h>
+#include <kstandarddirs.h>
 
 #include <tag.h>
 #if (TAGLIB_MAJOR_VERSION>1) ||  \
@@ -46,6 +50,7 @@
 #include <tstring.h>
 #include <tfile.h>
 #include <flacfile.h>
+#include <id3v2framefactory.h>
 #ifdef TAGLIB_1_2
 #include <oggflacfile.h>
 #endif
@@ -53,14 +58,88 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <math.h>
+
+#include "artthumbnailer.h"
+#include "coverart.h"
+#include "mappedinput.h"
+#include "taglibstream.h"
+
+#ifdef HAVE_LIBFLAC
+#include "flacloudness.h"
+#endif
+
+/**
+ * Finds the audio frames of a native FLAC file: they follow the metadata
+ * blocks and run up to the end of the file or an appended ID3v1 tag.
+ */
+static bool payloadRange(MappedInput &input, qint64 &offset, qint64 &length)
+{
+    qint64 pos = 0;
+    qint64 end = input.size();
+    InputSpan block = input.span(0, 10);
+
+    // some taggers put an ID3v2 tag in front of the stream
+    if (block.has(0, 10) && !memcmp(block.data(), "ID3", 3)) {
+        const uchar *buf = block.data();
+        pos = 10 + ((qint64(buf[6] & 0x7f) << 21) | ((buf[7] & 0x7f) << 14) |
+                    ((buf[8] & 0x7f) << 7) | (buf[9] & 0x7f));
+    }
+
+    block = input.span(pos, 4);
+    if (!block.has(0, 4) || memcmp(block.data(), "fLaC", 4))
+        return false;
+    pos += 4;
+
+    // every block header has a last-block flag and a 24 bit length
+    bool last = false;
+    while (!last) {
+        block = input.span(pos, 4);
+        if (!block.has(0, 4))
+            return false;
+        const uchar *buf = block.data();
+        last = buf[0] & 0x80;
+        pos += 4 + ((buf[1] << 16) | (buf[2] << 8) | buf[3]);
+    }
+
+    if (end - pos >= 128 && (block = input.span(end - 128, 3)).has(0, 3) &&
+        !memcmp(block.data(), "TAG", 3))
+        end -= 128;
+
+    offset = pos;
+    length = end - pos;
+    return length > 0;
+}
 
 K_EXPORT_COMPONENT_FACTORY(kfile_flac, KGenericFactory<KFlacPlugin>("kfile_flac"))
 
 KFlacPlugin::KFlacPlugin( QObject *parent, 
                         const QStringList &args )
-    : KFilePlugin( parent, args )
+    : CachedFilePlugin(parent, args, "kfile_flac", 1)
 {
     kDebug(7034) << "flac plugin\n";
+
+    // measuring loudness means decoding the whole file, so it's only done
+    // when asked for in kfile_flacrc
+    KConfig config("kfile_flacrc");
+    KConfigGroup loudness(&config, "Loudness");
+    m_loudness = loudness.readEntry("Enabled", false);
+    // one thread a file unless asked for, as files are read in parallel
+    m_loudnessThreads = qBound(1, loudness.readEntry("Threads", 1), QThread::idealThreadCount());
+
+    KConfig multimedia("kfile_multimediarc");
+    KConfigGroup fingerprint(&multimedia, "Fingerprint");
+    m_fingerprint = PayloadHash::mode(fingerprint.readEntry("Mode", QString("Off")).toLatin1());
+
+    // thumbnails of the cover art are cached by the hash of the art, so
+    // every album cover is only scaled once
+    KConfigGroup thumbnails(&multimedia, "Thumbnails");
+    m_thumbnailSize = thumbnails.readEntry("Size", 128);
+    m_thumbnailCache = KStandardDirs::locateLocal("cache", "coverart/");
+
+    setCacheSettings(QString("loudness=%1 fingerprint=%2 thumbnails=%3")
+                     .arg(m_loudness).arg(int(m_fingerprint)).arg(m_thumbnailSize).toLatin1());
+
     makeMimeTypeInfo( "audio/x-flac" );
 #ifdef TAGLIB_1_2
     makeMimeTypeInfo( "audio/x-flac+ogg" );
@@ -140,15 +219,61 @@ void KFlacPlugin::makeMimeTypeInfo(const QString& mimeType)
     setAttributes(item, KFileMimeTypeInfo::Cummulative);
     setHint(item, KFileMimeTypeInfo::Length);
     setUnit(item, KFileMimeTypeInfo::Seconds);
+
+    // cover art group
+
+    group = addGroupInfo(info, "Cover Art", i18n("Cover Art"));
+    setAttributes(group, 0);
+
+    addItemInfo(group, "Pictures", i18n("Pictures"), QVariant::Int);
+    addItemInfo(group, "Mime Type", i18n("MIME Type"), QVariant::String);
+    item = addItemInfo(group, "Resolution", i18n("Resolution"), QVariant::Size);
+    setHint(item, KFileMimeTypeInfo::Size);
+    item = addItemInfo(group, "Size", i18n("Size"), QVariant::Int);
+    setUnit(item, KFileMimeTypeInfo::Bytes);
+    item = addItemInfo(group, "Thumbnail", i18n("Thumbnail"), QVariant::Image);
+    setHint(item, KFileMimeTypeInfo::Thumbnail);
+
+#ifdef HAVE_LIBFLAC
+    // loudness analysis
+    group = addGroupInfo(info, "Analysis", i18n("Analysis"));
+    setAttributes(group, 0);
+
+    item = addItemInfo(group, "Integrated Loudness", i18n("Integrated Loudness"), QVariant::Double);
+    setSuffix(item, i18n(" LUFS"));
+    item = addItemInfo(group, "Loudness Range", i18n("Loudness Range"), QVariant::Double);
+    setSuffix(item, i18n(" LU"));
+    item = addItemInfo(group, "True Peak", i18n("True Peak"), QVariant::Double);
+    setSuffix(item, i18n(" dBTP"));
+    item = addItemInfo(group, "Leading Silence", i18n("Leading Silence"), QVariant::Double);
+    setUnit(item, KFileMimeTypeInfo::Seconds);
+    item = addItemInfo(group, "Trailing Silence", i18n("Trailing Silence"), QVariant::Double);
+    setUnit(item, KFileMimeTypeInfo::Seconds);
+#endif
+
+    // fingerprint group
+    group = addGroupInfo(info, "Fingerprint", i18n("Fingerprint"));
+    setAttributes(group, 0);
+
+    addItemInfo(group, "Payload Hash", i18n("Payload Hash"), QVariant::String);
+    addItemInfo(group, "Sampled Payload Hash", i18n("Sampled Payload Hash"), QVariant::String);
 }
 
-bool KFlacPlugin::readInfo( KFileMetaInfo& info, uint what )
+// TagLib reads the metadata blocks, and looks for an ID3v1 tag at the end
+AccessManifest KFlacPlugin::accessManifest(uint /*what*/) const
 {
-    if ( info.path().isEmpty() ) // remote file
+    return AccessManifest(64 << 10, 4096, AccessManifest::flacMetadata);
+}
+
+bool KFlacPlugin::readRecord( const QString& path, const QString& mimeType, uint what,
+                              MetadataRecord& record )
+{
+    if ( path.isEmpty() ) // remote file
         return false;
 
     bool readComment = false;
     bool readTech = false;
+    bool readThumbnail = what & KFileMetaInfo::Thumbnail;
     if (what & (KFileMetaInfo::Fastest |
                 KFileMetaInfo::DontCare |
                 KFileMetaInfo::ContentInfo)) readComment = true;
@@ -157,13 +282,27 @@ bool KFlacPlugin::readInfo( KFileMetaInfo& info, uint what )
                 KFileMetaInfo::DontCare |
                 KFileMetaInfo::TechnicalInfo)) readTech = true;
 
+    const bool native = mimeType == "audio/x-flac";
+
+    // TagLib, the payload hash and the cover art all read the one mapping
+    MappedInput input;
+    input.open(QFile::encodeName(path).data());
+
     TagLib::File *file = 0;
 
-    if (info.mimeType() == "audio/x-flac")
-        file = new TagLib::FLAC::File(QFile::encodeName(info.path()).data(), readTech);
+#ifdef HAVE_TAGLIB_IOSTREAM
+    TagLibStream stream(input, QFile::encodeName(path).data());
+    if (native)
+        file = new TagLib::FLAC::File(&stream, TagLib::ID3v2::FrameFactory::instance(), readTech);
+    else
+        file = new TagLib::Ogg::FLAC::File(&stream, readTech);
+#else
+    if (native)
+        file = new TagLib::FLAC::File(QFile::encodeName(path).data(), readTech);
 #ifdef TAGLIB_1_2
     else
-        file = new TagLib::Ogg::FLAC::File(QFile::encodeName(info.path()).data(), readTech);
+        file = new TagLib::Ogg::FLAC::File(QFile::encodeName(path).data(), readTech);
+#endif
 #endif
 
     if (!file || !file->isValid())
@@ -175,34 +314,103 @@ bool KFlacPlugin::readInfo( KFileMetaInfo& info, uint what )
 
     if(readComment && file->tag())
     {
-        KFileMetaInfoGroup commentgroup = appendGroup(info, "Comment");
-
-        QString date  = file->tag()->year() > 0 ? QString::number(file->tag()->year()) : QString();
-        QString track = file->tag()->track() > 0 ? QString::number(file->tag()->track()) : QString();
-
-        appendItem(commentgroup, "Title",       TStringToQString(file->tag()->title()).trimmed());
-        appendItem(commentgroup, "Artist",      TStringToQString(file->tag()->artist()).trimmed());
-        appendItem(commentgroup, "Album",       TStringToQString(file->tag()->album()).trimmed());
-        appendItem(commentgroup, "Date",        date);
-        appendItem(commentgroup, "Comment",     TStringToQString(file->tag()->comment()).trimmed());
-        appendItem(commentgroup, "Tracknumber", track);
-        appendItem(commentgroup, "Genre",       TStringToQString(file->tag()->genre()).trimmed());
+        const TagLib::Tag *tag = file->tag();
+        record.setTrimmedText(MetadataRecord::Title,   tag->title().to8Bit(true));
+        record.setTrimmedText(MetadataRecord::Artist,  tag->artist().to8Bit(true));
+        record.setTrimmedText(MetadataRecord::Album,   tag->album().to8Bit(true));
+        record.setText(MetadataRecord::Date,
+                       tag->year() > 0 ? QByteArray::number(tag->year()).data() : "");
+        record.setTrimmedText(MetadataRecord::Comment, tag->comment().to8Bit(true));
+        record.setText(MetadataRecord::Tracknumber,
+                       tag->track() > 0 ? QByteArray::number(tag->track()).data() : "");
+        record.setTrimmedText(MetadataRecord::Genre,   tag->genre().to8Bit(true));
+    }
+
+    if (readComment || readThumbnail)
+    {
+        // where the pictures are and what they are, without reading them
+        std::vector<CoverArt::Picture> pictures;
+        bool found = false;
+        if (input.isOpen())
+            found = native
+                  ? CoverArt::findFlac(input.handle(), pictures)
+                  : CoverArt::findOgg(input.handle(), pictures);
+        if (found)
+        {
+            const CoverArt::Picture &cover = pictures[CoverArt::frontCover(pictures)];
+            if (readComment)
+            {
+                record.setInteger(MetadataRecord::Pictures, pictures.size());
+                if (!cover.mime.empty())
+                    record.setText(MetadataRecord::PictureMimeType, cover.mime);
+                if (cover.width && cover.height)
+                    record.setSize(MetadataRecord::PictureResolution, cover.width, cover.height);
+                record.setInteger(MetadataRecord::PictureSize, cover.length);
+            }
+            if (readThumbnail)
+            {
+                ArtThumbnailer thumbnailer(m_thumbnailCache, m_thumbnailSize);
+                std::vector<uint32_t> pixels;
+                int width, height;
+                if (thumbnailer.thumbnail(input.handle(), cover, pixels, width, height))
+                    record.setImage(MetadataRecord::Thumbnail, &pixels[0], width, height);
+            }
+        }
     }
 
     if (readTech && file->audioProperties())
     {
-        KFileMetaInfoGroup techgroup = appendGroup(info, "Technical");
         TagLib::FLAC::Properties *properties =
                    (TagLib::FLAC::Properties*)(file->audioProperties());
 
-        appendItem(techgroup, "Bitrate",      properties->bitrate());
-        appendItem(techgroup, "Sample Rate",  properties->sampleRate());
-        appendItem(techgroup, "Sample Width", properties->sampleWidth());
-        appendItem(techgroup, "Channels",     properties->channels());
-        appendItem(techgroup, "Length",       properties->length());
+        record.setInteger(MetadataRecord::Bitrate,      properties->bitrate());
+        record.setInteger(MetadataRecord::SampleRate,   properties->sampleRate());
+        record.setInteger(MetadataRecord::SampleWidth,  properties->sampleWidth());
+        record.setInteger(MetadataRecord::Channels,     properties->channels());
+        record.setDuration(MetadataRecord::Length,      properties->length(), 1);
     }
 
     delete file;
+
+#ifdef HAVE_LIBFLAC
+    LoudnessMeter::Result loudness;
+    if (m_loudness && readTech &&
+        FlacLoudness::measure(QFile::encodeName(path).data(), !native,
+                              m_loudnessThreads, loudness))
+    {
+        if (loudness.integrated > -HUGE_VAL) {
+            record.setReal(MetadataRecord::IntegratedLoudness, loudness.integrated);
+            record.setReal(MetadataRecord::LoudnessRange,      loudness.range);
+        }
+        if (loudness.truePeak > -HUGE_VAL)
+            record.setReal(MetadataRecord::TruePeak,           loudness.truePeak);
+        record.setReal(MetadataRecord::LeadingSilence,  loudness.leadingSilence);
+        record.setReal(MetadataRecord::TrailingSilence, loudness.trailingSilence);
+    }
+#endif
+
+    if (m_fingerprint != PayloadHash::Off)
+    {
+        // hash the frames only, so retagged copies hash the same; Ogg FLAC
+        // needs the pages picked apart as their headers change
+        qint64 offset, length;
+        uint64_t hash;
+        bool ok = false;
+        if (input.isOpen()) {
+            if (native)
+                ok = payloadRange(input, offset, length) &&
+                     PayloadHash::hashRange(input.handle(), offset, length,
+                                            m_fingerprint, hash);
+            else
+                ok = PayloadHash::hashOggPages(input.handle(), 0, input.size(),
+                                               m_fingerprint, hash);
+        }
+        if (ok)
+            record.setHash(m_fingerprint == PayloadHash::Full
+                           ? MetadataRecord::PayloadHash : MetadataRecord::SampledPayloadHash,
+                           hash);
+    }
+
     return true;
 
 }
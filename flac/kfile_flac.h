@@ -25,18 +25,24 @@
 #define __KFILE_FLAC_H__
 
 #include <kfilemetainfo.h>
+#include <QString>
+
+#include "cachedfileplugin.h"
+#include "payloadhash.h"
 
 class QString;
 class QStringList;
 
-class KFlacPlugin: public KFilePlugin
+class KFlacPlugin: public CachedFilePlugin
 {
     Q_OBJECT
 
 public:
     KFlacPlugin( QObject *parent, const QStringList& args );
 
-    virtual bool readInfo( KFileMetaInfo& info, uint what);
+    virtual bool readRecord( const QString& path, const QString& mimeType, uint what,
+                             MetadataRecord& record);
+    virtual AccessManifest accessManifest( uint what ) const;
     virtual bool writeInfo( const KFileMetaInfo& info ) const;
     virtual QValidator* createValidator( const QString& mimetype,
                                          const QString &group,
@@ -44,6 +50,13 @@ public:
                                          QObject* parent, const char* name) const;
 protected:
     virtual void makeMimeTypeInfo(const QString& mimeType);
+
+private:
+    bool m_loudness;
+    int m_loudnessThreads;
+    PayloadHash::Mode m_fingerprint;
+    int m_thumbnailSize;
+    QString m_thumbnailCache;
 };
 
 
@@ -24,6 +24,9 @@
 #include <klocale.h>
 #include <kgenericfactory.h>
 #include <kstringvalidator.h>
+#include <kconfig.h>
+#include <kconfiggroup.h>
+#include <kstandarddirs.h>
 #include <kdebug.h>
 
 #include <q3dict.h>
@@ -38,15 +41,93 @@
 #include <id3v1genres.h>
 #include <id3v2framefactory.h>
 
+#include "artthumbnailer.h"
+#include "coverart.h"
+#include "mappedinput.h"
+#include "taglibstream.h"
+
+/**
+ * Finds the MPEG frames between the tags: ID3v2 at the start of the file,
+ * and ID3v1, Lyrics3v2 and APE at its end, in any combination.
+ */
+static bool payloadRange(MappedInput &input, qint64 &offset, qint64 &length)
+{
+    qint64 start = 0;
+    qint64 end = input.size();
+    InputSpan tag;
+
+    // ID3v2, possibly more than one
+    while ((tag = input.span(start, 10)).has(0, 10) && !memcmp(tag.data(), "ID3", 3)) {
+        const uchar *u = tag.data();
+        qint64 size = (qint64(u[6] & 0x7f) << 21) | ((u[7] & 0x7f) << 14) |
+                      ((u[8] & 0x7f) << 7) | (u[9] & 0x7f);
+        // a footer doubles the header at the end
+        start += 10 + size + ((u[5] & 0x10) ? 10 : 0);
+    }
+
+    if (end - start >= 128 && (tag = input.span(end - 128, 3)).has(0, 3) &&
+        !memcmp(tag.data(), "TAG", 3))
+        end -= 128;
+
+    // "LYRICS200" after a six digit size that doesn't count these 15 bytes
+    if (end - start >= 15 && (tag = input.span(end - 15, 15)).has(0, 15) &&
+        !memcmp(tag.data() + 6, "LYRICS200", 9)) {
+        qint64 size = QByteArray(reinterpret_cast<const char *>(tag.data()), 6).toLongLong();
+        if (size > 0 && size + 15 <= end - start)
+            end -= size + 15;
+    }
+
+    // APE footer, its size counts the footer but not the optional header
+    if (end - start >= 32 && (tag = input.span(end - 32, 32)).has(0, 32) &&
+        !memcmp(tag.data(), "APETAGEX", 8)) {
+        const uchar *u = tag.data();
+        qint64 size = u[12] | (u[13] << 8) | (u[14] << 16) | (qint64(u[15]) << 24);
+        if (u[23] & 0x80)
+            size += 32;
+        if (size <= end - start)
+            end -= size;
+    }
+
+    offset = start;
+    length = end - start;
+    return length > 0;
+}
+
+// the tags are shown as the ID3 tag they come from
+static const MetadataLayout mp3_layout[] = {
+    { MetadataRecord::Title,       "id3", 0, false },
+    { MetadataRecord::Artist,      "id3", 0, false },
+    { MetadataRecord::Album,       "id3", 0, false },
+    { MetadataRecord::Date,        "id3", 0, false },
+    { MetadataRecord::Comment,     "id3", 0, false },
+    { MetadataRecord::Tracknumber, "id3", 0, false },
+    { MetadataRecord::Genre,       "id3", 0, false },
+    { MetadataRecord::FieldCount,  0,     0, false }
+};
+
 typedef KGenericFactory<KMp3Plugin> Mp3Factory;
 
 K_EXPORT_COMPONENT_FACTORY(kfile_mp3, Mp3Factory( "kfile_mp3" ))
 
 KMp3Plugin::KMp3Plugin(QObject *parent, const QStringList &args)
-    : KFilePlugin(parent, args)
+    : CachedFilePlugin(parent, args, "kfile_mp3", 1)
 {
 	kDebug(7034) << "mp3 plugin\n";
 
+    KConfig config("kfile_multimediarc");
+    KConfigGroup fingerprint(&config, "Fingerprint");
+    m_fingerprint = PayloadHash::mode(fingerprint.readEntry("Mode", QString("Off")).toLatin1());
+
+    // thumbnails of the cover art are cached by the hash of the art, so
+    // every album cover is only scaled once
+    KConfigGroup thumbnails(&config, "Thumbnails");
+    m_thumbnailSize = thumbnails.readEntry("Size", 128);
+    m_thumbnailCache = KStandardDirs::locateLocal("cache", "coverart/");
+
+    setCacheSettings(QString("fingerprint=%1 thumbnails=%2")
+                     .arg(int(m_fingerprint)).arg(m_thumbnailSize).toLatin1());
+    setLayout(mp3_layout);
+
     KFileMimeTypeInfo *info = addMimeTypeInfo("audio/mpeg");
 
     // id3 group
@@ -106,14 +187,42 @@ KMp3Plugin::KMp3Plugin(QObject *parent, const QStringList &args)
     setAttributes(item,  KFileMimeTypeInfo::Cummulative);
     setUnit(item, KFileMimeTypeInfo::Seconds);
     item = addItemInfo(group, "Emphasis", i18n("Emphasis"), QVariant::String);
+
+    // cover art group
+
+    group = addGroupInfo(info, "Cover Art", i18n("Cover Art"));
+
+    addItemInfo(group, "Pictures", i18n("Pictures"), QVariant::Int);
+    addItemInfo(group, "Mime Type", i18n("MIME Type"), QVariant::String);
+    item = addItemInfo(group, "Resolution", i18n("Resolution"), QVariant::Size);
+    setHint(item, KFileMimeTypeInfo::Size);
+    item = addItemInfo(group, "Size", i18n("Size"), QVariant::Int);
+    setUnit(item, KFileMimeTypeInfo::Bytes);
+    item = addItemInfo(group, "Thumbnail", i18n("Thumbnail"), QVariant::Image);
+    setHint(item, KFileMimeTypeInfo::Thumbnail);
+
+    // fingerprint group
+
+    group = addGroupInfo(info, "Fingerprint", i18n("Fingerprint"));
+
+    item = addItemInfo(group, "Payload Hash", i18n("Payload Hash"), QVariant::String);
+    item = addItemInfo(group, "Sampled Payload Hash", i18n("Sampled Payload Hash"), QVariant::String);
 }
 
-bool KMp3Plugin::readInfo(KFileMetaInfo &info, uint what)
+// the ID3v2 tag and the first frames, and ID3v1 and APE tags at the end
+AccessManifest KMp3Plugin::accessManifest(uint /*what*/) const
+{
+    return AccessManifest(16 << 10, 4096, AccessManifest::id3v2Tag);
+}
+
+bool KMp3Plugin::readRecord(const QString &path, const QString &/*mimeType*/, uint what,
+                            MetadataRecord &record)
 {
     kDebug(7034) << "mp3 plugin readInfo\n";
 
     bool readId3 = false;
     bool readTech = false;
+    bool readThumbnail = what & KFileMetaInfo::Thumbnail;
 
     typedef enum KFileMetaInfo::What What;
 
@@ -131,13 +240,21 @@ bool KMp3Plugin::readInfo(KFileMetaInfo &info, uint what)
         readTech = true;
     }
 
-    if(!readId3 && !readTech)
+    if(!readId3 && !readTech && !readThumbnail)
         return true;
 
-    if ( info.path().isEmpty() ) // remote file
+    if ( path.isEmpty() ) // remote file
         return false;
 
-    TagLib::MPEG::File file(QFile::encodeName(info.path()).data(), readTech);
+    // TagLib, the payload hash and the cover art all read the one mapping
+    MappedInput input;
+    input.open(QFile::encodeName(path).data());
+#ifdef HAVE_TAGLIB_IOSTREAM
+    TagLibStream stream(input, QFile::encodeName(path).data());
+    TagLib::MPEG::File file(&stream, TagLib::ID3v2::FrameFactory::instance(), readTech);
+#else
+    TagLib::MPEG::File file(QFile::encodeName(path).data(), readTech);
+#endif
 
     if(!file.isOpen())
     {
@@ -147,35 +264,55 @@ bool KMp3Plugin::readInfo(KFileMetaInfo &info, uint what)
 
     if(readId3)
     {
-        KFileMetaInfoGroup id3group = appendGroup(info, "id3");
-
-        QString date  = file.tag()->year() > 0 ? QString::number(file.tag()->year()) : QString();
-        QString track = file.tag()->track() > 0 ? QString::number(file.tag()->track()) : QString();
-
-        QString title = TStringToQString(file.tag()->title()).trimmed();
-        if (!title.isEmpty())
-            appendItem(id3group, "Title", title);
-        QString artist = TStringToQString(file.tag()->artist()).trimmed();
-        if (!artist.isEmpty())
-            appendItem(id3group, "Artist", artist);
-        QString album = TStringToQString(file.tag()->album()).trimmed();
-        if (!album.isEmpty())
-            appendItem(id3group, "Album", album);
-        appendItem(id3group, "Date",        date);
-        QString comment = TStringToQString(file.tag()->comment()).trimmed();
-        if (!comment.isEmpty())
-            appendItem(id3group, "Comment", comment);
-        appendItem(id3group, "Tracknumber", track);
-        QString genre = TStringToQString(file.tag()->genre()).trimmed();
-        if (!genre.isEmpty())
-            appendItem(id3group, "Genre", genre);
+        // only the tags that are there, but always a date and track
+        const TagLib::Tag *tag = file.tag();
+        if(!tag->title().isEmpty())
+            record.setTrimmedText(MetadataRecord::Title, tag->title().to8Bit(true));
+        if(!tag->artist().isEmpty())
+            record.setTrimmedText(MetadataRecord::Artist, tag->artist().to8Bit(true));
+        if(!tag->album().isEmpty())
+            record.setTrimmedText(MetadataRecord::Album, tag->album().to8Bit(true));
+        record.setText(MetadataRecord::Date,
+                       tag->year() > 0 ? QByteArray::number(tag->year()).data() : "");
+        if(!tag->comment().isEmpty())
+            record.setTrimmedText(MetadataRecord::Comment, tag->comment().to8Bit(true));
+        record.setText(MetadataRecord::Tracknumber,
+                       tag->track() > 0 ? QByteArray::number(tag->track()).data() : "");
+        if(!tag->genre().isEmpty())
+            record.setTrimmedText(MetadataRecord::Genre, tag->genre().to8Bit(true));
     }
 
-    if(readTech)
+    if(readId3 || readThumbnail)
     {
-        KFileMetaInfoGroup techgroup = appendGroup(info, "Technical");
+        // where the pictures are and what they are, without reading them
+        std::vector<CoverArt::Picture> pictures;
+        if(input.isOpen() &&
+           CoverArt::findId3v2(input.handle(), 0, pictures))
+        {
+            const CoverArt::Picture &cover = pictures[CoverArt::frontCover(pictures)];
+            if(readId3)
+            {
+                record.setInteger(MetadataRecord::Pictures, pictures.size());
+                if(!cover.mime.empty())
+                    record.setText(MetadataRecord::PictureMimeType, cover.mime);
+                if(cover.width && cover.height)
+                    record.setSize(MetadataRecord::PictureResolution, cover.width, cover.height);
+                record.setInteger(MetadataRecord::PictureSize, cover.length);
+            }
+            if(readThumbnail)
+            {
+                ArtThumbnailer thumbnailer(m_thumbnailCache, m_thumbnailSize);
+                std::vector<uint32_t> pixels;
+                int width, height;
+                if(thumbnailer.thumbnail(input.handle(), cover, pixels, width, height))
+                    record.setImage(MetadataRecord::Thumbnail, &pixels[0], width, height);
+            }
+        }
+    }
 
-        QString version;
+    if(readTech)
+    {
+        const char *version = 0;
         switch(file.audioProperties()->version())
         {
         case TagLib::MPEG::Header::Version1:
@@ -189,20 +326,29 @@ bool KMp3Plugin::readInfo(KFileMetaInfo &info, uint what)
             break;
         }
 
-        static const int dummy = 0; // QVariant's bool constructor requires a dummy int value.
-
         // CRC and Emphasis aren't yet implemented in TagLib (not that I think anyone cares)
 
-        appendItem(techgroup, "Version",     version);
-        appendItem(techgroup, "Layer",       file.audioProperties()->layer());
-        // appendItem(techgroup, "CRC",      file.audioProperties()->crc());
-        appendItem(techgroup, "Bitrate",     file.audioProperties()->bitrate());
-        appendItem(techgroup, "Sample Rate", file.audioProperties()->sampleRate());
-        appendItem(techgroup, "Channels",    file.audioProperties()->channels());
-        appendItem(techgroup, "Copyright",   QVariant(file.audioProperties()->isCopyrighted(), dummy));
-        appendItem(techgroup, "Original",    QVariant(file.audioProperties()->isOriginal(), dummy));
-        appendItem(techgroup, "Length",      file.audioProperties()->length());
-        // appendItem(techgroup, "Emphasis", file.audioProperties()->empahsis());
+        record.setText(MetadataRecord::MpegVersion,    version ? version : "");
+        record.setInteger(MetadataRecord::Layer,       file.audioProperties()->layer());
+        record.setInteger(MetadataRecord::Bitrate,     file.audioProperties()->bitrate());
+        record.setInteger(MetadataRecord::SampleRate,  file.audioProperties()->sampleRate());
+        record.setInteger(MetadataRecord::Channels,    file.audioProperties()->channels());
+        record.setBoolean(MetadataRecord::CopyrightFlag, file.audioProperties()->isCopyrighted());
+        record.setBoolean(MetadataRecord::OriginalFlag,  file.audioProperties()->isOriginal());
+        record.setDuration(MetadataRecord::Length,     file.audioProperties()->length(), 1);
+    }
+
+    if(m_fingerprint != PayloadHash::Off)
+    {
+        // hash the frames only, so retagged copies hash the same
+        qint64 offset, length;
+        uint64_t hash;
+        if(input.isOpen() &&
+           payloadRange(input, offset, length) &&
+           PayloadHash::hashRange(input.handle(), offset, length, m_fingerprint, hash))
+            record.setHash(m_fingerprint == PayloadHash::Full
+                           ? MetadataRecord::PayloadHash : MetadataRecord::SampledPayloadHash,
+                           hash);
     }
 
     kDebug(7034) << "reading finished\n";
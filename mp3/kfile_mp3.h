@@ -20,22 +20,33 @@
 #define __KFILE_MP3_H__
 
 #include <kfilemetainfo.h>
+#include <QString>
+
+#include "cachedfileplugin.h"
+#include "payloadhash.h"
 
 class QStringList;
 
-class KMp3Plugin: public KFilePlugin
+class KMp3Plugin: public CachedFilePlugin
 {
     Q_OBJECT
 
 public:
     KMp3Plugin(QObject *parent, const QStringList &args);
 
-    virtual bool readInfo( KFileMetaInfo& info, uint what );
+    virtual bool readRecord( const QString& path, const QString& mimeType, uint what,
+                             MetadataRecord& record );
+    virtual AccessManifest accessManifest( uint what ) const;
     virtual bool writeInfo( const KFileMetaInfo& info) const;
     virtual QValidator *createValidator(const QString &mimetype,
                                         const QString &group,
                                         const QString &key,
                                         QObject *parent, const char *name) const;
+
+private:
+    PayloadHash::Mode m_fingerprint;
+    int m_thumbnailSize;
+    QString m_thumbnailCache;
 };
 
 #endif
@@ -45,11 +45,14 @@
 #include <unistd.h>
 #include <ctype.h>
 
+#include "mappedinput.h"
+#include "taglibstream.h"
+
 K_EXPORT_COMPONENT_FACTORY(kfile_mpc, KGenericFactory<KMpcPlugin>("kfile_mpc"))
 
 KMpcPlugin::KMpcPlugin( QObject *parent, 
                         const QStringList &args )
-    : KFilePlugin( parent, args )
+    : CachedFilePlugin(parent, args, "kfile_mpc", 1)
 {
     kDebug(7034) << "mpc plugin\n";
 
@@ -124,7 +127,14 @@ KMpcPlugin::KMpcPlugin( QObject *parent,
     setUnit(item, KFileMimeTypeInfo::Seconds);
 }
 
-bool KMpcPlugin::readInfo( KFileMetaInfo& info, uint what )
+// the stream header, maybe behind an ID3v2 tag, and the APE tag at the end
+AccessManifest KMpcPlugin::accessManifest(uint /*what*/) const
+{
+    return AccessManifest(4096, 4096, AccessManifest::id3v2Tag);
+}
+
+bool KMpcPlugin::readRecord( const QString& path, const QString& /*mimeType*/, uint what,
+                             MetadataRecord& record )
 {
 
     bool readComment = false;
@@ -137,10 +147,17 @@ bool KMpcPlugin::readInfo( KFileMetaInfo& info, uint what )
                 KFileMetaInfo::DontCare |
                 KFileMetaInfo::TechnicalInfo)) readTech = true;
 
-    if ( info.path().isEmpty() ) // remote file
+    if ( path.isEmpty() ) // remote file
         return false;
 
-    TagLib::File *file = new TagLib::MPC::File(QFile::encodeName(info.path()).data(), readTech);
+#ifdef HAVE_TAGLIB_IOSTREAM
+    MappedInput input;
+    input.open(QFile::encodeName(path).data());
+    TagLibStream stream(input, QFile::encodeName(path).data());
+    TagLib::File *file = new TagLib::MPC::File(&stream, readTech);
+#else
+    TagLib::File *file = new TagLib::MPC::File(QFile::encodeName(path).data(), readTech);
+#endif
 
     if (!file->isOpen())
     {
@@ -151,31 +168,28 @@ bool KMpcPlugin::readInfo( KFileMetaInfo& info, uint what )
 
     if(readComment)
     {
-        KFileMetaInfoGroup commentgroup = appendGroup(info, "Comment");
-
-        QString date  = file->tag()->year() > 0 ? QString::number(file->tag()->year()) : QString();
-        QString track = file->tag()->track() > 0 ? QString::number(file->tag()->track()) : QString();
-
-        appendItem(commentgroup, "Title",       TStringToQString(file->tag()->title()).trimmed());
-        appendItem(commentgroup, "Artist",      TStringToQString(file->tag()->artist()).trimmed());
-        appendItem(commentgroup, "Album",       TStringToQString(file->tag()->album()).trimmed());
-        appendItem(commentgroup, "Date",        date);
-        appendItem(commentgroup, "Comment",     TStringToQString(file->tag()->comment()).trimmed());
-        appendItem(commentgroup, "Tracknumber", track);
-        appendItem(commentgroup, "Genre",       TStringToQString(file->tag()->genre()).trimmed());
+        const TagLib::Tag *tag = file->tag();
+        record.setTrimmedText(MetadataRecord::Title,   tag->title().to8Bit(true));
+        record.setTrimmedText(MetadataRecord::Artist,  tag->artist().to8Bit(true));
+        record.setTrimmedText(MetadataRecord::Album,   tag->album().to8Bit(true));
+        record.setText(MetadataRecord::Date,
+                       tag->year() > 0 ? QByteArray::number(tag->year()).data() : "");
+        record.setTrimmedText(MetadataRecord::Comment, tag->comment().to8Bit(true));
+        record.setText(MetadataRecord::Tracknumber,
+                       tag->track() > 0 ? QByteArray::number(tag->track()).data() : "");
+        record.setTrimmedText(MetadataRecord::Genre,   tag->genre().to8Bit(true));
     }
 
     if (readTech)
     {
-        KFileMetaInfoGroup techgroup = appendGroup(info, "Technical");
         TagLib::MPC::Properties *properties =
                    (TagLib::MPC::Properties*)(file->audioProperties());
 
-        appendItem(techgroup, "Bitrate",      properties->bitrate());
-        appendItem(techgroup, "Sample Rate",  properties->sampleRate());
-        appendItem(techgroup, "Channels",     properties->channels());
-        appendItem(techgroup, "Length",       properties->length());
-        appendItem(techgroup, "Version",      properties->mpcVersion());
+        record.setInteger(MetadataRecord::Bitrate,      properties->bitrate());
+        record.setInteger(MetadataRecord::SampleRate,   properties->sampleRate());
+        record.setInteger(MetadataRecord::Channels,     properties->channels());
+        record.setDuration(MetadataRecord::Length,      properties->length(), 1);
+        record.setInteger(MetadataRecord::Version,      properties->mpcVersion());
     }
 
     delete file;
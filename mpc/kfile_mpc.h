@@ -26,17 +26,21 @@
 
 #include <kfilemetainfo.h>
 
+#include "cachedfileplugin.h"
+
 class QString;
 class QStringList;
 
-class KMpcPlugin: public KFilePlugin
+class KMpcPlugin: public CachedFilePlugin
 {
     Q_OBJECT
 
 public:
     KMpcPlugin( QObject *parent, const QStringList& args );
 
-    virtual bool readInfo( KFileMetaInfo& info, uint what);
+    virtual bool readRecord( const QString& path, const QString& mimeType, uint what,
+                             MetadataRecord& record);
+    virtual AccessManifest accessManifest( uint what ) const;
     virtual bool writeInfo( const KFileMetaInfo& info ) const;
     virtual QValidator* createValidator( const QString& mimetype,
                                          const QString &group,
@@ -34,6 +34,9 @@
 #include <klocale.h>
 #include <kgenericfactory.h>
 #include <ksavefile.h>
+#include <kconfig.h>
+#include <kconfiggroup.h>
+#include <kstandarddirs.h>
 
 #include <ogg/ogg.h>
 #include <vorbis/codec.h>
@@ -42,6 +45,55 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "artthumbnailer.h"
+#include "coverart.h"
+#include "mappedinput.h"
+
+// libvorbisfile reads the file through the mapping, with these callbacks
+// standing in for stdio
+struct VorbisSource
+{
+    MappedInput *input;
+    ogg_int64_t pos;
+};
+
+static size_t vorbisRead(void *data, size_t size, size_t count, void *source)
+{
+    VorbisSource *in = static_cast<VorbisSource *>(source);
+    if (!size)
+        return 0;
+    const size_t got = in->input->read(in->pos, data, size * count);
+    in->pos += got;
+    return got / size;
+}
+
+static int vorbisSeek(void *source, ogg_int64_t offset, int whence)
+{
+    VorbisSource *in = static_cast<VorbisSource *>(source);
+    ogg_int64_t pos = offset;
+    if (whence == SEEK_CUR)
+        pos += in->pos;
+    else if (whence == SEEK_END)
+        pos += in->input->size();
+    if (pos < 0)
+        return -1;
+    in->pos = pos;
+    return 0;
+}
+
+static int vorbisClose(void * /*source*/)
+{
+    return 0;
+}
+
+static long vorbisTell(void *source)
+{
+    return static_cast<VorbisSource *>(source)->pos;
+}
 
 // known translations for common ogg/vorbis keys
 // from http://www.ogg.org/ogg/vorbis/doc/v-comment.html
@@ -64,9 +116,23 @@ K_EXPORT_COMPONENT_FACTORY(kfile_ogg, KGenericFactory<KOggPlugin>("kfile_ogg"))
 
 KOggPlugin::KOggPlugin( QObject *parent, 
                         const QStringList &args )
-    : KFilePlugin( parent, args )
+    : CachedFilePlugin(parent, args, "kfile_ogg", 1)
 {
     kDebug(7034) << "ogg plugin\n";
+
+    KConfig config("kfile_multimediarc");
+    KConfigGroup fingerprint(&config, "Fingerprint");
+    m_fingerprint = PayloadHash::mode(fingerprint.readEntry("Mode", QString("Off")).toLatin1());
+
+    // thumbnails of the cover art are cached by the hash of the art, so
+    // every album cover is only scaled once
+    KConfigGroup thumbnails(&config, "Thumbnails");
+    m_thumbnailSize = thumbnails.readEntry("Size", 128);
+    m_thumbnailCache = KStandardDirs::locateLocal("cache", "coverart/");
+
+    setCacheSettings(QString("fingerprint=%1 thumbnails=%2")
+                     .arg(int(m_fingerprint)).arg(m_thumbnailSize).toLatin1());
+
     KFileMimeTypeInfo* info = addMimeTypeInfo( "audio/x-vorbis+ogg" );
 
     KFileMimeTypeInfo::GroupInfo* group = 0;
@@ -147,12 +213,41 @@ KOggPlugin::KOggPlugin( QObject *parent,
     item = addItemInfo(group, "Length", i18n("Length"), QVariant::Int);
     setAttributes(item, KFileMimeTypeInfo::Cummulative);
     setUnit(item, KFileMimeTypeInfo::Seconds);
+
+    // cover art group
+
+    group = addGroupInfo(info, "Cover Art", i18n("Cover Art"));
+    setAttributes(group, 0);
+
+    addItemInfo(group, "Pictures", i18n("Pictures"), QVariant::Int);
+    addItemInfo(group, "Mime Type", i18n("MIME Type"), QVariant::String);
+    item = addItemInfo(group, "Resolution", i18n("Resolution"), QVariant::Size);
+    setHint(item, KFileMimeTypeInfo::Size);
+    item = addItemInfo(group, "Size", i18n("Size"), QVariant::Int);
+    setUnit(item, KFileMimeTypeInfo::Bytes);
+    item = addItemInfo(group, "Thumbnail", i18n("Thumbnail"), QVariant::Image);
+    setHint(item, KFileMimeTypeInfo::Thumbnail);
+
+    // fingerprint group
+
+    group = addGroupInfo(info, "Fingerprint", i18n("Fingerprint"));
+    setAttributes(group, 0);
+
+    addItemInfo(group, "Payload Hash", i18n("Payload Hash"), QVariant::String);
+    addItemInfo(group, "Sampled Payload Hash", i18n("Sampled Payload Hash"), QVariant::String);
 }
 
-bool KOggPlugin::readInfo( KFileMetaInfo& info, uint what )
+// the header packets, and the last pages, whose granule position gives
+// the length
+AccessManifest KOggPlugin::accessManifest(uint /*what*/) const
+{
+    return AccessManifest(64 << 10, 64 << 10);
+}
+
+bool KOggPlugin::readRecord( const QString& path, const QString& /*mimeType*/, uint what,
+                             MetadataRecord& record )
 {
     // parts of this code taken from ogginfo.c of the vorbis-tools v1.0rc2
-    FILE *fp;
     OggVorbis_File vf;
     int rc,i;
     vorbis_comment *vc;
@@ -160,6 +255,7 @@ bool KOggPlugin::readInfo( KFileMetaInfo& info, uint what )
     
     bool readComment = false;
     bool readTech = false;
+    bool readThumbnail = what & KFileMetaInfo::Thumbnail;
     if (what & (KFileMetaInfo::Fastest | 
                 KFileMetaInfo::DontCare |
                 KFileMetaInfo::ContentInfo)) readComment = true;
@@ -170,21 +266,25 @@ bool KOggPlugin::readInfo( KFileMetaInfo& info, uint what )
 
     memset(&vf, 0, sizeof(OggVorbis_File));
 
-    if ( info.path().isEmpty() ) // remote file
+    if ( path.isEmpty() ) // remote file
         return false;
  
-    fp = fopen(QFile::encodeName(info.path()),"rb");
-    if (!fp)
+    MappedInput input;
+    if (!input.open(QFile::encodeName(path).data()))
     {
-        kDebug(7034) << "Unable to open " << QFile::encodeName(info.path());
+        kDebug(7034) << "Unable to open " << QFile::encodeName(path);
         return false;
     }
+    // the headers, then a bisection for the last page
+    input.advise(RandomAccess);
 
-    rc = ov_open(fp,&vf,NULL,0);
+    VorbisSource source = { &input, 0 };
+    ov_callbacks callbacks = { vorbisRead, vorbisSeek, vorbisClose, vorbisTell };
+    rc = ov_open_callbacks(&source, &vf, NULL, 0, callbacks);
 
     if (rc < 0) 
     {
-        kDebug(7034) << "Unable to understand " << QFile::encodeName(info.path())
+        kDebug(7034) << "Unable to understand " << QFile::encodeName(path)
                       << ", errorcode=" << rc << endl;
         return false;
     }
@@ -196,52 +296,93 @@ bool KOggPlugin::readInfo( KFileMetaInfo& info, uint what )
     if (readComment)
     {
         vc = ov_comment(&vf,-1);
-        
-        KFileMetaInfoGroup commentGroup = appendGroup(info, "Comment");
-            
+
         for (i=0; i < vc->comments; i++)
         {
+            // pictures are listed below, not dumped as base64
+            if (!strncasecmp(vc->user_comments[i], "METADATA_BLOCK_PICTURE=", 23))
+                continue;
+
             kDebug(7034) << vc->user_comments[i];
-            QStringList split = QString::fromUtf8(vc->user_comments[i]).split(QChar('='));
-            split[0] = split[0].toLower();
-            split[0][0] = split[0][0].toUpper();
- 
-            // we have to be sure that the i18n() string always has the same
-            // case. Oh, and is UTF8 ok here?
-            appendItem(commentGroup, split[0], split[1]);
+            const char *comment = vc->user_comments[i];
+            const char *value = strchr(comment, '=');
+            if (!value || value == comment)
+                continue;
+
+            // field names are ASCII, and shown as "Title" for TITLE
+            std::string key(comment, value - comment);
+            for (size_t j = 0; j < key.size(); ++j)
+                key[j] = j ? tolower(key[j]) : toupper(key[j]);
+            ++value;
+            record.setTag("Comment", key.c_str(), value,
+                          vc->comment_lengths[i] - (value - comment));
+        }
+    }
+
+    // where the pictures are and what they are, without reading them
+    std::vector<CoverArt::Picture> pictures;
+    if ((readComment || readThumbnail) && CoverArt::findOgg(input.handle(), pictures))
+    {
+        const CoverArt::Picture &cover = pictures[CoverArt::frontCover(pictures)];
+        if (readComment)
+        {
+            record.setInteger(MetadataRecord::Pictures, pictures.size());
+            if (!cover.mime.empty())
+                record.setText(MetadataRecord::PictureMimeType, cover.mime);
+            if (cover.width && cover.height)
+                record.setSize(MetadataRecord::PictureResolution, cover.width, cover.height);
+            record.setInteger(MetadataRecord::PictureSize, cover.length);
+        }
+        if (readThumbnail)
+        {
+            ArtThumbnailer thumbnailer(m_thumbnailCache, m_thumbnailSize);
+            std::vector<uint32_t> pixels;
+            int width, height;
+            if (thumbnailer.thumbnail(input.handle(), cover, pixels, width, height))
+                record.setImage(MetadataRecord::Thumbnail, &pixels[0], width, height);
         }
     }
  
     if (readTech)
     {  
-        KFileMetaInfoGroup techgroup = appendGroup(info, "Technical");
         // get other information about the file
         vi = ov_info(&vf,-1);
         if (vi)
         {
 
-            appendItem(techgroup, "Version", int(vi->version));
-            appendItem(techgroup, "Channels", int(vi->channels));
-            appendItem(techgroup, "Sample Rate", int(vi->rate));
+            record.setInteger(MetadataRecord::Version, vi->version);
+            record.setInteger(MetadataRecord::Channels, vi->channels);
+            record.setInteger(MetadataRecord::SampleRate, vi->rate);
 
             if (vi->bitrate_upper > 0) 
-                appendItem(techgroup, "UpperBitrate",
-                           int(vi->bitrate_upper+500)/1000);
+                record.setInteger(MetadataRecord::UpperBitrate,
+                                  int(vi->bitrate_upper+500)/1000);
             if (vi->bitrate_lower > 0) 
-                appendItem(techgroup, "LowerBitrate",
-                           int(vi->bitrate_lower+500)/1000);
+                record.setInteger(MetadataRecord::LowerBitrate,
+                                  int(vi->bitrate_lower+500)/1000);
             if (vi->bitrate_nominal > 0) 
-                appendItem(techgroup, "NominalBitrate",
-                           int(vi->bitrate_nominal+500)/1000);
+                record.setInteger(MetadataRecord::NominalBitrate,
+                                  int(vi->bitrate_nominal+500)/1000);
 
             if (ov_bitrate(&vf,-1) > 0)
-                appendItem(techgroup, "Bitrate", int(ov_bitrate(&vf,-1)+500)/1000);
+                record.setInteger(MetadataRecord::Bitrate, int(ov_bitrate(&vf,-1)+500)/1000);
             
         }
         
-        appendItem(techgroup, "Length", int(ov_time_total(&vf,-1)));
+        // in milliseconds, which are shown as whole seconds
+        record.setDuration(MetadataRecord::Length, qint64(ov_time_total(&vf,-1) * 1000), 1000);
     }
 
+    // vorbiscomment rewrites the header pages and renumbers the rest, so
+    // only the bodies and granule positions of the audio pages are hashed
+    uint64_t hash;
+    if (m_fingerprint != PayloadHash::Off &&
+        PayloadHash::hashOggPages(input.handle(), 0, input.size(),
+                                  m_fingerprint, hash))
+        record.setHash(m_fingerprint == PayloadHash::Full
+                       ? MetadataRecord::PayloadHash : MetadataRecord::SampledPayloadHash,
+                       hash);
+
     ov_clear(&vf);
 
     return true;
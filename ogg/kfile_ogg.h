@@ -22,23 +22,34 @@
 #define __KFILE_OGG_H__
 
 #include <kfilemetainfo.h>
+#include <QString>
+
+#include "cachedfileplugin.h"
+#include "payloadhash.h"
 
 class QString;
 class QStringList;
 
-class KOggPlugin: public KFilePlugin
+class KOggPlugin: public CachedFilePlugin
 {
     Q_OBJECT
     
 public:
     KOggPlugin( QObject *parent, const QStringList& args );
     
-    virtual bool readInfo( KFileMetaInfo& info, uint what);
+    virtual bool readRecord( const QString& path, const QString& mimeType, uint what,
+                             MetadataRecord& record);
+    virtual AccessManifest accessManifest( uint what ) const;
     virtual bool writeInfo( const KFileMetaInfo& info ) const;
     virtual QValidator* createValidator( const QString& mimetype,
                                          const QString &group,
                                          const QString &key,
                                          QObject* parent, const char* name) const;
+
+private:
+    PayloadHash::Mode m_fingerprint;
+    int m_thumbnailSize;
+    QString m_thumbnailCache;
 };
 
 
@@ -17,20 +17,45 @@
  */
 
 #include "kfile_sid.h"
+#include "sidheaderwriter.h"
+#include "sidparser.h"
+#include "snapshotfile.h"
 
 #include <klocale.h>
 #include <kgenericfactory.h>
 #include <kstringvalidator.h>
+#include <kstandarddirs.h>
+#include <kconfig.h>
+#include <kconfiggroup.h>
+#include <kmd5.h>
 #include <kdebug.h>
 
+#include <QDateTime>
 #include <QFile>
+#include <QFileInfo>
+#include <QThread>
 #include <qvalidator.h>
 #include <QWidget>
 
-#include <unistd.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <fcntl.h>
+// PSID/RSID tunes can't be larger than the header plus the C64's memory
+static const qint64 max_sid_size = 0x7c + 2 + 0x10000;
+
+// the PSID format allows at most 256 subtunes
+static const int max_songs = 256;
+
+static QString formatLength(uint32_t ms)
+{
+    uint32_t seconds = (ms + 500) / 1000;
+    return QString("%1:%2").arg(seconds / 60).arg(seconds % 60, 2, 10, QChar('0'));
+}
+
+// what the header says of the tune is shown in a group of its own
+static const MetadataLayout sid_layout[] = {
+    { MetadataRecord::Title,      "General", 0, false },
+    { MetadataRecord::Artist,     "General", 0, false },
+    { MetadataRecord::Copyright,  "General", 0, false },
+    { MetadataRecord::FieldCount, 0,         0, false }
+};
 
 typedef KGenericFactory<KSidPlugin> SidFactory;
 
@@ -39,7 +64,7 @@ K_EXPORT_COMPONENT_FACTORY(kfile_sid, SidFactory("kfile_sid"))
 KSidPlugin::KSidPlugin(QObject *parent,
                        const QStringList &args)
     
-    : KFilePlugin(parent, args)
+    : CachedFilePlugin(parent, args, "kfile_sid", 1)
 {
     kDebug(7034) << "sid plugin\n";
     
@@ -72,86 +97,120 @@ KSidPlugin::KSidPlugin(QObject *parent,
 
     addItemInfo(group, "Number of Songs", i18n("Number of Songs"), QVariant::Int);
     item = addItemInfo(group, "Start Song", i18n("Start Song"), QVariant::Int);
+
+    item = addItemInfo(group, "Length", i18n("Length"), QVariant::Int);
+    setAttributes(item, KFileMimeTypeInfo::Cummulative);
+    setHint(item, KFileMimeTypeInfo::Length);
+    setUnit(item, KFileMimeTypeInfo::Seconds);
+
+    addItemInfo(group, "Song Lengths", i18n("Song Lengths"), QVariant::String);
+
+    // the song length database is compiled from HVSC's Songlengths.md5
+    // with kfile_sid_songlengths; it's only mapped, never parsed, here
+    KConfig config("kfile_sidrc");
+    KConfigGroup songlengths(&config, "Songlengths");
+    QString index = songlengths.readPathEntry("Index",
+                        KStandardDirs::locate("data", "kfile_sid/Songlengths.idx"));
+    if (!index.isEmpty() && m_songlengths.open(QFile::encodeName(index)))
+        kDebug(7034) << "using song length database " << index;
+
+    // tunes that aren't in the database can be emulated to guess their
+    // lengths, which costs up to Budget milliseconds of CPU time per file
+    KConfigGroup emulation(&config, "Emulation");
+    m_emulate = emulation.readEntry("Enabled", false);
+    m_emulation.budgetMs = emulation.readEntry("Budget", 1000);
+    m_emulation.maxSeconds = emulation.readEntry("MaxLength", 600);
+    m_emulation.threads = emulation.readEntry("Threads", QThread::idealThreadCount());
+    if (m_emulation.threads < 1)
+        m_emulation.threads = 1;
+
+    // a newer song length database gives other lengths
+    setCacheSettings(QString("songlengths=%1,%2 emulation=%3,%4,%5")
+                     .arg(index).arg(QFileInfo(index).lastModified().toTime_t())
+                     .arg(m_emulate).arg(m_emulation.budgetMs).arg(m_emulation.maxSeconds)
+                     .toLatin1());
+    setLayout(sid_layout);
 }
 
-bool KSidPlugin::readInfo(KFileMetaInfo& info, uint /*what*/)
+// the header, or all of the tune when it is looked up or emulated
+AccessManifest KSidPlugin::accessManifest(uint /*what*/) const
 {
-    if ( info.path().isEmpty() ) // remote file
-        return false;
-    QFile file(info.path());
-    if ( !file.open(QIODevice::ReadOnly) )
-        return false;
-
-    int version;
-    int num_songs;
-    int start_song;
-    QString name;
-    QString artist;
-    QString copyright;
-    
-    char buf[64] = { 0 };
-    
-    if (4 != file.read(buf, 4))
-        return false;
-    if (strncmp(buf, "PSID", 4))
-        return false;
-
-    //read version
-    int ch;
-    if (0 > (ch = file.getch()))
-        return false;
-    version = ch << 8;
-    if (0 > (ch = file.getch()))
-        return false;
-    version+= ch;
-
-    //read number of songs
-    file.seek(0xE);
-    if (0 > (ch = file.getch()))
-        return false;
-    num_songs = ch << 8;
-    if (0 > (ch = file.getch()))
-        return false;
-    num_songs += ch;
+    const bool whole = m_songlengths.isOpen() || m_emulate;
+    return AccessManifest(whole ? max_sid_size : 0x7c, 0, 0, true);
+}
 
-    //start song
-    if (0 > (ch = file.getch()))
-        return false;
-    start_song = ch << 8;
-    if (0 > (ch = file.getch()))
+bool KSidPlugin::readRecord(const QString& path, const QString& /*mimeType*/, uint /*what*/,
+                            MetadataRecord& record)
+{
+    if ( path.isEmpty() ) // remote file
         return false;
-    start_song += ch;
-
-    //name
-    file.seek(0x16);
-    if (32 != file.read(buf, 32))
+    SnapshotFile file(path, snapshot());
+    if ( !file.open(QIODevice::ReadOnly) )
         return false;
-    name = buf;
 
-    //artist
-    if (32 != file.read(buf, 32))
+    // HVSC identifies tunes by the MD5 sum of the whole file, and the
+    // emulation needs all of it too
+    SidParser parser(m_songlengths.isOpen() || m_emulate, max_sid_size);
+    if (file.parse(parser) == PushParser::Failed)
         return false;
-    artist = buf;
 
-    //copyright
-    if (32 != file.read(buf, 32))
-        return false;
-    copyright = buf;
+    int version = parser.version();
+    int num_songs = parser.songs();
+    int start_song = parser.startSong();
+    const QByteArray name = QString(parser.name().c_str()).toUtf8();
+    const QByteArray artist = QString(parser.artist().c_str()).toUtf8();
+    const QByteArray copyright = QString(parser.copyright().c_str()).toUtf8();
+
+    uint32_t lengths[max_songs];
+    int known_songs = 0;
+    bool estimated = false;
+    if (parser.haveData()) {
+        const std::string &data = parser.data();
+
+        if (m_songlengths.isOpen()) {
+            KMD5 md5(data.data(), data.size());
+            known_songs = m_songlengths.lookup(md5.rawDigest(), lengths, max_songs);
+            if (known_songs > max_songs)
+                known_songs = max_songs;
+        }
+
+        std::vector<SidLengthEstimator::Song> songs;
+        if (known_songs == 0 && m_emulate &&
+            SidLengthEstimator::estimate(reinterpret_cast<const unsigned char *>(data.data()),
+                                         data.size(), m_emulation, songs)) {
+            // songs that crashed or ran out of time stay unknown (0)
+            for (size_t i = 0; i < songs.size() && known_songs < max_songs; ++i)
+                lengths[known_songs++] =
+                    songs[i].reason > SidLengthEstimator::Limit ? songs[i].ms : 0;
+            estimated = true;
+        }
+    }
 
-    QString TODO("TODO");
     kDebug(7034) << "sid plugin readInfo\n";
-    
-    KFileMetaInfoGroup general = appendGroup(info, "General");
-
-    appendItem(general, "Title",     name);
-    appendItem(general, "Artist",    artist);
-    appendItem(general, "Copyright", copyright);
 
-    KFileMetaInfoGroup tech = appendGroup(info, "Technical");
-
-    appendItem(tech, "Version",         version);
-    appendItem(tech, "Number of Songs", num_songs);
-    appendItem(tech, "Start Song", start_song);
+    record.setText(MetadataRecord::Title,     name.constData(), name.size());
+    record.setText(MetadataRecord::Artist,    artist.constData(), artist.size());
+    record.setText(MetadataRecord::Copyright, copyright.constData(), copyright.size());
+
+    record.setInteger(MetadataRecord::Version,   version);
+    record.setInteger(MetadataRecord::SongCount, num_songs);
+    record.setInteger(MetadataRecord::StartSong, start_song);
+
+    if (known_songs > 0) {
+        QStringList songs;
+        for (int i = 0; i < known_songs; ++i) {
+            if (lengths[i] == 0)
+                songs.append("?");
+            else
+                songs.append((estimated ? "~" : "") + formatLength(lengths[i]));
+        }
+
+        int song = (start_song >= 1 && start_song <= known_songs) ? start_song : 1;
+        if (lengths[song - 1] > 0)
+            record.setDuration(MetadataRecord::Length, lengths[song - 1], 1000);
+        const QByteArray lengthList = songs.join(", ").toUtf8();
+        record.setText(MetadataRecord::SongLengths, lengthList.constData(), lengthList.size());
+    }
 
     kDebug(7034) << "reading finished\n";
     return true;
@@ -161,52 +220,29 @@ bool KSidPlugin::writeInfo(const KFileMetaInfo& info) const
 {
     kDebug(7034) ;
 
-    char name[32] = {0};
-    char artist[32] = {0};
-    char copyright[32] = {0};
-
-    int file = 0;
-    QString s;
-        
     KFileMetaInfoGroup group = info.group("General");
     if (!group.isValid())
-        goto failure;
+        return false;
 
-    s = group.item("Title").value().toString();
-    if (s.isNull()) goto failure;
-    strncpy(name, s.local8Bit(), 31);
-    
-    s = group.item("Artist").value().toString();
-    if (s.isNull()) goto failure;
-    strncpy(artist, s.local8Bit(), 31);
-    
-    s = group.item("Copyright").value().toString();
-    if (s.isNull()) goto failure;
-    strncpy(copyright, s.local8Bit(), 31);
-    
-    kDebug(7034) << "Opening sid file " << info.path();
-    file = ::open(QFile::encodeName(info.path()), O_WRONLY);
-    //name
-    if (-1 == ::lseek(file, 0x16, SEEK_SET))
-        goto failure;
-    if (32 != ::write(file, name, 32))
-        goto failure;
-
-    //artist
-    if (32 != ::write(file, artist, 32))
-        goto failure;
-
-    //copyright
-    if (32 != write(file, copyright, 32))
-        goto failure;
-
-    close(file);
-    return true;
+    QString name = group.item("Title").value().toString();
+    QString artist = group.item("Artist").value().toString();
+    QString copyright = group.item("Copyright").value().toString();
+    if (name.isNull() || artist.isNull() || copyright.isNull())
+        return false;
+
+    std::vector<SidHeaderWriter::Update> updates(1);
+    updates[0].path = QFile::encodeName(info.path()).constData();
+    updates[0].setFields(name.toLocal8Bit().constData(),
+                         artist.toLocal8Bit().constData(),
+                         copyright.toLocal8Bit().constData());
 
-failure:
-    if (file) close(file);
-    kDebug(7034) << "something went wrong writing to sid file\n";
-    return false;
+    kDebug(7034) << "Writing sid file " << info.path();
+    if (SidHeaderWriter::write(updates, false) != 1) {
+        kDebug(7034) << "something went wrong writing to sid file\n";
+        return false;
+    }
+
+    return true;
 }
 
 QValidator*
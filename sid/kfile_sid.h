@@ -23,20 +23,31 @@
 
 #include <kfilemetainfo.h>
 
+#include "cachedfileplugin.h"
+#include "sidsonglengths.h"
+#include "sidemu.h"
+
 class QStringList;
 
-class KSidPlugin: public KFilePlugin
+class KSidPlugin: public CachedFilePlugin
 {
     Q_OBJECT
     
 public:
     KSidPlugin(QObject *parent, const QStringList& args);
     
-    virtual bool readInfo(KFileMetaInfo& info, uint what);
+    virtual bool readRecord(const QString& path, const QString& mimeType, uint what,
+                            MetadataRecord& record);
+    virtual AccessManifest accessManifest(uint what) const;
     virtual bool writeInfo(const KFileMetaInfo& info) const;
     QValidator* createValidator(const QString& mimetype, const QString& group,
                                 const QString& key, QObject* parent,
                                 const char* name) const;
+
+private:
+    SidSonglengths m_songlengths;
+    bool m_emulate;
+    SidLengthEstimator::Options m_emulation;
 };
 
 #endif
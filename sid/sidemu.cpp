@@ -0,0 +1,1001 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "sidemu.h"
+
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+namespace {
+
+const uint32_t pal_clock = 985248;
+const uint32_t ntsc_clock = 1022727;
+const uint32_t pal_frame = 312 * 63;    // cycles per PAL frame
+const uint32_t ntsc_frame = 263 * 65;
+const uint16_t cia_default = 0x4025;    // the KERNAL's 60Hz timer
+
+// base cycles per opcode; page crossings and taken branches are added
+// while executing.  Opcodes we don't emulate jam the CPU anyway.
+const uint8_t cycle_table[256] = {
+    7,6,0,8,3,3,5,5,3,2,2,2,4,4,6,6,
+    2,5,0,8,4,4,6,6,2,4,2,7,4,4,7,7,
+    6,6,0,8,3,3,5,5,4,2,2,2,4,4,6,6,
+    2,5,0,8,4,4,6,6,2,4,2,7,4,4,7,7,
+    6,6,0,8,3,3,5,5,3,2,2,2,3,4,6,6,
+    2,5,0,8,4,4,6,6,2,4,2,7,4,4,7,7,
+    6,6,0,8,3,3,5,5,4,2,2,2,5,4,6,6,
+    2,5,0,8,4,4,6,6,2,4,2,7,4,4,7,7,
+    2,6,2,6,3,3,3,3,2,2,2,2,4,4,4,4,
+    2,6,0,6,4,4,4,4,2,5,2,5,5,5,5,5,
+    2,6,2,6,3,3,3,3,2,2,2,2,4,4,4,4,
+    2,5,0,5,4,4,4,4,2,4,2,4,4,4,4,4,
+    2,6,2,8,3,3,5,5,2,2,2,2,4,4,6,6,
+    2,5,0,8,4,4,6,6,2,4,2,7,4,4,7,7,
+    2,6,2,8,3,3,5,5,2,2,2,2,4,4,6,6,
+    2,5,0,8,4,4,6,6,2,4,2,7,4,4,7,7
+};
+
+/**
+ * A 6510 with 64k of RAM, the SID's registers and just enough of the
+ * VIC, the CIAs and the KERNAL to keep common players happy.  Anything
+ * else a tune tries to use makes it jam, which ends its estimation.
+ */
+class Cpu
+{
+public:
+    enum Status { Returned, Jammed, OutOfCycles };
+
+    uint8_t ram[0x10000];
+    uint8_t sid[0x20];
+    uint16_t ciaLatch;
+    bool ciaWritten;
+    uint64_t cycles;
+
+    void reset()
+    {
+        memset(sid, 0, sizeof(sid));
+        ram[0] = 0x2f;
+        ram[1] = 0x37;
+        updateBanks();
+        ciaLatch = cia_default;
+        ciaWritten = false;
+        cycles = 0;
+        noise = 0x7ffff8;
+        a = x = y = 0;
+        s = 0xff;
+        setP(0x24);
+    }
+
+    bool kernalVisible() const { return kernalOn; }
+
+    /**
+     * Runs the subroutine at addr until it returns.  With irq set, the
+     * stack is set up like the KERNAL's IRQ entry leaves it, so handlers
+     * may return through $EA31/$EA81 or restore the registers themselves.
+     */
+    Status call(uint16_t addr, uint8_t acc, bool irq, uint32_t maxCycles);
+
+private:
+    uint16_t pc;
+    uint8_t a, x, y, s;
+    uint8_t flagN, flagZ;   // N is bit 7 of flagN, Z is set if flagZ == 0
+    bool flagV, flagC, flagD, flagI;
+    bool ioOn, kernalOn;
+    uint32_t noise;
+
+    void updateBanks()
+    {
+        uint8_t port = (ram[1] | ~ram[0]) & 7;
+        ioOn = (port & 4) && (port & 3);
+        kernalOn = port & 2;
+    }
+
+    uint8_t getP() const
+    {
+        return (flagN & 0x80) | (flagV ? 0x40 : 0) | 0x20 | (flagD ? 0x08 : 0) |
+               (flagI ? 0x04 : 0) | (flagZ ? 0 : 0x02) | (flagC ? 0x01 : 0);
+    }
+
+    void setP(uint8_t p)
+    {
+        flagN = p;
+        flagV = p & 0x40;
+        flagD = p & 0x08;
+        flagI = p & 0x04;
+        flagZ = !(p & 0x02);
+        flagC = p & 0x01;
+    }
+
+    uint8_t ioRead(uint16_t addr)
+    {
+        switch (addr & 0xfc00) {
+        case 0xd000: {
+            uint32_t raster = (cycles / 63) % 312;
+            if ((addr & 0x3f) == 0x11)
+                return ((raster >> 1) & 0x80) | 0x1b;
+            if ((addr & 0x3f) == 0x12)
+                return raster & 0xff;
+            return 0;
+        }
+        case 0xd400:
+            if ((addr & 0x1f) == 0x1b) {
+                // players use voice 3's oscillator as a random generator
+                uint32_t bit = ((noise >> 22) ^ (noise >> 17)) & 1;
+                noise = ((noise << 1) | bit) & 0x7fffff;
+                return noise & 0xff;
+            }
+            return 0;
+        case 0xd800:
+            return ram[addr];
+        case 0xdc00:
+            if ((addr & 0x0f) == 0x04)
+                return (ciaLatch - cycles % (uint32_t(ciaLatch) + 1)) & 0xff;
+            if ((addr & 0x0f) == 0x05)
+                return (ciaLatch - cycles % (uint32_t(ciaLatch) + 1)) >> 8;
+            return (addr & 0x0f) == 0x0d ? 0 : 0xff;
+        default:
+            return 0xff;
+        }
+    }
+
+    void ioWrite(uint16_t addr, uint8_t v)
+    {
+        switch (addr & 0xfc00) {
+        case 0xd400:
+            sid[addr & 0x1f] = v;
+            break;
+        case 0xd800:
+            ram[addr] = v;
+            break;
+        case 0xdc00:
+            if ((addr & 0x0f) == 0x04) {
+                ciaLatch = (ciaLatch & 0xff00) | v;
+                ciaWritten = true;
+            } else if ((addr & 0x0f) == 0x05) {
+                ciaLatch = (ciaLatch & 0x00ff) | (v << 8);
+                ciaWritten = true;
+            }
+            break;
+        }
+    }
+
+    uint8_t read(uint16_t addr)
+    {
+        if (addr >= 0xd000) {
+            if (addr < 0xe000) {
+                if (ioOn)
+                    return ioRead(addr);
+            } else if (kernalOn) {
+                // there is no KERNAL, everything in it traps
+                if (addr >= 0xfffe)
+                    return addr == 0xfffe ? 0x48 : 0xff;
+                return 0x02;
+            }
+        }
+        return ram[addr];
+    }
+
+    void write(uint16_t addr, uint8_t v)
+    {
+        if (ioOn && (addr & 0xf000) == 0xd000) {
+            ioWrite(addr, v);
+        } else {
+            ram[addr] = v;
+            if (addr < 2)
+                updateBanks();
+        }
+    }
+
+    void push(uint8_t v) { ram[0x100 | s--] = v; }
+    uint8_t pull() { return ram[0x100 | ++s]; }
+
+    uint8_t fetch() { return read(pc++); }
+    uint16_t fetch16() { uint16_t lo = fetch(); return lo | (fetch() << 8); }
+
+    uint16_t aZPX() { return (fetch() + x) & 0xff; }
+    uint16_t aZPY() { return (fetch() + y) & 0xff; }
+    uint16_t aABX(bool penalty)
+    {
+        uint16_t base = fetch16();
+        uint16_t addr = base + x;
+        if (penalty && ((base ^ addr) & 0xff00))
+            ++cycles;
+        return addr;
+    }
+    uint16_t aABY(bool penalty)
+    {
+        uint16_t base = fetch16();
+        uint16_t addr = base + y;
+        if (penalty && ((base ^ addr) & 0xff00))
+            ++cycles;
+        return addr;
+    }
+    uint16_t aIZX()
+    {
+        uint8_t zp = fetch() + x;
+        return ram[zp] | (ram[uint8_t(zp + 1)] << 8);
+    }
+    uint16_t aIZY(bool penalty)
+    {
+        uint8_t zp = fetch();
+        uint16_t base = ram[zp] | (ram[uint8_t(zp + 1)] << 8);
+        uint16_t addr = base + y;
+        if (penalty && ((base ^ addr) & 0xff00))
+            ++cycles;
+        return addr;
+    }
+
+    void nz(uint8_t v) { flagN = flagZ = v; }
+
+    void ora(uint8_t m) { nz(a |= m); }
+    void anda(uint8_t m) { nz(a &= m); }
+    void eor(uint8_t m) { nz(a ^= m); }
+
+    void adc(uint8_t m)
+    {
+        unsigned carry = flagC ? 1 : 0;
+        unsigned sum = a + m + carry;
+        if (!flagD) {
+            flagV = ~(a ^ m) & (a ^ sum) & 0x80;
+            flagC = sum > 0xff;
+            nz(a = sum);
+            return;
+        }
+        unsigned lo = (a & 0x0f) + (m & 0x0f) + carry;
+        if (lo > 9)
+            lo += 6;
+        unsigned hi = (a >> 4) + (m >> 4) + (lo > 0x0f);
+        flagZ = sum & 0xff;
+        flagN = hi << 4;
+        flagV = ((hi << 4) ^ a) & ~(a ^ m) & 0x80;
+        if (hi > 9)
+            hi += 6;
+        flagC = hi > 0x0f;
+        a = (hi << 4) | (lo & 0x0f);
+    }
+
+    void sbc(uint8_t m)
+    {
+        unsigned borrow = flagC ? 0 : 1;
+        unsigned diff = a - m - borrow;
+        flagV = (a ^ m) & (a ^ diff) & 0x80;
+        flagC = diff < 0x100;
+        if (!flagD) {
+            nz(a = diff);
+            return;
+        }
+        nz(diff);
+        int lo = (a & 0x0f) - (m & 0x0f) - int(borrow);
+        int hi = (a >> 4) - (m >> 4);
+        if (lo & 0x10) {
+            lo -= 6;
+            --hi;
+        }
+        if (hi & 0x10)
+            hi -= 6;
+        a = ((hi << 4) | (lo & 0x0f)) & 0xff;
+    }
+
+    void cmp(uint8_t r, uint8_t m)
+    {
+        flagC = r >= m;
+        nz(r - m);
+    }
+
+    void bit(uint8_t m)
+    {
+        flagN = m;
+        flagV = m & 0x40;
+        flagZ = a & m;
+    }
+
+    uint8_t asl(uint8_t m) { flagC = m & 0x80; nz(m <<= 1); return m; }
+    uint8_t lsr(uint8_t m) { flagC = m & 0x01; nz(m >>= 1); return m; }
+    uint8_t rol(uint8_t m)
+    {
+        bool c = m & 0x80;
+        m = (m << 1) | (flagC ? 1 : 0);
+        flagC = c;
+        nz(m);
+        return m;
+    }
+    uint8_t ror(uint8_t m)
+    {
+        bool c = m & 0x01;
+        m = (m >> 1) | (flagC ? 0x80 : 0);
+        flagC = c;
+        nz(m);
+        return m;
+    }
+
+    void branch(bool taken)
+    {
+        int8_t offset = fetch();
+        if (taken) {
+            uint16_t target = pc + offset;
+            cycles += ((pc ^ target) & 0xff00) ? 2 : 1;
+            pc = target;
+        }
+    }
+};
+
+#define RMW(addr, op) { uint16_t ea = (addr); write(ea, op(read(ea))); }
+
+Cpu::Status Cpu::call(uint16_t addr, uint8_t acc, bool irq, uint32_t maxCycles)
+{
+    s = 0xff;
+    push(0xff);
+    push(0xfe);
+    if (irq) {
+        push(getP());
+        push(acc);
+        push(x);
+        push(y);
+        flagI = true;
+    }
+
+    const uint8_t top = 0xff;
+    const uint64_t end = cycles + maxCycles;
+    pc = addr;
+    a = acc;
+
+    while (cycles < end) {
+        uint8_t op = fetch();
+        cycles += cycle_table[op];
+
+        switch (op) {
+        // loads and stores
+        case 0xa9: nz(a = fetch()); break;
+        case 0xa5: nz(a = read(fetch())); break;
+        case 0xb5: nz(a = read(aZPX())); break;
+        case 0xad: nz(a = read(fetch16())); break;
+        case 0xbd: nz(a = read(aABX(true))); break;
+        case 0xb9: nz(a = read(aABY(true))); break;
+        case 0xa1: nz(a = read(aIZX())); break;
+        case 0xb1: nz(a = read(aIZY(true))); break;
+        case 0xa2: nz(x = fetch()); break;
+        case 0xa6: nz(x = read(fetch())); break;
+        case 0xb6: nz(x = read(aZPY())); break;
+        case 0xae: nz(x = read(fetch16())); break;
+        case 0xbe: nz(x = read(aABY(true))); break;
+        case 0xa0: nz(y = fetch()); break;
+        case 0xa4: nz(y = read(fetch())); break;
+        case 0xb4: nz(y = read(aZPX())); break;
+        case 0xac: nz(y = read(fetch16())); break;
+        case 0xbc: nz(y = read(aABX(true))); break;
+        case 0x85: write(fetch(), a); break;
+        case 0x95: write(aZPX(), a); break;
+        case 0x8d: write(fetch16(), a); break;
+        case 0x9d: write(aABX(false), a); break;
+        case 0x99: write(aABY(false), a); break;
+        case 0x81: write(aIZX(), a); break;
+        case 0x91: write(aIZY(false), a); break;
+        case 0x86: write(fetch(), x); break;
+        case 0x96: write(aZPY(), x); break;
+        case 0x8e: write(fetch16(), x); break;
+        case 0x84: write(fetch(), y); break;
+        case 0x94: write(aZPX(), y); break;
+        case 0x8c: write(fetch16(), y); break;
+
+        // transfers and stack
+        case 0xaa: nz(x = a); break;
+        case 0xa8: nz(y = a); break;
+        case 0x8a: nz(a = x); break;
+        case 0x98: nz(a = y); break;
+        case 0xba: nz(x = s); break;
+        case 0x9a: s = x; break;
+        case 0x48: push(a); break;
+        case 0x68: nz(a = pull()); break;
+        case 0x08: push(getP() | 0x10); break;
+        case 0x28: setP(pull()); break;
+
+        // logic and arithmetic
+        case 0x09: ora(fetch()); break;
+        case 0x05: ora(read(fetch())); break;
+        case 0x15: ora(read(aZPX())); break;
+        case 0x0d: ora(read(fetch16())); break;
+        case 0x1d: ora(read(aABX(true))); break;
+        case 0x19: ora(read(aABY(true))); break;
+        case 0x01: ora(read(aIZX())); break;
+        case 0x11: ora(read(aIZY(true))); break;
+        case 0x29: anda(fetch()); break;
+        case 0x25: anda(read(fetch())); break;
+        case 0x35: anda(read(aZPX())); break;
+        case 0x2d: anda(read(fetch16())); break;
+        case 0x3d: anda(read(aABX(true))); break;
+        case 0x39: anda(read(aABY(true))); break;
+        case 0x21: anda(read(aIZX())); break;
+        case 0x31: anda(read(aIZY(true))); break;
+        case 0x49: eor(fetch()); break;
+        case 0x45: eor(read(fetch())); break;
+        case 0x55: eor(read(aZPX())); break;
+        case 0x4d: eor(read(fetch16())); break;
+        case 0x5d: eor(read(aABX(true))); break;
+        case 0x59: eor(read(aABY(true))); break;
+        case 0x41: eor(read(aIZX())); break;
+        case 0x51: eor(read(aIZY(true))); break;
+        case 0x69: adc(fetch()); break;
+        case 0x65: adc(read(fetch())); break;
+        case 0x75: adc(read(aZPX())); break;
+        case 0x6d: adc(read(fetch16())); break;
+        case 0x7d: adc(read(aABX(true))); break;
+        case 0x79: adc(read(aABY(true))); break;
+        case 0x61: adc(read(aIZX())); break;
+        case 0x71: adc(read(aIZY(true))); break;
+        case 0xe9: case 0xeb: sbc(fetch()); break;
+        case 0xe5: sbc(read(fetch())); break;
+        case 0xf5: sbc(read(aZPX())); break;
+        case 0xed: sbc(read(fetch16())); break;
+        case 0xfd: sbc(read(aABX(true))); break;
+        case 0xf9: sbc(read(aABY(true))); break;
+        case 0xe1: sbc(read(aIZX())); break;
+        case 0xf1: sbc(read(aIZY(true))); break;
+        case 0xc9: cmp(a, fetch()); break;
+        case 0xc5: cmp(a, read(fetch())); break;
+        case 0xd5: cmp(a, read(aZPX())); break;
+        case 0xcd: cmp(a, read(fetch16())); break;
+        case 0xdd: cmp(a, read(aABX(true))); break;
+        case 0xd9: cmp(a, read(aABY(true))); break;
+        case 0xc1: cmp(a, read(aIZX())); break;
+        case 0xd1: cmp(a, read(aIZY(true))); break;
+        case 0xe0: cmp(x, fetch()); break;
+        case 0xe4: cmp(x, read(fetch())); break;
+        case 0xec: cmp(x, read(fetch16())); break;
+        case 0xc0: cmp(y, fetch()); break;
+        case 0xc4: cmp(y, read(fetch())); break;
+        case 0xcc: cmp(y, read(fetch16())); break;
+        case 0x24: bit(read(fetch())); break;
+        case 0x2c: bit(read(fetch16())); break;
+
+        // increments and shifts
+        case 0xe8: nz(++x); break;
+        case 0xc8: nz(++y); break;
+        case 0xca: nz(--x); break;
+        case 0x88: nz(--y); break;
+        case 0xe6: { uint16_t ea = fetch(); uint8_t m = read(ea) + 1; write(ea, m); nz(m); break; }
+        case 0xf6: { uint16_t ea = aZPX(); uint8_t m = read(ea) + 1; write(ea, m); nz(m); break; }
+        case 0xee: { uint16_t ea = fetch16(); uint8_t m = read(ea) + 1; write(ea, m); nz(m); break; }
+        case 0xfe: { uint16_t ea = aABX(false); uint8_t m = read(ea) + 1; write(ea, m); nz(m); break; }
+        case 0xc6: { uint16_t ea = fetch(); uint8_t m = read(ea) - 1; write(ea, m); nz(m); break; }
+        case 0xd6: { uint16_t ea = aZPX(); uint8_t m = read(ea) - 1; write(ea, m); nz(m); break; }
+        case 0xce: { uint16_t ea = fetch16(); uint8_t m = read(ea) - 1; write(ea, m); nz(m); break; }
+        case 0xde: { uint16_t ea = aABX(false); uint8_t m = read(ea) - 1; write(ea, m); nz(m); break; }
+        case 0x0a: a = asl(a); break;
+        case 0x06: RMW(fetch(), asl); break;
+        case 0x16: RMW(aZPX(), asl); break;
+        case 0x0e: RMW(fetch16(), asl); break;
+        case 0x1e: RMW(aABX(false), asl); break;
+        case 0x4a: a = lsr(a); break;
+        case 0x46: RMW(fetch(), lsr); break;
+        case 0x56: RMW(aZPX(), lsr); break;
+        case 0x4e: RMW(fetch16(), lsr); break;
+        case 0x5e: RMW(aABX(false), lsr); break;
+        case 0x2a: a = rol(a); break;
+        case 0x26: RMW(fetch(), rol); break;
+        case 0x36: RMW(aZPX(), rol); break;
+        case 0x2e: RMW(fetch16(), rol); break;
+        case 0x3e: RMW(aABX(false), rol); break;
+        case 0x6a: a = ror(a); break;
+        case 0x66: RMW(fetch(), ror); break;
+        case 0x76: RMW(aZPX(), ror); break;
+        case 0x6e: RMW(fetch16(), ror); break;
+        case 0x7e: RMW(aABX(false), ror); break;
+
+        // flags
+        case 0x18: flagC = false; break;
+        case 0x38: flagC = true; break;
+        case 0x58: flagI = false; break;
+        case 0x78: flagI = true; break;
+        case 0xb8: flagV = false; break;
+        case 0xd8: flagD = false; break;
+        case 0xf8: flagD = true; break;
+
+        // control flow
+        case 0x10: branch(!(flagN & 0x80)); break;
+        case 0x30: branch(flagN & 0x80); break;
+        case 0x50: branch(!flagV); break;
+        case 0x70: branch(flagV); break;
+        case 0x90: branch(!flagC); break;
+        case 0xb0: branch(flagC); break;
+        case 0xd0: branch(flagZ); break;
+        case 0xf0: branch(!flagZ); break;
+        case 0x4c: pc = fetch16(); break;
+        case 0x6c: {
+            // the indirect jump never crosses a page
+            uint16_t ptr = fetch16();
+            pc = read(ptr) | (read((ptr & 0xff00) | ((ptr + 1) & 0xff)) << 8);
+            break;
+        }
+        case 0x20: {
+            uint16_t target = fetch16();
+            --pc;
+            push(pc >> 8);
+            push(pc & 0xff);
+            pc = target;
+            break;
+        }
+        case 0x60:
+            pc = pull();
+            pc |= pull() << 8;
+            ++pc;
+            if (s == top)
+                return Returned;
+            break;
+        case 0x40:
+            setP(pull());
+            pc = pull();
+            pc |= pull() << 8;
+            if (s == top)
+                return Returned;
+            break;
+        case 0x00:
+            // a BRK in a player means it ran into empty memory
+            return Jammed;
+
+        // undocumented opcodes some players use
+        case 0xa7: nz(a = x = read(fetch())); break;
+        case 0xb7: nz(a = x = read(aZPY())); break;
+        case 0xaf: nz(a = x = read(fetch16())); break;
+        case 0xbf: nz(a = x = read(aABY(true))); break;
+        case 0xa3: nz(a = x = read(aIZX())); break;
+        case 0xb3: nz(a = x = read(aIZY(true))); break;
+        case 0x87: write(fetch(), a & x); break;
+        case 0x97: write(aZPY(), a & x); break;
+        case 0x8f: write(fetch16(), a & x); break;
+        case 0x83: write(aIZX(), a & x); break;
+        case 0x0b: case 0x2b: anda(fetch()); flagC = a & 0x80; break;
+        case 0x4b: anda(fetch()); a = lsr(a); break;
+        case 0x6b:
+            a &= fetch();
+            a = (a >> 1) | (flagC ? 0x80 : 0);
+            nz(a);
+            flagC = a & 0x40;
+            flagV = ((a >> 6) ^ (a >> 5)) & 1;
+            break;
+        case 0xcb: {
+            uint8_t m = fetch();
+            flagC = (a & x) >= m;
+            nz(x = (a & x) - m);
+            break;
+        }
+        case 0x07: case 0x17: case 0x0f: case 0x1f: case 0x1b: case 0x03: case 0x13:
+        case 0x27: case 0x37: case 0x2f: case 0x3f: case 0x3b: case 0x23: case 0x33:
+        case 0x47: case 0x57: case 0x4f: case 0x5f: case 0x5b: case 0x43: case 0x53:
+        case 0x67: case 0x77: case 0x6f: case 0x7f: case 0x7b: case 0x63: case 0x73:
+        case 0xc7: case 0xd7: case 0xcf: case 0xdf: case 0xdb: case 0xc3: case 0xd3:
+        case 0xe7: case 0xf7: case 0xef: case 0xff: case 0xfb: case 0xe3: case 0xf3: {
+            // read-modify-write combinations; the low bits pick the mode
+            uint16_t ea;
+            switch (op & 0x1f) {
+            case 0x07: ea = fetch(); break;
+            case 0x17: ea = aZPX(); break;
+            case 0x0f: ea = fetch16(); break;
+            case 0x1f: ea = aABX(false); break;
+            case 0x1b: ea = aABY(false); break;
+            case 0x03: ea = aIZX(); break;
+            default:   ea = aIZY(false); break;
+            }
+            uint8_t m = read(ea);
+            switch (op >> 5) {
+            case 0: m = asl(m); ora(m); break;          // SLO
+            case 1: m = rol(m); anda(m); break;         // RLA
+            case 2: m = lsr(m); eor(m); break;          // SRE
+            case 3: m = ror(m); adc(m); break;          // RRA
+            case 6: --m; cmp(a, m); break;              // DCP
+            default: ++m; sbc(m); break;                // ISC
+            }
+            write(ea, m);
+            break;
+        }
+        case 0xea: case 0x1a: case 0x3a: case 0x5a: case 0x7a: case 0xda: case 0xfa:
+            break;
+        case 0x80: case 0x82: case 0x89: case 0xc2: case 0xe2:
+        case 0x04: case 0x44: case 0x64:
+        case 0x14: case 0x34: case 0x54: case 0x74: case 0xd4: case 0xf4:
+            ++pc;
+            break;
+        case 0x0c:
+            pc += 2;
+            break;
+        case 0x1c: case 0x3c: case 0x5c: case 0x7c: case 0xdc: case 0xfc:
+            aABX(true);
+            break;
+
+        default:
+            // KIL and the unstable opcodes.  The KERNAL's IRQ exits are
+            // traps too and count as a normal return from the handler.
+            if (kernalOn && (pc == 0xea32 || pc == 0xea82))
+                return Returned;
+            return Jammed;
+        }
+    }
+
+    return OutOfCycles;
+}
+
+#undef RMW
+
+struct Tune
+{
+    uint16_t init;
+    uint16_t play;
+    int songs;
+    uint32_t speed;
+    bool ntsc;
+};
+
+inline uint16_t be16(const unsigned char *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+/**
+ * The CPU time budget all subtunes of a file share.
+ */
+class CpuBudget
+{
+public:
+    explicit CpuBudget(int ms)
+        : m_remaining(int64_t(ms) * 1000000), m_exhausted(false)
+    {
+        pthread_mutex_init(&m_lock, 0);
+    }
+
+    ~CpuBudget()
+    {
+        pthread_mutex_destroy(&m_lock);
+    }
+
+    static int64_t threadTime()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        return int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    }
+
+    // charges the CPU time the calling thread used since last
+    bool charge(int64_t &last)
+    {
+        int64_t now = threadTime();
+
+        pthread_mutex_lock(&m_lock);
+        m_remaining -= now - last;
+        if (m_remaining <= 0)
+            m_exhausted = true;
+        bool exhausted = m_exhausted;
+        pthread_mutex_unlock(&m_lock);
+
+        last = now;
+        return !exhausted;
+    }
+
+private:
+    pthread_mutex_t m_lock;
+    int64_t m_remaining;
+    bool m_exhausted;
+};
+
+inline uint64_t fnv1a(const uint8_t *p, size_t n)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < n; ++i)
+        h = (h ^ p[i]) * 1099511628211ULL;
+    return h;
+}
+
+/**
+ * Finds the first time the register state of the last few seconds has
+ * been seen before: a rolling hash over a window of per-frame state
+ * hashes is looked up in an open addressed table.
+ */
+class LoopDetector
+{
+public:
+    explicit LoopDetector(size_t window)
+        : m_window(window), m_frames(0), m_hash(0), m_power(1), m_changes(0),
+          m_used(0), m_history(window, 0), m_changed(window, 0), m_table(1024)
+    {
+        for (size_t i = 0; i < window; ++i)
+            m_power *= multiplier;
+    }
+
+    /**
+     * Adds the state of the next frame.  Returns the number of frames up
+     * to the loop point once the window has been seen before, otherwise 0.
+     */
+    size_t add(uint64_t state)
+    {
+        size_t slot = m_frames % m_window;
+        bool changed = m_frames && state != m_history[(m_frames - 1) % m_window];
+
+        m_hash = m_hash * multiplier + state;
+        if (m_frames >= m_window) {
+            m_hash -= m_history[slot] * m_power;
+            m_changes -= m_changed[slot];
+        }
+        m_changes += changed;
+        m_history[slot] = state;
+        m_changed[slot] = changed;
+        ++m_frames;
+
+        // a static window (a held note, silence) says nothing about loops
+        if (m_frames < m_window || m_changes < 2)
+            return 0;
+
+        if (2 * (m_used + 1) > m_table.size())
+            grow();
+
+        // the window that ended at frame g repeats at the current frame
+        // f, so the tune loops back to frame g - window + 1 after playing
+        // f - window + 1 frames
+        uint64_t key = m_hash | 1;
+        if (insert(key, m_frames))
+            return 0;
+        return m_frames - m_window;
+    }
+
+private:
+    static const uint64_t multiplier = 0x100000001b3ULL;
+
+    struct Entry
+    {
+        Entry() : key(0), frame(0) {}
+        uint64_t key;
+        size_t frame;
+    };
+
+    // returns false if the key was already there
+    bool insert(uint64_t key, size_t frame)
+    {
+        const size_t mask = m_table.size() - 1;
+        for (size_t i = key & mask; ; i = (i + 1) & mask) {
+            if (m_table[i].key == key)
+                return false;
+            if (m_table[i].key == 0) {
+                m_table[i].key = key;
+                m_table[i].frame = frame;
+                ++m_used;
+                return true;
+            }
+        }
+    }
+
+    void grow()
+    {
+        std::vector<Entry> old(2 * m_table.size());
+        old.swap(m_table);
+        m_used = 0;
+        for (size_t i = 0; i < old.size(); ++i)
+            if (old[i].key)
+                insert(old[i].key, old[i].frame);
+    }
+
+    size_t m_window;
+    size_t m_frames;
+    uint64_t m_hash;
+    uint64_t m_power;
+    size_t m_changes;
+    size_t m_used;
+    std::vector<uint64_t> m_history;
+    std::vector<uint8_t> m_changed;
+    std::vector<Entry> m_table;
+};
+
+struct Job
+{
+    const Tune *tune;
+    const uint8_t *image;
+    const SidLengthEstimator::Options *options;
+    CpuBudget *budget;
+    std::vector<SidLengthEstimator::Song> *songs;
+    int next;
+    pthread_mutex_t lock;
+};
+
+void emulateSong(const Job &job, int song, SidLengthEstimator::Song &result)
+{
+    const Tune &tune = *job.tune;
+    const SidLengthEstimator::Options &options = *job.options;
+    const uint32_t clock = tune.ntsc ? ntsc_clock : pal_clock;
+    const uint32_t frame = tune.ntsc ? ntsc_frame : pal_frame;
+
+    // the speed bits of songs beyond 32 repeat the last one
+    const bool cia = (tune.speed >> (song < 32 ? song : 31)) & 1;
+
+    result.ms = 0;
+    result.reason = SidLengthEstimator::Failed;
+
+    int64_t cpuTime = CpuBudget::threadTime();
+    if (!job.budget->charge(cpuTime)) {
+        result.reason = SidLengthEstimator::Budget;
+        return;
+    }
+
+    Cpu *cpu = new Cpu;
+    memcpy(cpu->ram, job.image, sizeof(cpu->ram));
+    cpu->reset();
+
+    if (cpu->call(tune.init, song, false, clock * 10) != Cpu::Returned) {
+        delete cpu;
+        return;
+    }
+
+    const uint64_t limit = uint64_t(options.maxSeconds) * clock;
+    const uint64_t silenceLimit = uint64_t(options.silenceSeconds) * clock;
+    LoopDetector loops(4 * clock / frame);
+    std::vector<uint64_t> frameEnd;
+    frameEnd.reserve(limit / frame + 1);
+
+    uint64_t elapsed = 0;
+    uint64_t silentSince = 0;
+    bool silent = false;
+    bool heard = false;
+
+    for (;;) {
+        uint16_t play = tune.play;
+        bool irq = false;
+        if (play == 0) {
+            irq = true;
+            play = cpu->kernalVisible() ? cpu->ram[0x314] | (cpu->ram[0x315] << 8)
+                                        : cpu->ram[0xfffe] | (cpu->ram[0xffff] << 8);
+            // init didn't install a handler of its own
+            if (play == 0xea31)
+                break;
+        }
+
+        uint32_t period = frame;
+        if (cia || (irq && cpu->ciaWritten))
+            period = uint32_t(cpu->ciaLatch) + 1;
+        if (period < 0x1000)
+            period = 0x1000;
+
+        if (cpu->call(play, 0, irq, period * 4) != Cpu::Returned)
+            break;
+
+        const uint64_t start = elapsed;
+        elapsed += period;
+        frameEnd.push_back(elapsed);
+
+        // the gates and the master volume tell whether anything is audible
+        const uint8_t *sid = cpu->sid;
+        bool audible = (sid[0x18] & 0x0f) && ((sid[0x04] | sid[0x0b] | sid[0x12]) & 0x01);
+        if (audible) {
+            heard = true;
+            silent = false;
+        } else if (!silent) {
+            silent = true;
+            silentSince = start;
+        }
+
+        if (heard && silent && elapsed - silentSince >= silenceLimit) {
+            result.ms = silentSince * 1000 / clock;
+            result.reason = SidLengthEstimator::Silence;
+            break;
+        }
+
+        size_t loopFrames = loops.add(fnv1a(sid, 0x19));
+        if (loopFrames) {
+            result.ms = frameEnd[loopFrames - 1] * 1000 / clock;
+            result.reason = SidLengthEstimator::Loop;
+            break;
+        }
+
+        if (elapsed >= limit) {
+            result.ms = elapsed * 1000 / clock;
+            result.reason = SidLengthEstimator::Limit;
+            break;
+        }
+
+        if ((frameEnd.size() & 63) == 0 && !job.budget->charge(cpuTime)) {
+            result.reason = SidLengthEstimator::Budget;
+            break;
+        }
+    }
+
+    job.budget->charge(cpuTime);
+    delete cpu;
+}
+
+void *worker(void *arg)
+{
+    Job &job = *static_cast<Job *>(arg);
+    for (;;) {
+        pthread_mutex_lock(&job.lock);
+        int song = job.next++;
+        pthread_mutex_unlock(&job.lock);
+
+        if (song >= int(job.songs->size()))
+            break;
+        emulateSong(job, song, (*job.songs)[song]);
+    }
+    return 0;
+}
+
+}
+
+bool SidLengthEstimator::estimate(const unsigned char *data, size_t size,
+                                  const Options &options, std::vector<Song> &songs)
+{
+    if (size < 0x76 || memcmp(data, "PSID", 4) != 0)
+        return false;
+
+    Tune tune;
+    int version = be16(data + 4);
+    size_t offset = be16(data + 6);
+    uint16_t load = be16(data + 8);
+    tune.init = be16(data + 10);
+    tune.play = be16(data + 12);
+    tune.songs = be16(data + 14);
+    tune.speed = (uint32_t(be16(data + 18)) << 16) | be16(data + 20);
+    if (offset > size)
+        return false;
+    // the flags of a v2 header, which a truncated file may not have
+    tune.ntsc = version >= 2 && offset >= 0x7c && size >= 0x78 &&
+                ((be16(data + 0x76) >> 2) & 3) == 2;
+    if (load == 0) {
+        // the load address is the first word of the data
+        if (offset + 2 > size)
+            return false;
+        load = data[offset] | (data[offset + 1] << 8);
+        offset += 2;
+    }
+    if (tune.init == 0)
+        tune.init = load;
+    if (tune.songs < 1)
+        tune.songs = 1;
+    if (tune.songs > 256)
+        tune.songs = 256;
+
+    size_t length = size - offset;
+    if (load + length > 0x10000)
+        length = 0x10000 - load;
+
+    std::vector<uint8_t> image(0x10000, 0);
+    memcpy(&image[load], data + offset, length);
+    // the KERNAL's IRQ vector, which an init routine may replace
+    image[0x314] = 0x31;
+    image[0x315] = 0xea;
+
+    songs.resize(tune.songs);
+
+    CpuBudget budget(options.budgetMs);
+    Job job;
+    job.tune = &tune;
+    job.image = &image[0];
+    job.options = &options;
+    job.budget = &budget;
+    job.songs = &songs;
+    job.next = 0;
+    pthread_mutex_init(&job.lock, 0);
+
+    int threads = options.threads < tune.songs ? options.threads : tune.songs;
+    std::vector<pthread_t> pool;
+    for (int i = 1; i < threads; ++i) {
+        pthread_t thread;
+        if (pthread_create(&thread, 0, worker, &job) == 0)
+            pool.push_back(thread);
+    }
+
+    // the calling thread works on the songs as well
+    worker(&job);
+    for (size_t i = 0; i < pool.size(); ++i)
+        pthread_join(pool[i], 0);
+
+    pthread_mutex_destroy(&job.lock);
+    return true;
+}
@@ -0,0 +1,84 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef SIDEMU_H
+#define SIDEMU_H
+
+#include <stddef.h>
+#include <vector>
+
+#if !defined(__osf__)
+#include <inttypes.h>
+#else
+typedef unsigned char  uint8_t;
+typedef unsigned short uint16_t;
+typedef unsigned int   uint32_t;
+typedef unsigned long long uint64_t;
+#endif
+
+/**
+ * Estimates the play time of the subtunes of a PSID file for tunes that
+ * aren't in the song length database.
+ *
+ * Every subtune is run on a minimal 6510 emulator: the init routine is
+ * called once and the play routine (or the IRQ handler the init routine
+ * installed) once per frame.  Nothing but the CPU and the register file
+ * of the SID is emulated; the tune ends when the SID stays silent for a
+ * while or when its register state starts repeating, which is how almost
+ * all C64 music players loop.
+ *
+ * Subtunes are emulated in parallel, and the CPU time spent on all of
+ * them together is limited by budgetMs.
+ */
+class SidLengthEstimator
+{
+public:
+    enum Reason {
+        Failed,     // the tune crashed or hung, no length known
+        Budget,     // the CPU time budget ran out before the end was found
+        Limit,      // still playing after maxSeconds
+        Silence,    // the tune fell silent
+        Loop        // the tune started over
+    };
+
+    struct Options
+    {
+        Options()
+            : budgetMs(1000), maxSeconds(600), silenceSeconds(3), threads(1) {}
+
+        int budgetMs;
+        int maxSeconds;
+        int silenceSeconds;
+        int threads;
+    };
+
+    struct Song
+    {
+        uint32_t ms;
+        Reason reason;
+    };
+
+    /**
+     * Emulates all subtunes of the PSID file in data.  Returns false if
+     * the file can't be emulated at all (RSID tunes need a complete C64),
+     * otherwise songs holds one entry per subtune.
+     */
+    static bool estimate(const unsigned char *data, size_t size,
+                         const Options &options, std::vector<Song> &songs);
+};
+
+#endif
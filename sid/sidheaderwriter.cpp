@@ -0,0 +1,150 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "sidheaderwriter.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <map>
+#include <set>
+
+// offset of the name field; author and released follow it directly
+static const off_t block_offset = 0x16;
+
+// files kept open at a time while waiting for a group to reach the disk
+static const size_t group_size = 256;
+
+void SidHeaderWriter::Update::setFields(const char *name, const char *author,
+                                        const char *released)
+{
+    // each field is a string of at most 31 characters plus a NUL
+    memset(block, 0, sizeof(block));
+    strncpy(block, name, 31);
+    strncpy(block + 32, author, 31);
+    strncpy(block + 64, released, 31);
+}
+
+static bool writeBlock(int fd, const char *block)
+{
+    char magic[4];
+    if (pread(fd, magic, 4, 0) != 4 ||
+        (memcmp(magic, "PSID", 4) != 0 && memcmp(magic, "RSID", 4) != 0))
+        return false;
+
+    return pwrite(fd, block, 96, block_offset) == 96;
+}
+
+#ifdef HAVE_SYNCFS
+// one file is kept open on every filesystem written to, which is synced
+// once all blocks are written
+static size_t writeSynced(std::vector<SidHeaderWriter::Update> &updates)
+{
+    std::map<dev_t, int> filesystems;
+    std::vector<dev_t> devices(updates.size());
+    for (size_t i = 0; i < updates.size(); ++i) {
+        SidHeaderWriter::Update &update = updates[i];
+        int fd = ::open(update.path.c_str(), O_RDWR);
+        struct stat st;
+        update.ok = fd != -1 && writeBlock(fd, update.block) && fstat(fd, &st) == 0;
+        if (!update.ok) {
+            if (fd != -1)
+                ::close(fd);
+            continue;
+        }
+#ifdef SYNC_FILE_RANGE_WRITE
+        // start writeback now, it is waited for below
+        sync_file_range(fd, block_offset, 96, SYNC_FILE_RANGE_WRITE);
+#endif
+        devices[i] = st.st_dev;
+        if (!filesystems.insert(std::make_pair(st.st_dev, fd)).second)
+            ::close(fd);
+    }
+
+    std::set<dev_t> failed;
+    for (std::map<dev_t, int>::const_iterator it = filesystems.begin();
+         it != filesystems.end(); ++it) {
+        if (syncfs(it->second) == -1)
+            failed.insert(it->first);
+        ::close(it->second);
+    }
+
+    size_t written = 0;
+    for (size_t i = 0; i < updates.size(); ++i) {
+        if (updates[i].ok && failed.count(devices[i]))
+            updates[i].ok = false;
+        if (updates[i].ok)
+            ++written;
+    }
+    return written;
+}
+#endif
+
+size_t SidHeaderWriter::write(std::vector<Update> &updates, bool sync)
+{
+#ifdef HAVE_SYNCFS
+    if (sync)
+        return writeSynced(updates);
+#endif
+
+    size_t written = 0;
+    std::vector<int> fds;
+    fds.reserve(group_size);
+
+    for (size_t first = 0; first < updates.size(); first += group_size) {
+        size_t last = first + group_size;
+        if (last > updates.size())
+            last = updates.size();
+
+        fds.clear();
+        for (size_t i = first; i < last; ++i) {
+            Update &update = updates[i];
+            int fd = ::open(update.path.c_str(), O_RDWR);
+            update.ok = fd != -1 && writeBlock(fd, update.block);
+
+            if (update.ok && sync) {
+#ifdef SYNC_FILE_RANGE_WRITE
+                // start writeback now, it is waited for below
+                sync_file_range(fd, block_offset, 96, SYNC_FILE_RANGE_WRITE);
+#endif
+                fds.push_back(fd);
+            } else if (fd != -1) {
+                ::close(fd);
+            }
+        }
+
+        if (sync) {
+            for (size_t i = first, j = 0; i < last; ++i) {
+                if (!updates[i].ok)
+                    continue;
+                int fd = fds[j++];
+                if (fdatasync(fd) == -1)
+                    updates[i].ok = false;
+                ::close(fd);
+            }
+        }
+
+        for (size_t i = first; i < last; ++i)
+            if (updates[i].ok)
+                ++written;
+    }
+
+    return written;
+}
@@ -0,0 +1,56 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef SIDHEADERWRITER_H
+#define SIDHEADERWRITER_H
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+/**
+ * Rewrites the name, author and released fields of many PSID/RSID files.
+ *
+ * The three 32 byte fields are adjacent in the header (0x16 - 0x75), so
+ * each file costs one open, one read of the magic, one pwrite of the
+ * whole 96 byte block and one close.  When sync is requested, writeback
+ * of every block is started as soon as it is written, and once all of
+ * them are written every filesystem they are on is synced once with
+ * syncfs().  Without syncfs() the files are waited for a group at a time.
+ */
+class SidHeaderWriter
+{
+public:
+    struct Update
+    {
+        Update() : block(), ok(false) {}
+
+        void setFields(const char *name, const char *author, const char *released);
+
+        std::string path;       // in the local 8-bit file name encoding
+        char block[96];         // name, author, released; NUL padded
+        bool ok;                // set by write()
+    };
+
+    /**
+     * Writes all updates and returns how many succeeded; the ok member
+     * of each update tells which ones did.
+     */
+    static size_t write(std::vector<Update> &updates, bool sync);
+};
+
+#endif
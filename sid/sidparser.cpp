@@ -0,0 +1,74 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "sidparser.h"
+
+#include <string.h>
+
+// the header up to the end of the copyright field
+static const size_t sid_header = 0x76;
+
+// the rest of the tune is taken in pieces of this much
+static const size_t sid_piece = 0x1000;
+
+static std::string field(const uint8_t *data)
+{
+    const char *text = reinterpret_cast<const char *>(data);
+    return std::string(text, strnlen(text, 32));
+}
+
+SidParser::SidParser(bool wholeFile, size_t maxSize)
+    : m_wholeFile(wholeFile), m_maxSize(maxSize), m_version(0), m_songs(0), m_startSong(0),
+      m_haveHeader(false), m_haveData(false)
+{
+    want(0, sid_header);
+}
+
+PushParser::Status SidParser::consume(const uint8_t *data, size_t length)
+{
+    if (!m_haveHeader) {
+        if (length < sid_header || memcmp(data, "PSID", 4))
+            return Failed;
+
+        m_version = (data[4] << 8) | data[5];
+        m_songs = (data[0xe] << 8) | data[0xf];
+        m_startSong = (data[0x10] << 8) | data[0x11];
+        m_name = field(data + 0x16);
+        m_artist = field(data + 0x36);
+        m_copyright = field(data + 0x56);
+        m_haveHeader = true;
+
+        if (!m_wholeFile)
+            return Done;
+        m_data.assign(reinterpret_cast<const char *>(data), sid_header);
+        want(sid_header, sid_piece);
+        return Continue;
+    }
+
+    // what is handed over may go beyond the piece asked for
+    m_data.append(reinterpret_cast<const char *>(data), length);
+    if (m_data.size() > m_maxSize) {
+        m_data.clear();
+        return Done;
+    }
+    if (length < need()) {
+        m_haveData = true;
+        return Done;
+    }
+    want(m_data.size(), sid_piece);
+    return Continue;
+}
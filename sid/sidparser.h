@@ -0,0 +1,65 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef SIDPARSER_H
+#define SIDPARSER_H
+
+#include <string>
+
+#include "pushparser.h"
+
+/**
+ * Reads the header of a PSID file, and all of the tune when it is to be
+ * looked up in the song length database or emulated, as long as it is
+ * no larger than maxSize.
+ */
+class SidParser: public PushParser
+{
+public:
+    SidParser(bool wholeFile, size_t maxSize);
+
+    int version() const { return m_version; }
+    int songs() const { return m_songs; }
+    int startSong() const { return m_startSong; }
+    const std::string &name() const { return m_name; }
+    const std::string &artist() const { return m_artist; }
+    const std::string &copyright() const { return m_copyright; }
+
+    /** All of the file, if it was wanted and not too large. */
+    bool haveData() const { return m_haveData; }
+    const std::string &data() const { return m_data; }
+
+protected:
+    virtual Status consume(const uint8_t *data, size_t length);
+
+private:
+    bool m_wholeFile;
+    size_t m_maxSize;
+
+    int m_version;
+    int m_songs;
+    int m_startSong;
+    std::string m_name;
+    std::string m_artist;
+    std::string m_copyright;
+
+    bool m_haveHeader;
+    bool m_haveData;
+    std::string m_data;
+};
+
+#endif
@@ -0,0 +1,294 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "sidsonglengths.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+static const char index_magic[8] = { 'S', 'I', 'D', 'L', 'I', 'D', 'X', '1' };
+static const size_t header_size = 16;
+static const size_t entry_size = 24;
+
+static inline uint32_t get32(const unsigned char *p)
+{
+    return uint32_t(p[0]) | (uint32_t(p[1]) << 8) |
+           (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24);
+}
+
+static inline uint16_t get16(const unsigned char *p)
+{
+    return uint16_t(p[0] | (p[1] << 8));
+}
+
+static inline void put32(unsigned char *p, uint32_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+SidSonglengths::SidSonglengths()
+    : m_map(0), m_mapSize(0), m_count(0), m_poolCount(0)
+{
+}
+
+SidSonglengths::~SidSonglengths()
+{
+    close();
+}
+
+bool SidSonglengths::open(const char *indexPath)
+{
+    close();
+
+    int fd = ::open(indexPath, O_RDONLY);
+    if (fd == -1)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || size_t(st.st_size) < header_size) {
+        ::close(fd);
+        return false;
+    }
+
+    void *map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED)
+        return false;
+
+    const unsigned char *p = static_cast<const unsigned char *>(map);
+    uint32_t count = get32(p + 8);
+    uint32_t poolCount = get32(p + 12);
+
+    // refuse anything that isn't exactly what compile() writes
+    if (memcmp(p, index_magic, 8) != 0 ||
+        uint64_t(st.st_size) != header_size + uint64_t(count) * entry_size
+                                + uint64_t(poolCount) * 4) {
+        munmap(map, st.st_size);
+        return false;
+    }
+
+    m_map = p;
+    m_mapSize = st.st_size;
+    m_count = count;
+    m_poolCount = poolCount;
+    return true;
+}
+
+void SidSonglengths::close()
+{
+    if (m_map)
+        munmap(const_cast<unsigned char *>(m_map), m_mapSize);
+    m_map = 0;
+    m_mapSize = 0;
+    m_count = 0;
+    m_poolCount = 0;
+}
+
+int SidSonglengths::lookup(const unsigned char md5[16], uint32_t *lengths,
+                           int maxSongs) const
+{
+    if (!m_map || m_count == 0)
+        return 0;
+
+    const unsigned char *entries = m_map + header_size;
+    const unsigned char *pool = entries + size_t(m_count) * entry_size;
+
+    // interpolate the position from the top 32 bits of the sum
+    uint32_t key = (uint32_t(md5[0]) << 24) | (uint32_t(md5[1]) << 16) |
+                   (uint32_t(md5[2]) << 8) | uint32_t(md5[3]);
+    int64_t i = int64_t((uint64_t(key) * m_count) >> 32);
+
+    int c = memcmp(entries + i * entry_size, md5, 16);
+    while (c > 0 && i > 0)
+        c = memcmp(entries + --i * entry_size, md5, 16);
+    while (c < 0 && i < int64_t(m_count) - 1)
+        c = memcmp(entries + ++i * entry_size, md5, 16);
+    if (c != 0)
+        return 0;
+
+    const unsigned char *entry = entries + i * entry_size;
+    uint32_t first = get32(entry + 16);
+    int songs = get16(entry + 20);
+    if (uint64_t(first) + songs > m_poolCount)
+        return 0;
+
+    for (int song = 0; song < songs && song < maxSongs; ++song)
+        lengths[song] = get32(pool + (size_t(first) + song) * 4);
+
+    return songs;
+}
+
+namespace {
+
+struct CompiledEntry
+{
+    unsigned char md5[16];
+    uint32_t first;
+    uint16_t songs;
+
+    bool operator<(const CompiledEntry &other) const
+    {
+        return memcmp(md5, other.md5, 16) < 0;
+    }
+};
+
+}
+
+static int hexValue(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    c = tolower(c);
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+// parses "m:ss" or "m:ss.SSS", returns false at the end of the list
+static bool parseLength(const char *&p, uint32_t &ms)
+{
+    while (*p == ' ' || *p == '\t')
+        ++p;
+    if (!isdigit(*p))
+        return false;
+
+    uint32_t minutes = 0;
+    while (isdigit(*p))
+        minutes = minutes * 10 + (*p++ - '0');
+    if (*p++ != ':')
+        return false;
+
+    uint32_t seconds = 0;
+    while (isdigit(*p))
+        seconds = seconds * 10 + (*p++ - '0');
+
+    uint32_t millis = 0;
+    if (*p == '.') {
+        ++p;
+        int digits = 0;
+        while (isdigit(*p)) {
+            if (digits++ < 3)
+                millis = millis * 10 + (*p - '0');
+            ++p;
+        }
+        for (; digits < 3; ++digits)
+            millis *= 10;
+    }
+
+    // older databases append attributes like "(G)" to a length
+    if (*p == '(') {
+        while (*p && *p != ')')
+            ++p;
+        if (*p)
+            ++p;
+    }
+
+    ms = (minutes * 60 + seconds) * 1000 + millis;
+    return true;
+}
+
+bool SidSonglengths::compile(const char *textPath, const char *indexPath)
+{
+    FILE *in = fopen(textPath, "r");
+    if (!in)
+        return false;
+
+    std::vector<CompiledEntry> entries;
+    std::vector<uint32_t> pool;
+    char line[4096];
+
+    while (fgets(line, sizeof(line), in)) {
+        // "; /path/to/tune.sid" comments and the "[Database]" section
+        if (line[0] == ';' || line[0] == '[')
+            continue;
+
+        const char *p = line;
+        CompiledEntry entry;
+        bool valid = true;
+        for (int i = 0; i < 16 && valid; ++i) {
+            int hi = hexValue(p[2 * i]);
+            int lo = hi < 0 ? -1 : hexValue(p[2 * i + 1]);
+            valid = lo >= 0;
+            entry.md5[i] = (hi << 4) | lo;
+        }
+        if (!valid || p[32] != '=')
+            continue;
+        p += 33;
+
+        entry.first = pool.size();
+        uint32_t ms;
+        while (parseLength(p, ms))
+            pool.push_back(ms);
+        entry.songs = pool.size() - entry.first;
+
+        if (entry.songs > 0)
+            entries.push_back(entry);
+    }
+    fclose(in);
+
+    std::sort(entries.begin(), entries.end());
+
+    FILE *out = fopen(indexPath, "wb");
+    if (!out)
+        return false;
+
+    unsigned char buf[entry_size];
+    size_t count = 0;
+    for (size_t i = 0; i < entries.size(); ++i)
+        if (i == 0 || memcmp(entries[i].md5, entries[i - 1].md5, 16) != 0)
+            ++count;
+
+    memcpy(buf, index_magic, 8);
+    put32(buf + 8, count);
+    put32(buf + 12, pool.size());
+    bool ok = fwrite(buf, header_size, 1, out) == 1;
+
+    for (size_t i = 0; ok && i < entries.size(); ++i) {
+        // duplicate sums are the same tune listed twice; keep the first
+        if (i > 0 && memcmp(entries[i].md5, entries[i - 1].md5, 16) == 0)
+            continue;
+        memcpy(buf, entries[i].md5, 16);
+        put32(buf + 16, entries[i].first);
+        buf[20] = entries[i].songs & 0xff;
+        buf[21] = entries[i].songs >> 8;
+        buf[22] = buf[23] = 0;
+        ok = fwrite(buf, entry_size, 1, out) == 1;
+    }
+
+    for (size_t i = 0; ok && i < pool.size(); ++i) {
+        put32(buf, pool[i]);
+        ok = fwrite(buf, 4, 1, out) == 1;
+    }
+
+    if (fclose(out) != 0)
+        ok = false;
+    if (!ok)
+        unlink(indexPath);
+    return ok;
+}
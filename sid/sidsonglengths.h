@@ -0,0 +1,83 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef SIDSONGLENGTHS_H
+#define SIDSONGLENGTHS_H
+
+#include <stddef.h>
+
+#if !defined(__osf__)
+#include <inttypes.h>
+#else
+typedef unsigned short uint16_t;
+typedef unsigned int   uint32_t;
+typedef unsigned long long uint64_t;
+#endif
+
+/**
+ * Read-only view of a compiled HVSC song length database.
+ *
+ * HVSC's Songlengths.md5 maps the MD5 of a complete .sid file to the
+ * play time of each of its subtunes.  Parsing the ~50000 line text file
+ * every time the plugin is loaded is far too slow, so it is compiled once
+ * (see compile()) into a binary index which is memory-mapped here:
+ *
+ *   header   "SIDLIDX1", uint32 entry count, uint32 pool count
+ *   entries  16 byte MD5, uint32 first pool index, uint16 songs,
+ *            uint16 reserved; sorted by MD5
+ *   pool     uint32 length in milliseconds per subtune
+ *
+ * All integers are little-endian.  MD5 sums are uniformly distributed,
+ * so lookup() interpolates the position of the key from its first bytes
+ * and only has to probe a couple of neighbouring entries.
+ */
+class SidSonglengths
+{
+public:
+    SidSonglengths();
+    ~SidSonglengths();
+
+    bool open(const char *indexPath);
+    void close();
+    bool isOpen() const { return m_map != 0; }
+
+    /**
+     * Looks up the tune with the given MD5 sum.  Returns the number of
+     * subtunes known to the database (0 if the tune is unknown) and
+     * stores the length of subtune i (in milliseconds) in lengths[i]
+     * for up to maxSongs entries.
+     */
+    int lookup(const unsigned char md5[16], uint32_t *lengths, int maxSongs) const;
+
+    /**
+     * Builds a binary index from HVSC's Songlengths.md5.  Only that file
+     * will do: the older Songlengths.txt is keyed by the MD5 of parts of
+     * a tune, which never matches the MD5 of the whole file looked up.
+     */
+    static bool compile(const char *textPath, const char *indexPath);
+
+private:
+    SidSonglengths(const SidSonglengths &);
+    SidSonglengths &operator=(const SidSonglengths &);
+
+    const unsigned char *m_map;
+    size_t m_mapSize;
+    uint32_t m_count;
+    uint32_t m_poolCount;
+};
+
+#endif
@@ -0,0 +1,41 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Compiles HVSC's Songlengths.md5 into the index read by kfile_sid, e.g.
+ *   kfile_sid_songlengths C64Music/DOCUMENTS/Songlengths.md5
+ *       ~/.kde4/share/apps/kfile_sid/Songlengths.idx
+ */
+
+#include "sidsonglengths.h"
+
+#include <stdio.h>
+
+int main(int argc, char **argv)
+{
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s Songlengths.md5 Songlengths.idx\n", argv[0]);
+        return 2;
+    }
+
+    if (!SidSonglengths::compile(argv[1], argv[2])) {
+        fprintf(stderr, "%s: could not compile %s into %s\n",
+                argv[0], argv[1], argv[2]);
+        return 1;
+    }
+
+    return 0;
+}
@@ -26,16 +26,20 @@
  */
 #include <kfilemetainfo.h>
 
+#include "cachedfileplugin.h"
+
 class QStringList;
 
-class theoraPlugin: public KFilePlugin
+class theoraPlugin: public CachedFilePlugin
 {
     Q_OBJECT
     
 public:
     theoraPlugin( QObject *parent,  const QStringList& args );
     
-    virtual bool readInfo( KFileMetaInfo& info, uint what);
+    virtual bool readRecord( const QString& path, const QString& mimeType, uint what,
+                             MetadataRecord& record);
+    virtual AccessManifest accessManifest( uint what ) const;
 };
 
 #endif // __KFILE_THEORA_H__
@@ -0,0 +1,418 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "theoraparser.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#include <vector>
+
+#include "checkpointstate.h"
+
+// the input is taken in pieces of this much
+static const size_t ogg_piece = 16 << 10;
+
+// the last page of the video is looked for in this much at the end
+static const uint64_t ogg_tail = 64 << 10;
+
+// the layout of saved parsers
+static const char state_version = 1;
+
+// each thread keeps up to this many sync and stream states, as long as
+// their buffers are no bigger than this
+static const size_t kept_syncs = 2;
+static const size_t kept_streams = 4;
+static const long kept_storage = 1 << 20;
+
+namespace {
+
+// The states of a parser that is done are handed on to the next one on
+// the same thread, buffers and all, rather than having libogg allocate
+// them anew for every file.
+struct OggStates
+{
+    std::vector<ogg_sync_state *> syncs;
+    std::vector<ogg_stream_state *> streams;
+};
+
+pthread_once_t ogg_states_once = PTHREAD_ONCE_INIT;
+pthread_key_t ogg_states_key;
+
+void destroyOggStates(void *data)
+{
+    OggStates *states = static_cast<OggStates *>(data);
+    for (size_t i = 0; i < states->syncs.size(); ++i) {
+        ogg_sync_clear(states->syncs[i]);
+        delete states->syncs[i];
+    }
+    for (size_t i = 0; i < states->streams.size(); ++i) {
+        ogg_stream_clear(states->streams[i]);
+        delete states->streams[i];
+    }
+    delete states;
+}
+
+void createOggStatesKey()
+{
+    pthread_key_create(&ogg_states_key, destroyOggStates);
+}
+
+OggStates &oggStates()
+{
+    pthread_once(&ogg_states_once, createOggStatesKey);
+    OggStates *states = static_cast<OggStates *>(pthread_getspecific(ogg_states_key));
+    if (!states) {
+        states = new OggStates;
+        pthread_setspecific(ogg_states_key, states);
+    }
+    return *states;
+}
+
+ogg_sync_state *takeSync()
+{
+    OggStates &states = oggStates();
+    if (states.syncs.empty()) {
+        ogg_sync_state *sync = new ogg_sync_state;
+        ogg_sync_init(sync);
+        return sync;
+    }
+    ogg_sync_state *sync = states.syncs.back();
+    states.syncs.pop_back();
+    ogg_sync_reset(sync);
+    return sync;
+}
+
+void giveSync(ogg_sync_state *sync)
+{
+    OggStates &states = oggStates();
+    if (states.syncs.size() < kept_syncs && sync->storage <= kept_storage) {
+        states.syncs.push_back(sync);
+        return;
+    }
+    ogg_sync_clear(sync);
+    delete sync;
+}
+
+ogg_stream_state *takeStream(int serial)
+{
+    OggStates &states = oggStates();
+    if (states.streams.empty()) {
+        ogg_stream_state *stream = new ogg_stream_state;
+        ogg_stream_init(stream, serial);
+        return stream;
+    }
+    ogg_stream_state *stream = states.streams.back();
+    states.streams.pop_back();
+    ogg_stream_reset_serialno(stream, serial);
+    return stream;
+}
+
+void giveStream(ogg_stream_state *stream)
+{
+    OggStates &states = oggStates();
+    if (states.streams.size() < kept_streams && stream->body_storage <= kept_storage) {
+        states.streams.push_back(stream);
+        return;
+    }
+    ogg_stream_clear(stream);
+    delete stream;
+}
+
+}
+
+TheoraParser::TheoraParser(uint64_t fileSize)
+    : m_fileSize(fileSize), m_stage(Identify), m_sync(takeSync()), m_syncOffset(0),
+      m_theoraStream(0), m_vorbisStream(0), m_theoraHeaders(0),
+      m_vorbisHeaders(0), m_theoraSerial(0), m_vorbisSerial(0), m_corrupt(false),
+      m_decoding(false), m_duration(0), m_granulepos(-1), m_pageEnd(0)
+{
+    // libtheora is still a bit unstable and sadly the init_ functions
+    // don't take care of things the way one would expect.  So, let's do
+    // some explicit clearing of these fields.
+    memset(&m_theoraInfo, 0, sizeof(m_theoraInfo));
+    memset(&m_theoraComment, 0, sizeof(m_theoraComment));
+    memset(&m_theoraState, 0, sizeof(m_theoraState));
+
+    vorbis_info_init(&m_vorbisInfo);
+    vorbis_comment_init(&m_vorbisComment);
+    theora_comment_init(&m_theoraComment);
+    theora_info_init(&m_theoraInfo);
+
+    want(0, ogg_piece);
+}
+
+TheoraParser::~TheoraParser()
+{
+    if (m_vorbisStream)
+        giveStream(m_vorbisStream);
+    if (m_theoraStream)
+        giveStream(m_theoraStream);
+    if (m_decoding)
+        theora_clear(&m_theoraState);
+    theora_comment_clear(&m_theoraComment);
+    theora_info_clear(&m_theoraInfo);
+    vorbis_comment_clear(&m_vorbisComment);
+    vorbis_info_clear(&m_vorbisInfo);
+    giveSync(m_sync);
+}
+
+bool TheoraParser::nextPage(ogg_page *page)
+{
+    // like ogg_sync_pageout(), but keeping count of where the pages are
+    long ret;
+    while ((ret = ogg_sync_pageseek(m_sync, page)) < 0)
+        m_syncOffset += -ret;
+    if (!ret)
+        return false;
+    m_syncOffset += ret;
+    return true;
+}
+
+void TheoraParser::keepHeader(char stream, const ogg_packet &packet)
+{
+    typedef CheckpointState S;
+    m_headerState += stream;
+    S::put(m_headerState, packet.b_o_s, 1);
+    S::put(m_headerState, packet.e_o_s, 1);
+    S::put(m_headerState, packet.granulepos, 8);
+    S::put(m_headerState, packet.packetno, 8);
+    S::put(m_headerState, std::string(reinterpret_cast<const char *>(packet.packet), packet.bytes));
+}
+
+void TheoraParser::queuePage(ogg_page *page)
+{
+    if (m_theoraHeaders)
+        ogg_stream_pagein(m_theoraStream, page);
+    if (m_vorbisHeaders)
+        ogg_stream_pagein(m_vorbisStream, page);
+}
+
+// most of the ogg stuff was borrowed from libtheora/examples/player_example.c
+bool TheoraParser::identify()
+{
+    ogg_page page;
+    ogg_packet packet;
+    while (nextPage(&page)) {
+        // is this a mandated initial header? If not, stop parsing
+        if (!ogg_page_bos(&page)) {
+            queuePage(&page);
+            return true;
+        }
+
+        ogg_stream_state *test = takeStream(ogg_page_serialno(&page));
+        ogg_stream_pagein(test, &page);
+        ogg_stream_packetout(test, &packet);
+
+        // identify the codec: try theora
+        if (!m_theoraHeaders && theora_decode_header(&m_theoraInfo, &m_theoraComment, &packet) >= 0) {
+            m_theoraStream = test;
+            m_theoraSerial = ogg_page_serialno(&page);
+            m_theoraHeaders = 1;
+            keepHeader('t', packet);
+        } else if (!m_vorbisHeaders &&
+                   vorbis_synthesis_headerin(&m_vorbisInfo, &m_vorbisComment, &packet) >= 0) {
+            m_vorbisStream = test;
+            m_vorbisSerial = ogg_page_serialno(&page);
+            m_vorbisHeaders = 1;
+            keepHeader('v', packet);
+        } else {
+            // whatever it is, we don't care about it
+            giveStream(test);
+        }
+    }
+    return false;
+}
+
+bool TheoraParser::headers()
+{
+    ogg_page page;
+    ogg_packet packet;
+    while ((m_theoraHeaders && m_theoraHeaders < 3) || (m_vorbisHeaders && m_vorbisHeaders < 3)) {
+        int ret;
+        while (m_theoraHeaders && m_theoraHeaders < 3 &&
+               (ret = ogg_stream_packetout(m_theoraStream, &packet))) {
+            if (ret < 0 || theora_decode_header(&m_theoraInfo, &m_theoraComment, &packet))
+                m_corrupt = true;
+            else
+                keepHeader('t', packet);
+            ++m_theoraHeaders;
+        }
+        while (m_vorbisHeaders && m_vorbisHeaders < 3 &&
+               (ret = ogg_stream_packetout(m_vorbisStream, &packet))) {
+            if (ret < 0 || vorbis_synthesis_headerin(&m_vorbisInfo, &m_vorbisComment, &packet))
+                m_corrupt = true;
+            else
+                keepHeader('v', packet);
+            ++m_vorbisHeaders;
+        }
+        if ((!m_theoraHeaders || m_theoraHeaders == 3) && (!m_vorbisHeaders || m_vorbisHeaders == 3))
+            break;
+
+        // the header pages/packets will arrive before anything else we
+        // care about, or the stream is not obeying spec
+        if (!nextPage(&page))
+            return false;
+        queuePage(&page);
+    }
+    return true;
+}
+
+PushParser::Status TheoraParser::consume(const uint8_t *data, size_t length)
+{
+    if (m_corrupt)
+        return Failed;
+    const uint64_t end = offset() + length;
+    if (length) {
+        char *buffer = ogg_sync_buffer(m_sync, length);
+        memcpy(buffer, data, length);
+        ogg_sync_wrote(m_sync, length);
+    }
+    const bool last = length < need();
+
+    if (m_stage == Identify && identify())
+        m_stage = Headers;
+
+    if (m_stage == Headers && headers()) {
+        if (!m_theoraHeaders || m_corrupt)
+            return Failed;
+        theora_decode_init(&m_theoraState, &m_theoraInfo);
+        m_decoding = true;
+        m_stage = Length;
+
+        // the last page is near the end, where the file can be skipped to
+        if (m_fileSize > ogg_tail && m_fileSize - ogg_tail > end) {
+            ogg_sync_reset(m_sync);
+            m_syncOffset = m_fileSize - ogg_tail;
+            want(m_syncOffset, ogg_piece);
+            return Continue;
+        }
+    }
+
+    if (m_stage != Length) {
+        if (last)
+            return Failed;
+        want(end, ogg_piece);
+        return Continue;
+    }
+
+    // We don't need to store any of the pages or packets, libtheora
+    // doesn't use them in the one call we make with the state, and it
+    // would mean buffering all of the file.
+    ogg_page page;
+    while (nextPage(&page)) {
+        if (ogg_page_serialno(&page) == m_theoraSerial && ogg_page_granulepos(&page) >= 0) {
+            m_granulepos = ogg_page_granulepos(&page);
+            m_duration = theora_granule_time(&m_theoraState, m_granulepos);
+        }
+        m_pageEnd = m_syncOffset;
+    }
+    if (last)
+        return Done;
+    want(end, ogg_piece);
+    return Continue;
+}
+
+bool TheoraParser::save(std::string &state) const
+{
+    if (m_stage != Length || !m_pageEnd)
+        return false;
+
+    typedef CheckpointState S;
+    state.clear();
+    state += state_version;
+    S::put(state, m_pageEnd, 8);
+    S::put(state, m_granulepos, 8);
+    S::put(state, m_theoraSerial, 4);
+    S::put(state, m_vorbisSerial, 4);
+    state += m_headerState;
+    return true;
+}
+
+bool TheoraParser::resume(const std::string &state)
+{
+    if (m_stage != Identify || offset())
+        return false;
+
+    CheckpointState in(state);
+    if (in.number(1) != uint64_t(state_version))
+        return false;
+    const uint64_t pageEnd = in.number(8);
+    const ogg_int64_t granulepos = in.number(8);
+    const int theoraSerial = in.number(4);
+    const int vorbisSerial = in.number(4);
+    if (!in.ok() || !pageEnd || (m_fileSize && pageEnd > m_fileSize))
+        return false;
+
+    // the headers go where they would have from the pages
+    int theoraHeaders = 0;
+    int vorbisHeaders = 0;
+    bool ok = true;
+    while (ok && !in.atEnd()) {
+        const int stream = in.number(1);
+        ogg_packet packet;
+        packet.b_o_s = in.number(1);
+        packet.e_o_s = in.number(1);
+        packet.granulepos = in.number(8);
+        packet.packetno = in.number(8);
+        std::string bytes = in.bytes();
+        if (!in.ok() || bytes.empty()) {
+            ok = false;
+            break;
+        }
+        packet.packet = reinterpret_cast<unsigned char *>(&bytes[0]);
+        packet.bytes = bytes.size();
+
+        if (stream == 't' && theoraHeaders < 3 &&
+            theora_decode_header(&m_theoraInfo, &m_theoraComment, &packet) >= 0)
+            ++theoraHeaders;
+        else if (stream == 'v' && vorbisHeaders < 3 &&
+                 vorbis_synthesis_headerin(&m_vorbisInfo, &m_vorbisComment, &packet) >= 0)
+            ++vorbisHeaders;
+        else
+            ok = false;
+    }
+    // the headers taken in part can't be taken back, so the parser fails
+    if (!ok || theoraHeaders != 3 || (vorbisHeaders && vorbisHeaders != 3)) {
+        m_corrupt = true;
+        return false;
+    }
+
+    m_theoraStream = takeStream(theoraSerial);
+    m_theoraSerial = theoraSerial;
+    m_theoraHeaders = 3;
+    if (vorbisHeaders) {
+        m_vorbisStream = takeStream(vorbisSerial);
+        m_vorbisSerial = vorbisSerial;
+        m_vorbisHeaders = 3;
+    }
+    theora_decode_init(&m_theoraState, &m_theoraInfo);
+    m_decoding = true;
+    m_headerState.assign(state, 1 + 8 + 8 + 4 + 4, std::string::npos);
+    m_granulepos = granulepos;
+    if (granulepos >= 0)
+        m_duration = theora_granule_time(&m_theoraState, granulepos);
+    m_pageEnd = pageEnd;
+    m_stage = Length;
+
+    // the pages that were there are skipped like everything but the end
+    m_syncOffset = pageEnd;
+    if (m_fileSize > ogg_tail && m_fileSize - ogg_tail > pageEnd)
+        m_syncOffset = m_fileSize - ogg_tail;
+    want(m_syncOffset, ogg_piece);
+    return true;
+}
@@ -0,0 +1,112 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef THEORAPARSER_H
+#define THEORAPARSER_H
+
+#include "theora/theora.h"
+#include "vorbis/codec.h"
+
+#include <string>
+
+#include "pushparser.h"
+
+/**
+ * Reads the Theora headers of an Ogg file, and the Vorbis headers if
+ * there is a Vorbis stream as well, and the length of the video from
+ * the granule position of its last page.
+ *
+ * When the size of the file is known, everything but its last 64 KiB
+ * is skipped after the headers.  Otherwise, as for a stream, all of the
+ * pages are looked at.
+ *
+ * What was found can be saved, and a parser for the file once it has
+ * grown resumed from it: the headers are taken from what was saved, and
+ * the pages from the end of the last one seen before.
+ *
+ * The Ogg sync and stream states are kept from one parser to the next
+ * on a thread, and so are the buffers libogg grew in them.
+ */
+class TheoraParser: public PushParser
+{
+public:
+    explicit TheoraParser(uint64_t fileSize);
+    virtual ~TheoraParser();
+
+    const theora_info &theoraInfo() const { return m_theoraInfo; }
+    bool haveVorbis() const { return m_vorbisHeaders > 0; }
+    const vorbis_info &vorbisInfo() const { return m_vorbisInfo; }
+
+    /** The length of the video in seconds. */
+    double duration() const { return m_duration; }
+
+    /** The headers and where the pages were read to, once they were. */
+    bool save(std::string &state) const;
+    /**
+     * Takes up a parser saved for the file when it was smaller.  When
+     * that doesn't work the parser fails, and a new one is needed.
+     */
+    bool resume(const std::string &state);
+
+protected:
+    virtual Status consume(const uint8_t *data, size_t length);
+
+private:
+    enum Stage {
+        Identify,
+        Headers,
+        Length
+    };
+
+    bool identify();
+    bool headers();
+    bool nextPage(ogg_page *page);
+    void queuePage(ogg_page *page);
+    void keepHeader(char stream, const ogg_packet &packet);
+
+    uint64_t m_fileSize;
+    Stage m_stage;
+
+    // taken from the ones the thread keeps, and given back to them
+    ogg_sync_state *m_sync;
+    // where the rest of what is buffered in m_sync is in the file
+    uint64_t m_syncOffset;
+    ogg_stream_state *m_theoraStream;
+    ogg_stream_state *m_vorbisStream;
+    theora_info m_theoraInfo;
+    theora_comment m_theoraComment;
+    theora_state m_theoraState;
+    vorbis_info m_vorbisInfo;
+    vorbis_comment m_vorbisComment;
+
+    // the header packets of each stream seen, up to 3
+    int m_theoraHeaders;
+    int m_vorbisHeaders;
+    int m_theoraSerial;
+    int m_vorbisSerial;
+    bool m_corrupt;
+    bool m_decoding;
+    double m_duration;
+
+    // the header packets as saved, the granule position the duration
+    // is from, and the end of the last page
+    std::string m_headerState;
+    ogg_int64_t m_granulepos;
+    uint64_t m_pageEnd;
+};
+
+#endif
@@ -18,11 +18,17 @@
  */
 
 #include "kfile_wav.h"
+#include "wavoverview.h"
+#include "wavloudness.h"
+#include "wavparser.h"
+#include "snapshotfile.h"
 
 #include <k3process.h>
 #include <klocale.h>
 #include <kgenericfactory.h>
 #include <kstringvalidator.h>
+#include <kconfig.h>
+#include <kconfiggroup.h>
 #include <kdebug.h>
 
 #include <q3dict.h>
@@ -30,6 +36,12 @@
 #include <q3cstring.h>
 #include <QFile>
 #include <QDateTime>
+#include <QPair>
+#include <QTextCodec>
+#include <QThread>
+#include <QXmlStreamReader>
+
+#include <math.h>
 
 #if !defined(__osf__)
 #include <inttypes.h>
@@ -38,6 +50,196 @@ typedef unsigned short uint16_t;
 typedef unsigned int   uint32_t;
 #endif
 
+typedef QList<QPair<QString, QString> > TagList;
+
+// format tags of the fmt chunk
+static const uint16_t format_pcm = 0x0001;
+static const uint16_t format_float = 0x0003;
+
+// LIST/INFO sub-chunks and the items they are shown as
+static const struct {
+    char id[5];
+    const char *key;
+} info_tags[] = {
+    { "INAM", "Title" },
+    { "IART", "Artist" },
+    { "IPRD", "Album" },
+    { "ICMT", "Comment" },
+    { "ICRD", "Date" },
+    { "IGNR", "Genre" },
+    { "ICOP", "Copyright" },
+    { "ITRK", "Tracknumber" },
+    { "IPRT", "Tracknumber" },
+    { "IENG", "Engineer" },
+    { "ITCH", "Technician" },
+    { "ISFT", "Software" },
+    { "ISBJ", "Subject" },
+    { "IKEY", "Keywords" },
+    { "ISRC", "Source" }
+};
+static const int info_tag_count = sizeof(info_tags) / sizeof(info_tags[0]);
+
+// iXML elements below <BWFXML> and the items they are shown as
+static const struct {
+    const char *element;
+    const char *key;
+} ixml_tags[] = {
+    { "PROJECT", "Project" },
+    { "SCENE", "Scene" },
+    { "TAKE", "Take" },
+    { "TAPE", "Tape" },
+    { "CIRCLED", "Circled" },
+    { "NOTE", "Note" }
+};
+static const int ixml_tag_count = sizeof(ixml_tags) / sizeof(ixml_tags[0]);
+
+/**
+ * Maps the format tag and sample size of the fmt chunk to the sample
+ * formats the analysis code reads.
+ */
+static bool sampleFormat(uint16_t format_tag, uint16_t sample_size,
+                         WavOverview::Format &format)
+{
+    if (format_tag == format_float)
+        format = WavOverview::Float32;
+    else if (format_tag != format_pcm)
+        return false;
+    else if (sample_size <= 8)
+        format = WavOverview::Unsigned8;
+    else if (sample_size <= 16)
+        format = WavOverview::Signed16;
+    else if (sample_size <= 24)
+        format = WavOverview::Signed24;
+    else if (sample_size <= 32)
+        format = WavOverview::Signed32;
+    else
+        return false;
+    return format != WavOverview::Float32 || sample_size == 32;
+}
+
+/**
+ * The strings in INFO chunks have no defined encoding.  Most writers use
+ * UTF-8 nowadays, so use that unless the bytes aren't valid UTF-8.
+ */
+static QString decodeText(const char *data, int length)
+{
+    int end = 0;
+    while (end < length && data[end])
+        ++end;
+
+    QTextCodec::ConverterState state;
+    QString text = QTextCodec::codecForName("UTF-8")->toUnicode(data, end, &state);
+    if (state.invalidChars > 0)
+        text = QString::fromLatin1(data, end);
+    return text.trimmed();
+}
+
+static void readInfoList(const QByteArray &chunk, TagList &tags)
+{
+    // the list type ("INFO") is followed by id/size/string sub-chunks
+    const char *data = chunk.constData();
+    int pos = 4;
+    while (pos + 8 <= chunk.size()) {
+        const uchar *header = reinterpret_cast<const uchar *>(data + pos);
+        int size = header[4] | (header[5] << 8) | (header[6] << 16) | (header[7] << 24);
+        pos += 8;
+        if (size < 0 || size > chunk.size() - pos)
+            break;
+
+        for (int i = 0; i < info_tag_count; ++i) {
+            if (!memcmp(data + pos - 8, info_tags[i].id, 4)) {
+                QString value = decodeText(data + pos, size);
+                if (!value.isEmpty())
+                    tags.append(qMakePair(QString(info_tags[i].key), value));
+                break;
+            }
+        }
+        pos += size + (size & 1);
+    }
+}
+
+static void readBext(const QByteArray &chunk, TagList &tags, quint64 &time_reference)
+{
+    // EBU Tech 3285: fixed fields, then the free-form coding history
+    if (chunk.size() < 602)
+        return;
+
+    const char *data = chunk.constData();
+    const uchar *u = reinterpret_cast<const uchar *>(data);
+    static const struct {
+        int offset;
+        int length;
+        const char *key;
+    } fields[] = {
+        { 0, 256, "Description" },
+        { 256, 32, "Originator" },
+        { 288, 32, "Originator Reference" },
+        { 320, 10, "Origination Date" },
+        { 330, 8, "Origination Time" },
+        { 602, -1, "Coding History" }
+    };
+
+    for (unsigned int i = 0; i < sizeof(fields) / sizeof(fields[0]); ++i) {
+        int length = fields[i].length < 0 ? chunk.size() - fields[i].offset : fields[i].length;
+        QString value = decodeText(data + fields[i].offset, length);
+        if (!value.isEmpty())
+            tags.append(qMakePair(QString(fields[i].key), value));
+    }
+
+    time_reference = 0;
+    for (int i = 7; i >= 0; --i)
+        time_reference = (time_reference << 8) | u[338 + i];
+
+    // version 2 added the loudness values, 0x7fff means "not set"
+    int version = u[346] | (u[347] << 8);
+    short loudness = short(u[412] | (u[413] << 8));
+    if (version >= 2 && loudness != 0x7fff)
+        tags.append(qMakePair(QString("Loudness"), QString::number(loudness / 100.0, 'f', 2)));
+}
+
+static void readIxml(const QByteArray &chunk, TagList &tags)
+{
+    QXmlStreamReader xml(chunk);
+    int depth = 0;
+    while (!xml.atEnd()) {
+        xml.readNext();
+        if (xml.isEndElement()) {
+            --depth;
+        } else if (xml.isStartElement()) {
+            ++depth;
+            if (depth != 2)
+                continue;
+            for (int i = 0; i < ixml_tag_count; ++i) {
+                if (xml.name() == QLatin1String(ixml_tags[i].element)) {
+                    QString value = xml.readElementText().trimmed();
+                    --depth;
+                    if (!value.isEmpty())
+                        tags.append(qMakePair(QString(ixml_tags[i].key), value));
+                    break;
+                }
+            }
+        }
+    }
+}
+
+// the sample width is called the sample size here, and the length has
+// a fraction of a second
+static const MetadataLayout wav_layout[] = {
+    { MetadataRecord::SampleWidth, 0, "Sample Size", false },
+    { MetadataRecord::Length,      0, 0,             true },
+    { MetadataRecord::FieldCount,  0, 0,             false }
+};
+
+// keeps tags read from the chunks, in their fields where they have one
+static void setTags(MetadataRecord &record, const char *group, const TagList &tags)
+{
+    for (int i = 0; i < tags.count(); ++i) {
+        const QByteArray key = tags[i].first.toUtf8();
+        const QByteArray value = tags[i].second.toUtf8();
+        record.setTag(group, key.constData(), value.constData(), value.size());
+    }
+}
+
 typedef KGenericFactory<KWavPlugin> WavFactory;
 
 K_EXPORT_COMPONENT_FACTORY(kfile_wav, WavFactory( "kfile_wav" ))
@@ -45,7 +247,7 @@ K_EXPORT_COMPONENT_FACTORY(kfile_wav, WavFactory( "kfile_wav" ))
 KWavPlugin::KWavPlugin(QObject *parent, 
                        const QStringList &args)
     
-    : KFilePlugin(parent, args)
+    : CachedFilePlugin(parent, args, "kfile_wav", 1)
 {
     KFileMimeTypeInfo* info = addMimeTypeInfo( "audio/x-wav" );
 
@@ -64,107 +266,246 @@ KWavPlugin::KWavPlugin(QObject *parent,
 
     item = addItemInfo(group, "Channels", i18n("Channels"), QVariant::Int);
 
-    item = addItemInfo(group, "Length", i18n("Length"), QVariant::Int);
+    item = addItemInfo(group, "Length", i18n("Length"), QVariant::Double);
     setAttributes(item,  KFileMimeTypeInfo::Cummulative);
     setUnit(item, KFileMimeTypeInfo::Seconds);
+
+    // LIST/INFO tags
+    group = addGroupInfo(info, "Comment", i18n("Comment"));
+
+    item = addItemInfo(group, "Title", i18n("Title"), QVariant::String);
+    setHint(item, KFileMimeTypeInfo::Name);
+    item = addItemInfo(group, "Artist", i18n("Artist"), QVariant::String);
+    setHint(item, KFileMimeTypeInfo::Author);
+    addItemInfo(group, "Album", i18n("Album"), QVariant::String);
+    item = addItemInfo(group, "Comment", i18n("Comment"), QVariant::String);
+    setHint(item, KFileMimeTypeInfo::Description);
+    addItemInfo(group, "Date", i18n("Date"), QVariant::String);
+    addItemInfo(group, "Genre", i18n("Genre"), QVariant::String);
+    addItemInfo(group, "Copyright", i18n("Copyright"), QVariant::String);
+    addItemInfo(group, "Tracknumber", i18n("Track Number"), QVariant::String);
+    addItemInfo(group, "Engineer", i18n("Engineer"), QVariant::String);
+    addItemInfo(group, "Technician", i18n("Technician"), QVariant::String);
+    addItemInfo(group, "Software", i18n("Software"), QVariant::String);
+    addItemInfo(group, "Subject", i18n("Subject"), QVariant::String);
+    addItemInfo(group, "Keywords", i18n("Keywords"), QVariant::String);
+    addItemInfo(group, "Source", i18n("Source"), QVariant::String);
+
+    // bext (Broadcast Wave) fields
+    group = addGroupInfo(info, "Broadcast", i18n("Broadcast Wave"));
+
+    addItemInfo(group, "Description", i18n("Description"), QVariant::String);
+    addItemInfo(group, "Originator", i18n("Originator"), QVariant::String);
+    addItemInfo(group, "Originator Reference", i18n("Originator Reference"), QVariant::String);
+    addItemInfo(group, "Origination Date", i18n("Origination Date"), QVariant::String);
+    addItemInfo(group, "Origination Time", i18n("Origination Time"), QVariant::String);
+    item = addItemInfo(group, "Time Reference", i18n("Time Reference"), QVariant::Double);
+    setUnit(item, KFileMimeTypeInfo::Seconds);
+    item = addItemInfo(group, "Loudness", i18n("Loudness"), QVariant::String);
+    setSuffix(item, i18n(" LUFS"));
+    addItemInfo(group, "Coding History", i18n("Coding History"), QVariant::String);
+
+    // iXML production metadata
+    group = addGroupInfo(info, "iXML", i18n("iXML"));
+
+    addItemInfo(group, "Project", i18n("Project"), QVariant::String);
+    addItemInfo(group, "Scene", i18n("Scene"), QVariant::String);
+    addItemInfo(group, "Take", i18n("Take"), QVariant::String);
+    addItemInfo(group, "Tape", i18n("Tape"), QVariant::String);
+    addItemInfo(group, "Circled", i18n("Circled"), QVariant::String);
+    addItemInfo(group, "Note", i18n("Note"), QVariant::String);
+
+    // the waveform overview means reading all of the audio data, so it's
+    // only computed when asked for in kfile_wavrc
+    KConfig config("kfile_wavrc");
+    KConfigGroup waveform(&config, "Waveform");
+    m_waveform = waveform.readEntry("Enabled", false);
+    m_waveformBuckets = waveform.readEntry("Buckets", 512);
+    // several files are read at once already, so a file gets one thread
+    // unless more are asked for, and never more than there are cores
+    m_waveformThreads = qBound(1, waveform.readEntry("Threads", 1), QThread::idealThreadCount());
+
+    // as is the loudness measurement
+    KConfigGroup loudness(&config, "Loudness");
+    m_loudness = loudness.readEntry("Enabled", false);
+    m_loudnessThreads = qBound(1, loudness.readEntry("Threads", 1), QThread::idealThreadCount());
+
+    // fingerprinting is shared by all the multimedia plugins
+    KConfig multimedia("kfile_multimediarc");
+    KConfigGroup fingerprint(&multimedia, "Fingerprint");
+    m_fingerprint = PayloadHash::mode(fingerprint.readEntry("Mode", QString("Off")).toLatin1());
+
+    setCacheSettings(QString("waveform=%1,%2 loudness=%3 fingerprint=%4")
+                     .arg(m_waveform).arg(m_waveformBuckets).arg(m_loudness)
+                     .arg(int(m_fingerprint)).toLatin1());
+    setLayout(wav_layout);
+
+    group = addGroupInfo(info, "Analysis", i18n("Analysis"));
+
+    addItemInfo(group, "Waveform", i18n("Waveform"), QVariant::ByteArray);
+    item = addItemInfo(group, "Integrated Loudness", i18n("Integrated Loudness"), QVariant::Double);
+    setSuffix(item, i18n(" LUFS"));
+    item = addItemInfo(group, "Loudness Range", i18n("Loudness Range"), QVariant::Double);
+    setSuffix(item, i18n(" LU"));
+    item = addItemInfo(group, "True Peak", i18n("True Peak"), QVariant::Double);
+    setSuffix(item, i18n(" dBTP"));
+    item = addItemInfo(group, "Leading Silence", i18n("Leading Silence"), QVariant::Double);
+    setUnit(item, KFileMimeTypeInfo::Seconds);
+    item = addItemInfo(group, "Trailing Silence", i18n("Trailing Silence"), QVariant::Double);
+    setUnit(item, KFileMimeTypeInfo::Seconds);
+
+    group = addGroupInfo(info, "Fingerprint", i18n("Fingerprint"));
+
+    addItemInfo(group, "Payload Hash", i18n("Payload Hash"), QVariant::String);
+    addItemInfo(group, "Sampled Payload Hash", i18n("Sampled Payload Hash"), QVariant::String);
 }
 
-bool KWavPlugin::readInfo( KFileMetaInfo& info, uint /*what*/)
+// the chunk headers, and the tags that often come after the data
+AccessManifest KWavPlugin::accessManifest(uint what) const
 {
-    if ( info.path().isEmpty() ) // remote file
+    const bool readComment = what & (KFileMetaInfo::Fastest |
+                                     KFileMetaInfo::DontCare |
+                                     KFileMetaInfo::ContentInfo);
+    return AccessManifest(64 << 10, 0, readComment ? AccessManifest::riffChunks : 0, true);
+}
+
+bool KWavPlugin::readRecord( const QString& path, const QString& /*mimeType*/, uint what,
+                             MetadataRecord& record)
+{
+    if ( path.isEmpty() ) // remote file
         return false;
 
-    QFile file(info.path());
-
-    uint32_t format_size;
-    uint16_t format_tag;
-    uint16_t channel_count;
-    uint32_t sample_rate;
-    uint32_t bytes_per_second;
-    uint16_t bytes_per_sample;
-    uint16_t sample_size;
-    uint32_t data_size;
-    uint32_t unknown_chunk_size;
-    uint16_t unknown_chunk16;
-    bool have_fmt = false;
-    bool have_data = false;
-    QIODevice::Offset file_length;
-
-    const char *riff_signature = "RIFF";
-    const char *wav_signature = "WAVE";
-    const char *fmt_signature = "fmt ";
-    const char *data_signature = "data";
-    char signature_buffer[4];
+    bool readComment = false;
+    if (what & (KFileMetaInfo::Fastest |
+                KFileMetaInfo::DontCare |
+                KFileMetaInfo::ContentInfo)) readComment = true;
+
+    bool readWaveform = false;
+    if (m_waveform && (what & (KFileMetaInfo::DontCare |
+                               KFileMetaInfo::TechnicalInfo))) readWaveform = true;
+
+    bool readLoudness = false;
+    if (m_loudness && (what & (KFileMetaInfo::DontCare |
+                               KFileMetaInfo::TechnicalInfo))) readLoudness = true;
+
+    SnapshotFile file(path, snapshot());
+
+    TagList comment_tags;
+    TagList broadcast_tags;
+    TagList xml_tags;
+    quint64 time_reference = 0;
+    bool have_bext = false;
 
     if (!file.open(QIODevice::ReadOnly))
     {
-        kDebug(7034) << "Couldn't open " << QFile::encodeName(info.path());
+        kDebug(7034) << "Couldn't open " << QFile::encodeName(path);
         return false;
     }    
 
-    file_length = file.size() - 100; // a bit of insurance
-    QDataStream dstream(&file);
-
-    // WAV files are little-endian
-    dstream.setByteOrder(QDataStream::LittleEndian);
+    // Walk the chunk headers, skipping everything we don't need, so only
+    // the headers and the descriptive chunks are read no matter how big
+    // the audio data is.  Those often come after the data chunk, so when
+    // they're wanted the walk goes on to the end of the file.
+    //
+    // A recording that is still going on has only grown since it was
+    // last read, and the walk is taken up again at its data chunk, whose
+    // size the recorder may not have finalized yet.
+    WavParser parser(file.size(), readComment);
+    uint64_t checkpoint_size;
+    std::string state;
+    if (checkpoint(checkpoint_size, state) && parser.resume(state))
+        kDebug(7034) << "Resuming " << QFile::encodeName(path) << " from " << checkpoint_size;
+    if (file.parse(parser) == PushParser::Failed)
+        return false;
+    if (parser.save(state))
+        setCheckpoint(state);
 
-    // Read and verify the RIFF signature
-    dstream.readRawBytes(signature_buffer, 4);
-    if (memcmp(signature_buffer, riff_signature, 4))
-         return false;
+    if (!parser.haveData() || !parser.haveFormat())
+        return false;
 
-    // Skip the next bit (total file size, pretty useless)
-    file.seek(8);
+    const WavParser::Format &format_chunk = parser.format();
+    const uint16_t channel_count = format_chunk.channelCount;
+    const uint32_t sample_rate = format_chunk.sampleRate;
+    const uint32_t bytes_per_second = format_chunk.bytesPerSecond;
+    const uint16_t bytes_per_sample = format_chunk.bytesPerSample;
+    const uint16_t sample_size = format_chunk.sampleSize;
+    const quint64 data_offset = parser.dataOffset();
+    const quint64 data_size = parser.dataSize();
 
-    // Read and verify the WAVE signature
-    dstream.readRawBytes(signature_buffer, 4);
-    if (memcmp(signature_buffer, wav_signature, 4))
-         return false;
-
-    // pretty dumb scanner, but better than what we had!
-    do
-    {
-	dstream.readRawBytes(signature_buffer, 4);
-	if (!memcmp(signature_buffer, fmt_signature, 4)) {
-	    dstream >> format_size;
-	    dstream >> format_tag;
-	    dstream >> channel_count;
-	    dstream >> sample_rate;
-	    dstream >> bytes_per_second;
-	    dstream >> bytes_per_sample;
-	    dstream >> sample_size;
-	    have_fmt = true;
-	    if ( format_size > 16 ) {
-		for (unsigned int i = 0; i < (format_size-16+1)/2; i++)
-		    dstream >> unknown_chunk16;
-	    }
-	} else if (!memcmp(signature_buffer, data_signature, 4)) {
-	    dstream >> data_size;
-	    have_data = true;
-	} else {
-	    dstream >> unknown_chunk_size;
-	    for (unsigned int i = 0; i < (unknown_chunk_size+1)/2; i++)
-		dstream >> unknown_chunk16;
-	}
-	if (have_data && have_fmt)
-	    break;
-    } while (file.pos() < file_length);
-
-    if ( (!have_data) || (!have_fmt) )
-	return false;
+    const WavParser::Chunks &chunks = parser.chunks();
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        const QByteArray chunk(chunks[i].second.data(), chunks[i].second.size());
+        if (chunks[i].first == "LIST") {
+            if (chunk.startsWith("INFO"))
+                readInfoList(chunk, comment_tags);
+        } else if (chunks[i].first == "bext") {
+            readBext(chunk, broadcast_tags, time_reference);
+            have_bext = true;
+        } else if (chunks[i].first == "iXML") {
+            readIxml(chunk, xml_tags);
+        }
+    }
 
     // These values are downright illegal
     if ((!channel_count) || (!bytes_per_second))
         return false;
     
-    KFileMetaInfoGroup group = appendGroup(info, "Technical");
-    
+    record.setInteger(MetadataRecord::SampleWidth, sample_size);
+    record.setInteger(MetadataRecord::SampleRate, sample_rate);
+    record.setInteger(MetadataRecord::Channels, channel_count);
+
+    // a block of PCM or float samples is one frame, so whole frames are
+    // counted; a compressed block holds many, and only the byte rate tells
+    WavOverview::Format format = WavOverview::Signed16;
+    bool have_format = bytes_per_sample == channel_count * ((sample_size + 7) / 8) &&
+                       sampleFormat(format_chunk.subFormat, sample_size, format);
+    if (have_format && sample_rate)
+        record.setDuration(MetadataRecord::Length, data_size / bytes_per_sample, sample_rate);
+    else
+        record.setDuration(MetadataRecord::Length, data_size, bytes_per_second);
+
+    setTags(record, "Comment", comment_tags);
+
+    if (have_bext) {
+        setTags(record, "Broadcast", broadcast_tags);
+        // the time reference counts samples since midnight
+        if (sample_rate)
+            record.setReal(MetadataRecord::TimeReference, double(time_reference) / sample_rate);
+    }
+
+    setTags(record, "iXML", xml_tags);
+
+    // both analyses read the data chunk where the walk above found it
+    std::vector<uint8_t> blob;
+    if (readWaveform && have_format &&
+        WavOverview::compute(file.handle(), data_offset, data_size, format,
+                             channel_count, m_waveformBuckets,
+                             m_waveformThreads, blob))
+        record.setBlob(MetadataRecord::Waveform, &blob[0], blob.size());
+
+    LoudnessMeter::Result loudness;
+    if (readLoudness && have_format && sample_rate &&
+        WavLoudness::measure(file.handle(), data_offset, data_size, format,
+                             channel_count, sample_rate, m_loudnessThreads,
+                             loudness)) {
+        // nothing above the gates means there is no loudness to speak of
+        if (loudness.integrated > -HUGE_VAL) {
+            record.setReal(MetadataRecord::IntegratedLoudness, loudness.integrated);
+            record.setReal(MetadataRecord::LoudnessRange, loudness.range);
+        }
+        if (loudness.truePeak > -HUGE_VAL)
+            record.setReal(MetadataRecord::TruePeak, loudness.truePeak);
+        record.setReal(MetadataRecord::LeadingSilence, loudness.leadingSilence);
+        record.setReal(MetadataRecord::TrailingSilence, loudness.trailingSilence);
+    }
 
-    appendItem(group, "Sample Size", int(sample_size));
-    appendItem(group, "Sample Rate", int(sample_rate));
-    appendItem(group, "Channels", int(channel_count));
-    unsigned int wav_seconds = data_size / bytes_per_second;
-    appendItem(group, "Length", int(wav_seconds));
+    // only the samples, so retagged copies hash the same
+    uint64_t hash;
+    if (m_fingerprint != PayloadHash::Off &&
+        PayloadHash::hashRange(file.handle(), data_offset, data_size, m_fingerprint, hash))
+        record.setHash(m_fingerprint == PayloadHash::Full
+                       ? MetadataRecord::PayloadHash : MetadataRecord::SampledPayloadHash,
+                       hash);
 
     return true;
 }
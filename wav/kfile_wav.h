@@ -22,16 +22,29 @@
 
 #include <kfilemetainfo.h>
 
+#include "cachedfileplugin.h"
+#include "payloadhash.h"
+
 class QStringList;
 
-class KWavPlugin: public KFilePlugin
+class KWavPlugin: public CachedFilePlugin
 {
     Q_OBJECT
     
 public:
     KWavPlugin( QObject *parent, const QStringList& args );
     
-    virtual bool readInfo( KFileMetaInfo& info, uint what);
+    virtual bool readRecord( const QString& path, const QString& mimeType, uint what,
+                             MetadataRecord& record);
+    virtual AccessManifest accessManifest( uint what ) const;
+
+private:
+    bool m_waveform;
+    int m_waveformBuckets;
+    int m_waveformThreads;
+    bool m_loudness;
+    int m_loudnessThreads;
+    PayloadHash::Mode m_fingerprint;
 };
 
 #endif
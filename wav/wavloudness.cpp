@@ -0,0 +1,187 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "wavloudness.h"
+
+#include <string.h>
+#include <pthread.h>
+
+#include "mappedinput.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+// frames converted to floats at a time
+const size_t block_frames = 4096;
+
+void toFloat(const uint8_t *p, size_t n, WavOverview::Format format, float *out)
+{
+    size_t i = 0;
+    switch (format) {
+    case WavOverview::Unsigned8:
+        for (; i < n; ++i)
+            out[i] = (int(p[i]) - 128) * (1.0f / 128.0f);
+        break;
+    case WavOverview::Signed16:
+#ifdef __SSE2__
+        {
+            const __m128 scale = _mm_set1_ps(1.0f / 32768.0f);
+            for (; i + 8 <= n; i += 8) {
+                __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 2 * i));
+                // sign extend by unpacking into the high halves
+                __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+                __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+                _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+                _mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+            }
+        }
+#endif
+        for (; i < n; ++i)
+            out[i] = int16_t(p[2 * i] | (p[2 * i + 1] << 8)) * (1.0f / 32768.0f);
+        break;
+    case WavOverview::Signed24:
+        for (; i < n; ++i, p += 3)
+            out[i] = int32_t((uint32_t(p[0]) << 8) | (uint32_t(p[1]) << 16) |
+                             (uint32_t(p[2]) << 24)) * (1.0f / 2147483648.0f);
+        break;
+    case WavOverview::Signed32:
+#ifdef __SSE2__
+        {
+            const __m128 scale = _mm_set1_ps(1.0f / 2147483648.0f);
+            for (; i + 4 <= n; i += 4)
+                _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128(
+                        reinterpret_cast<const __m128i *>(p + 4 * i))), scale));
+        }
+#endif
+        for (; i < n; ++i)
+            out[i] = int32_t(uint32_t(p[4 * i]) | (uint32_t(p[4 * i + 1]) << 8) |
+                             (uint32_t(p[4 * i + 2]) << 16) |
+                             (uint32_t(p[4 * i + 3]) << 24)) * (1.0f / 2147483648.0f);
+        break;
+    case WavOverview::Float32:
+        for (; i < n; ++i) {
+            uint32_t bits = uint32_t(p[4 * i]) | (uint32_t(p[4 * i + 1]) << 8) |
+                            (uint32_t(p[4 * i + 2]) << 16) | (uint32_t(p[4 * i + 3]) << 24);
+            memcpy(out + i, &bits, 4);
+        }
+        break;
+    }
+}
+
+struct Job
+{
+    const uint8_t *data;
+    WavOverview::Format format;
+    int frameSize;
+    uint64_t first;
+    uint64_t last;
+    LoudnessMeter *meter;
+};
+
+void feed(const Job &job, uint64_t first, uint64_t last, bool measure,
+          std::vector<float> &buffer)
+{
+    const int channels = job.meter->channels();
+    while (first < last) {
+        size_t count = last - first < block_frames ? last - first : block_frames;
+        toFloat(job.data + first * job.frameSize, count * channels, job.format, &buffer[0]);
+        if (measure)
+            job.meter->process(&buffer[0], count);
+        else
+            job.meter->prime(&buffer[0], count);
+        first += count;
+    }
+}
+
+void *measureSegment(void *arg)
+{
+    const Job &job = *static_cast<Job *>(arg);
+    std::vector<float> buffer(block_frames * job.meter->channels());
+
+    uint64_t prime = job.meter->primeFrames();
+    if (prime > job.first)
+        prime = job.first;
+    feed(job, job.first - prime, job.first, false, buffer);
+    feed(job, job.first, job.last, true, buffer);
+    return 0;
+}
+
+}
+
+bool WavLoudness::measure(int fd, uint64_t offset, uint64_t size,
+                          WavOverview::Format format, int channels,
+                          int sampleRate, int threads,
+                          LoudnessMeter::Result &result)
+{
+    static const int sample_sizes[] = { 1, 2, 3, 4, 4 };
+    const int frameSize = sample_sizes[format] * channels;
+
+    if (channels < 1 || sampleRate < 1 || threads < 1)
+        return false;
+
+    const uint64_t frames = size / frameSize;
+    if (frames == 0)
+        return false;
+
+    MappedRange map(fd, offset, frames * frameSize, SequentialAccess);
+    if (!map.data())
+        return false;
+
+    std::vector<LoudnessMeter *> meters;
+    for (int t = 0; t < threads; ++t)
+        meters.push_back(new LoudnessMeter(sampleRate, channels));
+
+    // segments start on sub-block boundaries so they can be merged
+    const uint64_t subBlock = meters[0]->subBlockFrames();
+    const uint64_t subBlocks = frames / subBlock;
+    if (uint64_t(threads) > subBlocks)
+        threads = subBlocks > 0 ? subBlocks : 1;
+
+    std::vector<Job> jobs(threads);
+    std::vector<pthread_t> pool;
+    for (int t = 0; t < threads; ++t) {
+        Job &job = jobs[t];
+        job.data = map.data();
+        job.format = format;
+        job.frameSize = frameSize;
+        job.first = subBlocks * t / threads * subBlock;
+        job.last = t + 1 < threads ? subBlocks * (t + 1) / threads * subBlock : frames;
+        job.meter = meters[t];
+
+        pthread_t thread;
+        if (t > 0 && pthread_create(&thread, 0, measureSegment, &job) == 0)
+            pool.push_back(thread);
+        else if (t > 0)
+            measureSegment(&job);
+    }
+
+    measureSegment(&jobs[0]);
+    for (size_t i = 0; i < pool.size(); ++i)
+        pthread_join(pool[i], 0);
+
+    for (int t = 1; t < threads; ++t)
+        meters[0]->merge(*meters[t]);
+    result = meters[0]->result();
+
+    for (size_t i = 0; i < meters.size(); ++i)
+        delete meters[i];
+
+    return true;
+}
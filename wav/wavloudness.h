@@ -0,0 +1,44 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef WAVLOUDNESS_H
+#define WAVLOUDNESS_H
+
+#include "wavoverview.h"
+#include "loudnessmeter.h"
+
+/**
+ * Measures the loudness of the PCM data of a WAV file.
+ *
+ * The data chunk is memory-mapped and cut into one segment per thread.
+ * Every thread converts its segment to floats a block at a time and
+ * feeds it to its own LoudnessMeter; the meters are merged at the end.
+ */
+class WavLoudness
+{
+public:
+    /**
+     * Measures size bytes of interleaved samples starting at offset in
+     * fd.  Returns false if the data can't be mapped or holds no frames.
+     */
+    static bool measure(int fd, uint64_t offset, uint64_t size,
+                        WavOverview::Format format, int channels,
+                        int sampleRate, int threads,
+                        LoudnessMeter::Result &result);
+};
+
+#endif
@@ -0,0 +1,355 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "wavoverview.h"
+
+#include <float.h>
+#include <math.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "mappedinput.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+struct Envelope
+{
+    Envelope() : min(FLT_MAX), max(-FLT_MAX), squares(0), count(0) {}
+
+    void add(float lo, float hi, double sum, uint64_t n)
+    {
+        if (lo < min)
+            min = lo;
+        if (hi > max)
+            max = hi;
+        squares += sum;
+        count += n;
+    }
+
+    float min;
+    float max;
+    double squares;
+    uint64_t count;
+};
+
+// the kernels read unaligned little-endian samples
+
+inline int16_t load16(const uint8_t *p)
+{
+    return int16_t(p[0] | (p[1] << 8));
+}
+
+inline int32_t load32(const uint8_t *p)
+{
+    return int32_t(uint32_t(p[0]) | (uint32_t(p[1]) << 8) |
+                   (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24));
+}
+
+void scanUnsigned8(const uint8_t *p, size_t n, Envelope &e)
+{
+    int lo = 255, hi = 0;
+    uint64_t sum = 0;
+    size_t i = 0;
+#ifdef __SSE2__
+    __m128i vlo = _mm_set1_epi8(char(0xff));
+    __m128i vhi = _mm_setzero_si128();
+    __m128i acc = _mm_setzero_si128();
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bias = _mm_set1_epi8(char(0x80));
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i));
+        vlo = _mm_min_epu8(vlo, v);
+        vhi = _mm_max_epu8(vhi, v);
+        // center on zero and widen to 16 bits for the squares
+        __m128i c = _mm_xor_si128(v, bias);
+        __m128i c0 = _mm_srai_epi16(_mm_unpacklo_epi8(c, c), 8);
+        __m128i c1 = _mm_srai_epi16(_mm_unpackhi_epi8(c, c), 8);
+        __m128i sq = _mm_add_epi32(_mm_madd_epi16(c0, c0), _mm_madd_epi16(c1, c1));
+        acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(sq, zero));
+        acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(sq, zero));
+    }
+    uint8_t los[16], his[16];
+    uint64_t sums[2];
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(los), vlo);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(his), vhi);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(sums), acc);
+    for (int k = 0; k < 16; ++k) {
+        if (los[k] < lo)
+            lo = los[k];
+        if (his[k] > hi)
+            hi = his[k];
+    }
+    sum = sums[0] + sums[1];
+#endif
+    for (; i < n; ++i) {
+        int v = p[i];
+        if (v < lo)
+            lo = v;
+        if (v > hi)
+            hi = v;
+        sum += (v - 128) * (v - 128);
+    }
+    e.add((lo - 128) / 128.0f, (hi - 128) / 128.0f, sum / (128.0 * 128.0), n);
+}
+
+void scanSigned16(const uint8_t *p, size_t n, Envelope &e)
+{
+    int lo = 32767, hi = -32768;
+    uint64_t sum = 0;
+    size_t i = 0;
+#ifdef __SSE2__
+    __m128i vlo = _mm_set1_epi16(32767);
+    __m128i vhi = _mm_set1_epi16(-32768);
+    __m128i acc = _mm_setzero_si128();
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 2 * i));
+        vlo = _mm_min_epi16(vlo, v);
+        vhi = _mm_max_epi16(vhi, v);
+        // a pair of squares is at most 2^31, which still fits unsigned
+        __m128i sq = _mm_madd_epi16(v, v);
+        acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(sq, zero));
+        acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(sq, zero));
+    }
+    int16_t los[8], his[8];
+    uint64_t sums[2];
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(los), vlo);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(his), vhi);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(sums), acc);
+    for (int k = 0; k < 8; ++k) {
+        if (los[k] < lo)
+            lo = los[k];
+        if (his[k] > hi)
+            hi = his[k];
+    }
+    sum = sums[0] + sums[1];
+#endif
+    for (; i < n; ++i) {
+        int v = load16(p + 2 * i);
+        if (v < lo)
+            lo = v;
+        if (v > hi)
+            hi = v;
+        sum += v * v;
+    }
+    e.add(lo / 32768.0f, hi / 32768.0f, sum / (32768.0 * 32768.0), n);
+}
+
+// float samples, with int32 ones scaled on the fly
+template <bool integer>
+void scanFloat(const uint8_t *p, size_t n, Envelope &e)
+{
+    const float scale = integer ? 1.0f / 2147483648.0f : 1.0f;
+    float lo = FLT_MAX, hi = -FLT_MAX;
+    double sum = 0;
+    size_t i = 0;
+#ifdef __SSE2__
+    __m128 vlo = _mm_set1_ps(FLT_MAX);
+    __m128 vhi = _mm_set1_ps(-FLT_MAX);
+    const __m128 vscale = _mm_set1_ps(scale);
+    while (i + 4 <= n) {
+        // sum the squares of short runs in single precision only
+        __m128 acc = _mm_setzero_ps();
+        size_t end = i + 4096 < n ? i + 4096 : n;
+        for (; i + 4 <= end; i += 4) {
+            __m128 v;
+            if (integer)
+                v = _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128(
+                        reinterpret_cast<const __m128i *>(p + 4 * i))), vscale);
+            else
+                v = _mm_loadu_ps(reinterpret_cast<const float *>(p + 4 * i));
+            vlo = _mm_min_ps(vlo, v);
+            vhi = _mm_max_ps(vhi, v);
+            acc = _mm_add_ps(acc, _mm_mul_ps(v, v));
+        }
+        float sums[4];
+        _mm_storeu_ps(sums, acc);
+        sum += double(sums[0]) + sums[1] + sums[2] + sums[3];
+    }
+    float los[4], his[4];
+    _mm_storeu_ps(los, vlo);
+    _mm_storeu_ps(his, vhi);
+    for (int k = 0; k < 4; ++k) {
+        if (los[k] < lo)
+            lo = los[k];
+        if (his[k] > hi)
+            hi = his[k];
+    }
+#endif
+    for (; i < n; ++i) {
+        float v;
+        if (integer) {
+            v = load32(p + 4 * i) * scale;
+        } else {
+            int32_t bits = load32(p + 4 * i);
+            memcpy(&v, &bits, 4);
+        }
+        if (v < lo)
+            lo = v;
+        if (v > hi)
+            hi = v;
+        sum += double(v) * v;
+    }
+    e.add(lo, hi, sum, n);
+}
+
+void scanSigned24(const uint8_t *p, size_t n, Envelope &e)
+{
+    // widen to 32 bits in small blocks and reuse the int32 kernel
+    int32_t block[1024];
+    while (n > 0) {
+        size_t count = n < 1024 ? n : 1024;
+        for (size_t i = 0; i < count; ++i, p += 3)
+            block[i] = int32_t((uint32_t(p[0]) << 8) | (uint32_t(p[1]) << 16) |
+                               (uint32_t(p[2]) << 24));
+        scanFloat<true>(reinterpret_cast<const uint8_t *>(block), count, e);
+        n -= count;
+    }
+}
+
+struct Job
+{
+    const uint8_t *data;
+    WavOverview::Format format;
+    int sampleSize;
+    int channels;
+    uint64_t frames;
+    int buckets;
+    int firstBucket;
+    int lastBucket;
+    std::vector<Envelope> *envelopes;
+};
+
+void *scanBuckets(void *arg)
+{
+    const Job &job = *static_cast<Job *>(arg);
+    for (int b = job.firstBucket; b < job.lastBucket; ++b) {
+        uint64_t first = job.frames * b / job.buckets;
+        uint64_t last = job.frames * (b + 1) / job.buckets;
+        const uint8_t *p = job.data + first * job.channels * job.sampleSize;
+        size_t n = (last - first) * job.channels;
+        Envelope &e = (*job.envelopes)[b];
+
+        switch (job.format) {
+        case WavOverview::Unsigned8: scanUnsigned8(p, n, e); break;
+        case WavOverview::Signed16:  scanSigned16(p, n, e); break;
+        case WavOverview::Signed24:  scanSigned24(p, n, e); break;
+        case WavOverview::Signed32:  scanFloat<true>(p, n, e); break;
+        case WavOverview::Float32:   scanFloat<false>(p, n, e); break;
+        }
+    }
+    return 0;
+}
+
+inline void put16(std::vector<uint8_t> &blob, int v)
+{
+    blob.push_back(v & 0xff);
+    blob.push_back((v >> 8) & 0xff);
+}
+
+inline int to16(float v)
+{
+    if (!(v > -1.0f))   // also catches NaN
+        return -32768;
+    if (v >= 1.0f)
+        return 32767;
+    return int(floorf(v * 32767.0f + 0.5f));
+}
+
+}
+
+bool WavOverview::compute(int fd, uint64_t offset, uint64_t size, Format format,
+                          int channels, int buckets, int threads,
+                          std::vector<uint8_t> &blob)
+{
+    static const int sample_sizes[] = { 1, 2, 3, 4, 4 };
+    const int sampleSize = sample_sizes[format];
+
+    if (channels < 1 || buckets < 1 || buckets > 0xffff || threads < 1)
+        return false;
+
+    const uint64_t frames = size / (uint64_t(sampleSize) * channels);
+    if (frames == 0)
+        return false;
+    if (uint64_t(buckets) > frames)
+        buckets = frames;
+
+    MappedRange map(fd, offset, frames * sampleSize * channels, SequentialAccess);
+    if (!map.data())
+        return false;
+    map.advise(WillNeedAccess);
+
+    std::vector<Envelope> envelopes(buckets);
+    if (threads > buckets)
+        threads = buckets;
+
+    std::vector<Job> jobs(threads);
+    std::vector<pthread_t> pool;
+    for (int t = 0; t < threads; ++t) {
+        Job &job = jobs[t];
+        job.data = map.data();
+        job.format = format;
+        job.sampleSize = sampleSize;
+        job.channels = channels;
+        job.frames = frames;
+        job.buckets = buckets;
+        job.firstBucket = buckets * t / threads;
+        job.lastBucket = buckets * (t + 1) / threads;
+        job.envelopes = &envelopes;
+
+        pthread_t thread;
+        if (t > 0 && pthread_create(&thread, 0, scanBuckets, &job) == 0)
+            pool.push_back(thread);
+        else if (t > 0)
+            scanBuckets(&job);
+    }
+
+    // the calling thread takes the first range
+    scanBuckets(&jobs[0]);
+    for (size_t i = 0; i < pool.size(); ++i)
+        pthread_join(pool[i], 0);
+
+    blob.clear();
+    blob.reserve(20 + 6 * buckets);
+    blob.push_back('W');
+    blob.push_back('O');
+    blob.push_back('V');
+    blob.push_back('R');
+    put16(blob, 1);
+    put16(blob, buckets);
+    put16(blob, channels);
+    put16(blob, 0);
+    for (int i = 0; i < 8; ++i)
+        blob.push_back((frames >> (8 * i)) & 0xff);
+
+    for (int b = 0; b < buckets; ++b) {
+        const Envelope &e = envelopes[b];
+        double rms = e.count ? sqrt(e.squares / e.count) : 0;
+        // NaN float samples leave a bucket without a level
+        if (rms != rms)
+            rms = 0;
+        put16(blob, to16(e.min));
+        put16(blob, to16(e.max));
+        put16(blob, rms >= 1.0 ? 65535 : int(rms * 65535.0 + 0.5));
+    }
+
+    return true;
+}
@@ -0,0 +1,69 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef WAVOVERVIEW_H
+#define WAVOVERVIEW_H
+
+#include <stddef.h>
+#include <vector>
+
+#if !defined(__osf__)
+#include <inttypes.h>
+#else
+typedef unsigned char  uint8_t;
+typedef unsigned short uint16_t;
+typedef unsigned int   uint32_t;
+typedef unsigned long long uint64_t;
+#endif
+
+/**
+ * Computes a waveform overview (the envelope browsers draw as a
+ * thumbnail) of the PCM data of a WAV file.
+ *
+ * The data chunk is memory-mapped and split into a fixed number of
+ * buckets.  For each bucket the minimum, maximum and RMS over all samples
+ * of all channels are computed with SSE2 kernels; the buckets are shared
+ * out among threads in contiguous ranges.  The result is a blob of
+ *
+ *   "WOVR", uint16 version (1), uint16 bucket count,
+ *   uint16 channels, uint16 reserved, uint64 frames,
+ *   per bucket: int16 minimum, int16 maximum, uint16 RMS
+ *
+ * in little-endian byte order, with all values scaled to 16 bits.
+ */
+class WavOverview
+{
+public:
+    enum Format {
+        Unsigned8,
+        Signed16,
+        Signed24,
+        Signed32,
+        Float32
+    };
+
+    /**
+     * Scans size bytes of interleaved samples starting at offset in fd.
+     * Returns false if the data can't be mapped or there is nothing to
+     * scan; buckets is lowered to the number of frames for short files.
+     */
+    static bool compute(int fd, uint64_t offset, uint64_t size, Format format,
+                        int channels, int buckets, int threads,
+                        std::vector<uint8_t> &blob);
+};
+
+#endif
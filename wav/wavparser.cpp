@@ -0,0 +1,207 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "wavparser.h"
+
+#include <string.h>
+
+#include "checkpointstate.h"
+
+// format tags of the fmt chunk
+static const uint16_t format_extensible = 0xfffe;
+
+// descriptive chunks are small; anything bigger is not worth reading
+static const uint64_t max_metadata_size = 1 << 20;
+
+// the layout of saved walks; those of version 1 may end past a data
+// chunk whose size was stale
+static const char state_version = 2;
+
+WavParser::WavParser(uint64_t fileSize, bool readComment)
+    : m_fileSize(fileSize), m_readComment(readComment), m_haveDs64(false), m_ds64DataSize(0),
+      m_haveFormat(false), m_haveData(false), m_dataOffset(0), m_dataSize(0)
+{
+    memset(&m_format, 0, sizeof(m_format));
+}
+
+bool WavParser::accept(const char *form)
+{
+    return !memcmp(form, "WAVE", 4);
+}
+
+RiffParser::Action WavParser::chunk(const char *id, const char * /*type*/, uint64_t offset,
+                                    uint64_t &size, size_t &read)
+{
+    if (!memcmp(id, "ds64", 4)) {
+        read = 16;
+        return Read;
+    }
+    if (!memcmp(id, "fmt ", 4)) {
+        // WAVE_FORMAT_EXTENSIBLE keeps the real format tag at the start
+        // of a GUID after cbSize, validBits and the channel mask
+        read = size >= 40 ? 26 : 16;
+        return Read;
+    }
+
+    if (!memcmp(id, "data", 4)) {
+        // in RF64 files the real size is in ds64, the chunk says -1
+        if (isRf64() && m_haveDs64 && size == 0xffffffff)
+            size = m_ds64DataSize;
+        m_haveData = true;
+        m_dataOffset = offset;
+
+        // recorders that were interrupted leave the size at 0 or -1
+        const bool unknown = size == 0 || (!isRf64() && size == 0xffffffff);
+        if (m_fileSize && (unknown || offset + size > m_fileSize))
+            size = m_fileSize > offset ? m_fileSize - offset : 0;
+        else if (unknown) {
+            // then nothing can come after it
+            m_dataSize = 0;
+            return Stop;
+        }
+        m_dataSize = size;
+        return done();
+    }
+
+    if (m_readComment && size <= max_metadata_size &&
+        (!memcmp(id, "LIST", 4) || !memcmp(id, "bext", 4) || !memcmp(id, "iXML", 4))) {
+        read = size;
+        return Read;
+    }
+    return done();
+}
+
+RiffParser::Action WavParser::chunkData(const char *id, uint64_t offset,
+                                        const uint8_t *data, size_t length)
+{
+    if (!memcmp(id, "ds64", 4)) {
+        if (length < 16)
+            return Stop;
+        m_ds64DataSize = get64(data + 8);
+        m_haveDs64 = true;
+    } else if (!memcmp(id, "fmt ", 4)) {
+        if (length < 16)
+            return Stop;
+        m_format.formatTag = get16(data);
+        m_format.channelCount = get16(data + 2);
+        m_format.sampleRate = get32(data + 4);
+        m_format.bytesPerSecond = get32(data + 8);
+        m_format.bytesPerSample = get16(data + 12);
+        m_format.sampleSize = get16(data + 14);
+        if (m_format.formatTag == format_extensible && length >= 26)
+            m_format.subFormat = get16(data + 24);
+        else
+            m_format.subFormat = m_format.formatTag;
+        m_haveFormat = true;
+    } else {
+        m_chunks.push_back(std::make_pair(std::string(id, 4),
+                                          std::string(reinterpret_cast<const char *>(data), length)));
+        m_chunkOffsets.push_back(offset - 8);
+    }
+    return done();
+}
+
+bool WavParser::save(std::string &state) const
+{
+    if (isRf64() || !lastChunk())
+        return false;
+
+    // the size of the data chunk is read again, and nothing after it is
+    // kept: with a size the recorder hadn't finalized yet, the walk may
+    // have taken audio for chunk headers
+    uint64_t last = lastChunk();
+    if (m_haveData && m_dataOffset - 8 < last)
+        last = m_dataOffset - 8;
+
+    typedef CheckpointState S;
+    state.clear();
+    state += state_version;
+    state += char(m_readComment);
+    S::put(state, last, 8);
+    state += char(m_haveFormat);
+    S::put(state, m_format.formatTag, 2);
+    S::put(state, m_format.channelCount, 2);
+    S::put(state, m_format.sampleRate, 4);
+    S::put(state, m_format.bytesPerSecond, 4);
+    S::put(state, m_format.bytesPerSample, 2);
+    S::put(state, m_format.sampleSize, 2);
+    S::put(state, m_format.subFormat, 2);
+
+    // the chunks before the last one are not read again
+    const bool haveData = m_haveData && m_dataOffset < last;
+    state += char(haveData);
+    S::put(state, haveData ? m_dataOffset : 0, 8);
+    S::put(state, haveData ? m_dataSize : 0, 8);
+
+    size_t count = 0;
+    while (count < m_chunks.size() && m_chunkOffsets[count] < last)
+        ++count;
+    S::put(state, count, 4);
+    for (size_t i = 0; i < count; ++i) {
+        S::put(state, m_chunks[i].first);
+        S::put(state, m_chunkOffsets[i], 8);
+        S::put(state, m_chunks[i].second);
+    }
+    return true;
+}
+
+bool WavParser::resume(const std::string &state)
+{
+    CheckpointState in(state);
+    if (in.number(1) != uint64_t(state_version) || in.number(1) != uint64_t(m_readComment))
+        return false;
+    const uint64_t last = in.number(8);
+    const bool haveFormat = in.number(1);
+    Format format;
+    format.formatTag = in.number(2);
+    format.channelCount = in.number(2);
+    format.sampleRate = in.number(4);
+    format.bytesPerSecond = in.number(4);
+    format.bytesPerSample = in.number(2);
+    format.sampleSize = in.number(2);
+    format.subFormat = in.number(2);
+    const bool haveData = in.number(1);
+    const uint64_t dataOffset = in.number(8);
+    const uint64_t dataSize = in.number(8);
+
+    Chunks chunks;
+    std::vector<uint64_t> offsets;
+    const uint64_t count = in.number(4);
+    for (uint64_t i = 0; i < count && in.ok(); ++i) {
+        const std::string id = in.bytes();
+        offsets.push_back(in.number(8));
+        chunks.push_back(std::make_pair(id, in.bytes()));
+    }
+    // a parser that couldn't be resumed is left as it was
+    if (!in.ok() || !last || (m_fileSize && last >= m_fileSize))
+        return false;
+
+    m_haveFormat = haveFormat;
+    m_format = format;
+    m_haveData = haveData;
+    m_dataOffset = dataOffset;
+    m_dataSize = dataSize;
+    m_chunks.swap(chunks);
+    m_chunkOffsets.swap(offsets);
+    RiffParser::resume(last, false);
+    return true;
+}
+
+RiffParser::Action WavParser::done() const
+{
+    return m_haveData && m_haveFormat && !m_readComment ? Stop : Skip;
+}
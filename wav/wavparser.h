@@ -0,0 +1,103 @@
+/* This file is part of the KDE project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef WAVPARSER_H
+#define WAVPARSER_H
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "riffparser.h"
+
+/**
+ * Finds the format and the audio data of a WAV file, and with comments
+ * the LIST, bext and iXML chunks, which often follow the data.
+ *
+ * The size of the file is needed for the data chunks of recorders that
+ * were interrupted, whose sizes are 0 or -1.  When it isn't known, as
+ * for a stream, such a data chunk is taken to go on to the end of it.
+ *
+ * What was found can be saved, and a parser for the file once it has
+ * grown resumed from it: the walk then starts again at the header of
+ * the data chunk, whose size a recorder may not have finalized yet, or
+ * without one at the last chunk seen.
+ */
+class WavParser: public RiffParser
+{
+public:
+    struct Format
+    {
+        uint16_t formatTag;
+        uint16_t channelCount;
+        uint32_t sampleRate;
+        uint32_t bytesPerSecond;
+        uint16_t bytesPerSample;
+        uint16_t sampleSize;
+        // the format tag, or for WAVE_FORMAT_EXTENSIBLE the real one
+        uint16_t subFormat;
+    };
+
+    typedef std::vector<std::pair<std::string, std::string> > Chunks;
+
+    WavParser(uint64_t fileSize, bool readComment);
+
+    bool haveFormat() const { return m_haveFormat; }
+    const Format &format() const { return m_format; }
+
+    bool haveData() const { return m_haveData; }
+    uint64_t dataOffset() const { return m_dataOffset; }
+    /** The size of the data, or 0 when it goes on to the end of the stream. */
+    uint64_t dataSize() const { return m_dataSize; }
+
+    /** The descriptive chunks, by id, in the order of the file. */
+    const Chunks &chunks() const { return m_chunks; }
+
+    /**
+     * What the walk found so far, unless it can't be resumed from, as
+     * for RF64 files whose sizes are in ds64 at the start.
+     */
+    bool save(std::string &state) const;
+    /** Takes up a walk saved for the file when it was smaller. */
+    bool resume(const std::string &state);
+
+protected:
+    virtual bool accept(const char *form);
+    virtual Action chunk(const char *id, const char *type, uint64_t offset,
+                         uint64_t &size, size_t &read);
+    virtual Action chunkData(const char *id, uint64_t offset, const uint8_t *data,
+                             size_t length);
+
+private:
+    Action done() const;
+
+    uint64_t m_fileSize;
+    bool m_readComment;
+
+    bool m_haveDs64;
+    uint64_t m_ds64DataSize;
+    bool m_haveFormat;
+    Format m_format;
+    bool m_haveData;
+    uint64_t m_dataOffset;
+    uint64_t m_dataSize;
+    Chunks m_chunks;
+    // where the header of each of m_chunks is
+    std::vector<uint64_t> m_chunkOffsets;
+};
+
+#endif